@@ -8,6 +8,52 @@
 #include <sys/sysctl.h>
 #endif
 
+/* Global state for signal handlers. Defined here rather than next to
+ * main() so libwaitlock, which has no main(), links the same engine. */
+#ifdef HAVE_SYSLOG_H
+struct global_state g_state = { -1, "", 0, FALSE, FALSE, FALSE, LOG_DAEMON, 0, 0, 0 };
+#else
+struct global_state g_state = { -1, "", 0, FALSE, FALSE, FALSE, 0, 0, 0, 0 };
+#endif
+
+/* Command line options */
+struct options opts = {
+    NULL,      /* descriptor */
+    1,         /* max_holders */
+    FALSE,     /* one_per_cpu */
+    0,         /* exclude_cpus */
+    -1.0,      /* timeout (infinite) */
+    FALSE,     /* check_only */
+    FALSE,     /* list_mode */
+    FALSE,     /* done_mode */
+    FALSE,     /* show_all */
+    FALSE,     /* stale_only */
+    FMT_HUMAN, /* output_format */
+    NULL,      /* lock_dir */
+    NULL,      /* exec_argv */
+    FALSE,     /* test_mode */
+    -1,        /* preferred_slot (auto) */
+    FALSE,     /* migrate_mode */
+    BACKEND_FILE, /* backend */
+    FALSE,     /* daemon_mode */
+    NULL,      /* socket_path */
+    FALSE,     /* server_mode */
+    -1,        /* hold_fd */
+    FALSE,     /* no_supervise */
+    FALSE,     /* background */
+    -1,        /* ready_fd */
+    FALSE,     /* fair */
+    0,         /* priority */
+    0,         /* aging */
+    1,         /* weight */
+    0,         /* rw_mode */
+    FALSE,     /* rw_prefer_readers */
+    NULL,      /* descriptors */
+    0,         /* descriptor_count */
+    FALSE,     /* any_mode */
+    0          /* shards */
+};
+
 /* C89 compatibility function for strcasecmp */
 int strcasecmp_compat(const char *s1, const char *s2) {
     while (*s1 && *s2) {
@@ -54,6 +100,19 @@ int parse_syslog_facility(const char *facility_name) {
     return -1;  /* Invalid facility */
 }
 
+/* Parse lock backend name to backend constant */
+int parse_backend_name(const char *backend_name) {
+    if (backend_name == NULL) {
+        return -1;
+    }
+    if (strcmp(backend_name, "file") == 0) return BACKEND_FILE;
+    if (strcmp(backend_name, "shm") == 0) return BACKEND_SHM;
+    if (strcmp(backend_name, "ofd") == 0) return BACKEND_OFD;
+    if (strcmp(backend_name, "sysv") == 0) return BACKEND_SYSV;
+    if (strcmp(backend_name, "robust") == 0) return BACKEND_ROBUST;
+    return -1;  /* Invalid backend */
+}
+
 /* Portable string functions */
 #ifndef HAVE_SNPRINTF
 static int custom_vsnprintf(char *str, size_t size, const char *format, va_list args) {
@@ -81,8 +140,28 @@ static int snprintf_impl(char *str, size_t size, const char *format, ...) {
 
 /* Parse command line arguments */
 int parse_args(int argc, char *argv[]) {
-    int i;
-    char *env_timeout, *env_dir, *env_slot;
+    static char **descriptors = NULL;
+    char **grown;
+    int i, j;
+    char *env_timeout, *env_dir, *env_slot, *env_backend, *env_socket;
+    const char *prog;
+    
+    /* Room for every argument as a descriptor, for --all */
+    grown = realloc(descriptors, argc * sizeof(*descriptors));
+    if (!grown) {
+        error(E_SYSTEM, "Cannot allocate descriptor list: %s", strerror(errno));
+        return E_SYSTEM;
+    }
+    descriptors = grown;
+    opts.descriptors = descriptors;
+    opts.descriptor_count = 0;
+    
+    /* Invoked as waitlockd, run the daemon */
+    prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    if (strcmp(prog, "waitlockd") == 0) {
+        opts.daemon_mode = TRUE;
+    }
     
     /* Check environment variables first */
     env_timeout = getenv("WAITLOCK_TIMEOUT");
@@ -107,6 +186,20 @@ int parse_args(int argc, char *argv[]) {
         }
     }
     
+    env_backend = getenv("WAITLOCK_BACKEND");
+    if (env_backend && env_backend[0]) {
+        opts.backend = parse_backend_name(env_backend);
+        if (opts.backend == -1) {
+            error(E_USAGE, "Invalid WAITLOCK_BACKEND: %s (supported: file, shm, ofd, sysv, robust)", env_backend);
+            return E_USAGE;
+        }
+    }
+    
+    env_socket = getenv("WAITLOCK_SOCKET");
+    if (env_socket && env_socket[0]) {
+        opts.socket_path = env_socket;
+    }
+    
     /* Parse arguments */
     for (i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
@@ -164,6 +257,130 @@ int parse_args(int argc, char *argv[]) {
         else if (strcmp(argv[i], "--stale-only") == 0) {
             opts.stale_only = TRUE;
         }
+        else if (strcmp(argv[i], "--migrate-layout") == 0) {
+            opts.migrate_mode = TRUE;
+        }
+        else if (strcmp(argv[i], "--shards") == 0) {
+            char *end;
+            if (++i >= argc) {
+                error(E_USAGE, "Option %s requires an argument", argv[i-1]);
+                return E_USAGE;
+            }
+            opts.shards = (int)strtol(argv[i], &end, 10);
+            if (*end || end == argv[i] || opts.shards < 1 || opts.shards > LAYOUT_SHARDS_MAX) {
+                error(E_USAGE, "Invalid value for --shards: %s (must be 1-%d)", argv[i], LAYOUT_SHARDS_MAX);
+                return E_USAGE;
+            }
+        }
+        else if (strcmp(argv[i], "--backend") == 0) {
+            if (++i >= argc) {
+                error(E_USAGE, "Option %s requires an argument", argv[i-1]);
+                return E_USAGE;
+            }
+            opts.backend = parse_backend_name(argv[i]);
+            if (opts.backend == -1) {
+                error(E_USAGE, "Unknown backend: %s (supported backends: file, shm, ofd, sysv, robust)", argv[i]);
+                return E_USAGE;
+            }
+        }
+        else if (strcmp(argv[i], "--socket") == 0) {
+            if (++i >= argc) {
+                error(E_USAGE, "Option %s requires an argument", argv[i-1]);
+                return E_USAGE;
+            }
+            opts.socket_path = argv[i];
+        }
+        else if (strcmp(argv[i], "--daemon") == 0) {
+            opts.daemon_mode = TRUE;
+        }
+        else if (strcmp(argv[i], "--no-supervise") == 0) {
+            opts.no_supervise = TRUE;
+        }
+        else if (strcmp(argv[i], "--server") == 0) {
+            opts.server_mode = TRUE;
+        }
+        else if (strcmp(argv[i], "--fd") == 0) {
+            if (++i >= argc) {
+                error(E_USAGE, "Option %s requires an argument", argv[i-1]);
+                return E_USAGE;
+            }
+            opts.hold_fd = atoi(argv[i]);
+            if (opts.hold_fd < 0 || fcntl(opts.hold_fd, F_GETFD) < 0) {
+                error(E_USAGE, "File descriptor %s is not open", argv[i]);
+                return E_USAGE;
+            }
+        }
+        else if (strcmp(argv[i], "--fair") == 0) {
+            opts.fair = TRUE;
+        }
+        else if (strcmp(argv[i], "--priority") == 0 || strcmp(argv[i], "--aging") == 0) {
+            char *end;
+            long value;
+            if (++i >= argc) {
+                error(E_USAGE, "Option %s requires an argument", argv[i-1]);
+                return E_USAGE;
+            }
+            value = strtol(argv[i], &end, 10);
+            if (*end || end == argv[i] || value < 0 || value > 65535) {
+                error(E_USAGE, "Invalid value for %s: %s (must be 0-65535)", argv[i-1], argv[i]);
+                return E_USAGE;
+            }
+            if (strcmp(argv[i-1], "--priority") == 0) {
+                opts.priority = (int)value;
+            } else {
+                opts.aging = (int)value;
+            }
+            opts.fair = TRUE;  /* Priorities order the --fair queue */
+        }
+        else if (strcmp(argv[i], "--weight") == 0) {
+            char *end;
+            if (++i >= argc) {
+                error(E_USAGE, "Option %s requires an argument", argv[i-1]);
+                return E_USAGE;
+            }
+            opts.weight = (int)strtol(argv[i], &end, 10);
+            if (*end || end == argv[i] || opts.weight < 1 || opts.weight > WEIGHT_MAX) {
+                error(E_USAGE, "Invalid value for --weight: %s (must be 1-%d)", argv[i], WEIGHT_MAX);
+                return E_USAGE;
+            }
+        }
+        else if (strcmp(argv[i], "--any") == 0) {
+            opts.any_mode = TRUE;
+        }
+        else if (strcmp(argv[i], "--shared") == 0) {
+            opts.rw_mode = LOCK_TYPE_SHARED;
+        }
+        else if (strcmp(argv[i], "--exclusive") == 0) {
+            opts.rw_mode = LOCK_TYPE_EXCLUSIVE;
+        }
+        else if (strcmp(argv[i], "--rw-policy") == 0) {
+            if (++i >= argc) {
+                error(E_USAGE, "Option %s requires an argument", argv[i-1]);
+                return E_USAGE;
+            }
+            if (strcmp(argv[i], "writer") == 0) {
+                opts.rw_prefer_readers = FALSE;
+            } else if (strcmp(argv[i], "reader") == 0) {
+                opts.rw_prefer_readers = TRUE;
+            } else {
+                error(E_USAGE, "Invalid value for --rw-policy: %s (supported: writer, reader)", argv[i]);
+                return E_USAGE;
+            }
+        }
+        else if (strcmp(argv[i], "--background") == 0) {
+            opts.background = TRUE;
+        }
+        else if (strcmp(argv[i], "--ready-fd") == 0) {
+            if (++i >= argc) {
+                error(E_USAGE, "Option %s requires an argument", argv[i-1]);
+                return E_USAGE;
+            }
+            opts.ready_fd = atoi(argv[i]);
+            if (opts.ready_fd < 0 || fcntl(opts.ready_fd, F_GETFD) < 0) {
+                error(E_USAGE, "File descriptor %s is not open", argv[i]);
+                return E_USAGE;
+            }
+        }
         else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--format") == 0) {
             if (++i >= argc) {
                 error(E_USAGE, "Option %s requires an argument", argv[i-1]);
@@ -224,16 +441,51 @@ int parse_args(int argc, char *argv[]) {
             return E_USAGE;
         }
         else {
-            /* First non-option argument is the descriptor */
+            /* First non-option argument is the descriptor, further ones
+             * are only taken with --all */
             if (!opts.descriptor) {
                 opts.descriptor = argv[i];
-            } else {
-                error(E_USAGE, "Unexpected argument: %s", argv[i]);
-                return E_USAGE;
             }
+            opts.descriptors[opts.descriptor_count++] = argv[i];
         }
     }
     
+    /* --fd hands a lock file to the caller; only lock files can be handed over */
+    if (opts.hold_fd >= 0 && (opts.exec_argv || opts.backend != BACKEND_FILE)) {
+        error(E_USAGE, "--fd cannot be combined with --exec or a --backend other than file");
+        return E_USAGE;
+    }
+    
+    /* A robust mutex is released when its owner execs */
+    if (opts.no_supervise && (!opts.exec_argv || opts.backend == BACKEND_ROBUST)) {
+        error(E_USAGE, "--no-supervise needs --exec and a backend other than robust");
+        return E_USAGE;
+    }
+    
+    /* The fan-out is fixed when the directory is switched to shards */
+    if (opts.shards > 0 && !opts.migrate_mode) {
+        error(E_USAGE, "--shards only applies with --migrate-layout");
+        return E_USAGE;
+    }
+    
+    /* Readiness is reported by modes that acquire a lock and keep running */
+    if ((opts.background || opts.ready_fd >= 0) &&
+        (opts.check_only || opts.list_mode || opts.done_mode || opts.migrate_mode ||
+         opts.daemon_mode || opts.server_mode || opts.test_mode)) {
+        error(E_USAGE, "--background and --ready-fd only apply when acquiring a lock");
+        return E_USAGE;
+    }
+    if (opts.background && opts.hold_fd >= 0) {
+        error(E_USAGE, "--background cannot be combined with --fd");
+        return E_USAGE;
+    }
+    
+    /* The queue lives next to the slot files; waitlockd queues by itself */
+    if (opts.fair && opts.backend != BACKEND_FILE) {
+        error(E_USAGE, "--fair, --priority and --aging are only supported by the file backend");
+        return E_USAGE;
+    }
+    
     /* Handle CPU-based limits */
     if (opts.one_per_cpu) {
         int cpu_count = get_cpu_count();
@@ -241,8 +493,78 @@ int parse_args(int argc, char *argv[]) {
         if (opts.max_holders < 1) opts.max_holders = 1;
     }
     
+    /* Units are slot files, so weights need the file backend */
+    if (opts.weight > 1) {
+        if (opts.backend != BACKEND_FILE || opts.hold_fd >= 0 || opts.socket_path) {
+            error(E_USAGE, "--weight is only supported by the file backend, without --fd or waitlockd");
+            return E_USAGE;
+        }
+        if (opts.weight > opts.max_holders) {
+            error(E_USAGE, "Weight %d exceeds the %d units of the semaphore", opts.weight, opts.max_holders);
+            return E_USAGE;
+        }
+    }
+    
+    /* Readers and writers share one descriptor's slot files and queue */
+    if (opts.rw_mode) {
+        if (opts.backend != BACKEND_FILE || opts.socket_path) {
+            error(E_USAGE, "--shared and --exclusive are only supported by the file backend, without waitlockd");
+            return E_USAGE;
+        }
+        if (opts.max_holders > 1 || opts.weight > 1 || opts.fair) {
+            error(E_USAGE, "--shared and --exclusive cannot be combined with -m, --weight or --fair");
+            return E_USAGE;
+        }
+    }
+    
+    /* -a/--all outside --list takes every descriptor named, all or none;
+     * --any takes the first of them to come free. Both try each descriptor
+     * in turn and watch the slot files, so only the file backend can. */
+    if (opts.any_mode && (opts.list_mode || opts.check_only || opts.done_mode ||
+                          opts.migrate_mode || opts.daemon_mode || opts.server_mode)) {
+        error(E_USAGE, "--any only applies when acquiring a lock");
+        return E_USAGE;
+    }
+    if (opts.show_all && (opts.check_only || opts.done_mode || opts.migrate_mode ||
+                          opts.daemon_mode || opts.server_mode)) {
+        error(E_USAGE, "--all only applies to --list and when acquiring a lock");
+        return E_USAGE;
+    }
+    if (opts.descriptor_count > 1) {
+        if ((!opts.show_all && !opts.any_mode) || opts.list_mode || opts.check_only ||
+            opts.done_mode || opts.migrate_mode || opts.daemon_mode || opts.server_mode ||
+            opts.test_mode) {
+            error(E_USAGE, "Unexpected argument: %s", opts.descriptors[1]);
+            return E_USAGE;
+        }
+        if (opts.show_all && opts.any_mode) {
+            error(E_USAGE, "--all and --any cannot be combined");
+            return E_USAGE;
+        }
+        if (opts.backend != BACKEND_FILE || opts.hold_fd >= 0 || opts.socket_path || opts.fair) {
+            error(E_USAGE, "--all and --any are only supported by the file backend, without --fd, waitlockd or --fair");
+            return E_USAGE;
+        }
+        if (opts.show_all && opts.weight > 1) {
+            error(E_USAGE, "--all cannot be combined with --weight");
+            return E_USAGE;
+        }
+        for (i = 1; i < opts.descriptor_count; i++) {
+            if (!valid_descriptor(opts.descriptors[i])) {
+                error(E_USAGE, "Invalid descriptor: %s", opts.descriptors[i]);
+                return E_USAGE;
+            }
+            for (j = 0; j < i; j++) {
+                if (strcmp(opts.descriptors[i], opts.descriptors[j]) == 0) {
+                    error(E_USAGE, "Descriptor %s is listed twice", opts.descriptors[i]);
+                    return E_USAGE;
+                }
+            }
+        }
+    }
+    
     /* Read descriptor from stdin if not provided */
-    if (!opts.list_mode && !opts.test_mode && !opts.descriptor) {
+    if (!opts.list_mode && !opts.test_mode && !opts.migrate_mode && !opts.daemon_mode && !opts.server_mode && !opts.descriptor) {
         static char stdin_desc[MAX_DESC_LEN + 1];
         if (fgets(stdin_desc, sizeof(stdin_desc), stdin)) {
             size_t len = strlen(stdin_desc);
@@ -254,22 +576,19 @@ int parse_args(int argc, char *argv[]) {
     }
     
     /* Validate descriptor */
-    if (!opts.list_mode && !opts.test_mode && opts.descriptor) {
-        const char *p;
-        for (p = opts.descriptor; *p; p++) {
-            if (!isalnum(*p) && *p != '_' && *p != '-' && *p != '.') {
-                error(E_USAGE, "Invalid descriptor: %s (only alphanumeric characters, underscores, hyphens, and dots allowed)", opts.descriptor);
-                return E_USAGE;
-            }
-        }
+    if (!opts.list_mode && !opts.test_mode && !opts.migrate_mode && !opts.daemon_mode && !opts.server_mode && opts.descriptor) {
         if (strlen(opts.descriptor) > MAX_DESC_LEN) {
             error(E_USAGE, "Descriptor too long: %zu characters (max %d)", strlen(opts.descriptor), MAX_DESC_LEN);
             return E_USAGE;
         }
+        if (!valid_descriptor(opts.descriptor)) {
+            error(E_USAGE, "Invalid descriptor: %s (only alphanumeric characters, underscores, hyphens, and dots allowed, not starting with a dot)", opts.descriptor);
+            return E_USAGE;
+        }
     }
     
     /* Check required arguments */
-    if (!opts.list_mode && !opts.test_mode && !opts.descriptor) {
+    if (!opts.list_mode && !opts.test_mode && !opts.migrate_mode && !opts.daemon_mode && !opts.server_mode && !opts.descriptor) {
         error(E_USAGE, "No descriptor specified (provide as argument or via stdin)");
         return E_USAGE;
     }
@@ -287,26 +606,52 @@ int parse_args(int argc, char *argv[]) {
 /* Usage message */
 void usage(FILE *stream) {
     fprintf(stream, "Usage: waitlock [options] <descriptor>\n");
+    fprintf(stream, "       waitlock --all [options] <descriptor>...\n");
+    fprintf(stream, "       waitlock --any [options] <descriptor>...\n");
     fprintf(stream, "       waitlock --list [--format=<fmt>] [--all|--stale-only]\n");
     fprintf(stream, "       waitlock --check <descriptor>\n");
     fprintf(stream, "       waitlock --done <descriptor>\n");
+    fprintf(stream, "       waitlock --migrate-layout [--shards N] [--lock-dir DIR]\n");
+    fprintf(stream, "       waitlockd [--socket PATH] [--lock-dir DIR]\n");
+    fprintf(stream, "       waitlock --server [--lock-dir DIR] [--timeout SECS]\n");
     fprintf(stream, "       echo <descriptor> | waitlock [options]\n");
     fprintf(stream, "\n");
     fprintf(stream, "Process synchronization tool for shell scripts.\n");
     fprintf(stream, "\n");
     fprintf(stream, "Options:\n");
     fprintf(stream, "  -m, --allowMultiple N    Allow N concurrent holders (semaphore)\n");
+    fprintf(stream, "  --weight K               Take K of the semaphore's units at once, all or none\n");
+    fprintf(stream, "  --any                    Take whichever of the descriptors given is free first\n");
+    fprintf(stream, "  --shared                 Hold the lock alongside other --shared holders\n");
+    fprintf(stream, "  --exclusive              Hold the lock alone, excluding --shared holders\n");
+    fprintf(stream, "  --rw-policy POLICY       writer: waiting writers hold off new readers (default),\n");
+    fprintf(stream, "                           reader: readers never wait for queued writers\n");
     fprintf(stream, "  -c, --onePerCPU          Allow one lock per CPU core\n");
     fprintf(stream, "  -x, --excludeCPUs N      Reserve N CPUs (with --onePerCPU)\n");
     fprintf(stream, "  -t, --timeout SECS       Timeout in seconds (default: infinite)\n");
     fprintf(stream, "  --check                  Test if lock is available\n");
     fprintf(stream, "  --done                   Signal lock holder to release lock\n");
+    fprintf(stream, "  --fair                   Grant the lock to waiters in arrival order\n");
+    fprintf(stream, "  --priority N             Queue ahead of lower priority waiters (implies --fair)\n");
+    fprintf(stream, "  --aging SECS             Raise the queue priority by 1 every SECS waited\n");
     fprintf(stream, "  -e, --exec CMD           Execute command while holding lock\n");
+    fprintf(stream, "  --no-supervise           With --exec, exec in place; the command holds the lock\n");
     fprintf(stream, "  -l, --list               List active locks\n");
-    fprintf(stream, "  -a, --all                Include stale locks in list\n");
+    fprintf(stream, "  -a, --all                With --list, include stale locks; when acquiring,\n");
+    fprintf(stream, "                           take every descriptor given, all or none\n");
     fprintf(stream, "  --stale-only             Show only stale locks\n");
     fprintf(stream, "  -f, --format FMT         Output format: human, csv, null\n");
     fprintf(stream, "  -d, --lock-dir DIR       Lock directory (default: auto)\n");
+    fprintf(stream, "  --backend NAME           Lock backend: file, shm, ofd, sysv, robust (default: file)\n");
+    fprintf(stream, "  --socket PATH            Use the waitlockd listening on PATH when running\n");
+    fprintf(stream, "  --daemon                 Run as waitlockd (default socket: <lockdir>/waitlockd.sock)\n");
+    fprintf(stream, "  --fd N                   Hold the lock on inherited file descriptor N and exit\n");
+    fprintf(stream, "  --background             Detach once the lock is held and print the holder's PID\n");
+    fprintf(stream, "  --ready-fd N             Write the acquisition status byte to fd N\n");
+    fprintf(stream, "  --server                 Serve ACQUIRE/RELEASE/CHECK/LIST commands on stdin\n");
+    fprintf(stream, "  --migrate-layout         Move lock directory to per-descriptor subdirectories\n");
+    fprintf(stream, "  --shards N               With --migrate-layout, spread lock files over N hashed\n");
+    fprintf(stream, "                           directories instead (1-%d)\n", LAYOUT_SHARDS_MAX);
     fprintf(stream, "  -q, --quiet              Suppress non-error output\n");
     fprintf(stream, "  -v, --verbose            Verbose output\n");
     fprintf(stream, "  --syslog                 Log to syslog\n");
@@ -347,6 +692,24 @@ void error(int code, const char *fmt, ...) {
     fprintf(stderr, "\n");
 }
 
+/* Descriptor check shared by the CLI, waitlockd and libwaitlock. A
+ * descriptor names a directory in the subdirectory layouts, so ".", ".."
+ * and other names starting with a dot (which waitlock keeps for its own
+ * files, such as .layout) are refused. */
+bool valid_descriptor(const char *name) {
+    const char *p;
+
+    if (!name[0] || name[0] == '.' || strlen(name) > MAX_DESC_LEN) {
+        return FALSE;
+    }
+    for (p = name; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '_' && *p != '-' && *p != '.') {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
 /* Safe snprintf wrapper */
 int safe_snprintf(char *buf, size_t size, const char *fmt, ...) {
     va_list args;
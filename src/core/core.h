@@ -9,6 +9,9 @@ int strcasecmp_compat(const char *s1, const char *s2);
 /* Syslog facility parsing */
 int parse_syslog_facility(const char *facility_name);
 
+/* Lock backend parsing */
+int parse_backend_name(const char *backend_name);
+
 /* Command line parsing and core utilities */
 int parse_args(int argc, char *argv[]);
 void usage(FILE *stream);
@@ -16,6 +19,7 @@ void version(void);
 void debug(const char *fmt, ...);
 void error(int code, const char *fmt, ...);
 int safe_snprintf(char *buf, size_t size, const char *fmt, ...);
+bool valid_descriptor(const char *name);
 
 /* CPU count detection */
 int get_cpu_count(void);
@@ -0,0 +1,506 @@
+/*
+ * waitlockd client - requests locks from the daemon when WAITLOCK_SOCKET
+ * or --socket names one; every call reports DAEMON_UNAVAILABLE when
+ * nothing is listening, so the caller falls back to the lock directory
+ */
+
+#include "daemon.h"
+#include "../core/core.h"
+#include "../lock/lock.h"
+#include "../process/process.h"
+
+#ifdef HAVE_DAEMON_CLIENT
+
+#include <poll.h>
+
+/* Connection with buffered reply lines */
+struct daemon_conn {
+    int fd;
+    size_t len;
+    char buf[DAEMON_LINE_MAX];
+};
+
+/* Lock held by this process. The connection is also g_state.lock_fd, so
+ * the signal handler's close releases it like any other exit. */
+static int held_fd = -1;
+static int held_slot = -1;
+static time_t held_since;
+static char held_descriptor[MAX_DESC_LEN + 1];
+
+static double now_seconds(void) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+/* Connect to the configured socket. Returns -1 without a message when no
+ * socket is configured or no daemon is listening on it. */
+static int connect_daemon(struct daemon_conn *conn) {
+    struct sockaddr_un addr;
+
+    conn->fd = -1;
+    conn->len = 0;
+    if (!opts.socket_path || !opts.socket_path[0]) {
+        return -1;
+    }
+    if (strlen(opts.socket_path) >= sizeof(addr.sun_path)) {
+        debug("Socket path too long, not using waitlockd: %s", opts.socket_path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, opts.socket_path);
+
+    conn->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn->fd < 0) {
+        return -1;
+    }
+    if (connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        debug("No waitlockd on %s (%s), using the lock directory",
+              opts.socket_path, strerror(errno));
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int send_request(struct daemon_conn *conn, const char *fmt, ...) {
+    char line[DAEMON_LINE_MAX];
+    va_list args;
+    size_t len, sent = 0;
+
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    len = strlen(line);
+
+    while (sent < len) {
+        ssize_t n = send(conn->fd, line + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+/* Read one reply line, waiting until the deadline (seconds since the
+ * epoch, or < 0 for no limit). Returns 0, -1 on error or hangup, or
+ * -2 when the deadline passed. */
+static int read_reply(struct daemon_conn *conn, char *line, size_t size, double deadline) {
+    for (;;) {
+        char *end = memchr(conn->buf, '\n', conn->len);
+        struct pollfd pfd;
+        int wait_ms = -1;
+        ssize_t n;
+
+        if (end) {
+            size_t line_len = end - conn->buf;
+            if (line_len >= size) {
+                line_len = size - 1;
+            }
+            memcpy(line, conn->buf, line_len);
+            line[line_len] = '\0';
+            conn->len -= end + 1 - conn->buf;
+            memmove(conn->buf, end + 1, conn->len);
+            return 0;
+        }
+        if (conn->len == sizeof(conn->buf)) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        if (deadline >= 0) {
+            double remaining = deadline - now_seconds();
+            if (remaining <= 0) {
+                return -2;
+            }
+            wait_ms = (int)(remaining * 1000) + 1;
+        }
+        pfd.fd = conn->fd;
+        pfd.events = POLLIN;
+        n = poll(&pfd, 1, wait_ms);
+        if (n < 0) {
+            if (errno == EINTR && !g_state.should_exit) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            continue;
+        }
+
+        n = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        conn->len += n;
+    }
+}
+
+/* Send a request that is answered right away and read the first line */
+static int request(struct daemon_conn *conn, char *line, size_t size, const char *req) {
+    if (send_request(conn, "%s\n", req) != 0 ||
+        read_reply(conn, line, size, now_seconds() + DAEMON_REPLY_WAIT_MS / 1000.0) != 0) {
+        error(E_SYSTEM, "No reply from waitlockd on %s: %s", opts.socket_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Log and report a lock wait that ran out of time */
+static int report_timeout(const char *descriptor, double timeout) {
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_WARNING, "timeout waiting for lock '%s' after %.1f seconds",
+               descriptor, timeout);
+        closelog();
+#endif
+    }
+    error(E_TIMEOUT, "Timeout waiting for lock '%s' after %.1f seconds", descriptor, timeout);
+    return E_TIMEOUT;
+}
+
+int daemon_acquire_lock(const char *descriptor, int max_holders, double timeout) {
+    struct daemon_conn conn;
+    char line[DAEMON_LINE_MAX];
+    double start, deadline;
+    int slot, rc;
+
+    if (connect_daemon(&conn) != 0) {
+        return DAEMON_UNAVAILABLE;
+    }
+    if (max_holders > DAEMON_MAX_HOLDERS) {
+        error(E_USAGE, "waitlockd supports at most %d holders", DAEMON_MAX_HOLDERS);
+        close(conn.fd);
+        return E_USAGE;
+    }
+
+    /* Only a positive timeout waits in the queue; otherwise ask once and
+     * fail fast, as the file backend does */
+    start = now_seconds();
+    if (timeout > 0) {
+        deadline = start + timeout;
+    } else {
+        deadline = start + DAEMON_REPLY_WAIT_MS / 1000.0;
+    }
+    if (send_request(&conn, "ACQUIRE %d %d %d %s\n",
+                     max_holders, timeout > 0 ? 1 : 0, (int)getppid(), descriptor) != 0) {
+        rc = -1;
+    } else {
+        rc = read_reply(&conn, line, sizeof(line), deadline);
+    }
+
+    if (rc == -2 && timeout > 0) {
+        /* Closing the connection takes us out of the queue */
+        close(conn.fd);
+        return report_timeout(descriptor, timeout);
+    }
+    if (rc != 0) {
+        if (rc == -2) {
+            errno = ETIMEDOUT;
+        }
+        close(conn.fd);
+        if (g_state.should_exit) {
+            return E_SYSTEM;
+        }
+        error(E_SYSTEM, "Lost connection to waitlockd on %s: %s", opts.socket_path, strerror(errno));
+        return E_SYSTEM;
+    }
+
+    if (strcmp(line, "BUSY") == 0) {
+        close(conn.fd);
+        if (timeout == 0.0) {
+            /* An explicit -t 0 times out at once, as it does on files */
+            return report_timeout(descriptor, timeout);
+        }
+        debug("All %d slots are currently in use", max_holders);
+        return E_BUSY;
+    }
+    if (sscanf(line, "GRANTED %d", &slot) != 1) {
+        error(E_SYSTEM, "waitlockd refused lock '%s': %s", descriptor, line);
+        close(conn.fd);
+        return E_SYSTEM;
+    }
+
+    held_fd = conn.fd;
+    held_slot = slot;
+    held_since = time(NULL);
+    strncpy(held_descriptor, descriptor, sizeof(held_descriptor) - 1);
+    held_descriptor[sizeof(held_descriptor) - 1] = '\0';
+    g_state.lock_fd = conn.fd;
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "acquired lock '%s' (slot %d)", descriptor, slot);
+        closelog();
+#endif
+    }
+    debug("waitlockd granted slot %d of '%s'", slot, descriptor);
+    return E_SUCCESS;
+}
+
+/* Release the held lock. Waiting for the reply means the next holder has
+ * been granted by the time we exit; closing alone would release it too. */
+void daemon_release_lock(void) {
+    struct daemon_conn conn;
+    char line[DAEMON_LINE_MAX];
+
+    if (held_fd < 0) {
+        return;
+    }
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "released lock '%s' after %.0f seconds",
+               held_descriptor, difftime(time(NULL), held_since));
+        closelog();
+#endif
+    }
+
+    debug("Releasing slot %d of '%s'", held_slot, held_descriptor);
+    conn.fd = held_fd;
+    conn.len = 0;
+    if (send_request(&conn, "RELEASE\n") == 0) {
+        read_reply(&conn, line, sizeof(line), now_seconds() + DAEMON_REPLY_WAIT_MS / 1000.0);
+    }
+    close(held_fd);
+    if (g_state.lock_fd == held_fd) {
+        g_state.lock_fd = -1;
+    }
+    held_fd = -1;
+    held_slot = -1;
+}
+
+/* Slot held by this process, or -1 */
+int daemon_held_slot(void) {
+    return held_fd >= 0 ? held_slot : -1;
+}
+
+/* Check if the lock could be acquired now, in one round trip */
+int daemon_check_lock(const char *descriptor) {
+    struct daemon_conn conn;
+    char line[DAEMON_LINE_MAX];
+    char req[DAEMON_LINE_MAX];
+    int active, max_holders;
+
+    if (connect_daemon(&conn) != 0) {
+        return DAEMON_UNAVAILABLE;
+    }
+    safe_snprintf(req, sizeof(req), "CHECK %s", descriptor);
+    if (request(&conn, line, sizeof(line), req) != 0) {
+        close(conn.fd);
+        return E_SYSTEM;
+    }
+    close(conn.fd);
+    if (sscanf(line, "STATUS %d %d", &active, &max_holders) != 2) {
+        error(E_SYSTEM, "Unexpected reply from waitlockd: %s", line);
+        return E_SYSTEM;
+    }
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "check lock '%s': %s (%d/%d holders)",
+               descriptor, (active >= max_holders) ? "busy" : "available",
+               active, max_holders);
+        closelog();
+#endif
+    }
+
+    return (active >= max_holders) ? E_BUSY : E_SUCCESS;
+}
+
+/* Ask the daemon for the holders of one descriptor, or of all when
+ * descriptor is NULL, and pass each to the callback */
+static int for_each_holder(const char *descriptor,
+                           void (*fn)(const struct lock_info *info, void *arg), void *arg) {
+    struct daemon_conn conn;
+    char line[DAEMON_LINE_MAX];
+    char req[DAEMON_LINE_MAX];
+    double deadline;
+
+    if (connect_daemon(&conn) != 0) {
+        return DAEMON_UNAVAILABLE;
+    }
+    if (descriptor) {
+        safe_snprintf(req, sizeof(req), "LIST %s", descriptor);
+    } else {
+        safe_snprintf(req, sizeof(req), "LIST");
+    }
+    if (send_request(&conn, "%s\n", req) != 0) {
+        close(conn.fd);
+        error(E_SYSTEM, "No reply from waitlockd on %s: %s", opts.socket_path, strerror(errno));
+        return E_SYSTEM;
+    }
+
+    deadline = now_seconds() + DAEMON_REPLY_WAIT_MS / 1000.0;
+    while (read_reply(&conn, line, sizeof(line), deadline) == 0) {
+        struct lock_info info;
+        int pid, ppid, slot, max_holders;
+        unsigned uid;
+        long long acquired_at;
+
+        if (strcmp(line, "END") == 0) {
+            close(conn.fd);
+            return E_SUCCESS;
+        }
+        memset(&info, 0, sizeof(info));
+        if (sscanf(line, "HOLDER %d %d %u %d %d %lld %255s", &pid, &ppid, &uid, &slot,
+                   &max_holders, &acquired_at, info.descriptor) != 7) {
+            continue;
+        }
+        info.magic = LOCK_MAGIC;
+        info.pid = pid;
+        info.ppid = ppid;
+        info.uid = uid;
+        info.acquired_at = (time_t)acquired_at;
+        info.max_holders = max_holders;
+        info.lock_type = (info.max_holders > 1) ? 1 : 0;
+        info.slot = slot;
+        fn(&info, arg);
+    }
+
+    close(conn.fd);
+    error(E_SYSTEM, "No reply from waitlockd on %s: %s", opts.socket_path, strerror(errno));
+    return E_SYSTEM;
+}
+
+struct list_args {
+    output_format_t format;
+    bool show_all;
+    bool stale_only;
+};
+
+/* The daemon drops a holder the moment its connection closes, so none of
+ * its holders is ever stale */
+static void list_holder(const struct lock_info *info, void *arg) {
+    struct list_args *list = arg;
+    struct lock_info copy = *info;
+    char *cmdline = get_process_cmdline(copy.pid);
+
+    if (cmdline) {
+        strncpy(copy.cmdline, cmdline, sizeof(copy.cmdline) - 1);
+    }
+    print_lock_info(&copy, FALSE, list->format, list->show_all, list->stale_only);
+}
+
+int daemon_list_locks(output_format_t format, bool show_all, bool stale_only) {
+    struct list_args list;
+
+    list.format = format;
+    list.show_all = show_all;
+    list.stale_only = stale_only;
+    return for_each_holder(NULL, list_holder, &list);
+}
+
+struct done_counts {
+    int found;
+    int released;
+};
+
+static void signal_holder(const struct lock_info *info, void *arg) {
+    struct done_counts *counts = arg;
+
+    counts->found++;
+    if (kill(info->pid, SIGTERM) == 0) {
+        debug("Sent SIGTERM to process %d for lock %s", (int)info->pid, info->descriptor);
+        counts->released++;
+        if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+            openlog("waitlock", LOG_PID, g_state.syslog_facility);
+            syslog(LOG_INFO, "signaled process %d to release lock '%s'",
+                   (int)info->pid, info->descriptor);
+            closelog();
+#endif
+        }
+    } else {
+        debug("Failed to send SIGTERM to process %d: %s", (int)info->pid, strerror(errno));
+    }
+}
+
+/* Signal the holders the daemon reports. The daemon itself never kills
+ * anything; the signal comes from this process and its permissions. */
+int daemon_done_lock(const char *descriptor) {
+    struct done_counts counts;
+    int rc;
+
+    counts.found = 0;
+    counts.released = 0;
+    rc = for_each_holder(descriptor, signal_holder, &counts);
+    if (rc != E_SUCCESS) {
+        return rc;
+    }
+
+    if (counts.found == 0) {
+        if (!g_state.quiet) {
+            error(E_NOTFOUND, "No locks found for descriptor '%s'", descriptor);
+        }
+        return E_NOTFOUND;
+    }
+
+    if (counts.released == 0) {
+        if (!g_state.quiet) {
+            error(E_SYSTEM, "Failed to release any locks for descriptor '%s'", descriptor);
+        }
+        return E_SYSTEM;
+    }
+
+    debug("Released %d lock(s) for descriptor '%s'", counts.released, descriptor);
+    return E_SUCCESS;
+}
+
+#else /* !HAVE_DAEMON_CLIENT */
+
+/* Log and report a lock wait that ran out of time */
+static int report_timeout(const char *descriptor, double timeout) {
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_WARNING, "timeout waiting for lock '%s' after %.1f seconds",
+               descriptor, timeout);
+        closelog();
+#endif
+    }
+    error(E_TIMEOUT, "Timeout waiting for lock '%s' after %.1f seconds", descriptor, timeout);
+    return E_TIMEOUT;
+}
+
+int daemon_acquire_lock(const char *descriptor, int max_holders, double timeout) {
+    return DAEMON_UNAVAILABLE;
+}
+
+void daemon_release_lock(void) {
+}
+
+int daemon_held_slot(void) {
+    return -1;
+}
+
+int daemon_check_lock(const char *descriptor) {
+    return DAEMON_UNAVAILABLE;
+}
+
+int daemon_done_lock(const char *descriptor) {
+    return DAEMON_UNAVAILABLE;
+}
+
+int daemon_list_locks(output_format_t format, bool show_all, bool stale_only) {
+    return DAEMON_UNAVAILABLE;
+}
+
+#endif /* HAVE_DAEMON_CLIENT */
@@ -0,0 +1,634 @@
+/*
+ * waitlockd - lock manager daemon. Keeps every lock table in memory and
+ * serves clients over a Unix socket from one epoll loop; a holder is a
+ * connection, so a holder that dies releases its lock when the kernel
+ * closes its socket.
+ */
+
+#include "daemon.h"
+#include "../core/core.h"
+#include "../lock/lock.h"
+#include "../checksum/checksum.h"
+
+/* Socket the daemon listens on: --socket or WAITLOCK_SOCKET, else
+ * waitlockd.sock in the lock directory */
+const char *daemon_socket_path(void) {
+    static char path[PATH_MAX];
+    char *lock_dir;
+
+    if (opts.socket_path) {
+        return opts.socket_path;
+    }
+    lock_dir = find_lock_directory();
+    if (!lock_dir) {
+        return NULL;
+    }
+    safe_snprintf(path, sizeof(path), "%s/%s", lock_dir, DAEMON_SOCKET_NAME);
+    return path;
+}
+
+#ifdef HAVE_DAEMON_SERVER
+
+struct dl_client;
+
+/* One descriptor. Freed as soon as it has neither holders nor waiters. */
+struct dl_lock {
+    struct dl_lock *next;           /* Hash chain */
+    struct dl_client **slots;       /* Holder of each slot, NULL = free */
+    int slot_count;
+    int holders;
+    struct dl_client *queue_head;   /* Waiters, granted in arrival order */
+    struct dl_client *queue_tail;
+    char name[MAX_DESC_LEN + 1];
+};
+
+/* One connection */
+struct dl_client {
+    int fd;
+    pid_t pid;                      /* Peer credentials from SO_PEERCRED */
+    uid_t uid;
+    pid_t ppid;                     /* As reported by the client */
+    struct dl_lock *lock;           /* Lock held or waited for, or NULL */
+    int slot;                       /* Slot held, -1 while waiting */
+    int max_holders;
+    time_t acquired_at;
+    struct dl_client *prev;         /* Wait queue links */
+    struct dl_client *next;
+    size_t inlen;
+    char inbuf[DAEMON_LINE_MAX];
+    char *outbuf;                   /* Replies the socket did not take yet */
+    size_t outlen;
+    size_t outsize;
+    bool want_output;               /* Registered for EPOLLOUT */
+    bool dropped;                   /* Shut down; epoll reports the hangup */
+};
+
+static struct dl_lock *lock_table[DAEMON_HASH_SIZE];
+static int daemon_epfd = -1;
+
+/* Watch the client for EPOLLOUT only while it has replies queued */
+static void watch_output(struct dl_client *client, bool want_output) {
+    struct epoll_event ev;
+
+    if (client->want_output == want_output) {
+        return;
+    }
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_output ? EPOLLOUT : 0);
+    ev.data.ptr = client;
+    if (epoll_ctl(daemon_epfd, EPOLL_CTL_MOD, client->fd, &ev) == 0) {
+        client->want_output = want_output;
+    }
+}
+
+/* Send as much queued output as the socket takes without blocking.
+ * Returns -1 if the client is gone. */
+static int flush_output(struct dl_client *client) {
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < client->outlen) {
+        n = send(client->fd, client->outbuf + sent, client->outlen - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            debug("Cannot reply to client %d: %s", (int)client->pid, strerror(errno));
+            return -1;
+        }
+        sent += n;
+    }
+    client->outlen -= sent;
+    memmove(client->outbuf, client->outbuf + sent, client->outlen);
+    watch_output(client, client->outlen > 0);
+    return 0;
+}
+
+/* Stop serving a client from inside a request, where it cannot be freed:
+ * shutting the socket down makes epoll report a hangup for it */
+static void drop_client(struct dl_client *client) {
+    client->dropped = TRUE;
+    client->outlen = 0;
+    shutdown(client->fd, SHUT_RDWR);
+}
+
+/* Queue one reply line and send what the socket takes now. The rest is
+ * sent on EPOLLOUT, so a client that stops reading never stalls the
+ * loop; one that lets DAEMON_OUTPUT_MAX pile up is disconnected. */
+static void send_reply(struct dl_client *client, const char *fmt, ...) {
+    char line[DAEMON_LINE_MAX];
+    va_list args;
+    size_t len;
+
+    if (client->dropped) {
+        return;
+    }
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    len = strlen(line);
+
+    if (client->outlen + len > client->outsize) {
+        size_t size = client->outsize ? client->outsize * 2 : DAEMON_LINE_MAX * 8;
+        char *buf;
+
+        while (size < client->outlen + len) {
+            size *= 2;
+        }
+        buf = (size <= DAEMON_OUTPUT_MAX) ? realloc(client->outbuf, size) : NULL;
+        if (!buf) {
+            debug("Process %d is not reading its replies, disconnecting it", (int)client->pid);
+            drop_client(client);
+            return;
+        }
+        client->outbuf = buf;
+        client->outsize = size;
+    }
+    memcpy(client->outbuf + client->outlen, line, len);
+    client->outlen += len;
+    if (flush_output(client) != 0) {
+        drop_client(client);
+    }
+}
+
+static struct dl_lock **lock_bucket(const char *name) {
+    return &lock_table[calculate_crc32(name, strlen(name)) & (DAEMON_HASH_SIZE - 1)];
+}
+
+static struct dl_lock *find_lock(const char *name, bool create) {
+    struct dl_lock **bucket = lock_bucket(name);
+    struct dl_lock *lock;
+
+    for (lock = *bucket; lock; lock = lock->next) {
+        if (strcmp(lock->name, name) == 0) {
+            return lock;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    lock = calloc(1, sizeof(*lock));
+    if (!lock) {
+        return NULL;
+    }
+    strncpy(lock->name, name, sizeof(lock->name) - 1);
+    lock->next = *bucket;
+    *bucket = lock;
+    return lock;
+}
+
+static void free_lock_if_idle(struct dl_lock *lock) {
+    struct dl_lock **link;
+
+    if (lock->holders > 0 || lock->queue_head) {
+        return;
+    }
+    for (link = lock_bucket(lock->name); *link; link = &(*link)->next) {
+        if (*link == lock) {
+            *link = lock->next;
+            break;
+        }
+    }
+    free(lock->slots);
+    free(lock);
+}
+
+static void enqueue(struct dl_lock *lock, struct dl_client *client) {
+    client->next = NULL;
+    client->prev = lock->queue_tail;
+    if (lock->queue_tail) {
+        lock->queue_tail->next = client;
+    } else {
+        lock->queue_head = client;
+    }
+    lock->queue_tail = client;
+}
+
+static void dequeue(struct dl_lock *lock, struct dl_client *client) {
+    if (client->prev) {
+        client->prev->next = client->next;
+    } else {
+        lock->queue_head = client->next;
+    }
+    if (client->next) {
+        client->next->prev = client->prev;
+    } else {
+        lock->queue_tail = client->prev;
+    }
+    client->prev = client->next = NULL;
+}
+
+/* Give the client the lowest free slot below its limit. The caller has
+ * checked holders < max_holders, so one exists. */
+static int grant(struct dl_lock *lock, struct dl_client *client) {
+    int slot;
+
+    if (lock->slot_count < client->max_holders) {
+        struct dl_client **slots = realloc(lock->slots, client->max_holders * sizeof(*slots));
+        if (!slots) {
+            return -1;
+        }
+        memset(slots + lock->slot_count, 0,
+               (client->max_holders - lock->slot_count) * sizeof(*slots));
+        lock->slots = slots;
+        lock->slot_count = client->max_holders;
+    }
+    for (slot = 0; lock->slots[slot]; slot++) {
+        ;
+    }
+
+    lock->slots[slot] = client;
+    lock->holders++;
+    client->lock = lock;
+    client->slot = slot;
+    client->acquired_at = time(NULL);
+    send_reply(client, "GRANTED %d\n", slot);
+    debug("Granted slot %d of '%s' to process %d", slot, lock->name, (int)client->pid);
+    return 0;
+}
+
+/* Hand freed slots to waiters in arrival order. The head is never skipped,
+ * so a waiter asking for a lower limit holds back later ones. */
+static void grant_waiters(struct dl_lock *lock) {
+    while (lock->queue_head && lock->holders < lock->queue_head->max_holders) {
+        struct dl_client *client = lock->queue_head;
+
+        dequeue(lock, client);
+        if (grant(lock, client) != 0) {
+            send_reply(client, "ERROR out of memory\n");
+            client->lock = NULL;
+        }
+    }
+}
+
+/* Drop whatever the client holds or waits for */
+static void leave_lock(struct dl_client *client) {
+    struct dl_lock *lock = client->lock;
+
+    if (!lock) {
+        return;
+    }
+    if (client->slot >= 0) {
+        debug("Process %d released slot %d of '%s'", (int)client->pid, client->slot, lock->name);
+        lock->slots[client->slot] = NULL;
+        lock->holders--;
+        client->slot = -1;
+    } else {
+        dequeue(lock, client);
+    }
+    client->lock = NULL;
+    grant_waiters(lock);
+    free_lock_if_idle(lock);
+}
+
+static void handle_acquire(struct dl_client *client, const char *args) {
+    char name[DAEMON_LINE_MAX];
+    int max_holders, wait, ppid;
+    struct dl_lock *lock;
+
+    if (sscanf(args, "%d %d %d %511s", &max_holders, &wait, &ppid, name) != 4 ||
+        max_holders < 1 || max_holders > DAEMON_MAX_HOLDERS || !valid_descriptor(name)) {
+        send_reply(client, "ERROR malformed ACQUIRE\n");
+        return;
+    }
+    if (client->lock) {
+        send_reply(client, "ERROR connection already holds or waits for a lock\n");
+        return;
+    }
+
+    lock = find_lock(name, TRUE);
+    if (!lock) {
+        send_reply(client, "ERROR out of memory\n");
+        return;
+    }
+    client->ppid = ppid;
+    client->max_holders = max_holders;
+    client->slot = -1;
+
+    if (!lock->queue_head && lock->holders < max_holders) {
+        if (grant(lock, client) != 0) {
+            send_reply(client, "ERROR out of memory\n");
+            free_lock_if_idle(lock);
+        }
+    } else if (!wait) {
+        send_reply(client, "BUSY\n");
+        free_lock_if_idle(lock);
+    } else {
+        client->lock = lock;
+        enqueue(lock, client);
+        debug("Process %d queued for '%s'", (int)client->pid, name);
+    }
+}
+
+static void handle_check(struct dl_client *client, const char *args) {
+    char name[DAEMON_LINE_MAX];
+    struct dl_lock *lock;
+    int max_holders = 1;  /* Default to mutex behavior */
+    int i;
+
+    if (sscanf(args, "%511s", name) != 1 || !valid_descriptor(name)) {
+        send_reply(client, "ERROR malformed CHECK\n");
+        return;
+    }
+    lock = find_lock(name, FALSE);
+    if (!lock) {
+        send_reply(client, "STATUS 0 1\n");
+        return;
+    }
+    /* Use max_holders from any holder */
+    for (i = 0; i < lock->slot_count; i++) {
+        if (lock->slots[i]) {
+            max_holders = lock->slots[i]->max_holders;
+        }
+    }
+    send_reply(client, "STATUS %d %d\n", lock->holders, max_holders);
+}
+
+static void list_holders(struct dl_client *client, struct dl_lock *lock) {
+    int i;
+
+    for (i = 0; i < lock->slot_count; i++) {
+        struct dl_client *holder = lock->slots[i];
+        if (holder) {
+            send_reply(client, "HOLDER %d %d %u %d %d %lld %s\n",
+                       (int)holder->pid, (int)holder->ppid, (unsigned)holder->uid,
+                       i, holder->max_holders, (long long)holder->acquired_at, lock->name);
+        }
+    }
+}
+
+static void handle_list(struct dl_client *client, const char *args) {
+    char name[DAEMON_LINE_MAX];
+    struct dl_lock *lock;
+    int i;
+
+    if (sscanf(args, "%511s", name) == 1) {
+        lock = find_lock(name, FALSE);
+        if (lock) {
+            list_holders(client, lock);
+        }
+    } else {
+        for (i = 0; i < DAEMON_HASH_SIZE; i++) {
+            for (lock = lock_table[i]; lock; lock = lock->next) {
+                list_holders(client, lock);
+            }
+        }
+    }
+    send_reply(client, "END\n");
+}
+
+static void handle_request(struct dl_client *client, char *line) {
+    char *args = strchr(line, ' ');
+
+    if (args) {
+        *args++ = '\0';
+    } else {
+        args = line + strlen(line);
+    }
+
+    if (strcmp(line, "ACQUIRE") == 0) {
+        handle_acquire(client, args);
+    } else if (strcmp(line, "RELEASE") == 0) {
+        if (client->lock && client->slot >= 0) {
+            leave_lock(client);
+            send_reply(client, "RELEASED\n");
+        } else {
+            send_reply(client, "ERROR no lock held\n");
+        }
+    } else if (strcmp(line, "CHECK") == 0) {
+        handle_check(client, args);
+    } else if (strcmp(line, "LIST") == 0) {
+        handle_list(client, args);
+    } else {
+        send_reply(client, "ERROR unknown request\n");
+    }
+}
+
+static void disconnect(int epfd, struct dl_client *client) {
+    debug("Process %d disconnected", (int)client->pid);
+    leave_lock(client);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    free(client->outbuf);
+    free(client);
+}
+
+/* Read what the client sent and serve every complete line.
+ * Returns -1 once the client has to be disconnected. */
+static int serve_client(struct dl_client *client) {
+    ssize_t n;
+    char *start, *end;
+
+    n = read(client->fd, client->inbuf + client->inlen, sizeof(client->inbuf) - client->inlen);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    client->inlen += n;
+
+    start = client->inbuf;
+    while ((end = memchr(start, '\n', client->inlen - (start - client->inbuf))) != NULL) {
+        *end = '\0';
+        handle_request(client, start);
+        start = end + 1;
+    }
+    client->inlen -= start - client->inbuf;
+    memmove(client->inbuf, start, client->inlen);
+
+    if (client->inlen == sizeof(client->inbuf)) {
+        debug("Request line from process %d too long", (int)client->pid);
+        return -1;
+    }
+    return 0;
+}
+
+static void accept_clients(int epfd, int listen_fd) {
+    for (;;) {
+        struct dl_client *client;
+        struct epoll_event ev;
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        int fd;
+
+#ifdef HAVE_ACCEPT4
+        fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+#else
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+#endif
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                debug("accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        client = calloc(1, sizeof(*client));
+        if (!client || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0) {
+            free(client);
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->pid = cred.pid;
+        client->uid = cred.uid;
+        client->slot = -1;
+
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = client;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            free(client);
+            close(fd);
+            continue;
+        }
+        debug("Process %d (uid %u) connected", (int)client->pid, (unsigned)client->uid);
+    }
+}
+
+/* Bind the listening socket, replacing a stale one left by a daemon that
+ * was killed, but never one another daemon is still serving.
+ * Returns -2 if another daemon is serving. */
+static int open_listener(const char *socket_path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    char dir[PATH_MAX];
+    char *slash;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        error(E_USAGE, "Socket path too long: %s", socket_path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error(E_SYSTEM, "Cannot create socket: %s", strerror(errno));
+        return -1;
+    }
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            error(E_BUSY, "waitlockd is already listening on %s", socket_path);
+            close(fd);
+            return -2;
+        }
+        debug("Removing stale socket %s", socket_path);
+        unlink(socket_path);
+        close(fd);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            error(E_SYSTEM, "Cannot create socket: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        error(E_SYSTEM, "Cannot listen on %s: %s", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    /* Share the socket the way its directory is shared */
+    strncpy(dir, socket_path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    slash = strrchr(dir, '/');
+    if (slash) {
+        *slash = '\0';
+        if (stat(dir[0] ? dir : "/", &st) == 0) {
+            chmod(socket_path, st.st_mode & 0666);
+        }
+    }
+    return fd;
+}
+
+/* Serve clients until a signal stops the daemon. The socket file is left
+ * behind on a kill; the next daemon replaces it. */
+int run_daemon(const char *socket_path) {
+    struct epoll_event ev, events[DAEMON_MAX_EVENTS];
+    int listen_fd, epfd;
+    int n, i;
+
+    if (!socket_path) {
+        error(E_NODIR, "Cannot find lock directory for the waitlockd socket");
+        return E_NODIR;
+    }
+
+    listen_fd = open_listener(socket_path);
+    if (listen_fd < 0) {
+        return listen_fd == -2 ? E_BUSY : E_SYSTEM;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        error(E_SYSTEM, "Cannot create epoll instance: %s", strerror(errno));
+        close(listen_fd);
+        unlink(socket_path);
+        return E_SYSTEM;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    daemon_epfd = epfd;
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlockd", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "listening on %s", socket_path);
+        closelog();
+#endif
+    }
+    debug("Listening on %s", socket_path);
+
+    while (!g_state.should_exit) {
+        n = epoll_wait(epfd, events, DAEMON_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error(E_SYSTEM, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            struct dl_client *client = events[i].data.ptr;
+
+            if (!client) {
+                accept_clients(epfd, listen_fd);
+            } else if ((events[i].events & EPOLLOUT) && !client->dropped &&
+                       flush_output(client) != 0) {
+                disconnect(epfd, client);
+            } else if ((events[i].events & EPOLLIN) && serve_client(client) == 0 &&
+                       !(events[i].events & (EPOLLHUP | EPOLLERR))) {
+                continue;
+            } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+                disconnect(epfd, client);
+            }
+        }
+    }
+
+    close(epfd);
+    daemon_epfd = -1;
+    close(listen_fd);
+    unlink(socket_path);
+    return E_SUCCESS;
+}
+
+#else /* !HAVE_DAEMON_SERVER */
+
+int run_daemon(const char *socket_path) {
+    error(E_USAGE, "waitlockd is not supported on this platform");
+    return E_USAGE;
+}
+
+#endif /* HAVE_DAEMON_SERVER */
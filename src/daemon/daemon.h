@@ -0,0 +1,57 @@
+#ifndef WAITLOCK_DAEMON_H
+#define WAITLOCK_DAEMON_H
+
+#include "../waitlock.h"
+
+#ifdef HAVE_SYS_UN_H
+  #include <sys/socket.h>
+  #include <sys/un.h>
+  #define HAVE_DAEMON_CLIENT 1
+#endif
+
+#if defined(HAVE_DAEMON_CLIENT) && defined(HAVE_SYS_EPOLL_H) && \
+    defined(HAVE_EPOLL_CREATE1) && defined(SO_PEERCRED)
+  #define HAVE_DAEMON_SERVER 1
+  #include <sys/epoll.h>
+#endif
+
+/* Default socket, in the lock directory: <lockdir>/waitlockd.sock */
+#define DAEMON_SOCKET_NAME    "waitlockd.sock"
+#define DAEMON_LINE_MAX       512
+#define DAEMON_HASH_SIZE      4096   /* Lock table buckets, power of two */
+#define DAEMON_MAX_HOLDERS    65536
+#define DAEMON_MAX_EVENTS     64
+#define DAEMON_REPLY_WAIT_MS  2000   /* Bound on replies that never block */
+#define DAEMON_OUTPUT_MAX     (4 << 20)  /* Replies queued for a client that stops reading */
+
+/* Returned by the client calls when no daemon is listening, so the caller
+ * falls back to the configured backend */
+#define DAEMON_UNAVAILABLE    (-1)
+
+/* Protocol: newline-terminated text lines over a stream socket. A client
+ * holds at most one lock per connection; closing the connection releases
+ * it, or cancels the wait if it has not been granted yet.
+ *
+ *   ACQUIRE <max_holders> <wait> <ppid> <descriptor>
+ *       -> GRANTED <slot> | BUSY             (BUSY only when wait is 0)
+ *   RELEASE                  -> RELEASED
+ *   CHECK <descriptor>       -> STATUS <holders> <max_holders>
+ *   LIST [<descriptor>]      -> HOLDER <pid> <ppid> <uid> <slot> <max_holders>
+ *                                      <acquired_at> <descriptor>
+ *                               ... END
+ *   anything malformed       -> ERROR <message>
+ */
+
+/* Server, the waitlockd mode of the binary */
+const char *daemon_socket_path(void);
+int run_daemon(const char *socket_path);
+
+/* Client side, used by the lock dispatch when a socket is configured */
+int daemon_acquire_lock(const char *descriptor, int max_holders, double timeout);
+void daemon_release_lock(void);
+int daemon_held_slot(void);
+int daemon_check_lock(const char *descriptor);
+int daemon_done_lock(const char *descriptor);
+int daemon_list_locks(output_format_t format, bool show_all, bool stale_only);
+
+#endif /* WAITLOCK_DAEMON_H */
@@ -0,0 +1,511 @@
+/*
+ * libwaitlock - reentrant C API over the file backend engine
+ * Everything a call needs lives in the context or on the stack, never in
+ * g_state, so threads can lock through one context at the same time.
+ */
+
+#include "../waitlock.h"  /* config.h and feature macros come first */
+#include "libwaitlock.h"
+#include "../core/core.h"
+#include "../lock/lock.h"
+#include "../process/process.h"
+#include "../checksum/checksum.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1) && \
+    defined(HAVE_SYS_TIMERFD_H) && defined(HAVE_TIMERFD_CREATE)
+  #define HAVE_ASYNC_ACQUIRE 1
+  #include <sys/epoll.h>
+  #include <sys/timerfd.h>
+#endif
+
+struct wl_ctx {
+    char lock_dir[PATH_MAX];
+    char hostname[MAX_HOSTNAME];
+    char cmdline[MAX_CMDLINE];
+};
+
+/* An acquisition in progress. The caller polls epoll_fd, which reports the
+ * release watch and a timer for the next rescan or the deadline. */
+struct wl_pending {
+    char descriptor[MAX_DESC_LEN + 1];
+    struct file_claim claim;
+    int epoll_fd;
+    int watch_fd;
+    int timer_fd;
+    int fd;                     /* Claimed slot file, once granted */
+    int wait_ms;
+    bool forever;
+    struct timespec deadline;   /* CLOCK_MONOTONIC */
+};
+
+struct wl_iter {
+    const wl_ctx *ctx;
+    DIR *top;
+    DIR *sub;                   /* Per-descriptor subdirectory being read */
+    char sub_path[PATH_MAX];
+};
+
+wl_ctx *wl_open(const char *dir) {
+    wl_ctx *ctx;
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        return NULL;
+    }
+    if (!find_lock_directory_r(dir ? dir : getenv("WAITLOCK_DIR"), ctx->lock_dir,
+                               sizeof(ctx->lock_dir))) {
+        free(ctx);
+        return NULL;
+    }
+
+    /* Resolved once here so acquiring only touches the lock directory */
+    if (gethostname(ctx->hostname, sizeof(ctx->hostname)) != 0) {
+        safe_snprintf(ctx->hostname, sizeof(ctx->hostname), "unknown");
+    }
+    ctx->hostname[sizeof(ctx->hostname) - 1] = '\0';
+    get_process_cmdline_r(getpid(), ctx->cmdline, sizeof(ctx->cmdline));
+    return ctx;
+}
+
+void wl_close(wl_ctx *ctx) {
+    free(ctx);
+}
+
+const char *wl_dir(const wl_ctx *ctx) {
+    return ctx->lock_dir;
+}
+
+static double seconds_since(const struct timeval *start) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* Validate a request and prepare its claim */
+static int start_claim(wl_ctx *ctx, struct file_claim *claim, const char *descriptor,
+                       int max_holders) {
+    int rc;
+
+    if (!ctx || !descriptor || !valid_descriptor(descriptor) ||
+        max_holders < 1 || max_holders > 65535) {
+        return WL_EINVAL;
+    }
+
+    rc = file_claim_init(claim, ctx->lock_dir, descriptor, max_holders, ctx->hostname,
+                         ctx->cmdline);
+    if (rc == -1) {
+        errno = EPROTO;  /* Lock directory from a newer waitlock */
+        return WL_ESYSTEM;
+    }
+    if (rc == -2) {
+        return WL_ESYSTEM;
+    }
+    return WL_OK;
+}
+
+/* Hand a claimed slot file over to the caller's handle */
+static void fill_handle(wl_handle *handle, int fd, const struct file_claim *claim) {
+    handle->fd = fd;
+    handle->slot = claim->info.slot;
+    safe_snprintf(handle->path, sizeof(handle->path), "%s", claim->lock_path);
+}
+
+int wl_acquire(wl_ctx *ctx, const char *descriptor, int max_holders,
+               double timeout, wl_handle *handle) {
+    struct file_claim claim;
+    struct timeval start_time;
+    int wait_ms = INITIAL_WAIT_MS;
+    int watch_fd = -1;
+    bool watch_tried = FALSE;
+    int rc;
+    int fd;
+
+    if (!handle) {
+        return WL_EINVAL;
+    }
+    handle->fd = -1;
+    handle->slot = -1;
+    handle->path[0] = '\0';
+    rc = start_claim(ctx, &claim, descriptor, max_holders);
+    if (rc != WL_OK) {
+        return rc;
+    }
+
+    gettimeofday(&start_time, NULL);
+    while ((fd = file_claim_try(&claim)) < 0) {
+        int sleep_ms = wait_ms;
+
+        if (timeout == 0) {
+            if (watch_fd >= 0) close(watch_fd);
+            return WL_BUSY;
+        }
+
+        /* Rescan once right after the watch is set up, as the CLI does */
+        if (!watch_tried) {
+            watch_tried = TRUE;
+            watch_fd = file_claim_watch(&claim);
+            if (watch_fd >= 0) {
+                continue;
+            }
+        }
+
+        if (timeout > 0) {
+            double remaining = timeout - seconds_since(&start_time);
+            if (remaining <= 0) {
+                if (watch_fd >= 0) close(watch_fd);
+                return WL_TIMEOUT;
+            }
+            if (remaining * 1000 * TIMEOUT_FACTOR < sleep_ms) {
+                sleep_ms = (int)(remaining * 1000 * TIMEOUT_FACTOR);
+            }
+            if (sleep_ms < 1) sleep_ms = 1;
+        }
+
+        file_claim_wait(&claim, watch_fd, sleep_ms);
+        wait_ms = wait_ms * 2;
+        if (wait_ms > MAX_WAIT_MS) wait_ms = MAX_WAIT_MS;
+    }
+    if (watch_fd >= 0) close(watch_fd);
+
+    fill_handle(handle, fd, &claim);
+    return WL_OK;
+}
+
+int wl_try(wl_ctx *ctx, const char *descriptor, int max_holders, wl_handle *handle) {
+    return wl_acquire(ctx, descriptor, max_holders, 0, handle);
+}
+
+#ifdef HAVE_ASYNC_ACQUIRE
+
+static void free_pending(wl_pending *p) {
+    if (p->fd >= 0) {
+        unlink(p->claim.lock_path);
+        close(p->fd);
+    }
+    if (p->watch_fd >= 0) close(p->watch_fd);
+    if (p->timer_fd >= 0) close(p->timer_fd);
+    if (p->epoll_fd >= 0) close(p->epoll_fd);
+    free(p);
+}
+
+/* Read a nonblocking fd until it is empty, so epoll stops reporting it */
+static void drain_fd(int fd) {
+    char buf[4096];
+
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+}
+
+static bool deadline_passed(const wl_pending *p) {
+    struct timespec now;
+
+    if (p->forever) {
+        return FALSE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > p->deadline.tv_sec ||
+           (now.tv_sec == p->deadline.tv_sec && now.tv_nsec >= p->deadline.tv_nsec);
+}
+
+/* Fire the timer after wait_ms, at the deadline if that is sooner, or at
+ * once when wait_ms is 0 */
+static int arm_timer(wl_pending *p, int wait_ms) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    clock_gettime(CLOCK_MONOTONIC, &its.it_value);
+    its.it_value.tv_sec += wait_ms / 1000;
+    its.it_value.tv_nsec += (long)(wait_ms % 1000) * 1000000L;
+    if (its.it_value.tv_nsec >= 1000000000L) {
+        its.it_value.tv_sec++;
+        its.it_value.tv_nsec -= 1000000000L;
+    }
+    if (!p->forever && (its.it_value.tv_sec > p->deadline.tv_sec ||
+                        (its.it_value.tv_sec == p->deadline.tv_sec &&
+                         its.it_value.tv_nsec > p->deadline.tv_nsec))) {
+        its.it_value = p->deadline;
+    }
+    return timerfd_settime(p->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int watch_fd_in(int epoll_fd, int fd) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int wl_acquire_async(wl_ctx *ctx, const char *descriptor, int max_holders,
+                     double timeout, wl_pending **pending) {
+    wl_pending *p;
+    int rc;
+
+    if (!pending) {
+        return WL_EINVAL;
+    }
+    *pending = NULL;
+    if (!descriptor) {
+        return WL_EINVAL;
+    }
+
+    p = calloc(1, sizeof(*p));
+    if (!p) {
+        return WL_ESYSTEM;
+    }
+    p->epoll_fd = p->watch_fd = p->timer_fd = p->fd = -1;
+    safe_snprintf(p->descriptor, sizeof(p->descriptor), "%s", descriptor);
+    rc = start_claim(ctx, &p->claim, p->descriptor, max_holders);
+    if (rc != WL_OK) {
+        free_pending(p);
+        return rc;
+    }
+
+    /* Watch before the first attempt so a release right after it is seen */
+    if (timeout != 0) {
+        p->watch_fd = file_claim_watch(&p->claim);
+    }
+    p->fd = file_claim_try(&p->claim);
+    if (p->fd < 0 && timeout == 0) {
+        p->fd = -1;
+        free_pending(p);
+        return WL_BUSY;
+    }
+    if (p->fd < 0) {
+        p->fd = -1;
+    }
+
+    p->forever = (timeout < 0);
+    if (!p->forever) {
+        clock_gettime(CLOCK_MONOTONIC, &p->deadline);
+        p->deadline.tv_sec += (time_t)timeout;
+        p->deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1000000000.0);
+        if (p->deadline.tv_nsec >= 1000000000L) {
+            p->deadline.tv_sec++;
+            p->deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    p->wait_ms = INITIAL_WAIT_MS;
+    p->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    p->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (p->epoll_fd < 0 || p->timer_fd < 0 || watch_fd_in(p->epoll_fd, p->timer_fd) != 0 ||
+        (p->watch_fd >= 0 && watch_fd_in(p->epoll_fd, p->watch_fd) != 0) ||
+        arm_timer(p, (p->fd >= 0) ? 0 : p->wait_ms) != 0) {
+        int saved_errno = errno;
+        free_pending(p);
+        errno = saved_errno;
+        return WL_ESYSTEM;
+    }
+
+    *pending = p;
+    return WL_OK;
+}
+
+int wl_pending_fd(const wl_pending *pending) {
+    return pending->epoll_fd;
+}
+
+int wl_acquire_complete(wl_pending *p, wl_handle *handle) {
+    if (!p || !handle) {
+        return WL_EINVAL;
+    }
+    handle->fd = -1;
+    handle->slot = -1;
+    handle->path[0] = '\0';
+    drain_fd(p->timer_fd);
+    if (p->watch_fd >= 0) {
+        drain_fd(p->watch_fd);
+    }
+
+    if (p->fd < 0) {
+        p->fd = file_claim_try(&p->claim);
+        if (p->fd < 0) {
+            p->fd = -1;
+        }
+    }
+    if (p->fd >= 0) {
+        fill_handle(handle, p->fd, &p->claim);
+        p->fd = -1;
+        free_pending(p);
+        return WL_OK;
+    }
+
+    if (deadline_passed(p)) {
+        free_pending(p);
+        return WL_TIMEOUT;
+    }
+
+    /* The timer is the backoff bound that finds holders who died without
+     * removing their file; releases wake the watch directly */
+    p->wait_ms = p->wait_ms * 2;
+    if (p->wait_ms > MAX_WAIT_MS) p->wait_ms = MAX_WAIT_MS;
+    if (arm_timer(p, p->wait_ms) != 0) {
+        int saved_errno = errno;
+        free_pending(p);
+        errno = saved_errno;
+        return WL_ESYSTEM;
+    }
+    return WL_AGAIN;
+}
+
+void wl_acquire_cancel(wl_pending *pending) {
+    if (pending) {
+        free_pending(pending);
+    }
+}
+
+#else
+
+int wl_acquire_async(wl_ctx *ctx, const char *descriptor, int max_holders,
+                     double timeout, wl_pending **pending) {
+    (void)ctx; (void)descriptor; (void)max_holders; (void)timeout;
+    if (pending) {
+        *pending = NULL;
+    }
+    errno = ENOSYS;
+    return WL_ESYSTEM;
+}
+
+int wl_pending_fd(const wl_pending *pending) {
+    (void)pending;
+    return -1;
+}
+
+int wl_acquire_complete(wl_pending *pending, wl_handle *handle) {
+    (void)pending; (void)handle;
+    return WL_EINVAL;
+}
+
+void wl_acquire_cancel(wl_pending *pending) {
+    (void)pending;
+}
+
+#endif /* HAVE_ASYNC_ACQUIRE */
+
+int wl_release(wl_ctx *ctx, wl_handle *handle) {
+    (void)ctx;
+    if (!handle || handle->fd < 0) {
+        return WL_EINVAL;
+    }
+
+    /* Unlink while still locked, so nobody reaps a file we are about to drop */
+    unlink(handle->path);
+    close(handle->fd);
+    handle->fd = -1;
+    handle->slot = -1;
+    handle->path[0] = '\0';
+    return WL_OK;
+}
+
+int wl_check(wl_ctx *ctx, const char *descriptor) {
+    int max_holders;
+    int active;
+
+    if (!ctx || !descriptor || !valid_descriptor(descriptor)) {
+        return WL_EINVAL;
+    }
+    active = file_count_holders(ctx->lock_dir, descriptor, 1, &max_holders);
+    if (active == -1) {
+        errno = EPROTO;
+        return WL_ESYSTEM;
+    }
+    if (active < 0) {
+        return WL_ESYSTEM;
+    }
+    return (active >= max_holders) ? WL_BUSY : WL_OK;
+}
+
+wl_iter *wl_list(wl_ctx *ctx) {
+    wl_iter *it;
+
+    it = calloc(1, sizeof(*it));
+    if (!it) {
+        return NULL;
+    }
+    it->ctx = ctx;
+    it->top = opendir(ctx->lock_dir);
+    if (!it->top) {
+        free(it);
+        return NULL;
+    }
+    return it;
+}
+
+/* Report a slot file if it holds a valid record */
+static bool read_holder(const char *path, wl_info *out) {
+    struct lock_info info;
+
+    if (read_lock_file_any_format(path, &info) != 0 ||
+        info.magic != LOCK_MAGIC || !validate_lock_checksum(&info)) {
+        return FALSE;
+    }
+
+    memset(out, 0, sizeof(*out));
+    safe_snprintf(out->descriptor, sizeof(out->descriptor), "%s", info.descriptor);
+    out->pid = info.pid;
+    out->ppid = info.ppid;
+    out->uid = info.uid;
+    out->slot = info.slot;
+    out->max_holders = info.max_holders;
+    out->acquired_at = info.acquired_at;
+    out->stale = !holder_alive(path, &info);
+    return TRUE;
+}
+
+int wl_list_next(wl_iter *it, wl_info *out) {
+    struct dirent *entry;
+    char path[PATH_MAX];
+
+    for (;;) {
+        if (it->sub) {
+            entry = readdir(it->sub);
+            if (!entry) {
+                closedir(it->sub);
+                it->sub = NULL;
+                continue;
+            }
+            /* Skips ".", ".." and unpublished .claim files */
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            safe_snprintf(path, sizeof(path), "%s/%s", it->sub_path, entry->d_name);
+            if (lock_path_slot(path) < 0) {
+                continue;
+            }
+        } else {
+            entry = readdir(it->top);
+            if (!entry) {
+                return 0;
+            }
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            safe_snprintf(path, sizeof(path), "%s/%s", it->ctx->lock_dir, entry->d_name);
+            if (lock_path_slot(path) < 0) {
+                /* Descriptor subdirectory; other files fail opendir() */
+                it->sub = opendir(path);
+                if (it->sub) {
+                    safe_snprintf(it->sub_path, sizeof(it->sub_path), "%s", path);
+                }
+                continue;
+            }
+        }
+        if (read_holder(path, out)) {
+            return 1;
+        }
+    }
+}
+
+void wl_list_end(wl_iter *it) {
+    if (!it) {
+        return;
+    }
+    if (it->sub) {
+        closedir(it->sub);
+    }
+    closedir(it->top);
+    free(it);
+}
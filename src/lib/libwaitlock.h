@@ -0,0 +1,115 @@
+/*
+ * libwaitlock - take waitlock locks from C without running the CLI
+ *
+ * The library drives the same lock directory as the waitlock binary, so
+ * locks taken here are seen by "waitlock --list", "--check" and "--done",
+ * and waitlock processes queue behind them.
+ *
+ * Every call is reentrant. A context may be shared between threads; each
+ * thread passes its own handle. Handles live in caller storage and the
+ * acquire path allocates nothing.
+ *
+ *     wl_ctx *ctx = wl_open(NULL);
+ *     wl_handle h;
+ *     if (wl_acquire(ctx, "database", 1, 30.0, &h) == WL_OK) {
+ *         ...
+ *         wl_release(ctx, &h);
+ *     }
+ *     wl_close(ctx);
+ *
+ * Build with: cc prog.c $(pkg-config --cflags --libs libwaitlock)
+ */
+
+#ifndef LIBWAITLOCK_H
+#define LIBWAITLOCK_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define WL_API __attribute__((visibility("default")))
+#else
+#define WL_API
+#endif
+
+/* Return codes, matching the waitlock exit codes */
+#define WL_OK        0
+#define WL_BUSY      1   /* All slots are held */
+#define WL_TIMEOUT   2   /* Timed out waiting for a slot */
+#define WL_EINVAL    3   /* Bad descriptor, holder count or handle */
+#define WL_ESYSTEM   4   /* System error, errno is set */
+#define WL_ENODIR    6   /* No usable lock directory */
+#define WL_AGAIN     7   /* Async acquisition still pending (library only) */
+
+#define WL_DESC_MAX  255
+#define WL_PATH_MAX  4096
+
+typedef struct wl_ctx wl_ctx;
+typedef struct wl_iter wl_iter;
+typedef struct wl_pending wl_pending;
+
+/* A held lock. The slot file stays locked until wl_release() or exit. */
+typedef struct wl_handle {
+    int fd;
+    int slot;
+    char path[WL_PATH_MAX];
+} wl_handle;
+
+/* One holder, as reported by wl_list_next() */
+typedef struct wl_info {
+    char descriptor[WL_DESC_MAX + 1];
+    pid_t pid;
+    pid_t ppid;
+    uid_t uid;
+    int slot;
+    int max_holders;
+    time_t acquired_at;
+    int stale;          /* Holder is gone but its file is still there */
+} wl_info;
+
+/* Open a lock directory. NULL selects $WAITLOCK_DIR, or the directory the
+ * waitlock binary would use. Returns NULL with errno set on failure. */
+WL_API wl_ctx *wl_open(const char *dir);
+WL_API void wl_close(wl_ctx *ctx);
+WL_API const char *wl_dir(const wl_ctx *ctx);
+
+/* Take one of max_holders slots of descriptor. A negative timeout waits
+ * forever, 0 does not wait at all. */
+WL_API int wl_acquire(wl_ctx *ctx, const char *descriptor, int max_holders,
+                      double timeout, wl_handle *handle);
+WL_API int wl_try(wl_ctx *ctx, const char *descriptor, int max_holders, wl_handle *handle);
+WL_API int wl_release(wl_ctx *ctx, wl_handle *handle);
+
+/* Start acquiring without blocking, for event loops. On WL_OK *pending is
+ * set and wl_pending_fd() becomes readable whenever the acquisition may
+ * have progressed: a slot was released, a retry is due or the deadline
+ * passed. Then call wl_acquire_complete(), which returns WL_OK with the
+ * handle filled in, WL_TIMEOUT, or WL_AGAIN to keep polling. Any result
+ * other than WL_AGAIN frees the pending acquisition and closes its fd.
+ * A timeout of 0 returns WL_BUSY at once if no slot is free. The context
+ * must outlive the pending acquisition. Linux only; elsewhere WL_ESYSTEM
+ * with errno ENOSYS. */
+WL_API int wl_acquire_async(wl_ctx *ctx, const char *descriptor, int max_holders,
+                            double timeout, wl_pending **pending);
+WL_API int wl_pending_fd(const wl_pending *pending);
+WL_API int wl_acquire_complete(wl_pending *pending, wl_handle *handle);
+WL_API void wl_acquire_cancel(wl_pending *pending);
+
+/* WL_OK if descriptor has a free slot, WL_BUSY if not */
+WL_API int wl_check(wl_ctx *ctx, const char *descriptor);
+
+/* Iterate over the holders in the directory. wl_list_next() returns 1 and
+ * fills info, or 0 at the end. */
+WL_API wl_iter *wl_list(wl_ctx *ctx);
+WL_API int wl_list_next(wl_iter *it, wl_info *info);
+WL_API void wl_list_end(wl_iter *it);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBWAITLOCK_H */
@@ -6,10 +6,16 @@
 #include "../core/core.h"
 #include "../process/process.h"
 #include "../checksum/checksum.h"
+#include "../shm/shm.h"
+#include "../ofd/ofd.h"
+#include "../sysv/sysv.h"
+#include "../robust/robust.h"
+#include "../uring/uring.h"
+#include "../daemon/daemon.h"
 
-/* Find or create lock directory */
-char* find_lock_directory(void) {
-    static char lock_dir[PATH_MAX];
+/* Find or create a lock directory, the requested one if given, and copy
+ * its path into buf. Returns buf, or NULL. */
+char* find_lock_directory_r(const char *requested, char *buf, size_t size) {
     const char *candidates[] = {
         "/var/run/waitlock",
         "/run/waitlock",
@@ -21,13 +27,15 @@ char* find_lock_directory(void) {
     char *home;
     
     /* Use specified directory if provided */
-    if (opts.lock_dir) {
-        if (access(opts.lock_dir, W_OK) == 0) {
-            return (char*)opts.lock_dir;
+    if (requested) {
+        if (access(requested, W_OK) == 0) {
+            safe_snprintf(buf, size, "%s", requested);
+            return buf;
         }
         if (errno == ENOENT) {
-            if (mkdir(opts.lock_dir, 0755) == 0) {
-                return (char*)opts.lock_dir;
+            if (mkdir(requested, 0755) == 0) {
+                safe_snprintf(buf, size, "%s", requested);
+                return buf;
             }
         }
         return NULL;
@@ -36,11 +44,13 @@ char* find_lock_directory(void) {
     /* Try standard locations */
     for (p = candidates; *p; p++) {
         if (access(*p, W_OK) == 0) {
-            return (char*)*p;
+            safe_snprintf(buf, size, "%s", *p);
+            return buf;
         }
         if (errno == ENOENT) {
             if (mkdir(*p, 0755) == 0) {
-                return (char*)*p;
+                safe_snprintf(buf, size, "%s", *p);
+                return buf;
             }
         }
     }
@@ -48,62 +58,1369 @@ char* find_lock_directory(void) {
     /* Try home directory */
     home = getenv("HOME");
     if (home) {
-        safe_snprintf(lock_dir, sizeof(lock_dir), "%s/.waitlock", home);
-        if (access(lock_dir, W_OK) == 0) {
-            return lock_dir;
+        safe_snprintf(buf, size, "%s/.waitlock", home);
+        if (access(buf, W_OK) == 0) {
+            return buf;
         }
         if (errno == ENOENT) {
-            if (mkdir(lock_dir, 0755) == 0) {
-                return lock_dir;
+            if (mkdir(buf, 0755) == 0) {
+                return buf;
             }
         }
     }
     
     /* Last resort: current directory */
-    safe_snprintf(lock_dir, sizeof(lock_dir), "./waitlock");
-    if (access(lock_dir, W_OK) == 0) {
-        return lock_dir;
+    safe_snprintf(buf, size, "./waitlock");
+    if (access(buf, W_OK) == 0) {
+        return buf;
     }
     if (errno == ENOENT) {
-        if (mkdir(lock_dir, 0755) == 0) {
-            return lock_dir;
+        if (mkdir(buf, 0755) == 0) {
+            return buf;
         }
     }
     
     return NULL;
 }
 
+/* Find or create lock directory (static buffer, not thread-safe) */
+char* find_lock_directory(void) {
+    static char lock_dir[PATH_MAX];
+    
+    return find_lock_directory_r(opts.lock_dir, lock_dir, sizeof(lock_dir));
+}
+
 /* Portable file locking */
 int portable_lock(int fd, int operation) {
 #ifdef HAVE_FLOCK
     return flock(fd, operation);
 #else
+    return portable_range_lock(fd, 0, 0, operation);
+#endif
+}
+
+/* Lock len bytes of a file from start (len 0 locks to the end of the file).
+ * Open file description locks are used where available: like flock they
+ * belong to the open file, so they are shared across fork and dropped when
+ * the last descriptor closes, instead of whenever the process closes any
+ * descriptor for the file. */
+int portable_range_lock(int fd, off_t start, off_t len, int operation) {
     struct flock fl;
+    int cmd;
+    
     memset(&fl, 0, sizeof(fl));
     fl.l_type = (operation & LOCK_EX) ? F_WRLCK : F_RDLCK;
     fl.l_whence = SEEK_SET;
-    fl.l_start = 0;
-    fl.l_len = 0;
+    fl.l_start = start;
+    fl.l_len = len;
     
-    int cmd = (operation & LOCK_NB) ? F_SETLK : F_SETLKW;
+#ifdef F_OFD_SETLK
+    cmd = (operation & LOCK_NB) ? F_OFD_SETLK : F_OFD_SETLKW;
+#else
+    cmd = (operation & LOCK_NB) ? F_SETLK : F_SETLKW;
+#endif
     return fcntl(fd, cmd, &fl);
+}
+
+/* Check if a directory entry is "<prefix>N<suffix>" for a number N */
+static bool is_numbered_file(const char *name, const char *prefix, const char *suffix) {
+    size_t prefix_len = strlen(prefix);
+    const char *p;
+
+    if (strncmp(name, prefix, prefix_len) != 0) {
+        return FALSE;
+    }
+    p = name + prefix_len;
+    if (!isdigit((unsigned char)*p)) {
+        return FALSE;
+    }
+    while (isdigit((unsigned char)*p)) {
+        p++;
+    }
+    return strcmp(p, suffix) == 0;
+}
+
+/* Check if a directory entry is "<prefix>N.lock" for a slot number N */
+static bool is_slot_file(const char *name, const char *prefix) {
+    return is_numbered_file(name, prefix, ".lock");
+}
+
+/* Check if a directory entry is "<prefix>N.wait" for a --fair ticket N */
+static bool is_queue_file(const char *name, const char *prefix) {
+    return is_numbered_file(name, prefix, QUEUE_FILE_SUFFIX);
+}
+
+/* Read the on-disk layout of a lock directory (-1 if unsupported) */
+int get_lock_layout(const char *lock_dir) {
+    int shards;
+
+    return read_lock_layout(lock_dir, &shards);
+}
+
+/* Read the on-disk layout of a lock directory and its fan-out, 1 unless
+ * the layout is sharded (-1 if unsupported) */
+int read_lock_layout(const char *lock_dir, int *shards) {
+    char marker_path[PATH_MAX];
+    char buf[16];
+    const char *p;
+    ssize_t len;
+    int layout;
+    int fd;
+
+    *shards = 1;
+    safe_snprintf(marker_path, sizeof(marker_path), "%s/%s", lock_dir, LAYOUT_MARKER);
+    fd = open(marker_path, O_RDONLY);
+    if (fd < 0) {
+        /* Unmarked directories keep the layout older binaries understand */
+        return LAYOUT_FLAT;
+    }
+
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return LAYOUT_FLAT;
+    }
+    buf[len] = '\0';
+
+    layout = atoi(buf);
+    if (layout == LAYOUT_SHARDED) {
+        p = strchr(buf, ' ');
+        *shards = p ? atoi(p + 1) : 0;
+        if (*shards < 1 || *shards > LAYOUT_SHARDS_MAX) {
+            return -1;
+        }
+    } else if (layout != LAYOUT_FLAT && layout != LAYOUT_SUBDIR) {
+        return -1;
+    }
+    return layout;
+}
+
+/* Name of a descriptor's directory in the sharded layout. The hash only
+ * depends on the descriptor, so every process finds the same shard. */
+static void shard_dir_name(char *buf, size_t size, const char *descriptor, int shards) {
+    safe_snprintf(buf, size, "%02x",
+                  (unsigned int)(calculate_crc32(descriptor, strlen(descriptor)) % (uint32_t)shards));
+}
+
+/* Build the path of a descriptor's slot file in the given layout */
+static void slot_file_path(char *buf, size_t size, const char *lock_dir, int layout,
+                           int shards, const char *descriptor, int slot) {
+    char shard[8];
+
+    if (layout == LAYOUT_SUBDIR) {
+        safe_snprintf(buf, size, "%s/%s/slot%d.lock", lock_dir, descriptor, slot);
+    } else if (layout == LAYOUT_SHARDED) {
+        shard_dir_name(shard, sizeof(shard), descriptor, shards);
+        safe_snprintf(buf, size, "%s/%s/%s.slot%d.lock", lock_dir, shard, descriptor, slot);
+    } else {
+        safe_snprintf(buf, size, "%s/%s.slot%d.lock", lock_dir, descriptor, slot);
+    }
+}
+
+/* Directory holding a descriptor's slot files and the name prefix they use.
+ * The sharded layout keeps the flat names, in the descriptor's shard. */
+static void slot_file_location(char *dir_buf, size_t dir_size, char *prefix_buf,
+                               size_t prefix_size, const char *lock_dir,
+                               int layout, int shards, const char *descriptor) {
+    char shard[8];
+
+    if (layout == LAYOUT_SUBDIR) {
+        safe_snprintf(dir_buf, dir_size, "%s/%s", lock_dir, descriptor);
+        safe_snprintf(prefix_buf, prefix_size, "slot");
+    } else if (layout == LAYOUT_SHARDED) {
+        shard_dir_name(shard, sizeof(shard), descriptor, shards);
+        safe_snprintf(dir_buf, dir_size, "%s/%s", lock_dir, shard);
+        safe_snprintf(prefix_buf, prefix_size, "%s.slot", descriptor);
+    } else {
+        safe_snprintf(dir_buf, dir_size, "%s", lock_dir);
+        safe_snprintf(prefix_buf, prefix_size, "%s.slot", descriptor);
+    }
+}
+
+/* Name prefix of a descriptor's --fair queue files in its slot directory */
+static void queue_file_prefix(char *buf, size_t size, int layout, const char *descriptor) {
+    if (layout == LAYOUT_SUBDIR) {
+        safe_snprintf(buf, size, "queue");
+    } else {
+        safe_snprintf(buf, size, "%s.queue", descriptor);
+    }
+}
+
+/* Create a descriptor subdirectory or shard with the same mode as the lock
+ * directory, so a shared (e.g. 01777) lock directory stays usable by every
+ * user. An existing one is found by lookup alone: mkdir() takes the lock
+ * directory's inode lock even when it fails with EEXIST. */
+static int make_descriptor_dir(const char *lock_dir, const char *desc_dir) {
+    struct stat st;
+    mode_t mode = 0755;
+
+    if (stat(desc_dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+        return 0;
+    }
+    if (stat(lock_dir, &st) == 0) {
+        mode = st.st_mode & 07777;
+    }
+    if (mkdir(desc_dir, mode) == 0) {
+        chmod(desc_dir, mode);  /* Not filtered by umask */
+        return 0;
+    }
+    return (errno == EEXIST) ? 0 : -1;
+}
+
+/* Directory entry filter: whether name is worth opening */
+typedef bool (*entry_filter_t)(const char *name, const char *prefix);
+
+/* Directory entry visitor, given the entry open read-only as fd and the
+ * directory it is in as dir_fd (for unlinkat()); returning non-zero stops
+ * the scan */
+typedef int (*entry_visitor_t)(int dir_fd, const char *name, int fd, void *ctx);
+
+/* Flags for opening lock directory entries: a symlink planted in a shared
+ * lock directory is never followed, and a FIFO cannot block the scan */
+#define SCAN_OPEN_FLAGS (O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK)
+
+/* Bytes of directory entries fetched per getdents64 call */
+#define SCAN_BATCH_SIZE 32768
+
+/* Largest record read back: a format 2 record with the longest strings,
+ * or a format 1 struct lock_info */
+#define LOCK_RECORD_MAX (sizeof(struct lock_info) + sizeof(struct lock_header))
+
+/* Open the entry name of dir_fd and visit it. Entries that are gone or
+ * are symlinks are skipped. */
+static int visit_entry(int dir_fd, const char *name, entry_visitor_t visit, void *ctx) {
+    int fd;
+    int rc;
+
+    fd = openat(dir_fd, name, SCAN_OPEN_FLAGS);
+    if (fd < 0) {
+        return 0;
+    }
+    rc = visit(dir_fd, name, fd, ctx);
+    close(fd);
+    return rc;
+}
+
+#if defined(HAVE_SYS_SYSCALL_H) && HAVE_DECL_SYS_GETDENTS64
+/* Layout of the records getdents64 returns */
+struct scan_dirent {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* One getdents64 batch */
+union scan_dirents {
+    char bytes[SCAN_BATCH_SIZE];
+    uint64_t align;
+};
+#endif
+
+/* The one lock directory scanner: visit every entry of the directory open
+ * as dir_fd whose name passes match (with prefix). Names are filtered
+ * before any system call, and entries are opened relative to dir_fd, so
+ * the directory path is resolved once per scan rather than per file. On
+ * Linux entries are read in large getdents64 batches. Returns -1 if the
+ * directory cannot be read. */
+static int scan_lock_dir(int dir_fd, entry_filter_t match, const char *prefix,
+                         entry_visitor_t visit, void *ctx) {
+#if defined(HAVE_SYS_SYSCALL_H) && HAVE_DECL_SYS_GETDENTS64
+    union scan_dirents buf;
+    struct scan_dirent *entry;
+    long len;
+    long pos;
+
+    if (lseek(dir_fd, 0, SEEK_SET) < 0) {
+        return -1;
+    }
+    while ((len = syscall(SYS_getdents64, dir_fd, buf.bytes, sizeof(buf.bytes))) > 0) {
+        for (pos = 0; pos < len; pos += entry->d_reclen) {
+            entry = (struct scan_dirent *)(buf.bytes + pos);
+            if (match(entry->d_name, prefix) &&
+                visit_entry(dir_fd, entry->d_name, visit, ctx) != 0) {
+                return 0;
+            }
+        }
+    }
+    return (len < 0) ? -1 : 0;
+#else
+    struct dirent *entry;
+    DIR *dir;
+    int fd;
+
+    fd = dup(dir_fd);
+    if (fd < 0) {
+        return -1;
+    }
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+    rewinddir(dir);
+    while ((entry = readdir(dir)) != NULL) {
+        if (match(entry->d_name, prefix) &&
+            visit_entry(dir_fd, entry->d_name, visit, ctx) != 0) {
+            break;
+        }
+    }
+    closedir(dir);
+    return 0;
+#endif
+}
+
+/* Open a lock directory for scan_lock_dir() */
+static int open_scan_dir(const char *path) {
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/* Remove the entry name of dir_fd if it is still the file open as fd. By
+ * the time a scan finds a file stale, another process may have removed it
+ * and a new holder taken its name; that file is left alone. */
+static void unlink_scanned_entry(int dir_fd, const char *name, int fd) {
+    struct stat open_st;
+    struct stat name_st;
+
+    if (fstat(fd, &open_st) != 0 ||
+        fstatat(dir_fd, name, &name_st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        open_st.st_dev != name_st.st_dev || open_st.st_ino != name_st.st_ino) {
+        debug("Lock file %s was removed or replaced since it was read, leaving it", name);
+        return;
+    }
+    unlinkat(dir_fd, name, 0);
+}
+
+/* Directory entry visitor for scans that read each entry: buf holds the
+ * first len bytes of the entry open as fd, len being -1 if it cannot be
+ * read (e.g. a subdirectory) */
+typedef int (*record_visitor_t)(int dir_fd, const char *name, int fd,
+                                const char *buf, ssize_t len, void *ctx);
+
+/* A record_visitor_t run by scan_lock_dir() */
+struct record_scan {
+    record_visitor_t visit;
+    void *ctx;
+};
+
+/* Read the start of an entry and hand it to a record_visitor_t */
+static int read_and_visit(int dir_fd, const char *name, int fd, void *ctx) {
+    struct record_scan *scan = (struct record_scan *)ctx;
+    char buf[LOCK_RECORD_MAX];
+    ssize_t len;
+
+    len = pread(fd, buf, sizeof(buf), 0);
+    return scan->visit(dir_fd, name, fd, buf, len, scan->ctx);
+}
+
+#if defined(HAVE_URING) && HAVE_DECL_SYS_GETDENTS64
+/* Open, read and visit count entries of dir_fd in one io_uring batch,
+ * then close them in another. Entries the batch could not open (e.g. for
+ * want of descriptors) are retried one at a time once it is closed. If
+ * the ring fails, it is destroyed and cleared; without a ring the entries
+ * are visited one at a time. Returns TRUE if the visitor stopped. */
+static bool visit_record_batch(struct uring **ring, int dir_fd, struct uring_file *files,
+                               int count, record_visitor_t visit, void *ctx) {
+    struct record_scan plain;
+    bool retry[URING_BATCH];
+    char *bufs;
+    int rc = 0;
+    int i;
+
+    plain.visit = visit;
+    plain.ctx = ctx;
+    bufs = *ring ? malloc((size_t)count * LOCK_RECORD_MAX) : NULL;
+    for (i = 0; bufs && i < count; i++) {
+        files[i].buf = bufs + (size_t)i * LOCK_RECORD_MAX;
+        files[i].size = LOCK_RECORD_MAX;
+    }
+    if (!bufs || uring_open_read(*ring, dir_fd, SCAN_OPEN_FLAGS, files, count) != 0) {
+        if (bufs) {
+            debug("io_uring cannot open lock files, reading them one at a time");
+            uring_destroy(*ring);
+            *ring = NULL;
+        }
+        free(bufs);
+        for (i = 0; i < count && rc == 0; i++) {
+            rc = visit_entry(dir_fd, files[i].name, read_and_visit, &plain);
+        }
+        return rc != 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        retry[i] = (files[i].fd < 0);
+        if (!retry[i] && rc == 0) {
+            rc = visit(dir_fd, files[i].name, files[i].fd, files[i].buf, files[i].len, ctx);
+        }
+    }
+    uring_close_files(*ring, files, count);
+    free(bufs);
+    for (i = 0; i < count && rc == 0; i++) {
+        if (retry[i]) {
+            rc = visit_entry(dir_fd, files[i].name, read_and_visit, &plain);
+        }
+    }
+    return rc != 0;
+}
 #endif
+
+/* scan_lock_dir() for visitors that read each entry. Through the io_uring
+ * *ring, when there is one, the entries of each getdents64 batch are
+ * opened, read and closed URING_BATCH at a time, a handful of system calls
+ * for hundreds of lock files instead of three calls per file. Without a
+ * ring, or once it has failed, each entry is opened and read in turn. */
+static int scan_lock_records(struct uring **ring, int dir_fd, entry_filter_t match,
+                             const char *prefix, record_visitor_t visit, void *ctx) {
+    struct record_scan plain;
+#if defined(HAVE_URING) && HAVE_DECL_SYS_GETDENTS64
+    union scan_dirents buf;
+    struct uring_file files[URING_BATCH];
+    struct scan_dirent *entry;
+    bool stop = FALSE;
+    long len = 0;
+    long pos;
+    int count;
+
+    if (*ring) {
+        if (lseek(dir_fd, 0, SEEK_SET) < 0) {
+            return -1;
+        }
+        while (!stop && (len = syscall(SYS_getdents64, dir_fd, buf.bytes, sizeof(buf.bytes))) > 0) {
+            /* Names point into buf, so each batch ends with it */
+            count = 0;
+            for (pos = 0; pos < len && !stop; pos += entry->d_reclen) {
+                entry = (struct scan_dirent *)(buf.bytes + pos);
+                if (!match(entry->d_name, prefix)) {
+                    continue;
+                }
+                files[count++].name = entry->d_name;
+                if (count == URING_BATCH) {
+                    stop = visit_record_batch(ring, dir_fd, files, count, visit, ctx);
+                    count = 0;
+                }
+            }
+            if (!stop && count > 0) {
+                stop = visit_record_batch(ring, dir_fd, files, count, visit, ctx);
+            }
+        }
+        return (!stop && len < 0) ? -1 : 0;
+    }
+#endif
+    plain.visit = visit;
+    plain.ctx = ctx;
+    return scan_lock_dir(dir_fd, match, prefix, read_and_visit, &plain);
+}
+
+/* Visit every slot file of a descriptor. In the subdirectory and sharded
+ * layouts the flat names of the first legacy_slots slots are probed first,
+ * so holders created by older binaries are honoured; probing before the
+ * scan means a file being migrated is seen at least once. Returns -1 if
+ * the directory cannot be read. */
+static int for_each_slot_file(const char *lock_dir, int layout, int shards,
+                              const char *descriptor, int legacy_slots,
+                              entry_visitor_t visit, void *ctx) {
+    char scan_dir[PATH_MAX];
+    char prefix[MAX_DESC_LEN + 8];
+    char name[MAX_DESC_LEN + 32];
+    int lock_dir_fd;
+    int dir_fd;
+    int slot;
+    int rc;
+
+    slot_file_location(scan_dir, sizeof(scan_dir), prefix, sizeof(prefix),
+                       lock_dir, layout, shards, descriptor);
+
+    if (layout != LAYOUT_FLAT && legacy_slots > 0) {
+        lock_dir_fd = open_scan_dir(lock_dir);
+        if (lock_dir_fd < 0) {
+            return -1;
+        }
+        for (slot = 0; slot < legacy_slots; slot++) {
+            safe_snprintf(name, sizeof(name), "%s.slot%d.lock", descriptor, slot);
+            if (visit_entry(lock_dir_fd, name, visit, ctx) != 0) {
+                close(lock_dir_fd);
+                return 0;
+            }
+        }
+        close(lock_dir_fd);
+    }
+
+    dir_fd = open_scan_dir(scan_dir);
+    if (dir_fd < 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    rc = scan_lock_dir(dir_fd, is_slot_file, prefix, visit, ctx);
+    close(dir_fd);
+    return rc;
 }
 
+/* Extract the slot number from a slot file path (-1 if not a slot file) */
+int lock_path_slot(const char *path) {
+    const char *base = strrchr(path, '/');
+    const char *end;
+    const char *p;
+
+    base = base ? base + 1 : path;
+    end = base + strlen(base);
+    if (end - base < 10 || strcmp(end - 5, ".lock") != 0) {
+        return -1;
+    }
+
+    p = end - 5;
+    while (p > base && isdigit((unsigned char)p[-1])) {
+        p--;
+    }
+    if (p == end - 5 || p - base < 4 || strncmp(p - 4, "slot", 4) != 0) {
+        return -1;
+    }
+    return atoi(p);
+}
+
+/* Watch the directories of count claims for removed slot files, with one
+ * descriptor (-1 if unsupported) */
+static int open_release_watch(const struct file_claim *claims, int count) {
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_INOTIFY_INIT1)
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int i;
+
+    if (fd < 0) {
+        debug("inotify unavailable (%s), using backoff polling", strerror(errno));
+        return -1;
+    }
+
+    /* IN_CLOSE_WRITE also reports a holder or --fair waiter that died
+     * without removing its file. Claims sharing a directory share its watch. */
+    for (i = 0; i < count; i++) {
+        if (inotify_add_watch(fd, claims[i].scan_dir,
+                              IN_DELETE | IN_MOVED_FROM | IN_CLOSE_WRITE) < 0) {
+            debug("Cannot watch %s (%s), using backoff polling", claims[i].scan_dir,
+                  strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+#else
+    (void)claims;
+    (void)count;
+    return -1;
+#endif
+}
+
+/* Whether a removed file name is a slot file of one of the claims, or the
+ * queue file of a waiter they wait behind */
+static bool is_release_of(const char *name, const struct file_claim *claims, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (is_slot_file(name, claims[i].prefix) ||
+            ((claims[i].queue_fd >= 0 || claims[i].rw_mode) &&
+             is_queue_file(name, claims[i].queue_prefix))) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Wait up to wait_ms for a slot file of one of count claims to be removed,
+ * or for a --fair waiter ahead of a queued claim to leave the queue.
+ * Returns TRUE if woken by a release, FALSE on timeout or signal. */
+static bool wait_for_release(int watch_fd, const struct file_claim *claims, int count,
+                             int wait_ms) {
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_INOTIFY_INIT1)
+    union {
+        struct inotify_event event;
+        char buf[4096];
+    } events;
+    struct timeval deadline, now, tv;
+    fd_set readfds;
+    ssize_t len;
+    char *p;
+
+    if (watch_fd < 0) {
+        usleep(wait_ms * 1000);
+        return FALSE;
+    }
+
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += wait_ms / 1000;
+    deadline.tv_usec += (wait_ms % 1000) * 1000;
+    if (deadline.tv_usec >= 1000000) {
+        deadline.tv_sec++;
+        deadline.tv_usec -= 1000000;
+    }
+
+    while (1) {
+        gettimeofday(&now, NULL);
+        tv.tv_sec = deadline.tv_sec - now.tv_sec;
+        tv.tv_usec = deadline.tv_usec - now.tv_usec;
+        if (tv.tv_usec < 0) {
+            tv.tv_sec--;
+            tv.tv_usec += 1000000;
+        }
+        if (tv.tv_sec < 0) {
+            return FALSE;
+        }
+
+        FD_ZERO(&readfds);
+        FD_SET(watch_fd, &readfds);
+        if (select(watch_fd + 1, &readfds, NULL, NULL, &tv) <= 0) {
+            return FALSE;  /* Timed out or interrupted by a signal */
+        }
+
+        len = read(watch_fd, events.buf, sizeof(events.buf));
+        if (len <= 0) {
+            continue;
+        }
+
+        for (p = events.buf; p < events.buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+
+            /* On queue overflow we cannot know what went away, so rescan */
+            if ((ev->mask & IN_Q_OVERFLOW) ||
+                (ev->len > 0 && is_release_of(ev->name, claims, count))) {
+                return TRUE;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+#else
+    (void)watch_fd;
+    (void)claims;
+    (void)count;
+    usleep(wait_ms * 1000);
+    return FALSE;
+#endif
+}
+
+/* Result of probing a slot file's lock */
+#define HOLDER_DEAD      0
+#define HOLDER_ALIVE     1
+#define HOLDER_UNKNOWN  -1
+
+/* Binaries older than format 2 write and close a new slot file before
+ * reopening and flocking it, so for this many seconds after its
+ * acquisition time an unlocked version 1 record of a live pid is taken
+ * to be a holder still on its way to the flock */
+#define UNLOCKED_CLAIM_GRACE 2
+
+/* Probe the flock on a slot file open as fd. Holders keep their slot file
+ * locked for as long as they run, so if a non-blocking lock succeeds the
+ * holder is gone, whatever its recorded pid refers to now. A successful
+ * probe keeps the lock until fd is closed. */
+static int probe_lock_fd(int fd) {
+    if (portable_lock(fd, LOCK_EX | LOCK_NB) == 0) {
+        return HOLDER_DEAD;
+    }
+    if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EACCES) {
+        return HOLDER_ALIVE;
+    }
+    return HOLDER_UNKNOWN;  /* e.g. ENOLCK on filesystems without locking */
+}
+
+/* Probe the flock on the slot file at path */
+static int probe_slot_lock(const char *path) {
+    int fd;
+    int state;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        return (errno == ENOENT) ? HOLDER_DEAD : HOLDER_UNKNOWN;
+    }
+    state = probe_lock_fd(fd);
+    close(fd);
+    return state;
+}
+
+/* Interpret a slot file probe for holder_alive() and holder_alive_fd() */
+static bool holder_state_alive(int state, const char *name, const struct lock_info *info) {
+    if (state == HOLDER_UNKNOWN) {
+        debug("Cannot probe lock on %s, falling back to pid %d", name, (int)info->pid);
+        return process_exists(info->pid);
+    }
+    if (state == HOLDER_DEAD && info->version == 1 &&
+        difftime(time(NULL), info->acquired_at) < UNLOCKED_CLAIM_GRACE &&
+        process_exists(info->pid)) {
+        debug("Lock %s is not locked yet; pid %d may still be taking it", name, (int)info->pid);
+        return TRUE;
+    }
+
+    if (g_state.verbose) {
+        bool pid_exists = process_exists(info->pid);
+        if (state == HOLDER_ALIVE && !pid_exists) {
+            debug("Lock %s is held, but pid %d is not visible here (another PID namespace?)",
+                  name, (int)info->pid);
+        } else if (state == HOLDER_DEAD && pid_exists) {
+            debug("Lock %s is stale; pid %d now belongs to another process", name, (int)info->pid);
+        }
+    }
+    return state == HOLDER_ALIVE;
+}
+
+/* Check whether the holder of the slot file open as fd is alive; name is
+ * only used in messages */
+static bool holder_alive_fd(int fd, const char *name, const struct lock_info *info) {
+#ifndef HAVE_FLOCK
+    /* fcntl locks never conflict with the owning process, and probing
+     * through another descriptor would drop our own lock on close */
+    if (info->pid == getpid()) {
+        return TRUE;
+    }
+#endif
+    return holder_state_alive(probe_lock_fd(fd), name, info);
+}
+
+/* Check whether the holder of a slot file is alive. The flock probe is
+ * authoritative; the pid is only consulted when locks are unavailable, and
+ * for diagnostics in verbose mode. */
+bool holder_alive(const char *path, const struct lock_info *info) {
+#ifndef HAVE_FLOCK
+    /* fcntl locks never conflict with the owning process */
+    if (info->pid == getpid()) {
+        return TRUE;
+    }
+#endif
+    return holder_state_alive(probe_slot_lock(path), path, info);
+}
+
+static unsigned int claim_seq = 0;
+
+/* Open and flock a private file in dir to write a lock record into before
+ * it is published. Where the kernel supports it the file is unnamed
+ * (O_TMPFILE) and tmp_path is left empty, so nothing is left behind if the
+ * process dies before publishing; otherwise it is a hidden .claim file
+ * named in tmp_path. Returns the descriptor, or -1. */
+static int open_claim_file(const char *dir, char *tmp_path, size_t size, bool unnamed) {
+    unsigned int seq;
+    int fd;
+
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+    if (unnamed) {
+        fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            if (portable_lock(fd, LOCK_EX | LOCK_NB) == 0) {
+                tmp_path[0] = '\0';
+                return fd;
+            }
+            close(fd);
+        }
+    }
+#else
+    (void)unnamed;
+#endif
+
+    /* Private to this attempt, so threads of one process never share it */
+#ifdef HAVE_SYNC_BUILTINS
+    seq = __sync_fetch_and_add(&claim_seq, 1);
+#else
+    seq = claim_seq++;
+#endif
+    safe_snprintf(tmp_path, size, "%s/.claim.%d.%u", dir, (int)getpid(), seq);
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0 && portable_lock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        unlink(tmp_path);
+        fd = -1;
+    }
+    return fd;
+}
+
+/* Give the claim file fd the name lock_path, failing with EEXIST if the
+ * slot is taken. An unnamed file (empty tmp_path) is linked through
+ * /proc/self/fd, which unlike AT_EMPTY_PATH needs no privileges. */
+static int publish_claim_file(int fd, const char *tmp_path, const char *lock_path) {
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+    char fd_path[32];
+
+    if (tmp_path[0] == '\0') {
+        safe_snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+        return linkat(AT_FDCWD, fd_path, AT_FDCWD, lock_path, AT_SYMLINK_FOLLOW);
+    }
+#else
+    (void)fd;
+#endif
+    return link(tmp_path, lock_path);
+}
+
+/* Claim the first free slot below max_holders. The complete lock record is
+ * written into a flocked private file that is then linked into place, so no
+ * other process can see a slot file before it is locked and written, and
+ * the descriptor the record was written through is the one held. An
+ * adopted file (file_claim_adopt) is published the same way in place of a
+ * new one. Returns the locked descriptor and sets lock_path, or returns -1. */
+static int claim_slot_file(struct file_claim *claim, char *lock_path, size_t size) {
+    struct lock_info *info = &claim->info;
+    char tmp_path[PATH_MAX];
+    bool unnamed = TRUE;
+    int tmp_fd;
+    int fd;
+    int slot;
+
+    if (claim->adopt_fd >= 0) {
+        tmp_fd = claim->adopt_fd;
+        safe_snprintf(tmp_path, sizeof(tmp_path), "%s", claim->adopt_path);
+    } else {
+        tmp_fd = open_claim_file(claim->scan_dir, tmp_path, sizeof(tmp_path), unnamed);
+    }
+
+    for (slot = 0; slot < claim->max_holders; slot++) {
+        slot_file_path(lock_path, size, claim->lock_dir, claim->layout,
+                       claim->shards, claim->descriptor, slot);
+        info->slot = slot;
+        info->acquired_at = time(NULL);
+
+        if (tmp_fd >= 0) {
+            if (write_lock_record(tmp_fd, info, claim->layout != LAYOUT_FLAT) == 0 &&
+                publish_claim_file(tmp_fd, tmp_path, lock_path) == 0) {
+                if (tmp_path[0]) {
+                    unlink(tmp_path);
+                }
+                return tmp_fd;
+            }
+            if (errno == EEXIST) {
+                continue;
+            }
+            debug("Cannot publish lock file with link(): %s", strerror(errno));
+            if (claim->adopt_fd >= 0) {
+                return -1;  /* The caller's file has to be the slot file */
+            }
+            close(tmp_fd);
+            if (tmp_path[0] == '\0') {
+                /* No /proc to link through: retry the slot with a named file */
+                unnamed = FALSE;
+                tmp_fd = open_claim_file(claim->scan_dir, tmp_path, sizeof(tmp_path), unnamed);
+                slot--;
+                continue;
+            }
+            /* No hard links here: create slot files in place from now on */
+            unlink(tmp_path);
+            tmp_fd = -1;
+        }
+
+        fd = open(lock_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            continue;
+        }
+        portable_lock(fd, LOCK_EX);
+        if (write_lock_record(fd, info, claim->layout != LAYOUT_FLAT) == 0) {
+            return fd;
+        }
+        close(fd);
+        unlink(lock_path);
+    }
+
+    if (tmp_fd >= 0 && claim->adopt_fd < 0) {
+        close(tmp_fd);
+        if (tmp_path[0]) {
+            unlink(tmp_path);
+        }
+    }
+    return -1;
+}
+
+/* Live holder count gathered while visiting a descriptor's slot files */
+struct holder_scan {
+    int active;
+    int exclusive;  /* Live holders other than --shared ones */
+    int max_holders;
+    pid_t holder_pid;
+};
+
+/* Count live holders, removing files left behind by dead ones */
+static int reap_or_count_holder(int dir_fd, const char *name, int fd, void *ctx) {
+    struct holder_scan *scan = (struct holder_scan *)ctx;
+    struct lock_info info;
+
+    if (read_lock_header_fd(fd, &info) == 0) {
+        if (holder_alive_fd(fd, name, &info)) {
+            scan->active++;
+            if (info.lock_type != LOCK_TYPE_SHARED) {
+                scan->exclusive++;
+            }
+        } else {
+            unlink_scanned_entry(dir_fd, name, fd);
+        }
+    }
+    return 0;
+}
+
+/* Stop at the first live holder, for contention reporting */
+static int find_live_holder(int dir_fd, const char *name, int fd, void *ctx) {
+    struct holder_scan *scan = (struct holder_scan *)ctx;
+    struct lock_info info;
+
+    (void)dir_fd;
+    if (read_lock_header_fd(fd, &info) == 0 && holder_alive_fd(fd, name, &info)) {
+        scan->holder_pid = info.pid;
+        return 1;
+    }
+    return 0;
+}
+
+/* Prepare a file backend acquisition: resolve the layout and slot file
+ * location and fill in the record to publish. Returns 0, -1 if the lock
+ * directory has a layout this build does not know, or -2 (errno set) if
+ * the descriptor's subdirectory or shard cannot be created. */
+int file_claim_init(struct file_claim *claim, const char *lock_dir, const char *descriptor,
+                    int max_holders, const char *hostname, const char *cmdline) {
+    memset(claim, 0, sizeof(*claim));
+    claim->adopt_fd = -1;
+    claim->queue_fd = -1;
+    claim->weight = 1;
+    claim->lock_dir = lock_dir;
+    claim->descriptor = descriptor;
+    claim->max_holders = max_holders;
+
+    claim->layout = read_lock_layout(lock_dir, &claim->shards);
+    if (claim->layout < 0) {
+        return -1;
+    }
+    slot_file_location(claim->scan_dir, sizeof(claim->scan_dir), claim->prefix,
+                       sizeof(claim->prefix), lock_dir, claim->layout, claim->shards, descriptor);
+    queue_file_prefix(claim->queue_prefix, sizeof(claim->queue_prefix), claim->layout, descriptor);
+    if (claim->layout != LAYOUT_FLAT && make_descriptor_dir(lock_dir, claim->scan_dir) != 0) {
+        return -2;
+    }
+
+    claim->info.magic = LOCK_MAGIC;
+    claim->info.version = 1;
+    claim->info.pid = getpid();
+    claim->info.ppid = getppid();
+    claim->info.uid = getuid();
+    claim->info.lock_type = (max_holders > 1) ? 1 : 0;
+    claim->info.max_holders = max_holders;
+    strncpy(claim->info.hostname, hostname, sizeof(claim->info.hostname) - 1);
+    strncpy(claim->info.descriptor, descriptor, sizeof(claim->info.descriptor) - 1);
+    if (cmdline) {
+        strncpy(claim->info.cmdline, cmdline, sizeof(claim->info.cmdline) - 1);
+    }
+    return 0;
+}
+
+/* Publish the open file fd as the slot file instead of a new file. Its
+ * flock belongs to the open file description, so the lock stays held by
+ * every process sharing fd after this one exits; the record names our
+ * parent, the process the lock is kept for. fd must be a regular file on
+ * the lock directory's filesystem, under a name that link() can use.
+ * Returns 0, or -1 with errno set. */
+int file_claim_adopt(struct file_claim *claim, int fd) {
+#ifdef HAVE_FLOCK
+    char link_path[64];
+    struct stat fd_st, path_st, dir_st;
+    ssize_t len;
+
+    if (fstat(fd, &fd_st) != 0) {
+        return -1;
+    }
+    if (!S_ISREG(fd_st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The name it was opened under, to link() into the slot name */
+    safe_snprintf(link_path, sizeof(link_path), "/proc/self/fd/%d", fd);
+    len = readlink(link_path, claim->adopt_path, sizeof(claim->adopt_path) - 1);
+    if (len < 0) {
+        return -1;
+    }
+    claim->adopt_path[len] = '\0';
+    if (stat(claim->adopt_path, &path_st) != 0 ||
+        path_st.st_dev != fd_st.st_dev || path_st.st_ino != fd_st.st_ino) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (lock_path_slot(claim->adopt_path) >= 0) {
+        errno = EBUSY;  /* Already published as a slot file */
+        return -1;
+    }
+    if (stat(claim->scan_dir, &dir_st) != 0) {
+        return -1;
+    }
+    if (dir_st.st_dev != fd_st.st_dev) {
+        errno = EXDEV;
+        return -1;
+    }
+
+    if (portable_lock(fd, LOCK_EX | LOCK_NB) != 0 || ftruncate(fd, 0) != 0) {
+        return -1;
+    }
+    claim->adopt_fd = fd;
+    claim->info.pid = getppid();
+    claim->info.ppid = get_process_ppid(claim->info.pid);
+    get_process_cmdline_r(claim->info.pid, claim->info.cmdline, sizeof(claim->info.cmdline));
+    return 0;
+#else
+    /* fcntl locks belong to the process and would die with it */
+    (void)claim;
+    (void)fd;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/* Make the claim a --shared or --exclusive one. Shared holders may take
+ * any slot below RW_HOLDERS_MAX; an exclusive holder records a capacity of
+ * one, so --check and --list see it as a held mutex. */
+void file_claim_rw(struct file_claim *claim, int rw_mode, bool prefer_readers) {
+    claim->rw_mode = rw_mode;
+    claim->prefer_readers = prefer_readers;
+    claim->max_holders = RW_HOLDERS_MAX;
+    claim->info.lock_type = (uint16_t)rw_mode;
+    claim->info.max_holders = (rw_mode == LOCK_TYPE_SHARED) ? RW_HOLDERS_MAX : 1;
+}
+
+/* Path of the per-descriptor file name next to the slot files, such as the
+ * ticket counter */
+static void descriptor_file_path(char *buf, size_t size, const struct file_claim *claim,
+                                 const char *name) {
+    if (claim->layout == LAYOUT_SUBDIR) {
+        safe_snprintf(buf, size, "%s/%s", claim->scan_dir, name);
+    } else {
+        safe_snprintf(buf, size, "%s/%s.%s", claim->scan_dir, claim->descriptor, name);
+    }
+}
+
+/* Priority of a queued waiter at time now: its --priority, raised by one
+ * for every --aging interval it has waited. Queue records keep the
+ * priority in the reserved field, the aging interval in the slot field and
+ * a --weight above 1 in the lock_type field, so every waiter ranks every
+ * other waiter the same way. */
+static long queue_priority(const struct lock_info *record, time_t now) {
+    long priority = record->reserved;
+
+    if (record->slot > 0 && now > record->acquired_at) {
+        priority += (long)(now - record->acquired_at) / record->slot;
+    }
+    return priority;
+}
+
+/* State of a queue_waiters_ahead() scan */
+struct queue_scan {
+    size_t prefix_len;
+    unsigned long ticket;
+    long priority;
+    time_t now;
+    int *units;
+    bool reap;
+    int ahead;
+};
+
+/* Count one --fair waiter if it is served before the scanning one */
+static int count_waiter_ahead(int dir_fd, const char *name, int fd, void *ctx) {
+    struct queue_scan *scan = (struct queue_scan *)ctx;
+    struct lock_info info;
+    unsigned long other;
+    long other_priority;
+
+    other = strtoul(name + scan->prefix_len, NULL, 10);
+    if (other == scan->ticket) {
+        return 0;
+    }
+    if (read_lock_header_fd(fd, &info) != 0) {
+        return 0;  /* Not written yet, or damaged */
+    }
+    other_priority = queue_priority(&info, scan->now);
+    if (other_priority < scan->priority ||
+        (other_priority == scan->priority && other > scan->ticket)) {
+        return 0;
+    }
+    if (holder_alive_fd(fd, name, &info)) {
+        scan->ahead++;
+        if (scan->units) {
+            *scan->units += (info.lock_type > 1) ? info.lock_type : 1;
+        }
+    } else if (scan->reap) {
+        unlink_scanned_entry(dir_fd, name, fd);
+    }
+    return 0;
+}
+
+/* Number of live --fair waiters served before the waiter holding ticket
+ * with queue record self: those with a higher priority, then those of the
+ * same priority with a lower ticket. The units they ask for are added to
+ * *units if given. Queue files of waiters that died are removed if reap is
+ * set. A waiter keeps its queue file locked while it waits, exactly like a
+ * holder keeps its slot file. */
+static int queue_waiters_ahead(const char *scan_dir, const char *queue_prefix,
+                               unsigned long ticket, const struct lock_info *self,
+                               int *units, bool reap) {
+    struct queue_scan scan;
+    int dir_fd;
+
+    dir_fd = open_scan_dir(scan_dir);
+    if (dir_fd < 0) {
+        return 0;
+    }
+    memset(&scan, 0, sizeof(scan));
+    scan.prefix_len = strlen(queue_prefix);
+    scan.ticket = ticket;
+    scan.now = time(NULL);
+    scan.priority = queue_priority(self, scan.now);
+    scan.units = units;
+    scan.reap = reap;
+    scan_lock_dir(dir_fd, is_queue_file, queue_prefix, count_waiter_ahead, &scan);
+    close(dir_fd);
+    return scan.ahead;
+}
+
+/* Join the descriptor's --fair queue: draw the next ticket from the
+ * counter file and publish a locked queue file named after it. Both happen
+ * under the counter's lock, so queue files appear in ticket order and a
+ * later waiter can never miss an earlier one. Returns 0, or -1 with errno
+ * set. */
+int file_claim_enqueue(struct file_claim *claim) {
+    char counter_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    char buf[32];
+    unsigned int seq;
+    ssize_t len;
+    int counter_fd;
+    int fd;
+    int saved_errno;
+
+    descriptor_file_path(counter_path, sizeof(counter_path), claim, QUEUE_COUNTER_NAME);
+    counter_fd = open(counter_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (counter_fd < 0) {
+        return -1;
+    }
+    fchmod(counter_fd, 0666);  /* Shared by every user of the descriptor */
+    if (portable_lock(counter_fd, LOCK_EX) != 0) {
+        saved_errno = errno;
+        close(counter_fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    len = pread(counter_fd, buf, sizeof(buf) - 1, 0);
+    buf[len > 0 ? len : 0] = '\0';
+    claim->ticket = strtoul(buf, NULL, 10) + 1;
+
+    /* Written and locked under a private name, then renamed into the queue */
+#ifdef HAVE_SYNC_BUILTINS
+    seq = __sync_fetch_and_add(&claim_seq, 1);
+#else
+    seq = claim_seq++;
+#endif
+    safe_snprintf(tmp_path, sizeof(tmp_path), "%s/.queue.%d.%u", claim->scan_dir,
+                  (int)getpid(), seq);
+    safe_snprintf(claim->queue_path, sizeof(claim->queue_path), "%s/%s%lu%s", claim->scan_dir,
+                  claim->queue_prefix, claim->ticket, QUEUE_FILE_SUFFIX);
+    claim->queue_record = claim->info;
+    claim->queue_record.slot = (uint16_t)claim->aging;
+    claim->queue_record.reserved = (uint16_t)claim->priority;
+    if (claim->weight > 1) {
+        claim->queue_record.lock_type = (uint16_t)claim->weight;
+    }
+    claim->queue_record.acquired_at = time(NULL);
+
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || portable_lock(fd, LOCK_EX | LOCK_NB) != 0 ||
+        write_lock_record(fd, &claim->queue_record, claim->layout != LAYOUT_FLAT) != 0 ||
+        rename(tmp_path, claim->queue_path) != 0) {
+        saved_errno = errno;
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        close(counter_fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    len = safe_snprintf(buf, sizeof(buf), "%lu\n", claim->ticket);
+    if (ftruncate(counter_fd, 0) != 0 || pwrite(counter_fd, buf, len, 0) != len) {
+        debug("Cannot update ticket counter %s: %s", counter_path, strerror(errno));
+    }
+    close(counter_fd);
+
+    claim->queue_fd = fd;
+    return 0;
+}
+
+/* Leave the --fair queue, on success or when giving up */
+void file_claim_dequeue(struct file_claim *claim) {
+    if (claim->queue_fd < 0) {
+        return;
+    }
+    unlink(claim->queue_path);
+    close(claim->queue_fd);
+    claim->queue_fd = -1;
+}
+
+/* Number of live writers queued for the descriptor. Only --exclusive
+ * claims join the queue of a --shared/--exclusive descriptor, so an empty
+ * record with the last possible ticket ranks behind all of them. */
+static int queued_writers(const char *scan_dir, const char *queue_prefix, bool reap) {
+    struct lock_info none;
+
+    memset(&none, 0, sizeof(none));
+    return queue_waiters_ahead(scan_dir, queue_prefix, ULONG_MAX, &none, NULL, reap);
+}
+
+/* Claim a --shared or --exclusive slot. Holders are counted and the slot
+ * claimed under the descriptor's gate file, so a reader and a writer can
+ * never both find the lock free. A writer waits for every holder to leave
+ * and for the writers queued ahead of it; a reader waits for writers
+ * holding the lock and, unless readers are preferred, for queued writers,
+ * so a steady stream of readers cannot starve a writer. Returns as
+ * file_claim_try. */
+static int rw_claim_try(struct file_claim *claim) {
+    char gate_path[PATH_MAX];
+    struct holder_scan scan;
+    int gate_fd;
+    int fd = -1;
+
+    descriptor_file_path(gate_path, sizeof(gate_path), claim, RW_GATE_NAME);
+    gate_fd = open(gate_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (gate_fd < 0) {
+        debug("Cannot open gate file %s: %s", gate_path, strerror(errno));
+        return -1;
+    }
+    fchmod(gate_fd, 0666);  /* Shared by every user of the descriptor */
+    if (portable_lock(gate_fd, LOCK_EX) != 0) {
+        close(gate_fd);
+        return -1;
+    }
+
+    memset(&scan, 0, sizeof(scan));
+    for_each_slot_file(claim->lock_dir, claim->layout, claim->shards, claim->descriptor, 0,
+                       reap_or_count_holder, &scan);
+    if (claim->rw_mode == LOCK_TYPE_EXCLUSIVE) {
+        if (scan.active == 0 &&
+            (claim->queue_fd < 0 ||
+             queue_waiters_ahead(claim->scan_dir, claim->queue_prefix, claim->ticket,
+                                 &claim->queue_record, NULL, TRUE) == 0)) {
+            fd = claim_slot_file(claim, claim->lock_path, sizeof(claim->lock_path));
+        }
+    } else if (scan.exclusive == 0 &&
+               (claim->prefer_readers ||
+                queued_writers(claim->scan_dir, claim->queue_prefix, TRUE) == 0)) {
+        fd = claim_slot_file(claim, claim->lock_path, sizeof(claim->lock_path));
+    }
+    close(gate_fd);
+
+    if (fd >= 0) {
+        file_claim_dequeue(claim);
+    }
+    return fd;
+}
+
+/* Reap dead holders and claim a free slot, or claim->weight slots, all or
+ * none. Returns the locked descriptor with claim->lock_path set (further
+ * units in claim->units), -1 if not enough slots are free or, once
+ * enqueued, left over by waiters ahead, or -2 if a free slot was taken by
+ * someone else first. A successful claim leaves the queue. */
+int file_claim_try(struct file_claim *claim) {
+    struct holder_scan scan;
+    int units_ahead = 0;
+    int fd;
+    int i;
+
+    if (claim->rw_mode) {
+        return rw_claim_try(claim);
+    }
+
+    memset(&scan, 0, sizeof(scan));
+    for_each_slot_file(claim->lock_dir, claim->layout, claim->shards, claim->descriptor,
+                       claim->max_holders, reap_or_count_holder, &scan);
+    if (scan.active + claim->weight > claim->max_holders) {
+        return -1;
+    }
+    /* A queued waiter only takes the slots left over by those ahead of it */
+    if (claim->queue_fd >= 0) {
+        queue_waiters_ahead(claim->scan_dir, claim->queue_prefix, claim->ticket,
+                            &claim->queue_record, &units_ahead, TRUE);
+        if (scan.active + units_ahead + claim->weight > claim->max_holders) {
+            return -1;
+        }
+    }
+
+    fd = claim_slot_file(claim, claim->lock_path, sizeof(claim->lock_path));
+    if (fd < 0) {
+        return -2;
+    }
+    for (i = 0; i < claim->weight - 1; i++) {
+        claim->units[i].fd = claim_slot_file(claim, claim->units[i].path,
+                                             sizeof(claim->units[i].path));
+        if (claim->units[i].fd < 0) {
+            /* Never sit on part of a weighted claim: give it all back */
+            while (i-- > 0) {
+                unlink(claim->units[i].path);
+                close(claim->units[i].fd);
+            }
+            unlink(claim->lock_path);
+            close(fd);
+            return -2;
+        }
+    }
+    file_claim_dequeue(claim);
+    return fd;
+}
+
+/* Watch for released slots of the claim's descriptor (-1 if unsupported) */
+int file_claim_watch(const struct file_claim *claim) {
+    return open_release_watch(claim, 1);
+}
+
+/* Wait up to wait_ms for one of the descriptor's slot files to go away,
+ * or a queue file when queued or waiting behind queued writers */
+bool file_claim_wait(const struct file_claim *claim, int watch_fd, int wait_ms) {
+    return wait_for_release(watch_fd, claim, 1, wait_ms);
+}
+
+/* Watch for released slots of any of count claims, with one descriptor */
+int file_claims_watch(const struct file_claim *claims, int count) {
+    return open_release_watch(claims, count);
+}
+
+/* Wait up to wait_ms for a release of any of count claims */
+bool file_claims_wait(const struct file_claim *claims, int count, int watch_fd, int wait_ms) {
+    return wait_for_release(watch_fd, claims, count, wait_ms);
+}
+
+/* Slot files held beyond the first by a --weight acquisition. The buffer
+ * grows to the largest weight asked for and is kept. */
+static struct held_unit *held_units = NULL;
+static int held_unit_count = 0;
+static int held_unit_size = 0;
 
 /* Acquire lock */
 int acquire_lock(const char *descriptor, int max_holders, double timeout) {
     char *lock_dir;
-    char lock_path[PATH_MAX];
     char hostname[MAX_HOSTNAME];
-    struct lock_info info;
-    DIR *dir;
-    struct dirent *entry;
+    struct file_claim claim;
+    int rc;
     int fd;
     struct timeval start_time, now;
     double elapsed;
     int wait_ms = INITIAL_WAIT_MS;
     bool contention_logged = FALSE;
+    int watch_fd = -1;
+    bool watch_tried = FALSE;
+    
+    /* A listening waitlockd takes precedence over the configured backend,
+     * except for --fd, where the holder must be a file the caller has open */
+    if (opts.socket_path && opts.hold_fd < 0) {
+        int rc = daemon_acquire_lock(descriptor, max_holders, timeout);
+        if (rc != DAEMON_UNAVAILABLE) {
+            return rc;
+        }
+    }
+    
+    if (opts.backend == BACKEND_SHM) {
+        return shm_acquire_lock(descriptor, max_holders, timeout);
+    }
+    if (opts.backend == BACKEND_OFD) {
+        return ofd_acquire_lock(descriptor, max_holders, timeout);
+    }
+    if (opts.backend == BACKEND_SYSV) {
+        return sysv_acquire_lock(descriptor, max_holders, timeout);
+    }
+    if (opts.backend == BACKEND_ROBUST) {
+        return robust_acquire_lock(descriptor, max_holders, timeout);
+    }
     
     /* Find lock directory */
     debug("DEBUG: Finding lock directory...");
@@ -120,32 +1437,51 @@ int acquire_lock(const char *descriptor, int max_holders, double timeout) {
     if (gethostname(hostname, sizeof(hostname)) != 0) {
         safe_snprintf(hostname, sizeof(hostname), "unknown");
     }
-    hostname[sizeof(hostname) - 1] = '\0';
-    debug("DEBUG: Hostname: %s", hostname);
-    
-    /* Prepare lock info */
-    memset(&info, 0, sizeof(info));
-    info.magic = LOCK_MAGIC;
-    info.version = 1;
-    info.pid = getpid();
-    info.ppid = getppid();
-    info.uid = getuid();
-    info.lock_type = (max_holders > 1) ? 1 : 0;
-    info.max_holders = max_holders;
-    info.slot = 0;  /* Will be set when slot is assigned */
-    info.reserved = 0;
-    strncpy(info.hostname, hostname, sizeof(info.hostname) - 1);
-    info.hostname[sizeof(info.hostname) - 1] = '\0';
-    strncpy(info.descriptor, descriptor, sizeof(info.descriptor) - 1);
-    info.descriptor[sizeof(info.descriptor) - 1] = '\0';
-    
-    /* Get command line */
-    debug("DEBUG: Getting command line...");
-    char *cmdline = get_process_cmdline(info.pid);
-    if (cmdline) {
-        strncpy(info.cmdline, cmdline, sizeof(info.cmdline) - 1);
+    hostname[sizeof(hostname) - 1] = '\0';
+    debug("DEBUG: Hostname: %s", hostname);
+    
+    /* Prepare lock info */
+    rc = file_claim_init(&claim, lock_dir, descriptor, max_holders, hostname,
+                         get_process_cmdline(getpid()));
+    if (rc == -1) {
+        error(E_SYSTEM, "Unsupported layout in lock directory %s (created by a newer waitlock?)", lock_dir);
+        return E_SYSTEM;
+    }
+    if (rc == -2) {
+        error(E_SYSTEM, "Cannot create lock directory %s: %s", claim.scan_dir, strerror(errno));
+        return E_SYSTEM;
+    }
+    if (opts.hold_fd >= 0 && file_claim_adopt(&claim, opts.hold_fd) != 0) {
+        if (errno == EXDEV) {
+            error(E_SYSTEM, "File descriptor %d is not on the filesystem of %s", opts.hold_fd, lock_dir);
+        } else {
+            error(E_SYSTEM, "Cannot hold the lock on file descriptor %d: %s", opts.hold_fd, strerror(errno));
+        }
+        return E_SYSTEM;
+    }
+    claim.priority = opts.priority;
+    claim.aging = opts.aging;
+    if (opts.rw_mode) {
+        file_claim_rw(&claim, opts.rw_mode, opts.rw_prefer_readers);
+    }
+    if (opts.weight > 1) {
+        if (opts.weight - 1 > held_unit_size) {
+            struct held_unit *units = realloc(held_units, (opts.weight - 1) * sizeof(*units));
+            if (!units) {
+                error(E_SYSTEM, "Cannot allocate %d units: %s", opts.weight, strerror(errno));
+                return E_SYSTEM;
+            }
+            held_units = units;
+            held_unit_size = opts.weight - 1;
+        }
+        claim.weight = opts.weight;
+        claim.units = held_units;
+    }
+    /* Writers queue, so they are served in turn and readers can see them */
+    if ((opts.fair || opts.rw_mode == LOCK_TYPE_EXCLUSIVE) && file_claim_enqueue(&claim) != 0) {
+        error(E_SYSTEM, "Cannot join the queue for lock '%s': %s", descriptor, strerror(errno));
+        return E_SYSTEM;
     }
-    debug("DEBUG: Command line obtained");
     
     /* Try to acquire lock */
     debug("DEBUG: Starting lock acquisition...");
@@ -168,64 +1504,30 @@ int acquire_lock(const char *descriptor, int max_holders, double timeout) {
 #endif
                 }
                 error(E_TIMEOUT, "Timeout waiting for lock '%s' after %.1f seconds", descriptor, timeout);
+                if (watch_fd >= 0) close(watch_fd);
+                file_claim_dequeue(&claim);
                 return E_TIMEOUT;
             }
         }
         
-        /* Clean up stale locks and count active ones */
-        int active_locks = 0;
-        dir = opendir(lock_dir);
-        if (dir) {
-            while ((entry = readdir(dir)) != NULL) {
-                if (strncmp(entry->d_name, descriptor, strlen(descriptor)) == 0 && strstr(entry->d_name, ".lock")) {
-                    char check_path[PATH_MAX];
-                    struct lock_info existing_info;
-                    safe_snprintf(check_path, sizeof(check_path), "%s/%s", lock_dir, entry->d_name);
-                    if (read_lock_file_any_format(check_path, &existing_info) == 0) {
-                        if (existing_info.magic == LOCK_MAGIC && validate_lock_checksum(&existing_info)) {
-                            if (process_exists(existing_info.pid)) {
-                                active_locks++;
-                            } else {
-                                unlink(check_path);
-                            }
-                        }
-                    }
-                }
-            }
-            closedir(dir);
-        }
-
-        if (active_locks >= max_holders) {
-            if (timeout <= 0) return E_BUSY; // Fail fast if no timeout
-            // If timeout is set, the loop will handle it
-        } else {
-            // Try to claim an available slot atomically
-            int slot_claimed = -1;
-            for (int try_slot = 0; try_slot < max_holders; try_slot++) {
-                safe_snprintf(lock_path, sizeof(lock_path), "%s/%s.slot%d.lock", lock_dir, descriptor, try_slot);
-                
-                // Atomically create the lock file
-                fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
-                if (fd >= 0) {
-                    info.slot = try_slot;
-                    info.acquired_at = time(NULL);
-                    info.checksum = calculate_lock_checksum(&info);
-                    if (write(fd, &info, sizeof(info)) == sizeof(info)) {
-                        close(fd);
-                        slot_claimed = try_slot;
-                        break;
-                    }
-                    close(fd);
-                    unlink(lock_path); // Clean up on failure
-                }
-            }
-
-            if (slot_claimed >= 0) {
-                g_state.lock_fd = open(lock_path, O_RDONLY);
-                if (g_state.lock_fd >= 0) portable_lock(g_state.lock_fd, LOCK_EX);
-                safe_snprintf(g_state.lock_path, sizeof(g_state.lock_path), "%s", lock_path);
+        /* Clean up stale locks and try to claim an available slot atomically */
+        fd = file_claim_try(&claim);
+        if (fd >= 0) {
+            if (watch_fd >= 0) close(watch_fd);
+            if (claim.adopt_fd >= 0) {
+                /* Held by the caller's descriptor, not by this process */
                 return E_SUCCESS;
             }
+            /* The flock stays held on this descriptor for as long as we live */
+            g_state.lock_fd = fd;
+            safe_snprintf(g_state.lock_path, sizeof(g_state.lock_path), "%s", claim.lock_path);
+            held_unit_count = claim.weight - 1;
+            return E_SUCCESS;
+        }
+        if (fd == -1 && timeout <= 0) { // Fail fast if no timeout
+            if (watch_fd >= 0) close(watch_fd);
+            file_claim_dequeue(&claim);
+            return E_BUSY;
         }
         
         /* No slot could be claimed - all slots are currently in use */
@@ -247,12 +1549,16 @@ int acquire_lock(const char *descriptor, int max_holders, double timeout) {
 #endif
                 }
                 error(E_TIMEOUT, "Timeout waiting for lock '%s' after %.1f seconds", descriptor, timeout);
+                if (watch_fd >= 0) close(watch_fd);
+                file_claim_dequeue(&claim);
                 return E_TIMEOUT;
             }
         }
         
         /* Check if we should exit */
         if (g_state.should_exit) {
+            if (watch_fd >= 0) close(watch_fd);
+            file_claim_dequeue(&claim);
             return E_SYSTEM;
         }
         
@@ -266,36 +1572,13 @@ int acquire_lock(const char *descriptor, int max_holders, double timeout) {
                 openlog("waitlock", LOG_PID, g_state.syslog_facility);
                 
                 /* Find current lock holder to report in conflict message */
-                DIR *dir = opendir(lock_dir);
-                if (dir) {
-                    struct dirent *entry;
-                    pid_t holder_pid = 0;
-                    
-                    while ((entry = readdir(dir)) != NULL) {
-                        if (strncmp(entry->d_name, descriptor, strlen(descriptor)) == 0 && 
-                            strstr(entry->d_name, ".lock") != NULL) {
-                            char lock_file_path[PATH_MAX];
-                            struct lock_info check_info;
-                            
-                            safe_snprintf(lock_file_path, sizeof(lock_file_path), 
-                                          "%s/%s", lock_dir, entry->d_name);
-                            
-                            if (read_lock_file_any_format(lock_file_path, &check_info) == 0 &&
-                                process_exists(check_info.pid)) {
-                                holder_pid = check_info.pid;
-                                break;
-                            }
-                        }
-                    }
-                    closedir(dir);
-                    
-                    if (holder_pid > 0) {
-                        syslog(LOG_INFO, "lock '%s' held by PID %d", 
-                               descriptor, (int)holder_pid);
-                    } else {
-                        syslog(LOG_INFO, "lock contention for '%s' (waiting)", 
-                               descriptor);
-                    }
+                struct holder_scan scan;
+                memset(&scan, 0, sizeof(scan));
+                for_each_slot_file(lock_dir, claim.layout, claim.shards, descriptor, max_holders,
+                                   find_live_holder, &scan);
+                if (scan.holder_pid > 0) {
+                    syslog(LOG_INFO, "lock '%s' held by PID %d", 
+                           descriptor, (int)scan.holder_pid);
                 } else {
                     syslog(LOG_INFO, "lock contention for '%s' (waiting)", 
                            descriptor);
@@ -305,7 +1588,18 @@ int acquire_lock(const char *descriptor, int max_holders, double timeout) {
             }
         }
         
-        /* Wait with exponential backoff */
+        /* Start watching for released slots on the first wait, then rescan
+         * immediately so a release racing with the setup is not missed */
+        if (!watch_tried) {
+            watch_tried = TRUE;
+            watch_fd = file_claim_watch(&claim);
+            if (watch_fd >= 0) {
+                continue;
+            }
+        }
+        
+        /* Wait for a release, with exponential backoff as the upper bound
+         * so holders that died without removing their file are still found */
         int sleep_ms = wait_ms;
         
         /* For timeouts, don't sleep longer than remaining time */
@@ -318,6 +1612,8 @@ int acquire_lock(const char *descriptor, int max_holders, double timeout) {
             if (remaining <= 0) {
                 /* Already past timeout, return timeout error immediately */
                 error(E_TIMEOUT, "Timeout waiting for lock '%s' after %.1f seconds", descriptor, timeout);
+                if (watch_fd >= 0) close(watch_fd);
+                file_claim_dequeue(&claim);
                 return E_TIMEOUT;
             }
             /* Limit sleep to remaining timeout (with small margin) */
@@ -328,7 +1624,9 @@ int acquire_lock(const char *descriptor, int max_holders, double timeout) {
             if (sleep_ms < 1) sleep_ms = 1; /* Minimum 1ms */
         }
         
-        usleep(sleep_ms * 1000);
+        if (file_claim_wait(&claim, watch_fd, sleep_ms)) {
+            debug("Slot of '%s' released, retrying", descriptor);
+        }
         wait_ms = wait_ms * 2;
         if (wait_ms > MAX_WAIT_MS) wait_ms = MAX_WAIT_MS;
         
@@ -337,12 +1635,306 @@ int acquire_lock(const char *descriptor, int max_holders, double timeout) {
     }
 }
 
-/* Release lock */
-void release_lock(void) {
+static int compare_descriptors(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Acquire every one of count descriptors, or none of them. descriptors is
+ * sorted in place, and each pass takes them in that order with a single
+ * acquire_lock() attempt; on the first busy one, the locks taken so far
+ * are released again before waiting for that one to be released. No set
+ * is ever held in part while waiting, so jobs taking overlapping sets can
+ * neither deadlock nor keep each other's free resources idle. The first
+ * lock is held like a single one and the rest as further held units. */
+int acquire_all_locks(char *descriptors[], int count, int max_holders, double timeout) {
+    struct file_claim blocker_claim;
+    struct timeval start_time, now;
+    double elapsed;
+    char *lock_dir;
+    int watch_fd = -1;
+    int watched = -1;
+    int blocker;
+    int wait_ms = INITIAL_WAIT_MS;
+    int sleep_ms;
+    int rc = E_SUCCESS;
+    int i;
+
+    qsort(descriptors, count, sizeof(*descriptors), compare_descriptors);
+    if (count > held_unit_size) {
+        struct held_unit *units = realloc(held_units, count * sizeof(*units));
+        if (!units) {
+            error(E_SYSTEM, "Cannot allocate %d locks: %s", count, strerror(errno));
+            return E_SYSTEM;
+        }
+        held_units = units;
+        held_unit_size = count;
+    }
+
+    gettimeofday(&start_time, NULL);
+    while (1) {
+        /* One attempt at each descriptor, keeping what we get in held_units */
+        for (blocker = 0; blocker < count; blocker++) {
+            rc = acquire_lock(descriptors[blocker], max_holders, -1.0);
+            if (rc != E_SUCCESS) {
+                break;
+            }
+            held_units[blocker].fd = g_state.lock_fd;
+            safe_snprintf(held_units[blocker].path, sizeof(held_units[blocker].path), "%s",
+                          g_state.lock_path);
+            g_state.lock_fd = -1;
+            g_state.lock_path[0] = '\0';
+        }
+        if (blocker == count) {
+            if (watch_fd >= 0) close(watch_fd);
+            g_state.lock_fd = held_units[0].fd;
+            safe_snprintf(g_state.lock_path, sizeof(g_state.lock_path), "%s", held_units[0].path);
+            memmove(held_units, held_units + 1, (count - 1) * sizeof(*held_units));
+            held_unit_count = count - 1;
+            return E_SUCCESS;
+        }
+
+        /* Never wait on part of the set */
+        for (i = 0; i < blocker; i++) {
+            unlink(held_units[i].path);
+            close(held_units[i].fd);
+        }
+        if (rc != E_BUSY) {
+            if (watch_fd >= 0) close(watch_fd);
+            return rc;
+        }
+        debug("Lock '%s' is busy, holding none of the %d locks", descriptors[blocker], count);
+        if (timeout <= 0) {
+            if (watch_fd >= 0) close(watch_fd);
+            return E_BUSY;
+        }
+
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - start_time.tv_sec) +
+                  (now.tv_usec - start_time.tv_usec) / 1000000.0;
+        if (elapsed >= timeout) {
+            error(E_TIMEOUT, "Timeout waiting for locks after %.1f seconds (blocked by '%s')",
+                  timeout, descriptors[blocker]);
+            if (watch_fd >= 0) close(watch_fd);
+            return E_TIMEOUT;
+        }
+        if (g_state.should_exit) {
+            if (watch_fd >= 0) close(watch_fd);
+            return E_SYSTEM;
+        }
+
+        /* Watch the descriptor in the way, then retry at once so a release
+         * racing with the setup is not missed */
+        if (blocker != watched) {
+            if (watch_fd >= 0) close(watch_fd);
+            watch_fd = -1;
+            watched = blocker;
+            lock_dir = find_lock_directory();
+            if (lock_dir && file_claim_init(&blocker_claim, lock_dir, descriptors[blocker],
+                                            max_holders, "", NULL) == 0) {
+                if (opts.rw_mode) {
+                    file_claim_rw(&blocker_claim, opts.rw_mode, opts.rw_prefer_readers);
+                }
+                watch_fd = file_claim_watch(&blocker_claim);
+                if (watch_fd >= 0) {
+                    continue;
+                }
+            }
+        }
+
+        /* Wait for a release, bounded by the backoff and the time left */
+        sleep_ms = wait_ms;
+        if ((int)((timeout - elapsed) * 1000 * TIMEOUT_FACTOR) < sleep_ms) {
+            sleep_ms = (int)((timeout - elapsed) * 1000 * TIMEOUT_FACTOR);
+        }
+        if (sleep_ms < 1) sleep_ms = 1;
+        if (watch_fd >= 0) {
+            file_claim_wait(&blocker_claim, watch_fd, sleep_ms);
+        } else {
+            usleep(sleep_ms * 1000);
+        }
+        wait_ms = wait_ms * 2;
+        if (wait_ms > MAX_WAIT_MS) wait_ms = MAX_WAIT_MS;
+        wait_ms += rand() % (wait_ms / 10 + 1);
+    }
+}
+
+/* Acquire whichever of count descriptors is free first, trying them in the
+ * order given and setting *winner to the index of the one taken. While all
+ * are busy, one watch covers every candidate, so the first release of any
+ * of them is noticed at once. */
+int acquire_any_lock(char *descriptors[], int count, int max_holders, double timeout,
+                     int *winner) {
+    struct file_claim *claims = NULL;
+    struct timeval start_time, now;
+    double elapsed;
+    char *lock_dir;
+    bool watch_tried = FALSE;
+    int watch_fd = -1;
+    int wait_ms = INITIAL_WAIT_MS;
+    int sleep_ms;
+    int rc = E_BUSY;
+    int i;
+
+    gettimeofday(&start_time, NULL);
+    while (1) {
+        for (i = 0; i < count; i++) {
+            rc = acquire_lock(descriptors[i], max_holders, -1.0);
+            if (rc != E_BUSY) {
+                break;
+            }
+        }
+        if (rc != E_BUSY) {
+            if (rc == E_SUCCESS) {
+                *winner = i;
+            }
+            break;
+        }
+        if (timeout <= 0) {
+            break;
+        }
+
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - start_time.tv_sec) +
+                  (now.tv_usec - start_time.tv_usec) / 1000000.0;
+        if (elapsed >= timeout) {
+            error(E_TIMEOUT, "Timeout waiting for any of %d locks after %.1f seconds", count, timeout);
+            rc = E_TIMEOUT;
+            break;
+        }
+        if (g_state.should_exit) {
+            rc = E_SYSTEM;
+            break;
+        }
+
+        /* Watch every candidate on the first wait, then retry at once so a
+         * release racing with the setup is not missed */
+        if (!watch_tried) {
+            watch_tried = TRUE;
+            lock_dir = find_lock_directory();
+            claims = lock_dir ? calloc(count, sizeof(*claims)) : NULL;
+            for (i = 0; claims && i < count; i++) {
+                if (file_claim_init(&claims[i], lock_dir, descriptors[i], max_holders, "", NULL) != 0) {
+                    break;
+                }
+                if (opts.rw_mode) {
+                    file_claim_rw(&claims[i], opts.rw_mode, opts.rw_prefer_readers);
+                }
+            }
+            if (claims && i == count) {
+                watch_fd = file_claims_watch(claims, count);
+                if (watch_fd >= 0) {
+                    continue;
+                }
+            }
+        }
+
+        /* Wait for a release, bounded by the backoff and the time left */
+        sleep_ms = wait_ms;
+        if ((int)((timeout - elapsed) * 1000 * TIMEOUT_FACTOR) < sleep_ms) {
+            sleep_ms = (int)((timeout - elapsed) * 1000 * TIMEOUT_FACTOR);
+        }
+        if (sleep_ms < 1) sleep_ms = 1;
+        if (watch_fd >= 0) {
+            file_claims_wait(claims, count, watch_fd, sleep_ms);
+        } else {
+            usleep(sleep_ms * 1000);
+        }
+        wait_ms = wait_ms * 2;
+        if (wait_ms > MAX_WAIT_MS) wait_ms = MAX_WAIT_MS;
+        wait_ms += rand() % (wait_ms / 10 + 1);
+    }
+
+    if (watch_fd >= 0) close(watch_fd);
+    free(claims);
+    return rc;
+}
+
+/* Acquire what the command line asks for: descriptor, or every one given
+ * with --all, or the first free one given with --any, which then becomes
+ * opts.descriptor */
+int acquire_requested_locks(const char *descriptor) {
+    int winner = 0;
+    int rc;
+
+    if (opts.descriptor_count > 1 && opts.any_mode) {
+        rc = acquire_any_lock(opts.descriptors, opts.descriptor_count, opts.max_holders,
+                              opts.timeout, &winner);
+        if (rc == E_SUCCESS) {
+            opts.descriptor = opts.descriptors[winner];
+        }
+        return rc;
+    }
+    if (opts.descriptor_count > 1) {
+        return acquire_all_locks(opts.descriptors, opts.descriptor_count, opts.max_holders,
+                                 opts.timeout);
+    }
+    return acquire_lock(descriptor, opts.max_holders, opts.timeout);
+}
+
+/* Slot of the lock held by this process, or -1 */
+int held_lock_slot(void) {
+    int slot = daemon_held_slot();
+    
+    if (slot < 0) {
+        slot = shm_held_slot();
+    }
+    if (slot < 0) {
+        slot = ofd_held_slot();
+    }
+    if (slot < 0) {
+        slot = sysv_held_slot();
+    }
+    if (slot < 0) {
+        slot = robust_held_slot();
+    }
+    if (slot >= 0) {
+        return slot;
+    }
+    return g_state.lock_path[0] ? lock_path_slot(g_state.lock_path) : -1;
+}
+
+/* Comma-separated slots held by this process, for WAITLOCK_SLOT. Returns
+ * the number of slots written to buf. */
+int held_lock_slots(char *buf, size_t size) {
+    size_t len;
+    int slot;
+    int i;
+
+    buf[0] = '\0';
+    slot = held_lock_slot();
+    if (slot < 0) {
+        return 0;
+    }
+    safe_snprintf(buf, size, "%d", slot);
+    for (i = 0; i < held_unit_count; i++) {
+        len = strlen(buf);
+        safe_snprintf(buf + len, size - len, ",%d", lock_path_slot(held_units[i].path));
+    }
+    return held_unit_count + 1;
+}
+
+/* Let the held lock descriptors, opened close-on-exec, survive an exec so
+ * the new image holds the lock in our place */
+void inherit_held_locks(void) {
+    int i;
+
     if (g_state.lock_fd >= 0) {
-        close(g_state.lock_fd);
-        g_state.lock_fd = -1;
+        fcntl(g_state.lock_fd, F_SETFD, 0);
     }
+    for (i = 0; i < held_unit_count; i++) {
+        fcntl(held_units[i].fd, F_SETFD, 0);
+    }
+}
+
+/* Release lock */
+void release_lock(void) {
+    int i;
+    
+    daemon_release_lock();
+    shm_release_lock();
+    ofd_release_lock();
+    sysv_release_lock();
+    robust_release_lock();
     
     if (g_state.lock_path[0]) {
         /* Log to syslog if requested */
@@ -350,36 +1942,14 @@ void release_lock(void) {
 #ifdef HAVE_SYSLOG_H
             openlog("waitlock", LOG_PID, g_state.syslog_facility);
             
-            /* Extract descriptor name and calculate duration */
-            char *descriptor_start = strrchr(g_state.lock_path, '/');
-            if (descriptor_start) {
-                descriptor_start++;  /* Skip the '/' */
-                
-                /* Find the end of descriptor name (before .slot) */
-                char *descriptor_end = strstr(descriptor_start, ".slot");
-                if (descriptor_end) {
-                    char descriptor[MAX_DESC_LEN + 1];
-                    size_t desc_len = descriptor_end - descriptor_start;
-                    if (desc_len < sizeof(descriptor)) {
-                        strncpy(descriptor, descriptor_start, desc_len);
-                        descriptor[desc_len] = '\0';
-                        
-                        /* Read lock file to get acquisition time */
-                        struct lock_info info;
-                        if (read_lock_file_any_format(g_state.lock_path, &info) == 0) {
-                            time_t now = time(NULL);
-                            double duration = difftime(now, info.acquired_at);
-                            syslog(LOG_INFO, "released lock '%s' after %.0f seconds", 
-                                   descriptor, duration);
-                        } else {
-                            syslog(LOG_INFO, "released lock '%s'", descriptor);
-                        }
-                    } else {
-                        syslog(LOG_INFO, "released lock: %s", g_state.lock_path);
-                    }
-                } else {
-                    syslog(LOG_INFO, "released lock: %s", g_state.lock_path);
-                }
+            /* Read lock file to get descriptor and acquisition time */
+            struct lock_info info;
+            if (read_lock_file_any_format(g_state.lock_path, &info) == 0 &&
+                info.descriptor[0]) {
+                time_t now = time(NULL);
+                double duration = difftime(now, info.acquired_at);
+                syslog(LOG_INFO, "released lock '%s' after %.0f seconds", 
+                       info.descriptor, duration);
             } else {
                 syslog(LOG_INFO, "released lock: %s", g_state.lock_path);
             }
@@ -387,87 +1957,440 @@ void release_lock(void) {
 #endif
         }
         
+        /* Unlink before dropping the flock, so the file is never seen
+         * unlocked while it is still published */
+        for (i = 0; i < held_unit_count; i++) {
+            unlink(held_units[i].path);
+            close(held_units[i].fd);
+        }
+        held_unit_count = 0;
         unlink(g_state.lock_path);
         debug("Lock released: %s", g_state.lock_path);
         g_state.lock_path[0] = '\0';
     }
+    
+    if (g_state.lock_fd >= 0) {
+        close(g_state.lock_fd);
+        g_state.lock_fd = -1;
+    }
+}
+
+/* Count live holders for --check, removing corrupted files */
+static int check_holder(int dir_fd, const char *name, int fd, void *ctx) {
+    struct holder_scan *scan = (struct holder_scan *)ctx;
+    struct lock_info info;
+    int rc;
+
+    rc = read_lock_header_fd(fd, &info);
+    if (rc != -1) {
+        if (rc == 0 && holder_alive_fd(fd, name, &info)) {
+            scan->active++;
+            /* Use max_holders from any valid lock file */
+            scan->max_holders = info.max_holders;
+        } else if (rc == LOCK_RECORD_CORRUPT && probe_lock_fd(fd) != HOLDER_ALIVE) {
+            /* Corrupted lock file - clean it up */
+            debug("Removing corrupted lock file: %s", name);
+            unlink_scanned_entry(dir_fd, name, fd);
+            
+            /* Log corrupted lock cleanup to syslog */
+            if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                syslog(LOG_WARNING, "removed corrupted lock file: %s (invalid checksum)", 
+                       name);
+                closelog();
+#endif
+            }
+        }
+    }
+    return 0;
+}
+
+/* Count the live holders of a descriptor, probing the flat names of the
+ * first legacy_slots slots too. max_holders is set from any holder, 1 if
+ * there are none. Returns the count, -1 if the lock directory has a layout
+ * this build does not know, or -2 if it cannot be read. */
+int file_count_holders(const char *lock_dir, const char *descriptor, int legacy_slots,
+                       int *max_holders) {
+    struct holder_scan scan;
+    int layout;
+    int shards;
+
+    layout = read_lock_layout(lock_dir, &shards);
+    if (layout < 0) {
+        return -1;
+    }
+
+    memset(&scan, 0, sizeof(scan));
+    scan.max_holders = 1; /* Default to mutex behavior */
+    if (for_each_slot_file(lock_dir, layout, shards, descriptor, legacy_slots,
+                           check_holder, &scan) != 0) {
+        return -2;
+    }
+    *max_holders = scan.max_holders;
+    return scan.active;
+}
+
+/* Number of live writers queued for a --shared/--exclusive descriptor */
+static int descriptor_queued_writers(const char *lock_dir, const char *descriptor) {
+    char scan_dir[PATH_MAX];
+    char prefix[MAX_DESC_LEN + 8];
+    char queue_prefix[MAX_DESC_LEN + 8];
+    int layout;
+    int shards;
+
+    layout = read_lock_layout(lock_dir, &shards);
+    if (layout < 0) {
+        return 0;
+    }
+    slot_file_location(scan_dir, sizeof(scan_dir), prefix, sizeof(prefix),
+                       lock_dir, layout, shards, descriptor);
+    queue_file_prefix(queue_prefix, sizeof(queue_prefix), layout, descriptor);
+    return queued_writers(scan_dir, queue_prefix, FALSE);
 }
 
 /* Check if lock is available */
 int check_lock(const char *descriptor) {
     char *lock_dir;
-    DIR *dir;
-    struct dirent *entry;
-    int active_locks = 0;
-    int max_holders = 1; /* Default to mutex behavior */
+    struct holder_scan scan;
+    
+    /* A listening waitlockd takes precedence over the configured backend */
+    if (opts.socket_path) {
+        int rc = daemon_check_lock(descriptor);
+        if (rc != DAEMON_UNAVAILABLE) {
+            return rc;
+        }
+    }
+    
+    if (opts.backend == BACKEND_SHM) {
+        return shm_check_lock(descriptor);
+    }
+    if (opts.backend == BACKEND_OFD) {
+        return ofd_check_lock(descriptor);
+    }
+    if (opts.backend == BACKEND_SYSV) {
+        return sysv_check_lock(descriptor);
+    }
+    if (opts.backend == BACKEND_ROBUST) {
+        return robust_check_lock(descriptor);
+    }
     
     lock_dir = find_lock_directory();
     if (!lock_dir) {
         return E_SYSTEM;
     }
     
-    dir = opendir(lock_dir);
-    if (!dir) {
+    memset(&scan, 0, sizeof(scan));
+    scan.active = file_count_holders(lock_dir, descriptor, opts.max_holders, &scan.max_holders);
+    if (scan.active == -1) {
+        error(E_SYSTEM, "Unsupported layout in lock directory %s (created by a newer waitlock?)", lock_dir);
+        return E_SYSTEM;
+    }
+    if (scan.active < 0) {
         return E_SYSTEM;
     }
     
-    while ((entry = readdir(dir)) != NULL) {
-        /* Check if this is a lock file for our descriptor */
-        char *dot = strchr(entry->d_name, '.');
-        if (dot && strncmp(entry->d_name, descriptor, dot - entry->d_name) == 0 &&
-            (size_t)(dot - entry->d_name) == strlen(descriptor) &&
-            strstr(entry->d_name, ".lock")) {
-            char check_path[PATH_MAX];
-            struct lock_info info;
-            
-            safe_snprintf(check_path, sizeof(check_path), "%s/%s", 
-                          lock_dir, entry->d_name);
-            
-            if (read_lock_file_any_format(check_path, &info) == 0) {
-                if (info.magic == LOCK_MAGIC && validate_lock_checksum(&info) && process_exists(info.pid)) {
-                    active_locks++;
-                    /* Use max_holders from any valid lock file */
-                    max_holders = info.max_holders;
-                } else if (info.magic == LOCK_MAGIC && !validate_lock_checksum(&info)) {
-                    /* Corrupted lock file - clean it up */
-                    debug("Removing corrupted lock file: %s", entry->d_name);
-                    unlink(check_path);
-                    
-                    /* Log corrupted lock cleanup to syslog */
-                    if (g_state.use_syslog) {
+    /* Shared holders leave the lock available to readers only. A writer
+     * needs it to itself, and under the writer policy a reader also waits
+     * for the writers queued before it. */
+    if (opts.rw_mode == LOCK_TYPE_EXCLUSIVE && scan.active > 0) {
+        scan.max_holders = scan.active;
+    } else if (opts.rw_mode == LOCK_TYPE_SHARED && !opts.rw_prefer_readers &&
+               scan.active < scan.max_holders &&
+               descriptor_queued_writers(lock_dir, descriptor) > 0) {
+        scan.max_holders = scan.active;
+    }
+    
+    /* Log check operation result to syslog */
+    if (g_state.use_syslog) {
 #ifdef HAVE_SYSLOG_H
-                        openlog("waitlock", LOG_PID, g_state.syslog_facility);
-                        syslog(LOG_WARNING, "removed corrupted lock file: %s (invalid checksum)", 
-                               entry->d_name);
-                        closelog();
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "check lock '%s': %s (%d/%d holders)", 
+               descriptor, (scan.active >= scan.max_holders) ? "busy" : "available", 
+               scan.active, scan.max_holders);
+        closelog();
 #endif
-                    }
-                }
+    }
+    
+    return (scan.active >= scan.max_holders) ? E_BUSY : E_SUCCESS;
+}
+
+/* Name of a lock holder's user. Lock directories are mostly one or two
+ * users' locks, so the last lookup is kept rather than reading the user
+ * database again for every line of a long listing. */
+static const char *holder_user_name(uid_t uid) {
+    static char name[64] = "";
+    static uid_t name_uid;
+    struct passwd *pw;
+
+    if (name[0] == '\0' || uid != name_uid) {
+        pw = getpwuid(uid);
+        safe_snprintf(name, sizeof(name), "%s", pw ? pw->pw_name : "unknown");
+        name_uid = uid;
+    }
+    return name;
+}
+
+/* Print one lock holder in the requested list format */
+void print_lock_info(const struct lock_info *info, bool is_stale, output_format_t format,
+                     bool show_all, bool stale_only) {
+    if (stale_only && !is_stale) return;
+    if (!show_all && is_stale) return;
+    
+    /* Get user info */
+    const char *username = holder_user_name(info->uid);
+    
+    /* Format time; localtime_r() skips re-reading the zone for each line */
+    char time_str[20];
+    struct tm tm;
+    localtime_r(&info->acquired_at, &tm);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+    
+    /* Output based on format */
+    if (format == FMT_HUMAN) {
+        if (is_stale) {
+            printf("  [STALE]          (%-4d) %-4s %-8s %-19s %s\n",
+                   (int)info->pid, info->lock_type == 1 ? "n/a" : "-", username, time_str, 
+                   info->cmdline[0] ? info->cmdline : "Process no longer exists");
+        } else {
+            if (info->lock_type == 1) {
+                /* Semaphore - show slot */
+                printf("%-18s %-6d %-4d %-8s %-19s %s\n",
+                       info->descriptor, (int)info->pid, info->slot, username, time_str, info->cmdline);
+            } else if (info->lock_type == LOCK_TYPE_SHARED || info->lock_type == LOCK_TYPE_EXCLUSIVE) {
+                /* Reader-writer lock - show the mode */
+                printf("%-18s %-6d %-4s %-8s %-19s %s\n",
+                       info->descriptor, (int)info->pid,
+                       info->lock_type == LOCK_TYPE_SHARED ? "sh" : "ex", username, time_str,
+                       info->cmdline);
+            } else {
+                /* Mutex - no slot */
+                printf("%-18s %-6d %-4s %-8s %-19s %s\n",
+                       info->descriptor, (int)info->pid, "-", username, time_str, info->cmdline);
             }
         }
+    } else if (format == FMT_CSV) {
+        printf("%s,%d,%d,%s,%ld,%s,%s\n",
+               info->descriptor, (int)info->pid, info->slot, username, 
+               (long)info->acquired_at, is_stale ? "stale" : "active", 
+               info->cmdline);
+    } else if (format == FMT_NULL) {
+        printf("%s%c%d%c%d%c%s%c%ld%c%s%c%s%c%c",
+               info->descriptor, '\0', (int)info->pid, '\0', info->slot, '\0', username, '\0',
+               (long)info->acquired_at, '\0', is_stale ? "stale" : "active", '\0',
+               info->cmdline, '\0', '\0');
+    }
+}
+
+/* Semaphore units in use per descriptor, for the --list summary */
+struct unit_tally {
+    char descriptor[MAX_DESC_LEN + 1];
+    int used;
+    int capacity;
+};
+
+struct unit_tallies {
+    struct unit_tally *entries;
+    int count;
+    int size;
+};
+
+static void tally_unit(struct unit_tallies *tallies, const struct lock_info *info) {
+    int i;
+    
+    for (i = 0; i < tallies->count; i++) {
+        if (strcmp(tallies->entries[i].descriptor, info->descriptor) == 0) {
+            tallies->entries[i].used++;
+            return;
+        }
+    }
+    if (tallies->count == tallies->size) {
+        int size = tallies->size ? tallies->size * 2 : 16;
+        struct unit_tally *entries = realloc(tallies->entries, size * sizeof(*entries));
+        if (!entries) {
+            return;
+        }
+        tallies->entries = entries;
+        tallies->size = size;
+    }
+    safe_snprintf(tallies->entries[tallies->count].descriptor,
+                  sizeof(tallies->entries[tallies->count].descriptor), "%s", info->descriptor);
+    tallies->entries[tallies->count].used = 1;
+    tallies->entries[tallies->count].capacity = info->max_holders;
+    tallies->count++;
+}
+
+/* Print one lock file, open as fd and starting with the len bytes at buf,
+ * in the requested list format */
+static void list_lock_file(int fd, const char *name, const char *buf, ssize_t len,
+                           output_format_t format, bool show_all, bool stale_only,
+                           struct unit_tallies *tallies) {
+    struct lock_info info;
+    bool is_stale;
+    int rc;
+    
+    rc = parse_lock_record(buf, len, fd, &info);
+    if (rc == LOCK_RECORD_CORRUPT) {
+        debug("Skipping corrupted lock file: %s", name);
+    }
+    if (rc != 0) {
+        return;
+    }
+    
+    is_stale = !holder_alive_fd(fd, name, &info);
+    if (!is_stale && info.max_holders > 1 && info.lock_type == 1) {
+        tally_unit(tallies, &info);
+    }
+    print_lock_info(&info, is_stale, format, show_all, stale_only);
+}
+
+/* Print one --fair waiter of scan_dir, open as fd and starting with the
+ * len bytes at buf, with its 1-based position in the queue in place of a
+ * slot number */
+static void list_queue_file(int fd, const char *scan_dir, const char *name,
+                            const char *buf, ssize_t len, output_format_t format,
+                            bool show_all, bool stale_only) {
+    struct lock_info info;
+    char queue_prefix[MAX_DESC_LEN + 8];
+    char position[16];
+    const char *username;
+    struct tm tm;
+    char time_str[20];
+    
+    if (parse_lock_record(buf, len, fd, &info) != 0) {
+        return;
+    }
+    if (!holder_alive_fd(fd, name, &info)) {
+        print_lock_info(&info, TRUE, format, show_all, stale_only);
+        return;
+    }
+    if (stale_only) return;
+    
+    /* The queue file sits next to the descriptor's slot files */
+    queue_file_prefix(queue_prefix, sizeof(queue_prefix), LAYOUT_FLAT, info.descriptor);
+    if (!is_queue_file(name, queue_prefix)) {
+        queue_file_prefix(queue_prefix, sizeof(queue_prefix), LAYOUT_SUBDIR, info.descriptor);
+        if (!is_queue_file(name, queue_prefix)) return;
+    }
+    safe_snprintf(position, sizeof(position), "q%d",
+                  queue_waiters_ahead(scan_dir, queue_prefix,
+                                      strtoul(name + strlen(queue_prefix), NULL, 10),
+                                      &info, NULL, FALSE) + 1);
+    
+    username = holder_user_name(info.uid);
+    localtime_r(&info.acquired_at, &tm);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+    
+    if (format == FMT_HUMAN) {
+        printf("%-18s %-6d %-4s %-8s %-19s [priority %ld, waiting %lds] %s\n", info.descriptor,
+               (int)info.pid, position, username, time_str,
+               queue_priority(&info, time(NULL)), (long)(time(NULL) - info.acquired_at),
+               info.cmdline);
+    } else if (format == FMT_CSV) {
+        printf("%s,%d,%s,%s,%ld,queued,%s\n", info.descriptor, (int)info.pid, position,
+               username, (long)info.acquired_at, info.cmdline);
+    } else if (format == FMT_NULL) {
+        printf("%s%c%d%c%s%c%s%c%ld%cqueued%c%s%c%c", info.descriptor, '\0', (int)info.pid, '\0',
+               position, '\0', username, '\0', (long)info.acquired_at, '\0',
+               '\0', info.cmdline, '\0', '\0');
+    }
+}
+
+/* State of a list_locks() scan */
+struct list_scan {
+    const char *dir;  /* Path of the directory scanned, for per-file backends */
+    struct uring **ring;
+    output_format_t format;
+    bool show_all;
+    bool stale_only;
+    struct unit_tallies *tallies;
+};
+
+/* Lock directory entries worth opening for --list */
+static bool is_listed_entry(const char *name, const char *prefix) {
+    (void)prefix;
+    return name[0] != '.';
+}
+
+/* Descriptor subdirectory or shard entries worth opening for --list: the
+ * slot and queue files of one descriptor, or of any descriptor hashed to
+ * the shard */
+static bool is_listed_subdir_entry(const char *name, const char *prefix) {
+    (void)prefix;
+    return name[0] != '.' && (strstr(name, ".lock") || strstr(name, QUEUE_FILE_SUFFIX));
+}
+
+/* List one entry of a descriptor subdirectory or shard */
+static int list_subdir_entry(int dir_fd, const char *name, int fd,
+                             const char *buf, ssize_t len, void *ctx) {
+    struct list_scan *scan = (struct list_scan *)ctx;
+
+    (void)dir_fd;
+    if (strstr(name, ".lock")) {
+        list_lock_file(fd, name, buf, len, scan->format, scan->show_all, scan->stale_only,
+                       scan->tallies);
+    } else {
+        list_queue_file(fd, scan->dir, name, buf, len, scan->format, scan->show_all,
+                        scan->stale_only);
+    }
+    return 0;
+}
+
+/* List one entry of the lock directory */
+static int list_dir_entry(int dir_fd, const char *name, int fd,
+                          const char *buf, ssize_t len, void *ctx) {
+    struct list_scan *scan = (struct list_scan *)ctx;
+    struct list_scan sub;
+    char path[PATH_MAX];
+    struct stat st;
+
+    (void)dir_fd;
+    if (strstr(name, ".lock")) {
+        list_lock_file(fd, name, buf, len, scan->format, scan->show_all, scan->stale_only,
+                       scan->tallies);
+        return 0;
     }
-    
-    closedir(dir);
-    
-    /* Log check operation result to syslog */
-    if (g_state.use_syslog) {
-#ifdef HAVE_SYSLOG_H
-        openlog("waitlock", LOG_PID, g_state.syslog_facility);
-        syslog(LOG_INFO, "check lock '%s': %s (%d/%d holders)", 
-               descriptor, (active_locks >= max_holders) ? "busy" : "available", 
-               active_locks, max_holders);
-        closelog();
-#endif
+    if (strstr(name, QUEUE_FILE_SUFFIX)) {
+        list_queue_file(fd, scan->dir, name, buf, len, scan->format, scan->show_all,
+                        scan->stale_only);
+        return 0;
     }
-    
-    return (active_locks >= max_holders) ? E_BUSY : E_SUCCESS;
+
+    /* The other backends keep one file per descriptor and read it by path */
+    safe_snprintf(path, sizeof(path), "%s/%s", scan->dir, name);
+    if (shm_is_table_name(name)) {
+        /* Slot table of the shm backend, listed whichever backend is in use */
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            shm_list_table(path, scan->format, scan->show_all, scan->stale_only);
+        }
+    } else if (ofd_is_slot_file_name(name) || sysv_is_slot_file_name(name)) {
+        /* Slot file of the ofd or sysv backend */
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            ofd_list_file(path, ofd_is_slot_file_name(name) ? OFD_FILE_SUFFIX : SYSV_FILE_SUFFIX,
+                          scan->format, scan->show_all, scan->stale_only);
+        }
+    } else if (robust_is_block_name(name)) {
+        /* Control block of the robust backend */
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            robust_list_block(path, scan->format, scan->show_all, scan->stale_only);
+        }
+    } else {
+        /* Per-descriptor subdirectory or shard; fails harmlessly on other files */
+        sub = *scan;
+        sub.dir = path;
+        scan_lock_records(scan->ring, fd, is_listed_subdir_entry, NULL, list_subdir_entry, &sub);
+    }
+    return 0;
 }
 
 /* List locks */
 int list_locks(output_format_t format, bool show_all, bool stale_only) {
     char *lock_dir;
-    DIR *dir;
-    struct dirent *entry;
+    struct unit_tallies tallies;
+    struct list_scan scan;
+    struct uring *ring;
+    int dir_fd;
+    int i;
     
     lock_dir = find_lock_directory();
     if (!lock_dir) {
@@ -475,11 +2398,12 @@ int list_locks(output_format_t format, bool show_all, bool stale_only) {
         return E_NODIR;
     }
     
-    dir = opendir(lock_dir);
-    if (!dir) {
+    dir_fd = open_scan_dir(lock_dir);
+    if (dir_fd < 0) {
         error(E_SYSTEM, "Cannot open lock directory '%s': %s", lock_dir, strerror(errno));
         return E_SYSTEM;
     }
+    memset(&tallies, 0, sizeof(tallies));
     
     /* Print header */
     if (format == FMT_HUMAN && !g_state.quiet) {
@@ -489,76 +2413,200 @@ int list_locks(output_format_t format, bool show_all, bool stale_only) {
         printf("descriptor,pid,slot,user,acquired,status,command\n");
     }
     
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, ".lock")) {
-            char lock_path[PATH_MAX];
-            struct lock_info info;
-            bool is_stale = FALSE;
-            
-            safe_snprintf(lock_path, sizeof(lock_path), "%s/%s", 
-                          lock_dir, entry->d_name);
-            
-            if (read_lock_file_any_format(lock_path, &info) != 0) {
-                continue;  /* Cannot read lock file */
-            }
-            
-            if (info.magic != LOCK_MAGIC) continue;
-            
-            /* Validate checksum - skip corrupted files */
-            if (!validate_lock_checksum(&info)) {
-                debug("Skipping corrupted lock file: %s", entry->d_name);
-                continue;
-            }
-            
-            is_stale = !process_exists(info.pid);
-            
-            if (stale_only && !is_stale) continue;
-            if (!show_all && is_stale) continue;
-            
-            /* Get user info */
-            struct passwd *pw = getpwuid(info.uid);
-            const char *username = pw ? pw->pw_name : "unknown";
-            
-            /* Format time */
-            char time_str[20];
-            struct tm *tm = localtime(&info.acquired_at);
-            strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm);
-            
-            /* Output based on format */
-            if (format == FMT_HUMAN) {
-                if (is_stale) {
-                    printf("  [STALE]          (%-4d) %-4s %-8s %-19s %s\n",
-                           (int)info.pid, info.lock_type == 1 ? "n/a" : "-", username, time_str, 
-                           info.cmdline[0] ? info.cmdline : "Process no longer exists");
-                } else {
-                    if (info.lock_type == 1) {
-                        /* Semaphore - show slot */
-                        printf("%-18s %-6d %-4d %-8s %-19s %s\n",
-                               info.descriptor, (int)info.pid, info.slot, username, time_str, info.cmdline);
-                    } else {
-                        /* Mutex - no slot */
-                        printf("%-18s %-6d %-4s %-8s %-19s %s\n",
-                               info.descriptor, (int)info.pid, "-", username, time_str, info.cmdline);
-                    }
-                }
-            } else if (format == FMT_CSV) {
-                printf("%s,%d,%d,%s,%ld,%s,%s\n",
-                       info.descriptor, (int)info.pid, info.slot, username, 
-                       (long)info.acquired_at, is_stale ? "stale" : "active", 
-                       info.cmdline);
-            } else if (format == FMT_NULL) {
-                printf("%s%c%d%c%d%c%s%c%ld%c%s%c%s%c%c",
-                       info.descriptor, '\0', (int)info.pid, '\0', info.slot, '\0', username, '\0',
-                       (long)info.acquired_at, '\0', is_stale ? "stale" : "active", '\0',
-                       info.cmdline, '\0', '\0');
-            }
-        }
+    /* Locks served by waitlockd, then those in the directory */
+    if (opts.socket_path) {
+        daemon_list_locks(format, show_all, stale_only);
     }
     
-    closedir(dir);
+    /* Both layouts are listed, so files not yet migrated still show up */
+    ring = uring_create();
+    scan.dir = lock_dir;
+    scan.ring = &ring;
+    scan.format = format;
+    scan.show_all = show_all;
+    scan.stale_only = stale_only;
+    scan.tallies = &tallies;
+    scan_lock_records(&ring, dir_fd, is_listed_entry, NULL, list_dir_entry, &scan);
+    
+    uring_destroy(ring);
+    close(dir_fd);
+    
+    /* Semaphore units in use against capacity, counting --weight holders
+     * once per unit */
+    if (format == FMT_HUMAN && !g_state.quiet && !stale_only && tallies.count > 0) {
+        printf("\n%-18s %s\n", "DESCRIPTOR", "UNITS");
+        for (i = 0; i < tallies.count; i++) {
+            printf("%-18s %d/%d\n", tallies.entries[i].descriptor,
+                   tallies.entries[i].used, tallies.entries[i].capacity);
+        }
+    }
+    free(tallies.entries);
     return E_SUCCESS;
 }
 
+/* Encode info as a format 2 record. Returns its length, or 0 if buf is too
+ * small. */
+size_t encode_lock_record(const struct lock_info *info, char *buf, size_t size) {
+    struct lock_header header;
+    size_t hostname_len = strnlen(info->hostname, sizeof(info->hostname) - 1);
+    size_t descriptor_len = strnlen(info->descriptor, sizeof(info->descriptor) - 1);
+    size_t cmdline_len = strnlen(info->cmdline, sizeof(info->cmdline) - 1);
+    size_t len = sizeof(header) + hostname_len + descriptor_len + cmdline_len;
+    char *strings = buf + sizeof(header);
+
+    if (len > size) {
+        return 0;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = LOCK_MAGIC;
+    header.version = LOCK_FORMAT_V2;
+    header.header_size = sizeof(header);
+    header.acquired_at = info->acquired_at;
+    header.pid = info->pid;
+    header.ppid = info->ppid;
+    header.uid = info->uid;
+    header.lock_type = info->lock_type;
+    header.max_holders = info->max_holders;
+    header.slot = info->slot;
+    header.reserved = info->reserved;
+    header.hostname_len = (uint16_t)hostname_len;
+    header.descriptor_len = (uint16_t)descriptor_len;
+    header.cmdline_len = (uint16_t)cmdline_len;
+
+    memcpy(strings, info->hostname, hostname_len);
+    memcpy(strings + hostname_len, info->descriptor, descriptor_len);
+    memcpy(strings + hostname_len + descriptor_len, info->cmdline, cmdline_len);
+    header.strings_crc = calculate_crc32(strings, len - sizeof(header));
+    header.header_crc = calculate_crc32(&header, offsetof(struct lock_header, header_crc));
+    memcpy(buf, &header, sizeof(header));
+    return len;
+}
+
+/* Decode a format 2 record from the len bytes at buf. With header_only,
+ * only the header is needed and checked, and the strings are left empty.
+ * The record's own checksums stand in for the lock_info one, which is
+ * left 0. Returns 0, LOCK_RECORD_CORRUPT if a checksum does not match, or
+ * -1 if buf does not hold a format 2 record. */
+int decode_lock_record(const char *buf, size_t len, struct lock_info *info, bool header_only) {
+    struct lock_header header;
+    const char *strings;
+    size_t strings_len;
+
+    if (len < sizeof(header)) {
+        return -1;
+    }
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != LOCK_MAGIC || header.version != LOCK_FORMAT_V2 ||
+        header.header_size < sizeof(header)) {
+        return -1;
+    }
+    if (header.header_crc != calculate_crc32(&header, offsetof(struct lock_header, header_crc)) ||
+        header.hostname_len >= sizeof(info->hostname) ||
+        header.descriptor_len >= sizeof(info->descriptor) ||
+        header.cmdline_len >= sizeof(info->cmdline)) {
+        return LOCK_RECORD_CORRUPT;
+    }
+
+    info->magic = LOCK_MAGIC;
+    info->version = LOCK_FORMAT_V2;
+    info->pid = header.pid;
+    info->ppid = header.ppid;
+    info->uid = header.uid;
+    info->acquired_at = (time_t)header.acquired_at;
+    info->lock_type = header.lock_type;
+    info->max_holders = header.max_holders;
+    info->slot = header.slot;
+    info->reserved = header.reserved;
+    info->hostname[0] = '\0';
+    info->descriptor[0] = '\0';
+    info->cmdline[0] = '\0';
+    info->checksum = 0;
+    if (header_only) {
+        return 0;
+    }
+
+    strings = buf + header.header_size;
+    strings_len = (size_t)header.hostname_len + header.descriptor_len + header.cmdline_len;
+    if (len < header.header_size + strings_len ||
+        header.strings_crc != calculate_crc32(strings, strings_len)) {
+        return LOCK_RECORD_CORRUPT;
+    }
+    memcpy(info->hostname, strings, header.hostname_len);
+    info->hostname[header.hostname_len] = '\0';
+    strings += header.hostname_len;
+    memcpy(info->descriptor, strings, header.descriptor_len);
+    info->descriptor[header.descriptor_len] = '\0';
+    strings += header.descriptor_len;
+    memcpy(info->cmdline, strings, header.cmdline_len);
+    info->cmdline[header.cmdline_len] = '\0';
+    return 0;
+}
+
+/* Write info to fd as a format 2 record, or with compact FALSE as a
+ * format 1 record. Binaries older than format 2 take a lock file they
+ * cannot read for a stale one and remove it, so format 2 is only written
+ * in directories marked with a layout, whose slot files they never scan.
+ * Returns 0, or -1. */
+int write_lock_record(int fd, const struct lock_info *info, bool compact) {
+    char buf[LOCK_RECORD_MAX];
+    struct lock_info record;
+    size_t len;
+
+    if (!compact) {
+        record = *info;
+        record.version = LOCK_FORMAT_V1_LOCKED;
+        record.checksum = calculate_lock_checksum(&record);
+        return (pwrite(fd, &record, sizeof(record), 0) == (ssize_t)sizeof(record)) ? 0 : -1;
+    }
+    len = encode_lock_record(info, buf, sizeof(buf));
+    if (len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return (pwrite(fd, buf, len, 0) == (ssize_t)len) ? 0 : -1;
+}
+
+/* Read what scans need from a lock file: the header of a format 2 record,
+ * or a whole older record. Returns 0 for a valid record, with the strings
+ * of a format 2 record left empty, LOCK_RECORD_CORRUPT for a record of
+ * ours that fails its checksum, or -1 if the file cannot be read or holds
+ * no record. */
+int read_lock_header(const char *path, struct lock_info *info) {
+    int fd;
+    int rc;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+    rc = read_lock_header_fd(fd, info);
+    close(fd);
+    return rc;
+}
+
+/* read_lock_header() on a lock file open as fd */
+int read_lock_header_fd(int fd, struct lock_info *info) {
+    struct lock_header header;
+    ssize_t len;
+    int rc;
+
+    len = pread(fd, &header, sizeof(header), 0);
+    if (len < 0) {
+        return -1;
+    }
+    rc = decode_lock_record((const char *)&header, (size_t)len, info, TRUE);
+    if (rc != -1) {
+        return rc;
+    }
+
+    /* Format 1 and text records are checksummed as a whole */
+    if (read_lock_record_fd(fd, info) != 0 || info->magic != LOCK_MAGIC) {
+        return -1;
+    }
+    return validate_lock_checksum(info) ? 0 : LOCK_RECORD_CORRUPT;
+}
+
 /* Write lock information in text format as fallback */
 int write_text_lock_file(const char *path, const struct lock_info *info) {
     FILE *fp;
@@ -573,7 +2621,9 @@ int write_text_lock_file(const char *path, const struct lock_info *info) {
     fprintf(fp, "PPID=%d\n", (int)info->ppid);
     fprintf(fp, "UID=%d\n", (int)info->uid);
     fprintf(fp, "ACQUIRED=%ld\n", (long)info->acquired_at);
-    fprintf(fp, "TYPE=%s\n", info->lock_type ? "semaphore" : "mutex");
+    fprintf(fp, "TYPE=%s\n", info->lock_type == LOCK_TYPE_SHARED ? "shared" :
+                             info->lock_type == LOCK_TYPE_EXCLUSIVE ? "exclusive" :
+                             info->lock_type ? "semaphore" : "mutex");
     fprintf(fp, "MAX_HOLDERS=%d\n", info->max_holders);
     fprintf(fp, "SLOT=%d\n", info->slot);
     fprintf(fp, "HOSTNAME=%s\n", info->hostname);
@@ -584,9 +2634,8 @@ int write_text_lock_file(const char *path, const struct lock_info *info) {
     return 0;
 }
 
-/* Read lock information from text format */
-int read_text_lock_file(const char *path, struct lock_info *info) {
-    FILE *fp;
+/* Parse a text format lock file from fp */
+static void parse_text_lock_file(FILE *fp, struct lock_info *info) {
     char line[1024];
     char *equals;
     char type_str[32];
@@ -594,11 +2643,6 @@ int read_text_lock_file(const char *path, struct lock_info *info) {
     memset(info, 0, sizeof(*info));
     info->magic = LOCK_MAGIC;  /* Set magic for text format too */
     
-    fp = fopen(path, "r");
-    if (!fp) {
-        return -1;
-    }
-    
     while (fgets(line, sizeof(line), fp)) {
         /* Remove trailing newline */
         size_t len = strlen(line);
@@ -625,7 +2669,13 @@ int read_text_lock_file(const char *path, struct lock_info *info) {
         } else if (strcmp(line, "TYPE") == 0) {
             strncpy(type_str, equals, sizeof(type_str) - 1);
             type_str[sizeof(type_str) - 1] = '\0';
-            info->lock_type = (strcmp(type_str, "semaphore") == 0) ? 1 : 0;
+            if (strcmp(type_str, "shared") == 0) {
+                info->lock_type = LOCK_TYPE_SHARED;
+            } else if (strcmp(type_str, "exclusive") == 0) {
+                info->lock_type = LOCK_TYPE_EXCLUSIVE;
+            } else {
+                info->lock_type = (strcmp(type_str, "semaphore") == 0) ? 1 : 0;
+            }
         } else if (strcmp(line, "MAX_HOLDERS") == 0) {
             info->max_holders = atoi(equals);
         } else if (strcmp(line, "SLOT") == 0) {
@@ -641,7 +2691,17 @@ int read_text_lock_file(const char *path, struct lock_info *info) {
             info->cmdline[sizeof(info->cmdline) - 1] = '\0';
         }
     }
+}
+
+/* Read lock information from text format */
+int read_text_lock_file(const char *path, struct lock_info *info) {
+    FILE *fp;
     
+    fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    parse_text_lock_file(fp, info);
     fclose(fp);
     return 0;
 }
@@ -649,134 +2709,365 @@ int read_text_lock_file(const char *path, struct lock_info *info) {
 /* Read lock file in any format (binary or text fallback) */
 int read_lock_file_any_format(const char *path, struct lock_info *info) {
     int fd;
+    int rc;
     
-    /* Try binary format first */
-    fd = open(path, O_RDONLY);
-    if (fd >= 0) {
-        if (read(fd, info, sizeof(*info)) == sizeof(*info)) {
-            close(fd);
-            if (info->magic == LOCK_MAGIC) {
-                return 0;  /* Binary format successful */
-            }
+    fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+    rc = read_lock_record_fd(fd, info);
+    close(fd);
+    return rc;
+}
+
+/* Load a format 1 or text record from the len bytes at the start of the
+ * lock file open as fd, buf holding them */
+static int read_older_record(const char *buf, ssize_t len, int fd, struct lock_info *info) {
+    FILE *fp;
+
+    if (len >= (ssize_t)sizeof(*info)) {
+        memcpy(info, buf, sizeof(*info));
+        if (info->magic == LOCK_MAGIC) {
+            return 0;  /* Format 1 */
         }
+    }
+    if (len <= 0) {
+        return -1;  /* Nothing written yet */
+    }
+    
+    /* Binary format failed, try text format on the same file */
+    fd = dup(fd);
+    if (fd < 0) {
+        return -1;
+    }
+    fp = fdopen(fd, "r");
+    if (!fp) {
         close(fd);
+        return -1;
     }
+    rewind(fp);
+    parse_text_lock_file(fp, info);
+    fclose(fp);
+    debug("Read lock file using text fallback format");
+    return 0;
+}
+
+/* read_lock_file_any_format() on a lock file open as fd */
+int read_lock_record_fd(int fd, struct lock_info *info) {
+    char buf[LOCK_RECORD_MAX];
+    ssize_t len;
+    int rc;
     
-    /* Binary format failed, try text format */
-    if (read_text_lock_file(path, info) == 0) {
-        debug("Read lock file using text fallback format");
+    /* Try the binary formats first, with a single read */
+    len = pread(fd, buf, sizeof(buf), 0);
+    rc = (len > 0) ? decode_lock_record(buf, (size_t)len, info, FALSE) : -1;
+    if (rc == 0) {
+        /* Format 2, checksummed for callers that validate lock_info */
+        info->checksum = calculate_lock_checksum(info);
+        return 0;
+    }
+    if (rc == LOCK_RECORD_CORRUPT) {
+        /* Ours but damaged: make sure its lock_info checksum fails too */
+        info->checksum = calculate_lock_checksum(info) + 1;
         return 0;
     }
+    return read_older_record(buf, len, fd, info);
+}
+
+/* Parse the lock file open as fd from the len bytes read from its start
+ * into buf, as scans that batch their reads have them. Returns 0 for a
+ * valid record in any format, LOCK_RECORD_CORRUPT for a record of ours
+ * that fails its checksum, or -1 if there is no record. Unlike
+ * read_lock_record_fd(), a format 2 record is not given a lock_info
+ * checksum: its own checksums were checked in decoding. */
+int parse_lock_record(const char *buf, ssize_t len, int fd, struct lock_info *info) {
+    int rc;
+
+    rc = (len > 0) ? decode_lock_record(buf, (size_t)len, info, FALSE) : -1;
+    if (rc != -1) {
+        return rc;
+    }
+    if (read_older_record(buf, len, fd, info) != 0 || info->magic != LOCK_MAGIC) {
+        return -1;
+    }
+    return validate_lock_checksum(info) ? 0 : LOCK_RECORD_CORRUPT;
+}
+
+/* Progress of --done across a descriptor's slot files */
+struct done_scan {
+    const char *descriptor;
+    int found;
+    int released;
+};
+
+/* Signal the holder of one slot file, removing it if the holder is gone */
+static int signal_holder(int dir_fd, const char *name, int fd, void *ctx) {
+    struct done_scan *scan = (struct done_scan *)ctx;
+    struct lock_info info;
+    int rc;
     
-    return -1;  /* Both formats failed */
+    /* Read lock file information */
+    rc = read_lock_header_fd(fd, &info);
+    if (rc != -1) {
+        /* Validate checksum */
+        if (rc == 0) {
+            scan->found++;
+            
+            /* Check if the holder is still alive */
+            if (holder_alive_fd(fd, name, &info)) {
+                /* Send SIGTERM to the process */
+                if (kill(info.pid, SIGTERM) == 0) {
+                    debug("Sent SIGTERM to process %d for lock %s", info.pid, scan->descriptor);
+                    scan->released++;
+                    
+                    /* Log to syslog if enabled */
+                    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                        syslog(LOG_INFO, "signaled process %d to release lock '%s'", info.pid, scan->descriptor);
+                        closelog();
+#endif
+                    }
+                } else {
+                    debug("Failed to send SIGTERM to process %d: %s", info.pid, strerror(errno));
+                    
+                    /* If signal failed, check if the holder is actually gone */
+                    if (!holder_alive_fd(fd, name, &info)) {
+                        debug("Process %d no longer exists, removing stale lock", info.pid);
+                        unlink_scanned_entry(dir_fd, name, fd);
+                        scan->released++;
+                    }
+                }
+            } else {
+                /* Process is dead, remove stale lock */
+                debug("Process %d no longer exists, removing stale lock", info.pid);
+                unlink_scanned_entry(dir_fd, name, fd);
+                scan->released++;
+            }
+        } else if (probe_lock_fd(fd) != HOLDER_ALIVE) {
+            debug("Invalid checksum in lock file %s, removing", name);
+            unlink_scanned_entry(dir_fd, name, fd);
+        }
+    } else if (probe_lock_fd(fd) != HOLDER_ALIVE) {
+        /* A locked file belongs to a live holder whatever it contains */
+        debug("Failed to read lock file %s, removing", name);
+        unlink_scanned_entry(dir_fd, name, fd);
+    }
+    return 0;
 }
 
 /* Signal a waiting process to release its lock */
 int done_lock(const char *descriptor) {
     char *lock_dir;
-    char lock_path[PATH_MAX];
+    struct done_scan scan;
+    int layout;
+    int shards;
+    
+    /* A listening waitlockd takes precedence over the configured backend */
+    if (opts.socket_path) {
+        int rc = daemon_done_lock(descriptor);
+        if (rc != DAEMON_UNAVAILABLE) {
+            return rc;
+        }
+    }
+    
+    if (opts.backend == BACKEND_SHM) {
+        return shm_done_lock(descriptor);
+    }
+    if (opts.backend == BACKEND_OFD) {
+        return ofd_done_lock(descriptor);
+    }
+    if (opts.backend == BACKEND_SYSV) {
+        return sysv_done_lock(descriptor);
+    }
+    if (opts.backend == BACKEND_ROBUST) {
+        return robust_done_lock(descriptor);
+    }
+    
+    /* Find lock directory */
+    lock_dir = find_lock_directory();
+    if (!lock_dir) {
+        error(E_NODIR, "Cannot find or create lock directory");
+        return E_NODIR;
+    }
+    
+    layout = read_lock_layout(lock_dir, &shards);
+    if (layout < 0) {
+        error(E_SYSTEM, "Unsupported layout in lock directory %s (created by a newer waitlock?)", lock_dir);
+        return E_SYSTEM;
+    }
+    
+    /* Search for lock files matching the descriptor */
+    memset(&scan, 0, sizeof(scan));
+    scan.descriptor = descriptor;
+    if (for_each_slot_file(lock_dir, layout, shards, descriptor, opts.max_holders,
+                           signal_holder, &scan) != 0) {
+        error(E_SYSTEM, "Cannot open lock directory %s: %s", lock_dir, strerror(errno));
+        return E_SYSTEM;
+    }
+    
+    if (scan.found == 0) {
+        if (!g_state.quiet) {
+            error(E_NOTFOUND, "No locks found for descriptor '%s'", descriptor);
+        }
+        return E_NOTFOUND;
+    }
+    
+    if (scan.released == 0) {
+        if (!g_state.quiet) {
+            error(E_SYSTEM, "Failed to release any locks for descriptor '%s'", descriptor);
+        }
+        return E_SYSTEM;
+    }
+    
+    debug("Released %d lock(s) for descriptor '%s'", scan.released, descriptor);
+    return E_SUCCESS;
+}
+/* Switch the lock directory to the per-descriptor layout, or with
+ * --shards to the sharded layout */
+int migrate_lock_layout(void) {
+    char *lock_dir;
+    char marker_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    char marker[16];
     DIR *dir;
     struct dirent *entry;
-    struct lock_info info;
-    size_t desc_len;
-    int found_locks = 0;
-    int released_locks = 0;
+    int target = (opts.shards > 0) ? LAYOUT_SHARDED : LAYOUT_SUBDIR;
+    int layout;
+    int shards;
+    int fd;
+    int i;
+    int moved = 0;
+    int skipped = 0;
     
-    /* Find lock directory */
     lock_dir = find_lock_directory();
     if (!lock_dir) {
         error(E_NODIR, "Cannot find or create lock directory");
         return E_NODIR;
     }
     
-    /* Open lock directory */
+    layout = read_lock_layout(lock_dir, &shards);
+    if (layout < 0) {
+        error(E_SYSTEM, "Unsupported layout in lock directory %s (created by a newer waitlock?)", lock_dir);
+        return E_SYSTEM;
+    }
+    
+    /* Holders only look for flat names besides their own layout's, so
+     * files are never moved from one directory layout to another */
+    if (layout == LAYOUT_SHARDED && target == LAYOUT_SHARDED && shards != opts.shards) {
+        error(E_USAGE, "Lock directory %s already has %d shards; only a flat lock directory can be switched",
+              lock_dir, shards);
+        return E_USAGE;
+    }
+    if (layout != LAYOUT_FLAT && layout != target) {
+        error(E_USAGE, "Lock directory %s already uses layout %d; only a flat lock directory can be switched",
+              lock_dir, layout);
+        return E_USAGE;
+    }
+    
+    /* Shards are created up front, so acquiring never has to create one */
+    if (target == LAYOUT_SHARDED) {
+        for (i = 0; i < opts.shards; i++) {
+            safe_snprintf(tmp_path, sizeof(tmp_path), "%s/%02x", lock_dir, i);
+            if (make_descriptor_dir(lock_dir, tmp_path) != 0) {
+                error(E_SYSTEM, "Cannot create %s: %s", tmp_path, strerror(errno));
+                return E_SYSTEM;
+            }
+        }
+    }
+    
+    /* Publish the marker first: from here on new locks go to subdirectories
+     * or shards, while flat files are still honoured until they have been
+     * moved */
+    if (layout == LAYOUT_FLAT) {
+        if (target == LAYOUT_SHARDED) {
+            safe_snprintf(marker, sizeof(marker), "%d %d\n", LAYOUT_SHARDED, opts.shards);
+        } else {
+            safe_snprintf(marker, sizeof(marker), "%d\n", LAYOUT_SUBDIR);
+        }
+        safe_snprintf(marker_path, sizeof(marker_path), "%s/%s", lock_dir, LAYOUT_MARKER);
+        safe_snprintf(tmp_path, sizeof(tmp_path), "%s/%s.%d", lock_dir, LAYOUT_MARKER, (int)getpid());
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            error(E_SYSTEM, "Cannot create %s: %s", tmp_path, strerror(errno));
+            return E_SYSTEM;
+        }
+        if (write(fd, marker, strlen(marker)) != (ssize_t)strlen(marker) || close(fd) != 0 ||
+            rename(tmp_path, marker_path) != 0) {
+            error(E_SYSTEM, "Cannot write %s: %s", marker_path, strerror(errno));
+            unlink(tmp_path);
+            return E_SYSTEM;
+        }
+    }
+    
     dir = opendir(lock_dir);
     if (!dir) {
         error(E_SYSTEM, "Cannot open lock directory %s: %s", lock_dir, strerror(errno));
         return E_SYSTEM;
     }
     
-    desc_len = strlen(descriptor);
-    
-    /* Search for lock files matching the descriptor */
+    /* Move "<descriptor>.slotN.lock" to "<descriptor>/slotN.lock", or to
+     * "<hh>/<descriptor>.slotN.lock" */
     while ((entry = readdir(dir)) != NULL) {
-        /* Skip . and .. entries */
-        if (entry->d_name[0] == '.') {
+        char descriptor[MAX_DESC_LEN + 1];
+        char prefix[MAX_DESC_LEN + 8];
+        char new_prefix[MAX_DESC_LEN + 8];
+        char flat_path[PATH_MAX];
+        char desc_dir[PATH_MAX];
+        char new_path[PATH_MAX];
+        const char *dot = NULL;
+        const char *p;
+        size_t desc_len;
+        
+        for (p = strstr(entry->d_name, ".slot"); p; p = strstr(p + 1, ".slot")) {
+            dot = p;
+        }
+        if (!dot || dot == entry->d_name) {
+            continue;
+        }
+        desc_len = dot - entry->d_name;
+        if (desc_len > MAX_DESC_LEN) {
+            continue;
+        }
+        memcpy(descriptor, entry->d_name, desc_len);
+        descriptor[desc_len] = '\0';
+        safe_snprintf(prefix, sizeof(prefix), "%s.slot", descriptor);
+        if (!is_slot_file(entry->d_name, prefix)) {
             continue;
         }
         
-        /* Check if this file matches our descriptor pattern */
-        if (strncmp(entry->d_name, descriptor, desc_len) == 0 &&
-            (entry->d_name[desc_len] == '.' || entry->d_name[desc_len] == '\0') &&
-            strstr(entry->d_name, ".lock")) {
-            
-            /* Construct full path */
-            safe_snprintf(lock_path, sizeof(lock_path), "%s/%s", lock_dir, entry->d_name);
-            
-            /* Read lock file information */
-            if (read_lock_file_any_format(lock_path, &info) == 0) {
-                /* Validate checksum */
-                if (validate_lock_checksum(&info)) {
-                    found_locks++;
-                    
-                    /* Check if process is still alive */
-                    if (process_exists(info.pid)) {
-                        /* Send SIGTERM to the process */
-                        if (kill(info.pid, SIGTERM) == 0) {
-                            debug("Sent SIGTERM to process %d for lock %s", info.pid, descriptor);
-                            released_locks++;
-                            
-                            /* Log to syslog if enabled */
-                            if (g_state.use_syslog) {
-#ifdef HAVE_SYSLOG_H
-                                openlog("waitlock", LOG_PID, g_state.syslog_facility);
-                                syslog(LOG_INFO, "signaled process %d to release lock '%s'", info.pid, descriptor);
-                                closelog();
-#endif
-                            }
-                        } else {
-                            debug("Failed to send SIGTERM to process %d: %s", info.pid, strerror(errno));
-                            
-                            /* If signal failed, check if process is actually gone */
-                            if (!process_exists(info.pid)) {
-                                debug("Process %d no longer exists, removing stale lock", info.pid);
-                                unlink(lock_path);
-                                released_locks++;
-                            }
-                        }
-                    } else {
-                        /* Process is dead, remove stale lock */
-                        debug("Process %d no longer exists, removing stale lock", info.pid);
-                        unlink(lock_path);
-                        released_locks++;
-                    }
-                } else {
-                    debug("Invalid checksum in lock file %s, removing", lock_path);
-                    unlink(lock_path);
-                }
-            } else {
-                debug("Failed to read lock file %s, removing", lock_path);
-                unlink(lock_path);
-            }
+        safe_snprintf(flat_path, sizeof(flat_path), "%s/%s", lock_dir, entry->d_name);
+        slot_file_location(desc_dir, sizeof(desc_dir), new_prefix, sizeof(new_prefix),
+                           lock_dir, target, opts.shards, descriptor);
+        slot_file_path(new_path, sizeof(new_path), lock_dir, target, opts.shards, descriptor,
+                       atoi(entry->d_name + strlen(prefix)));
+        
+        /* link() never replaces an existing slot and keeps the inode, so
+         * the holder's descriptor and lock stay valid across the move */
+        if (make_descriptor_dir(lock_dir, desc_dir) != 0 || link(flat_path, new_path) != 0) {
+            debug("Leaving %s in place: %s", entry->d_name, strerror(errno));
+            skipped++;
+            continue;
         }
+        unlink(flat_path);
+        moved++;
     }
     
     closedir(dir);
     
-    if (found_locks == 0) {
-        if (!g_state.quiet) {
-            error(E_NOTFOUND, "No locks found for descriptor '%s'", descriptor);
-        }
-        return E_NOTFOUND;
+    if (!g_state.quiet) {
+        printf("Lock directory %s uses layout %d (%d lock file(s) moved, %d left in place)\n",
+               lock_dir, target, moved, skipped);
     }
     
-    if (released_locks == 0) {
-        if (!g_state.quiet) {
-            error(E_SYSTEM, "Failed to release any locks for descriptor '%s'", descriptor);
-        }
-        return E_SYSTEM;
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "migrated lock directory %s to layout %d (%d moved, %d skipped)",
+               lock_dir, target, moved, skipped);
+        closelog();
+#endif
     }
     
-    debug("Released %d lock(s) for descriptor '%s'", released_locks, descriptor);
     return E_SUCCESS;
-}
\ No newline at end of file
+}
@@ -3,13 +3,98 @@
 
 #include "../waitlock.h"
 
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_INOTIFY_INIT1)
+#include <sys/inotify.h>
+#endif
+
+#if defined(HAVE_SYS_SYSCALL_H) && HAVE_DECL_SYS_GETDENTS64
+#include <sys/syscall.h>
+#endif
+
+/* A slot file held as one unit of a --weight acquisition */
+struct held_unit {
+    int fd;
+    char path[PATH_MAX];
+};
+
+/* One file backend acquisition. It carries everything the attempt needs,
+ * so the file engine runs without g_state or opts and several threads can
+ * acquire at once (see lib/). */
+struct file_claim {
+    const char *lock_dir;
+    const char *descriptor;
+    int max_holders;
+    int layout;
+    int shards;                     /* Fan-out of the sharded layout */
+    char scan_dir[PATH_MAX];        /* Directory holding the slot files */
+    char prefix[MAX_DESC_LEN + 8];  /* Slot file name prefix in scan_dir */
+    struct lock_info info;          /* Record published in the claimed slot */
+    char lock_path[PATH_MAX];       /* Claimed slot file */
+    int adopt_fd;                   /* Caller's file to publish instead (-1 = none) */
+    char adopt_path[PATH_MAX];      /* Its current name, replaced by the slot name */
+    char queue_prefix[MAX_DESC_LEN + 8];  /* --fair queue file name prefix in scan_dir */
+    unsigned long ticket;           /* Our place in the --fair queue */
+    int priority;                   /* --priority, higher is served first */
+    int aging;                      /* --aging interval in seconds (0 = none) */
+    struct lock_info queue_record;  /* Record published in the queue file */
+    int weight;                     /* Slots to claim, all or none (--weight) */
+    struct held_unit *units;        /* Caller storage for the weight - 1 further slots */
+    int rw_mode;                    /* LOCK_TYPE_SHARED or LOCK_TYPE_EXCLUSIVE, 0 = neither */
+    bool prefer_readers;            /* Shared claims ignore queued writers */
+    int queue_fd;                   /* Locked queue file while queued (-1 = not queued) */
+    char queue_path[PATH_MAX];
+};
+
 /* Lock management functions */
 char* find_lock_directory(void);
+char* find_lock_directory_r(const char *requested, char *buf, size_t size);
 int acquire_lock(const char *descriptor, int max_holders, double timeout);
+int acquire_all_locks(char *descriptors[], int count, int max_holders, double timeout);
+int acquire_any_lock(char *descriptors[], int count, int max_holders, double timeout,
+                     int *winner);
+int acquire_requested_locks(const char *descriptor);
 void release_lock(void);
 int check_lock(const char *descriptor);
 int list_locks(output_format_t format, bool show_all, bool stale_only);
+int done_lock(const char *descriptor);
 int portable_lock(int fd, int operation);
+int portable_range_lock(int fd, off_t start, off_t len, int operation);
+int held_lock_slot(void);
+int held_lock_slots(char *buf, size_t size);
+void inherit_held_locks(void);
+bool holder_alive(const char *path, const struct lock_info *info);
+void print_lock_info(const struct lock_info *info, bool is_stale, output_format_t format,
+                     bool show_all, bool stale_only);
+
+/* Reentrant file backend engine */
+int file_claim_init(struct file_claim *claim, const char *lock_dir, const char *descriptor,
+                    int max_holders, const char *hostname, const char *cmdline);
+int file_claim_adopt(struct file_claim *claim, int fd);
+void file_claim_rw(struct file_claim *claim, int rw_mode, bool prefer_readers);
+int file_claim_enqueue(struct file_claim *claim);
+void file_claim_dequeue(struct file_claim *claim);
+int file_claim_try(struct file_claim *claim);
+int file_claim_watch(const struct file_claim *claim);
+bool file_claim_wait(const struct file_claim *claim, int watch_fd, int wait_ms);
+int file_claims_watch(const struct file_claim *claims, int count);
+bool file_claims_wait(const struct file_claim *claims, int count, int watch_fd, int wait_ms);
+int file_count_holders(const char *lock_dir, const char *descriptor, int legacy_slots,
+                       int *max_holders);
+
+/* Lock directory layout */
+int get_lock_layout(const char *lock_dir);
+int read_lock_layout(const char *lock_dir, int *shards);
+int migrate_lock_layout(void);
+int lock_path_slot(const char *path);
+
+/* Lock file records */
+size_t encode_lock_record(const struct lock_info *info, char *buf, size_t size);
+int decode_lock_record(const char *buf, size_t len, struct lock_info *info, bool header_only);
+int write_lock_record(int fd, const struct lock_info *info, bool compact);
+int read_lock_header(const char *path, struct lock_info *info);
+int read_lock_header_fd(int fd, struct lock_info *info);
+int read_lock_record_fd(int fd, struct lock_info *info);
+int parse_lock_record(const char *buf, ssize_t len, int fd, struct lock_info *info);
 
 /* Text fallback format functions */
 int write_text_lock_file(const char *path, const struct lock_info *info);
@@ -0,0 +1,513 @@
+/*
+ * Open file description lock backend - one file per descriptor, slot i
+ * held by a write lock on byte i, waits blocked in the kernel
+ */
+
+#include "ofd.h"
+#include "../core/core.h"
+#include "../lock/lock.h"
+#include "../process/process.h"
+
+/* Check if a directory entry name is an OFD slot file */
+bool ofd_is_slot_file_name(const char *name) {
+    size_t len = strlen(name);
+    size_t suffix_len = strlen(OFD_FILE_SUFFIX);
+
+    return len > suffix_len && strcmp(name + len - suffix_len, OFD_FILE_SUFFIX) == 0;
+}
+
+#ifdef HAVE_OFD_BACKEND
+
+/* Interval of the wait timer after its first expiry */
+#define OFD_TIMER_REPEAT_MS 50
+
+/* Slot held by this process. The descriptor is also g_state.lock_fd, so the
+ * signal handler releases the slot by closing it. */
+static int held_fd = -1;
+static int held_slot = -1;
+static time_t held_since;
+static char held_descriptor[MAX_DESC_LEN + 1];
+
+static off_t record_offset(int slot) {
+    return (off_t)OFD_RECORD_BASE + (off_t)slot * (off_t)sizeof(struct ofd_record);
+}
+
+/* Open the slot file for a descriptor, creating it if needed */
+int ofd_open_slot_file(const char *descriptor, const char *suffix) {
+    char *lock_dir;
+    char path[PATH_MAX];
+    int fd;
+
+    lock_dir = find_lock_directory();
+    if (!lock_dir) {
+        error(E_NODIR, "Cannot find or create lock directory");
+        return -1;
+    }
+
+    safe_snprintf(path, sizeof(path), "%s/%s%s", lock_dir, descriptor, suffix);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd >= 0) {
+        /* New file: share it the way the lock directory is shared */
+        struct stat dir_st;
+        if (stat(lock_dir, &dir_st) == 0) {
+            fchmod(fd, dir_st.st_mode & 0666);
+        }
+    } else if (errno == EEXIST) {
+        fd = open(path, O_RDWR);
+    }
+    if (fd < 0) {
+        error(E_SYSTEM, "Cannot open slot file %s: %s", path, strerror(errno));
+    }
+    return fd;
+}
+
+/* Find the first held slot at or after slot. Returns the slot, -1 if none,
+ * or -2 on error. Locks held through other open files conflict, so this
+ * also sees slots held by this process. */
+static int next_held_slot(int fd, int slot) {
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = slot;
+    fl.l_len = OFD_MAX_SLOTS - slot;
+    if (fcntl(fd, F_OFD_GETLK, &fl) != 0) {
+        return -2;
+    }
+    return (fl.l_type == F_UNLCK) ? -1 : (int)fl.l_start;
+}
+
+static bool slot_held(int fd, int slot) {
+    return next_held_slot(fd, slot) == slot;
+}
+
+static int read_record(int fd, int slot, struct ofd_record *rec) {
+    if (pread(fd, rec, sizeof(*rec), record_offset(slot)) != (ssize_t)sizeof(*rec) ||
+        rec->magic != OFD_RECORD_MAGIC || rec->slot != slot) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Lock the first free slot below max_slots without waiting. Returns the
+ * slot, -1 if all are held, or -2 on error. */
+int ofd_claim_slot(int fd, int max_slots) {
+    int i;
+
+    for (i = 0; i < max_slots && i < OFD_MAX_SLOTS; i++) {
+        if (portable_range_lock(fd, i, 1, LOCK_EX | LOCK_NB) == 0) {
+            return i;
+        }
+        if (errno != EAGAIN && errno != EACCES) {
+            return -2;
+        }
+    }
+    return -1;
+}
+
+/* Record this process as the holder of a locked slot */
+void ofd_write_record(int fd, int slot, int max_holders) {
+    struct ofd_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = OFD_RECORD_MAGIC;
+    rec.pid = getpid();
+    rec.ppid = getppid();
+    rec.uid = getuid();
+    rec.acquired_at = time(NULL);
+    rec.max_holders = max_holders;
+    rec.slot = slot;
+    if (pwrite(fd, &rec, sizeof(rec), record_offset(slot)) != (ssize_t)sizeof(rec)) {
+        /* The slot is held either way; only --list and --done lose out */
+        debug("Cannot write holder record for slot %d: %s", slot, strerror(errno));
+    }
+}
+
+/* Clear the record of a slot about to be unlocked, so --list does not
+ * show it as stale */
+void ofd_clear_record(int fd, int slot) {
+    struct ofd_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    if (pwrite(fd, &rec, sizeof(rec), record_offset(slot)) != (ssize_t)sizeof(rec)) {
+        debug("Cannot clear holder record for slot %d: %s", slot, strerror(errno));
+    }
+}
+
+static void wait_timer_handler(int sig) {
+    (void)sig;
+}
+
+/* Interrupt a blocking lock wait after wait_ms. SA_RESTART is left out so
+ * the wait fails with EINTR, and the timer repeats in case the first tick
+ * lands before the wait has started. */
+static void arm_wait_timer(int wait_ms, struct sigaction *saved) {
+    struct sigaction sa;
+    struct itimerval it;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wait_timer_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, saved);
+
+    memset(&it, 0, sizeof(it));
+    it.it_value.tv_sec = wait_ms / 1000;
+    it.it_value.tv_usec = (wait_ms % 1000) * 1000;
+    it.it_interval.tv_usec = OFD_TIMER_REPEAT_MS * 1000;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+static void disarm_wait_timer(const struct sigaction *saved) {
+    struct itimerval it;
+
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_REAL, &it, NULL);
+    sigaction(SIGALRM, saved, NULL);
+}
+
+/* Acquire a slot byte of the descriptor's slot file */
+int ofd_acquire_lock(const char *descriptor, int max_holders, double timeout) {
+    struct timeval start_time, now;
+    double elapsed;
+    int wait_ms = INITIAL_WAIT_MS;
+    bool contention_logged = FALSE;
+    int attempt = 0;
+    int claimed = -1;
+    int fd;
+
+    if (max_holders > OFD_MAX_SLOTS) {
+        error(E_USAGE, "The ofd backend supports at most %d holders", OFD_MAX_SLOTS);
+        return E_USAGE;
+    }
+
+    fd = ofd_open_slot_file(descriptor, OFD_FILE_SUFFIX);
+    if (fd < 0) {
+        return E_SYSTEM;
+    }
+
+    gettimeofday(&start_time, NULL);
+
+    while (1) {
+        /* Check timeout at start of each iteration, as the file backend does */
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - start_time.tv_sec) +
+                 (now.tv_usec - start_time.tv_usec) / 1000000.0;
+        if (timeout >= 0 && elapsed >= timeout) {
+            if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                syslog(LOG_WARNING, "timeout waiting for lock '%s' after %.1f seconds",
+                       descriptor, timeout);
+                closelog();
+#endif
+            }
+            error(E_TIMEOUT, "Timeout waiting for lock '%s' after %.1f seconds", descriptor, timeout);
+            break;
+        }
+
+        claimed = ofd_claim_slot(fd, max_holders);
+        if (claimed == -2) {
+            error(E_SYSTEM, "Cannot lock slot of '%s': %s", descriptor, strerror(errno));
+            close(fd);
+            return E_SYSTEM;
+        }
+
+        if (claimed < 0) {
+            debug("All %d slots are currently in use", max_holders);
+            if (timeout <= 0) {
+                /* Fail fast if no timeout, as the file backend does */
+                close(fd);
+                return E_BUSY;
+            }
+
+            if (g_state.should_exit) {
+                break;
+            }
+
+            if (!contention_logged) {
+                contention_logged = TRUE;
+                if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                    openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                    syslog(LOG_INFO, "lock contention for '%s' (waiting)", descriptor);
+                    closelog();
+#endif
+                }
+            }
+
+            /* Block in the kernel on one slot. A mutex waits for its only
+             * slot until the deadline; a semaphore rotates through its slots
+             * with backoff as the bound, since any of them may free first. */
+            struct sigaction saved;
+            int remaining_ms = (int)((timeout - elapsed) * 1000);
+            int block_ms = (max_holders == 1 || remaining_ms < wait_ms) ? remaining_ms : wait_ms;
+            int wait_slot = attempt++ % max_holders;
+
+            if (block_ms < 1) block_ms = 1;
+            arm_wait_timer(block_ms, &saved);
+            if (portable_range_lock(fd, wait_slot, 1, LOCK_EX) == 0) {
+                claimed = wait_slot;
+            } else if (errno != EINTR) {
+                disarm_wait_timer(&saved);
+                error(E_SYSTEM, "Cannot wait for slot %d of '%s': %s", wait_slot, descriptor, strerror(errno));
+                close(fd);
+                return E_SYSTEM;
+            }
+            disarm_wait_timer(&saved);
+
+            if (claimed < 0) {
+                wait_ms = wait_ms * 2;
+                if (wait_ms > MAX_WAIT_MS) wait_ms = MAX_WAIT_MS;
+                wait_ms += rand() % (wait_ms / 10 + 1);
+                continue;
+            }
+        }
+
+        ofd_write_record(fd, claimed, max_holders);
+
+        held_fd = fd;
+        held_slot = claimed;
+        held_since = time(NULL);
+        strncpy(held_descriptor, descriptor, sizeof(held_descriptor) - 1);
+        held_descriptor[sizeof(held_descriptor) - 1] = '\0';
+        g_state.lock_fd = fd;
+
+        if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+            openlog("waitlock", LOG_PID, g_state.syslog_facility);
+            syslog(LOG_INFO, "acquired lock '%s' (slot %d)", descriptor, claimed);
+            closelog();
+#endif
+        }
+        debug("Locked slot %d of '%s'", claimed, descriptor);
+        return E_SUCCESS;
+    }
+
+    close(fd);
+    return g_state.should_exit ? E_SYSTEM : E_TIMEOUT;
+}
+
+/* Release the held slot. Closing the file drops the byte lock; the record
+ * is cleared first so --list does not show it as stale. */
+void ofd_release_lock(void) {
+    if (held_fd < 0) {
+        return;
+    }
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "released lock '%s' after %.0f seconds",
+               held_descriptor, difftime(time(NULL), held_since));
+        closelog();
+#endif
+    }
+
+    debug("Releasing slot %d of '%s'", held_slot, held_descriptor);
+    ofd_clear_record(held_fd, held_slot);
+    close(held_fd);
+    if (g_state.lock_fd == held_fd) {
+        g_state.lock_fd = -1;
+    }
+    held_fd = -1;
+    held_slot = -1;
+}
+
+/* Slot held by this process, or -1 */
+int ofd_held_slot(void) {
+    return (held_fd >= 0) ? held_slot : -1;
+}
+
+/* Check if a slot could be acquired now */
+int ofd_check_lock(const char *descriptor) {
+    struct ofd_record rec;
+    int active = 0;
+    int max_holders = 1;  /* Default to mutex behavior */
+    int slot;
+    int fd;
+
+    fd = ofd_open_slot_file(descriptor, OFD_FILE_SUFFIX);
+    if (fd < 0) {
+        return E_SYSTEM;
+    }
+
+    for (slot = next_held_slot(fd, 0); slot >= 0; slot = next_held_slot(fd, slot + 1)) {
+        active++;
+        /* Use max_holders from any holder */
+        if (read_record(fd, slot, &rec) == 0 && rec.max_holders > 0) {
+            max_holders = rec.max_holders;
+        }
+        if (slot + 1 >= OFD_MAX_SLOTS) {
+            break;
+        }
+    }
+    close(fd);
+
+    if (slot == -2) {
+        error(E_SYSTEM, "Cannot query slot locks of '%s': %s", descriptor, strerror(errno));
+        return E_SYSTEM;
+    }
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "check lock '%s': %s (%d/%d holders)",
+               descriptor, (active >= max_holders) ? "busy" : "available",
+               active, max_holders);
+        closelog();
+#endif
+    }
+
+    return (active >= max_holders) ? E_BUSY : E_SUCCESS;
+}
+
+/* Signal every process holding a slot of an open slot file */
+int ofd_signal_holders(int fd, const char *descriptor) {
+    struct ofd_record rec;
+    int found = 0;
+    int released = 0;
+    int slot;
+
+    for (slot = next_held_slot(fd, 0); slot >= 0; slot = next_held_slot(fd, slot + 1)) {
+        found++;
+
+        if (read_record(fd, slot, &rec) != 0) {
+            debug("Slot %d of '%s' is held but has no holder record yet", slot, descriptor);
+        } else if (kill(rec.pid, SIGTERM) == 0) {
+            debug("Sent SIGTERM to process %d for lock %s", (int)rec.pid, descriptor);
+            released++;
+            if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                syslog(LOG_INFO, "signaled process %d to release lock '%s'", (int)rec.pid, descriptor);
+                closelog();
+#endif
+            }
+        } else {
+            debug("Failed to send SIGTERM to process %d: %s", (int)rec.pid, strerror(errno));
+        }
+        if (slot + 1 >= OFD_MAX_SLOTS) {
+            break;
+        }
+    }
+
+    if (found == 0) {
+        if (!g_state.quiet) {
+            error(E_NOTFOUND, "No locks found for descriptor '%s'", descriptor);
+        }
+        return E_NOTFOUND;
+    }
+
+    if (released == 0) {
+        if (!g_state.quiet) {
+            error(E_SYSTEM, "Failed to release any locks for descriptor '%s'", descriptor);
+        }
+        return E_SYSTEM;
+    }
+
+    debug("Released %d lock(s) for descriptor '%s'", released, descriptor);
+    return E_SUCCESS;
+}
+
+/* Signal every holder of the descriptor to release its slot */
+int ofd_done_lock(const char *descriptor) {
+    int result;
+    int fd;
+
+    fd = ofd_open_slot_file(descriptor, OFD_FILE_SUFFIX);
+    if (fd < 0) {
+        return E_SYSTEM;
+    }
+    result = ofd_signal_holders(fd, descriptor);
+    close(fd);
+    return result;
+}
+
+/* Print the holders recorded in one slot file. A record whose byte is no
+ * longer locked was left by a holder that died and is shown as stale. */
+void ofd_list_file(const char *path, const char *suffix, output_format_t format,
+                   bool show_all, bool stale_only) {
+    struct ofd_record rec;
+    struct lock_info info;
+    struct stat st;
+    const char *name;
+    size_t name_len;
+    int records;
+    int fd;
+    int i;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        debug("Skipping slot file %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    /* The descriptor is the file name without the suffix */
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    name_len = strlen(name) - strlen(suffix);
+
+    records = (st.st_size > OFD_RECORD_BASE) ?
+              (int)((st.st_size - OFD_RECORD_BASE) / (off_t)sizeof(struct ofd_record)) : 0;
+    for (i = 0; i < records && i < OFD_MAX_SLOTS; i++) {
+        char *cmdline;
+        bool is_stale;
+
+        if (read_record(fd, i, &rec) != 0) {
+            continue;
+        }
+        is_stale = !slot_held(fd, i);
+
+        memset(&info, 0, sizeof(info));
+        info.magic = LOCK_MAGIC;
+        info.pid = rec.pid;
+        info.ppid = rec.ppid;
+        info.uid = rec.uid;
+        info.acquired_at = (time_t)rec.acquired_at;
+        info.max_holders = rec.max_holders;
+        info.lock_type = (info.max_holders > 1) ? 1 : 0;
+        info.slot = i;
+        safe_snprintf(info.descriptor, sizeof(info.descriptor), "%.*s", (int)name_len, name);
+        cmdline = is_stale ? NULL : get_process_cmdline(info.pid);
+        if (cmdline) {
+            strncpy(info.cmdline, cmdline, sizeof(info.cmdline) - 1);
+        }
+
+        print_lock_info(&info, is_stale, format, show_all, stale_only);
+    }
+    close(fd);
+}
+
+#else /* !HAVE_OFD_BACKEND */
+
+int ofd_acquire_lock(const char *descriptor, int max_holders, double timeout) {
+    error(E_USAGE, "The ofd backend is not supported on this platform");
+    return E_USAGE;
+}
+
+void ofd_release_lock(void) {
+}
+
+int ofd_held_slot(void) {
+    return -1;
+}
+
+int ofd_check_lock(const char *descriptor) {
+    error(E_USAGE, "The ofd backend is not supported on this platform");
+    return E_USAGE;
+}
+
+int ofd_done_lock(const char *descriptor) {
+    error(E_USAGE, "The ofd backend is not supported on this platform");
+    return E_USAGE;
+}
+
+void ofd_list_file(const char *path, const char *suffix, output_format_t format,
+                   bool show_all, bool stale_only) {
+}
+
+#endif /* HAVE_OFD_BACKEND */
@@ -0,0 +1,52 @@
+#ifndef WAITLOCK_OFD_H
+#define WAITLOCK_OFD_H
+
+#include "../waitlock.h"
+
+#if defined(__linux__) && defined(F_OFD_SETLK) && defined(F_OFD_SETLKW) && defined(F_OFD_GETLK)
+  #define HAVE_OFD_BACKEND 1
+#endif
+
+/* Slot file, one per descriptor: <lockdir>/<descriptor>.ofd
+ * Slot i is held by a write lock on byte i. Holder records live in a
+ * sidecar area after the lock bytes, one per slot. */
+#define OFD_FILE_SUFFIX    ".ofd"
+#define OFD_RECORD_MAGIC   0x57414f01  /* "WAO" + record format version 1 */
+#define OFD_MAX_SLOTS      4096
+#define OFD_RECORD_BASE    OFD_MAX_SLOTS
+
+/* Holder record. Only metadata for --list and --done: whether a slot is held
+ * is decided by the kernel lock on its byte, so a record left behind by a
+ * holder that died is recognised as stale without any cleanup. */
+struct ofd_record {
+    uint32_t magic;         /* 0 = never written or released */
+    int32_t pid;
+    int32_t ppid;
+    uint32_t uid;
+    int64_t acquired_at;
+    uint16_t max_holders;
+    uint16_t slot;
+    uint32_t reserved;
+};
+
+/* Open file description byte-range lock backend */
+int ofd_acquire_lock(const char *descriptor, int max_holders, double timeout);
+void ofd_release_lock(void);
+int ofd_held_slot(void);
+int ofd_check_lock(const char *descriptor);
+int ofd_done_lock(const char *descriptor);
+bool ofd_is_slot_file_name(const char *name);
+void ofd_list_file(const char *path, const char *suffix, output_format_t format,
+                   bool show_all, bool stale_only);
+
+#ifdef HAVE_OFD_BACKEND
+/* Slot file primitives, shared with backends that keep their holder
+ * records in a slot file of their own */
+int ofd_open_slot_file(const char *descriptor, const char *suffix);
+int ofd_claim_slot(int fd, int max_slots);
+void ofd_write_record(int fd, int slot, int max_holders);
+void ofd_clear_record(int fd, int slot);
+int ofd_signal_holders(int fd, const char *descriptor);
+#endif
+
+#endif /* WAITLOCK_OFD_H */
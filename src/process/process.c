@@ -50,10 +50,8 @@ bool process_exists(pid_t pid) {
 #endif
 }
 
-/* Get process command line */
-char* get_process_cmdline(pid_t pid) {
-    static char cmdline[MAX_CMDLINE];
-    
+/* Get process command line into cmdline; returns cmdline, or NULL */
+char* get_process_cmdline_r(pid_t pid, char *cmdline, size_t size) {
 #ifdef __linux__
     char proc_path[64];
     int fd;
@@ -64,7 +62,7 @@ char* get_process_cmdline(pid_t pid) {
     fd = open(proc_path, O_RDONLY);
     if (fd < 0) return NULL;
     
-    len = read(fd, cmdline, sizeof(cmdline) - 1);
+    len = read(fd, cmdline, size - 1);
     close(fd);
     
     if (len <= 0) return NULL;
@@ -94,12 +92,12 @@ char* get_process_cmdline(pid_t pid) {
     
 #ifdef __APPLE__
     /* On macOS, use kp_proc.p_comm for basic command name */
-    strncpy(cmdline, kp.kp_proc.p_comm, sizeof(cmdline) - 1);
-    cmdline[sizeof(cmdline) - 1] = '\0';
+    strncpy(cmdline, kp.kp_proc.p_comm, size - 1);
+    cmdline[size - 1] = '\0';
 #else
     /* On BSD, use ki_comm for basic command name */
-    strncpy(cmdline, kp.ki_comm, sizeof(cmdline) - 1);
-    cmdline[sizeof(cmdline) - 1] = '\0';
+    strncpy(cmdline, kp.ki_comm, size - 1);
+    cmdline[size - 1] = '\0';
 #endif
     
     return cmdline;
@@ -112,7 +110,7 @@ char* get_process_cmdline(pid_t pid) {
     fp = popen(ps_cmd, "r");
     if (fp == NULL) return NULL;
     
-    if (fgets(cmdline, sizeof(cmdline), fp) == NULL) {
+    if (fgets(cmdline, size, fp) == NULL) {
         pclose(fp);
         return NULL;
     }
@@ -128,18 +126,227 @@ char* get_process_cmdline(pid_t pid) {
 #endif
 }
 
+/* Get process command line (static buffer, not thread-safe) */
+char* get_process_cmdline(pid_t pid) {
+    static char cmdline[MAX_CMDLINE];
+    
+    return get_process_cmdline_r(pid, cmdline, sizeof(cmdline));
+}
+
+/* Get process start time, used to tell a live holder from a recycled pid.
+ * Returns 0 where the start time is not available. */
+unsigned long long get_process_start_time(pid_t pid) {
+#ifdef __linux__
+    char proc_path[64];
+    char buf[1024];
+    char *p;
+    int fd;
+    ssize_t len;
+    int field;
+    
+    safe_snprintf(proc_path, sizeof(proc_path), "/proc/%d/stat", (int)pid);
+    fd = open(proc_path, O_RDONLY);
+    if (fd < 0) return 0;
+    
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) return 0;
+    buf[len] = '\0';
+    
+    /* Fields after the parenthesised command name; starttime is field 22 */
+    p = strrchr(buf, ')');
+    if (!p) return 0;
+    for (field = 2; field < 22 && p; field++) {
+        p = strchr(p + 1, ' ');
+    }
+    if (!p) return 0;
+    
+    return strtoull(p + 1, NULL, 10);
+#else
+    (void)pid;
+    return 0;
+#endif
+}
+
+/* Parent of another process (0 if unknown) */
+pid_t get_process_ppid(pid_t pid) {
+#ifdef __linux__
+    char proc_path[64];
+    char buf[1024];
+    char *p;
+    int fd;
+    ssize_t len;
+    
+    safe_snprintf(proc_path, sizeof(proc_path), "/proc/%d/stat", (int)pid);
+    fd = open(proc_path, O_RDONLY);
+    if (fd < 0) return 0;
+    
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) return 0;
+    buf[len] = '\0';
+    
+    /* "pid (comm) state ppid ..." */
+    p = strrchr(buf, ')');
+    if (!p || !(p = strchr(p + 2, ' '))) return 0;
+    
+    return (pid_t)atoi(p + 1);
+#else
+    (void)pid;
+    return 0;
+#endif
+}
+
+/* Detach the background holder from the caller's terminal and pipes, so
+ * that $(waitlock --background ...) returns once the lock is held */
+static void detach_stdio(void) {
+    int fd;
+    
+    if (!opts.background) return;
+    
+    fd = open("/dev/null", O_RDWR);
+    if (fd < 0) return;
+    dup2(fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    if (fd > STDERR_FILENO) {
+        close(fd);
+    }
+}
+
+/* Report the outcome of acquisition on --ready-fd as one byte, the ASCII
+ * digit of the exit code, then close it so the command run under --exec
+ * does not inherit it. A background holder lets go of stdio first. */
+void notify_ready(int status) {
+    char byte = (char)('0' + status);
+    ssize_t n;
+    
+    if (opts.ready_fd < 0) return;
+    
+    if (status == E_SUCCESS) {
+        detach_stdio();
+    }
+    do {
+        n = write(opts.ready_fd, &byte, 1);
+    } while (n < 0 && errno == EINTR);
+    close(opts.ready_fd);
+    opts.ready_fd = -1;
+}
+
+/* --background: fork a holder in its own session and wait on a pipe for
+ * its status byte. Returns -1 in the holder, which goes on to acquire with
+ * the pipe as its ready fd. The parent prints the holder's PID once the
+ * lock is held and returns the acquisition exit code. */
+int start_background(void) {
+    int fds[2];
+    pid_t pid;
+    char byte;
+    ssize_t n;
+    
+    if (pipe(fds) < 0) {
+        error(E_SYSTEM, "Cannot create pipe: %s", strerror(errno));
+        return E_SYSTEM;
+    }
+    
+    pid = fork();
+    if (pid < 0) {
+        error(E_SYSTEM, "Cannot fork background holder: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return E_SYSTEM;
+    }
+    
+    if (pid == 0) {
+        close(fds[0]);
+        setsid();
+        if (opts.ready_fd >= 0) {
+            close(opts.ready_fd);
+        }
+        opts.ready_fd = fds[1];
+        return -1;
+    }
+    
+    /* Signals sent to us while waiting are forwarded to the holder */
+    g_state.child_pid = pid;
+    close(fds[1]);
+    do {
+        n = read(fds[0], &byte, 1);
+    } while (n < 0 && errno == EINTR);
+    close(fds[0]);
+    g_state.child_pid = 0;
+    
+    if (n != 1) {
+        error(E_SYSTEM, "Background holder %d exited before acquiring the lock", (int)pid);
+        return E_SYSTEM;
+    }
+    if (byte == '0') {
+        printf("%d\n", (int)pid);
+    }
+    return byte - '0';
+}
+
+/* Replace this process with the command, lock held. The lock descriptor
+ * (slot file, OFD lock file or waitlockd connection) is not close-on-exec,
+ * and the pid in the lock record stays valid across exec, so the command
+ * becomes the holder and the lock is released when the last process
+ * holding the descriptor exits. Returns only if exec fails. */
+static int exec_in_place(char *argv[]) {
+    int saved_errno;
+    
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    
+    /* Export WAITLOCK_SLOT environment variable for semaphore holders */
+    if (opts.max_holders > 1) {
+        char slot_str[WEIGHT_SLOTS_MAX];
+        if (held_lock_slots(slot_str, sizeof(slot_str)) > 0) {
+            setenv("WAITLOCK_SLOT", slot_str, 1);
+        }
+    }
+    
+    /* The descriptor --any got */
+    if (opts.any_mode) {
+        setenv("WAITLOCK_DESCRIPTOR", opts.descriptor, 1);
+    }
+    
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "exec without supervisor: %s", argv[0]);
+        closelog();
+#endif
+    }
+    
+    inherit_held_locks();
+    execvp(argv[0], argv);
+    
+    /* Still ours: drop the lock and fail like the supervised child does */
+    saved_errno = errno;
+    release_lock();
+    error(E_EXEC, "Cannot execute command '%s': %s", argv[0], strerror(saved_errno));
+    return (saved_errno == ENOENT) ? E_NOTFOUND : E_EXEC;
+}
+
 /* Execute command while holding lock */
 int exec_with_lock(const char *descriptor, char *argv[]) {
     int ret;
     pid_t pid;
     int status;
     
-    /* Acquire lock first */
-    ret = acquire_lock(descriptor, opts.max_holders, opts.timeout);
+    /* Acquire lock first, or the set given with --all or --any */
+    ret = acquire_requested_locks(descriptor);
+    notify_ready(ret);
     if (ret != E_SUCCESS) {
         return ret;
     }
     
+    if (opts.no_supervise) {
+        return exec_in_place(argv);
+    }
+    
     /* Fork and exec */
     pid = fork();
     if (pid < 0) {
@@ -155,18 +362,20 @@ int exec_with_lock(const char *descriptor, char *argv[]) {
         signal(SIGHUP, SIG_DFL);
         signal(SIGQUIT, SIG_DFL);
         
-        /* Export WAITLOCK_SLOT environment variable for semaphore holders */
+        /* Export WAITLOCK_SLOT environment variable for semaphore holders,
+         * a comma-separated list with --weight */
         if (opts.max_holders > 1) {
-            char slot_str[32];
-            /* Need to get the slot number from the lock file path */
-            char *slot_pos = strstr(g_state.lock_path, ".slot");
-            if (slot_pos) {
-                int slot_num = atoi(slot_pos + 5);  /* Skip ".slot" */
-                safe_snprintf(slot_str, sizeof(slot_str), "%d", slot_num);
+            char slot_str[WEIGHT_SLOTS_MAX];
+            if (held_lock_slots(slot_str, sizeof(slot_str)) > 0) {
                 setenv("WAITLOCK_SLOT", slot_str, 1);
             }
         }
         
+        /* The descriptor --any got */
+        if (opts.any_mode) {
+            setenv("WAITLOCK_DESCRIPTOR", opts.descriptor, 1);
+        }
+        
         execvp(argv[0], argv);
         error(E_EXEC, "Cannot execute command '%s': %s", argv[0], strerror(errno));
         exit((errno == ENOENT) ? E_NOTFOUND : E_EXEC);
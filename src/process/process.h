@@ -13,6 +13,11 @@
 /* Process management functions */
 bool process_exists(pid_t pid);
 char* get_process_cmdline(pid_t pid);
+char* get_process_cmdline_r(pid_t pid, char *cmdline, size_t size);
+unsigned long long get_process_start_time(pid_t pid);
+pid_t get_process_ppid(pid_t pid);
 int exec_with_lock(const char *descriptor, char *argv[]);
+int start_background(void);
+void notify_ready(int status);
 
 #endif /* WAITLOCK_PROCESS_H */
\ No newline at end of file
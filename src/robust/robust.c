@@ -0,0 +1,620 @@
+/*
+ * Robust mutex backend - one mmap'd control block per descriptor whose
+ * slots are process-shared robust mutexes, so the kernel wakes waiters and
+ * reports holders that died
+ */
+
+#include "robust.h"
+#include "../core/core.h"
+#include "../lock/lock.h"
+#include "../process/process.h"
+
+/* Check if a directory entry name is a control block */
+bool robust_is_block_name(const char *name) {
+    size_t len = strlen(name);
+    size_t suffix_len = strlen(ROBUST_FILE_SUFFIX);
+
+    return len > suffix_len && strcmp(name + len - suffix_len, ROBUST_FILE_SUFFIX) == 0;
+}
+
+#ifdef HAVE_ROBUST_BACKEND
+
+/* Slot held by this process */
+static struct robust_block *held_block = NULL;
+static int held_slot = -1;
+static time_t held_since;
+static char held_descriptor[MAX_DESC_LEN + 1];
+
+/* Initialise a new control block and publish it by writing the magic */
+static void init_block(struct robust_block *blk) {
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t cond_attr;
+    int i;
+
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+
+    pthread_mutex_init(&blk->table_lock, &mutex_attr);
+    pthread_cond_init(&blk->released, &cond_attr);
+    for (i = 0; i < ROBUST_SLOTS; i++) {
+        pthread_mutex_init(&blk->slots[i].lock, &mutex_attr);
+    }
+
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    blk->mutex_size = sizeof(pthread_mutex_t);
+    blk->cond_size = sizeof(pthread_cond_t);
+    __sync_synchronize();
+    blk->magic = ROBUST_BLOCK_MAGIC;
+}
+
+/* Map a control block, creating and initialising it if create is set.
+ * Listing falls back to a read-only mapping, reported via writable.
+ * Returns NULL with errno set; EINVAL means the file is not a control
+ * block this build understands. */
+static struct robust_block *map_block(const char *path, const char *lock_dir, bool create,
+                                      bool *writable) {
+    struct robust_block *blk = NULL;
+    struct stat st;
+    bool creator = FALSE;
+    int waited;
+    int fd = -1;
+
+    *writable = TRUE;
+    if (create) {
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (fd >= 0) {
+            /* New block: share it the way the lock directory is shared */
+            struct stat dir_st;
+            if (stat(lock_dir, &dir_st) == 0) {
+                fchmod(fd, dir_st.st_mode & 0666);
+            }
+            creator = TRUE;
+            if (ftruncate(fd, sizeof(struct robust_block)) != 0) {
+                close(fd);
+                unlink(path);
+                return NULL;
+            }
+        }
+    }
+    if (fd < 0) {
+        fd = open(path, O_RDWR);
+        if (fd < 0 && !create && errno == EACCES) {
+            fd = open(path, O_RDONLY);
+            *writable = FALSE;
+        }
+        if (fd < 0) {
+            return NULL;
+        }
+    }
+
+    /* Wait for a concurrent creator to size and initialise the block */
+    for (waited = 0; ; waited++) {
+        if (fstat(fd, &st) != 0) {
+            break;
+        }
+        if (st.st_size == (off_t)sizeof(struct robust_block)) {
+            if (!blk) {
+                blk = mmap(NULL, sizeof(struct robust_block),
+                           *writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+                if (blk == MAP_FAILED) {
+                    blk = NULL;
+                    break;
+                }
+            }
+            if (creator) {
+                init_block(blk);
+            }
+            if (blk->magic != 0) {
+                break;
+            }
+        } else if (st.st_size != 0) {
+            errno = EINVAL;
+            break;
+        }
+        if (waited >= ROBUST_INIT_WAIT_MS) {
+            errno = EINVAL;
+            break;
+        }
+        usleep(1000);
+    }
+    close(fd);
+
+    if (blk && (blk->magic != ROBUST_BLOCK_MAGIC ||
+                blk->mutex_size != sizeof(pthread_mutex_t) ||
+                blk->cond_size != sizeof(pthread_cond_t))) {
+        munmap(blk, sizeof(struct robust_block));
+        errno = EINVAL;
+        return NULL;
+    }
+    return blk;
+}
+
+/* Map the control block for a descriptor, reporting failures */
+static struct robust_block *open_block(const char *descriptor) {
+    char *lock_dir;
+    char path[PATH_MAX];
+    struct robust_block *blk;
+    bool writable;
+
+    lock_dir = find_lock_directory();
+    if (!lock_dir) {
+        error(E_NODIR, "Cannot find or create lock directory");
+        return NULL;
+    }
+
+    safe_snprintf(path, sizeof(path), "%s/%s%s", lock_dir, descriptor, ROBUST_FILE_SUFFIX);
+    blk = map_block(path, lock_dir, TRUE, &writable);
+    if (!blk) {
+        if (errno == EINVAL) {
+            error(E_SYSTEM, "Control block %s has an unsupported format", path);
+        } else {
+            error(E_SYSTEM, "Cannot open control block %s: %s", path, strerror(errno));
+        }
+    }
+    return blk;
+}
+
+/* Lock a robust mutex, taking it over if its owner died holding it.
+ * try_only selects trylock, otherwise deadline (or NULL) bounds the wait.
+ * Returns 0 or the pthread error; recovered reports a dead owner. */
+static int lock_robust(pthread_mutex_t *mutex, const struct timespec *deadline, bool try_only,
+                       bool *recovered) {
+    int rc;
+
+    if (try_only) {
+        rc = pthread_mutex_trylock(mutex);
+    } else if (deadline) {
+        rc = pthread_mutex_timedlock(mutex, deadline);
+    } else {
+        rc = pthread_mutex_lock(mutex);
+    }
+    if (recovered) {
+        *recovered = (rc == EOWNERDEAD);
+    }
+    if (rc == EOWNERDEAD) {
+        pthread_mutex_consistent(mutex);
+        rc = 0;
+    }
+    return rc;
+}
+
+/* Unlock a slot and wake one semaphore waiter */
+static void unlock_slot(struct robust_block *blk, int slot) {
+    pthread_mutex_unlock(&blk->slots[slot].lock);
+
+    lock_robust(&blk->table_lock, NULL, FALSE, NULL);
+    if (blk->waiters > 0) {
+        pthread_cond_signal(&blk->released);
+    }
+    pthread_mutex_unlock(&blk->table_lock);
+}
+
+/* Note a slot taken over from a holder that died */
+static void slot_recovered(struct robust_block *blk, int slot) {
+    debug("Recovered slot %d from dead process %d", slot, (int)blk->slots[slot].pid);
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_WARNING, "recovered slot %d from dead process %d",
+               slot, (int)blk->slots[slot].pid);
+        closelog();
+#endif
+    }
+}
+
+/* Lock a free slot below max_holders without waiting. Returns the slot,
+ * -1 if all are held, or -2 with errno set on error. */
+static int claim_slot(struct robust_block *blk, int max_holders) {
+    uint32_t high_water;
+    bool recovered;
+    int rc;
+    int i;
+
+    for (i = 0; i < max_holders; i++) {
+        rc = lock_robust(&blk->slots[i].lock, NULL, TRUE, &recovered);
+        if (rc == 0) {
+            if (recovered) {
+                slot_recovered(blk, i);
+            }
+            /* Raise the high water mark so scans cover this slot */
+            while ((high_water = blk->high_water) < (uint32_t)i + 1 &&
+                   !__sync_bool_compare_and_swap(&blk->high_water, high_water, (uint32_t)i + 1)) {
+                /* Retry */
+            }
+            return i;
+        }
+        if (rc != EBUSY) {
+            errno = rc;
+            return -2;
+        }
+    }
+    return -1;
+}
+
+/* Acquire a slot of the descriptor's control block */
+int robust_acquire_lock(const char *descriptor, int max_holders, double timeout) {
+    struct robust_block *blk;
+    struct robust_slot *slot;
+    struct timeval start_time, now;
+    struct timespec deadline;
+    double elapsed;
+    int wait_ms = INITIAL_WAIT_MS;
+    bool contention_logged = FALSE;
+    int claimed = -1;
+    int rc;
+
+    if (max_holders > ROBUST_SLOTS) {
+        error(E_USAGE, "The robust backend supports at most %d holders", ROBUST_SLOTS);
+        return E_USAGE;
+    }
+
+    blk = open_block(descriptor);
+    if (!blk) {
+        return E_SYSTEM;
+    }
+
+    gettimeofday(&start_time, NULL);
+    if (timeout > 0) {
+        double end = start_time.tv_sec + start_time.tv_usec / 1000000.0 + timeout;
+        deadline.tv_sec = (time_t)end;
+        deadline.tv_nsec = (long)((end - (double)deadline.tv_sec) * 1000000000.0);
+    }
+
+    while (claimed < 0) {
+        /* Check timeout at start of each iteration, as the file backend does */
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - start_time.tv_sec) +
+                 (now.tv_usec - start_time.tv_usec) / 1000000.0;
+        if (timeout >= 0 && elapsed >= timeout) {
+            if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                syslog(LOG_WARNING, "timeout waiting for lock '%s' after %.1f seconds",
+                       descriptor, timeout);
+                closelog();
+#endif
+            }
+            error(E_TIMEOUT, "Timeout waiting for lock '%s' after %.1f seconds", descriptor, timeout);
+            munmap(blk, sizeof(struct robust_block));
+            return E_TIMEOUT;
+        }
+
+        claimed = claim_slot(blk, max_holders);
+        if (claimed >= 0) {
+            break;
+        }
+        if (claimed == -2) {
+            break;
+        }
+
+        debug("All %d slots are currently in use", max_holders);
+        if (timeout <= 0) {
+            /* Fail fast if no timeout, as the file backend does */
+            munmap(blk, sizeof(struct robust_block));
+            return E_BUSY;
+        }
+
+        if (g_state.should_exit) {
+            munmap(blk, sizeof(struct robust_block));
+            return E_SYSTEM;
+        }
+
+        if (!contention_logged) {
+            contention_logged = TRUE;
+            if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                syslog(LOG_INFO, "lock contention for '%s' (waiting)", descriptor);
+                closelog();
+#endif
+            }
+        }
+
+        if (max_holders == 1) {
+            /* A mutex waits on its slot: the holder's unlock or death
+             * wakes exactly one waiter */
+            bool recovered;
+            rc = lock_robust(&blk->slots[0].lock, &deadline, FALSE, &recovered);
+            if (rc == 0) {
+                if (recovered) {
+                    slot_recovered(blk, 0);
+                }
+                claimed = 0;
+            } else if (rc != ETIMEDOUT && rc != EINTR) {
+                errno = rc;
+                claimed = -2;
+            }
+        } else {
+            /* Semaphore waiters sleep on the condition variable. Rescanning
+             * under table_lock pairs with unlock_slot(), so no release is
+             * missed; the wait is still bounded by backoff because a holder
+             * that dies signals nobody. */
+            struct timespec wake_at;
+            double wake = now.tv_sec + now.tv_usec / 1000000.0 + wait_ms / 1000.0;
+            double end = deadline.tv_sec + deadline.tv_nsec / 1000000000.0;
+
+            if (wake > end) {
+                wake = end;
+            }
+            wake_at.tv_sec = (time_t)wake;
+            wake_at.tv_nsec = (long)((wake - (double)wake_at.tv_sec) * 1000000000.0);
+
+            lock_robust(&blk->table_lock, NULL, FALSE, NULL);
+            claimed = claim_slot(blk, max_holders);
+            if (claimed == -1) {
+                blk->waiters++;
+                if (pthread_cond_timedwait(&blk->released, &blk->table_lock, &wake_at) == EOWNERDEAD) {
+                    pthread_mutex_consistent(&blk->table_lock);
+                }
+                blk->waiters--;
+            }
+            pthread_mutex_unlock(&blk->table_lock);
+
+            wait_ms = wait_ms * 2;
+            if (wait_ms > MAX_WAIT_MS) wait_ms = MAX_WAIT_MS;
+            wait_ms += rand() % (wait_ms / 10 + 1);
+        }
+        if (claimed == -2) {
+            break;
+        }
+    }
+
+    if (claimed < 0) {
+        error(E_SYSTEM, "Cannot lock slot of '%s': %s", descriptor, strerror(errno));
+        munmap(blk, sizeof(struct robust_block));
+        return E_SYSTEM;
+    }
+
+    slot = &blk->slots[claimed];
+    slot->pid = getpid();
+    slot->ppid = getppid();
+    slot->uid = getuid();
+    slot->max_holders = max_holders;
+    slot->acquired_at = time(NULL);
+
+    held_block = blk;
+    held_slot = claimed;
+    held_since = (time_t)slot->acquired_at;
+    strncpy(held_descriptor, descriptor, sizeof(held_descriptor) - 1);
+    held_descriptor[sizeof(held_descriptor) - 1] = '\0';
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "acquired lock '%s' (slot %d)", descriptor, claimed);
+        closelog();
+#endif
+    }
+    debug("Locked slot %d of '%s' in control block", claimed, descriptor);
+    return E_SUCCESS;
+}
+
+/* Release the held slot. Exiting without this is handled by the kernel,
+ * which marks the slot's mutex as owned by a dead process. */
+void robust_release_lock(void) {
+    struct robust_block *blk = held_block;
+
+    if (!blk) {
+        return;
+    }
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "released lock '%s' after %.0f seconds",
+               held_descriptor, difftime(time(NULL), held_since));
+        closelog();
+#endif
+    }
+
+    debug("Releasing slot %d of '%s'", held_slot, held_descriptor);
+    blk->slots[held_slot].pid = 0;
+    unlock_slot(blk, held_slot);
+    munmap(blk, sizeof(struct robust_block));
+    held_block = NULL;
+    held_slot = -1;
+}
+
+/* Slot held by this process, or -1 */
+int robust_held_slot(void) {
+    return held_block ? held_slot : -1;
+}
+
+/* Check if a slot could be acquired now */
+int robust_check_lock(const char *descriptor) {
+    struct robust_block *blk;
+    bool recovered;
+    int active = 0;
+    int max_holders = 1;  /* Default to mutex behavior */
+    int i;
+
+    blk = open_block(descriptor);
+    if (!blk) {
+        return E_SYSTEM;
+    }
+
+    for (i = 0; i < (int)blk->high_water && i < ROBUST_SLOTS; i++) {
+        int rc = lock_robust(&blk->slots[i].lock, NULL, TRUE, &recovered);
+
+        if (rc == 0) {
+            if (recovered) {
+                slot_recovered(blk, i);
+            }
+            unlock_slot(blk, i);
+        } else if (rc == EBUSY) {
+            active++;
+            /* Use max_holders from any holder */
+            if (blk->slots[i].max_holders > 0) {
+                max_holders = blk->slots[i].max_holders;
+            }
+        }
+    }
+    munmap(blk, sizeof(struct robust_block));
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "check lock '%s': %s (%d/%d holders)",
+               descriptor, (active >= max_holders) ? "busy" : "available",
+               active, max_holders);
+        closelog();
+#endif
+    }
+
+    return (active >= max_holders) ? E_BUSY : E_SUCCESS;
+}
+
+/* Signal every holder of the descriptor to release its slot */
+int robust_done_lock(const char *descriptor) {
+    struct robust_block *blk;
+    int found = 0;
+    int released = 0;
+    int i;
+
+    blk = open_block(descriptor);
+    if (!blk) {
+        return E_SYSTEM;
+    }
+
+    for (i = 0; i < (int)blk->high_water && i < ROBUST_SLOTS; i++) {
+        pid_t pid = blk->slots[i].pid;
+        int rc = lock_robust(&blk->slots[i].lock, NULL, TRUE, NULL);
+
+        if (rc == 0) {
+            unlock_slot(blk, i);
+            continue;
+        }
+        if (rc != EBUSY) {
+            continue;
+        }
+        found++;
+
+        if (pid <= 0) {
+            debug("Slot %d of '%s' is held but has no holder record yet", i, descriptor);
+        } else if (kill(pid, SIGTERM) == 0) {
+            debug("Sent SIGTERM to process %d for lock %s", (int)pid, descriptor);
+            released++;
+            if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                syslog(LOG_INFO, "signaled process %d to release lock '%s'", (int)pid, descriptor);
+                closelog();
+#endif
+            }
+        } else {
+            debug("Failed to send SIGTERM to process %d: %s", (int)pid, strerror(errno));
+        }
+    }
+    munmap(blk, sizeof(struct robust_block));
+
+    if (found == 0) {
+        if (!g_state.quiet) {
+            error(E_NOTFOUND, "No locks found for descriptor '%s'", descriptor);
+        }
+        return E_NOTFOUND;
+    }
+
+    if (released == 0) {
+        if (!g_state.quiet) {
+            error(E_SYSTEM, "Failed to release any locks for descriptor '%s'", descriptor);
+        }
+        return E_SYSTEM;
+    }
+
+    debug("Released %d lock(s) for descriptor '%s'", released, descriptor);
+    return E_SUCCESS;
+}
+
+/* Print the holders recorded in one control block. A record whose mutex
+ * is free was left by a holder that died and is shown as stale. */
+void robust_list_block(const char *path, output_format_t format, bool show_all, bool stale_only) {
+    struct robust_block *blk;
+    struct lock_info info;
+    const char *name;
+    size_t name_len;
+    bool writable;
+    int i;
+
+    blk = map_block(path, NULL, FALSE, &writable);
+    if (!blk) {
+        debug("Skipping control block %s: %s", path, strerror(errno));
+        return;
+    }
+
+    /* The descriptor is the file name without the suffix */
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    name_len = strlen(name) - strlen(ROBUST_FILE_SUFFIX);
+
+    for (i = 0; i < (int)blk->high_water && i < ROBUST_SLOTS; i++) {
+        struct robust_slot *slot = &blk->slots[i];
+        char *cmdline;
+        bool is_stale;
+
+        if (slot->pid <= 0) {
+            continue;
+        }
+        if (writable) {
+            int rc = lock_robust(&slot->lock, NULL, TRUE, NULL);
+            is_stale = (rc == 0);
+            if (rc == 0) {
+                unlock_slot(blk, i);
+            }
+        } else {
+            /* Without write access the mutex cannot be probed */
+            is_stale = !process_exists(slot->pid);
+        }
+
+        memset(&info, 0, sizeof(info));
+        info.magic = LOCK_MAGIC;
+        info.pid = slot->pid;
+        info.ppid = slot->ppid;
+        info.uid = slot->uid;
+        info.acquired_at = (time_t)slot->acquired_at;
+        info.max_holders = slot->max_holders;
+        info.lock_type = (info.max_holders > 1) ? 1 : 0;
+        info.slot = i;
+        safe_snprintf(info.descriptor, sizeof(info.descriptor), "%.*s", (int)name_len, name);
+        cmdline = is_stale ? NULL : get_process_cmdline(info.pid);
+        if (cmdline) {
+            strncpy(info.cmdline, cmdline, sizeof(info.cmdline) - 1);
+        }
+
+        print_lock_info(&info, is_stale, format, show_all, stale_only);
+    }
+    munmap(blk, sizeof(struct robust_block));
+}
+
+#else /* !HAVE_ROBUST_BACKEND */
+
+int robust_acquire_lock(const char *descriptor, int max_holders, double timeout) {
+    error(E_USAGE, "The robust backend is not supported on this platform");
+    return E_USAGE;
+}
+
+void robust_release_lock(void) {
+}
+
+int robust_held_slot(void) {
+    return -1;
+}
+
+int robust_check_lock(const char *descriptor) {
+    error(E_USAGE, "The robust backend is not supported on this platform");
+    return E_USAGE;
+}
+
+int robust_done_lock(const char *descriptor) {
+    error(E_USAGE, "The robust backend is not supported on this platform");
+    return E_USAGE;
+}
+
+void robust_list_block(const char *path, output_format_t format, bool show_all, bool stale_only) {
+}
+
+#endif /* HAVE_ROBUST_BACKEND */
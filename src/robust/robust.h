@@ -0,0 +1,60 @@
+#ifndef WAITLOCK_ROBUST_H
+#define WAITLOCK_ROBUST_H
+
+#include "../waitlock.h"
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_MUTEX_CONSISTENT) && \
+    defined(HAVE_PTHREAD_MUTEXATTR_SETROBUST) && defined(HAVE_PTHREAD_MUTEX_TIMEDLOCK) && \
+    defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_SYNC_BUILTINS)
+  #define HAVE_ROBUST_BACKEND 1
+  #include <pthread.h>
+  #include <sys/mman.h>
+#endif
+
+/* Control block file, one per descriptor: <lockdir>/<descriptor>.mtx */
+#define ROBUST_FILE_SUFFIX    ".mtx"
+#define ROBUST_BLOCK_MAGIC    0x57415201  /* "WAR" + control block version 1 */
+#define ROBUST_SLOTS          1024
+#define ROBUST_INIT_WAIT_MS   1000        /* How long to wait for another creator */
+
+#ifdef HAVE_ROBUST_BACKEND
+
+/* Slot. Holding the slot means holding its robust mutex, so when a holder
+ * dies the kernel hands the next locker EOWNERDEAD instead of anyone having
+ * to check whether the recorded pid still exists. */
+struct robust_slot {
+    pthread_mutex_t lock;
+    int32_t pid;            /* 0 = never held or released */
+    int32_t ppid;
+    uint32_t uid;
+    uint16_t max_holders;
+    uint16_t reserved;
+    int64_t acquired_at;
+};
+
+/* Control block. The magic is written last by the creator, after every
+ * mutex and the condition variable are initialised; the object sizes are
+ * recorded so a build with a different pthread ABI refuses the file. */
+struct robust_block {
+    uint32_t magic;
+    uint16_t mutex_size;
+    uint16_t cond_size;
+    uint32_t high_water;    /* One past the highest slot ever claimed */
+    uint32_t waiters;       /* Semaphore waiters blocked on 'released' */
+    pthread_mutex_t table_lock;  /* Guards 'released'; robust as well */
+    pthread_cond_t released;     /* Signalled once per semaphore release */
+    struct robust_slot slots[ROBUST_SLOTS];
+};
+
+#endif /* HAVE_ROBUST_BACKEND */
+
+/* Robust process-shared mutex backend */
+int robust_acquire_lock(const char *descriptor, int max_holders, double timeout);
+void robust_release_lock(void);
+int robust_held_slot(void);
+int robust_check_lock(const char *descriptor);
+int robust_done_lock(const char *descriptor);
+bool robust_is_block_name(const char *name);
+void robust_list_block(const char *path, output_format_t format, bool show_all, bool stale_only);
+
+#endif /* WAITLOCK_ROBUST_H */
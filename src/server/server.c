@@ -0,0 +1,235 @@
+/*
+ * Coprocess mode (waitlock --server). One long-lived process takes and
+ * releases any number of locks on request, so lock directory discovery,
+ * hostname and cmdline lookup happen once instead of once per lock.
+ */
+
+#include "server.h"
+#include "../core/core.h"
+#include "../lib/libwaitlock.h"
+
+/* A lock held on behalf of the coprocess' user */
+struct server_lock {
+    char descriptor[MAX_DESC_LEN + 1];
+    wl_handle handle;
+};
+
+struct server_state {
+    wl_ctx *ctx;
+    FILE *out;
+    struct server_lock *held;
+    int held_count;
+    int held_size;
+};
+
+static void reply(struct server_state *s, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    vfprintf(s->out, fmt, args);
+    va_end(args);
+    fputc('\n', s->out);
+}
+
+static int cmd_acquire(struct server_state *s, char **argv, int argc) {
+    int max_holders = 1;
+    /* Waiting blocks every other command, so without -t only a bounded
+     * server --timeout may wait; otherwise a busy lock is BUSY at once */
+    double timeout = (opts.timeout > 0) ? opts.timeout : 0;
+    struct server_lock *lock;
+    char *end;
+    int rc;
+    int i;
+
+    if (argc < 2 || !valid_descriptor(argv[1])) {
+        reply(s, "ERROR usage: ACQUIRE <descriptor> [-m N] [-t SECS]");
+        return 0;
+    }
+    for (i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            max_holders = (int)strtol(argv[++i], &end, 10);
+            if (*end || max_holders < 1 || max_holders > 65535) {
+                reply(s, "ERROR invalid holder count: %s", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            timeout = strtod(argv[++i], &end);
+            if (*end) {
+                reply(s, "ERROR invalid timeout: %s", argv[i]);
+                return 0;
+            }
+        } else {
+            reply(s, "ERROR unknown option: %s", argv[i]);
+            return 0;
+        }
+    }
+
+    if (s->held_count == s->held_size) {
+        int size = s->held_size ? s->held_size * 2 : 8;
+        struct server_lock *held = realloc(s->held, size * sizeof(*held));
+        if (!held) {
+            reply(s, "ERROR out of memory");
+            return 0;
+        }
+        s->held = held;
+        s->held_size = size;
+    }
+
+    lock = &s->held[s->held_count];
+    rc = wl_acquire(s->ctx, argv[1], max_holders, timeout, &lock->handle);
+    if (rc == WL_OK) {
+        safe_snprintf(lock->descriptor, sizeof(lock->descriptor), "%s", argv[1]);
+        s->held_count++;
+        reply(s, "OK %d", lock->handle.slot);
+    } else if (rc == WL_BUSY) {
+        reply(s, "BUSY");
+    } else if (rc == WL_TIMEOUT) {
+        reply(s, "TIMEOUT");
+    } else {
+        reply(s, "ERROR cannot acquire %s: %s", argv[1], strerror(errno));
+    }
+    return 0;
+}
+
+/* Release the most recently acquired hold of the descriptor */
+static int cmd_release(struct server_state *s, char **argv, int argc) {
+    int i;
+
+    if (argc != 2) {
+        reply(s, "ERROR usage: RELEASE <descriptor>");
+        return 0;
+    }
+    for (i = s->held_count - 1; i >= 0; i--) {
+        if (strcmp(s->held[i].descriptor, argv[1]) == 0) {
+            wl_release(s->ctx, &s->held[i].handle);
+            s->held_count--;
+            memmove(&s->held[i], &s->held[i + 1], (s->held_count - i) * sizeof(*s->held));
+            reply(s, "OK");
+            return 0;
+        }
+    }
+    reply(s, "ERROR not held: %s", argv[1]);
+    return 0;
+}
+
+static int cmd_check(struct server_state *s, char **argv, int argc) {
+    int rc;
+
+    if (argc != 2 || !valid_descriptor(argv[1])) {
+        reply(s, "ERROR usage: CHECK <descriptor>");
+        return 0;
+    }
+    rc = wl_check(s->ctx, argv[1]);
+    if (rc == WL_OK) {
+        reply(s, "AVAILABLE");
+    } else if (rc == WL_BUSY) {
+        reply(s, "BUSY");
+    } else {
+        reply(s, "ERROR cannot check %s: %s", argv[1], strerror(errno));
+    }
+    return 0;
+}
+
+static int cmd_list(struct server_state *s, char **argv, int argc) {
+    wl_iter *it;
+    wl_info info;
+
+    (void)argv;
+    if (argc != 1) {
+        reply(s, "ERROR usage: LIST");
+        return 0;
+    }
+    it = wl_list(s->ctx);
+    if (!it) {
+        reply(s, "ERROR cannot read lock directory: %s", strerror(errno));
+        return 0;
+    }
+    while (wl_list_next(it, &info)) {
+        if (!info.stale) {
+            reply(s, "HOLDER %s %d %d %d", info.descriptor, info.slot, info.max_holders,
+                  (int)info.pid);
+        }
+    }
+    wl_list_end(it);
+    reply(s, "END");
+    return 0;
+}
+
+/* Run one command line. Returns 1 when the server should exit. */
+static int run_command(struct server_state *s, char *line) {
+    char *argv[16];
+    int argc = 0;
+    char *save = NULL;
+    char *tok;
+
+    for (tok = strtok_r(line, " \t\r\n", &save); tok && argc < 16;
+         tok = strtok_r(NULL, " \t\r\n", &save)) {
+        argv[argc++] = tok;
+    }
+    if (argc == 0) {
+        return 0;
+    }
+
+    if (strcasecmp_compat(argv[0], "ACQUIRE") == 0) {
+        return cmd_acquire(s, argv, argc);
+    }
+    if (strcasecmp_compat(argv[0], "RELEASE") == 0) {
+        return cmd_release(s, argv, argc);
+    }
+    if (strcasecmp_compat(argv[0], "CHECK") == 0) {
+        return cmd_check(s, argv, argc);
+    }
+    if (strcasecmp_compat(argv[0], "LIST") == 0) {
+        return cmd_list(s, argv, argc);
+    }
+    if (strcasecmp_compat(argv[0], "QUIT") == 0) {
+        reply(s, "OK");
+        return 1;
+    }
+    reply(s, "ERROR unknown command: %s", argv[0]);
+    return 0;
+}
+
+/* Serve commands from in until QUIT or end of input, then release every
+ * lock still held */
+int run_server(FILE *in, FILE *out) {
+    struct server_state s;
+    char line[SERVER_LINE_MAX];
+    int i;
+
+    if (opts.backend != BACKEND_FILE || opts.socket_path) {
+        error(E_USAGE, "--server supports the file backend only (no --backend or waitlockd socket)");
+        return E_USAGE;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.out = out;
+    s.ctx = wl_open(opts.lock_dir);
+    if (!s.ctx) {
+        error(E_NODIR, "Cannot find or create lock directory");
+        return E_NODIR;
+    }
+    debug("Serving lock commands in %s", wl_dir(s.ctx));
+
+    while (!g_state.should_exit && fgets(line, sizeof(line), in)) {
+        size_t len = strlen(line);
+
+        if (len == sizeof(line) - 1 && line[len - 1] != '\n') {
+            int c;
+            while ((c = fgetc(in)) != EOF && c != '\n') {
+            }
+            reply(&s, "ERROR line too long");
+        } else if (run_command(&s, line)) {
+            fflush(out);
+            break;
+        }
+        fflush(out);
+    }
+
+    for (i = 0; i < s.held_count; i++) {
+        wl_release(s.ctx, &s.held[i].handle);
+    }
+    free(s.held);
+    wl_close(s.ctx);
+    return E_SUCCESS;
+}
@@ -0,0 +1,22 @@
+#ifndef WAITLOCK_SERVER_H
+#define WAITLOCK_SERVER_H
+
+#include "../waitlock.h"
+
+#define SERVER_LINE_MAX  1024
+
+/* Coprocess protocol: one command per line on input, one reply per line
+ * on output (LIST ends with END). Locks are held by the server process and
+ * die with it.
+ *
+ *   ACQUIRE <descriptor> [-m N] [-t SECS]  -> OK <slot> | BUSY | TIMEOUT
+ *   RELEASE <descriptor>                   -> OK
+ *   CHECK <descriptor>                     -> AVAILABLE | BUSY
+ *   LIST                                   -> HOLDER <descriptor> <slot>
+ *                                                 <max_holders> <pid> ... END
+ *   QUIT                                   -> OK, then exit
+ *   anything malformed                     -> ERROR <message>
+ */
+int run_server(FILE *in, FILE *out);
+
+#endif /* WAITLOCK_SERVER_H */
@@ -0,0 +1,598 @@
+/*
+ * Shared memory slot table backend - one mmap'd table of slots per
+ * descriptor, claimed and released with compare-and-swap
+ */
+
+#include "shm.h"
+#include "../core/core.h"
+#include "../lock/lock.h"
+#include "../process/process.h"
+
+#ifdef HAVE_SHM_BACKEND
+
+#if defined(__linux__) && defined(HAVE_LINUX_FUTEX_H)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#define SHM_USE_FUTEX 1
+#endif
+
+#define SHM_TABLE_SIZE (sizeof(struct shm_table_header) + \
+                        SHM_TABLE_SLOTS * sizeof(struct shm_slot))
+
+/* Slot held by this process; also read by the signal handler */
+static struct shm_table_header *volatile held_table = NULL;
+static volatile int held_slot = -1;
+static uint64_t held_owner = 0;
+static char held_descriptor[MAX_DESC_LEN + 1];
+
+static struct shm_slot *table_slots(struct shm_table_header *hdr) {
+    return (struct shm_slot *)(hdr + 1);
+}
+
+/* Owner word for a process: pid in the high half, start time in the low half */
+static uint64_t owner_word(pid_t pid) {
+    return ((uint64_t)(uint32_t)pid << 32) | (uint32_t)get_process_start_time(pid);
+}
+
+static pid_t owner_pid(uint64_t owner) {
+    return (pid_t)(owner >> 32);
+}
+
+/* Check the owner is still running and its pid has not been reused */
+static bool owner_alive(uint64_t owner) {
+    uint32_t start = (uint32_t)owner;
+    uint32_t current;
+
+    if (!process_exists(owner_pid(owner))) {
+        return FALSE;
+    }
+    if (start == 0) {
+        return TRUE;  /* Start time unknown when the slot was claimed */
+    }
+    current = (uint32_t)get_process_start_time(owner_pid(owner));
+    return current == 0 || current == start;
+}
+
+/* Check if a directory entry name is a slot table */
+bool shm_is_table_name(const char *name) {
+    size_t len = strlen(name);
+    size_t suffix_len = strlen(SHM_TABLE_SUFFIX);
+
+    return len > suffix_len && strcmp(name + len - suffix_len, SHM_TABLE_SUFFIX) == 0;
+}
+
+/* Map a slot table read-write, creating it if needed, or read-only for listing.
+ * Returns NULL with errno set; EINVAL means the file is not a table we know. */
+static struct shm_table_header *map_table(const char *path, const char *lock_dir, bool writable) {
+    struct shm_table_header *hdr;
+    struct stat st;
+    int fd;
+
+    if (writable) {
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (fd >= 0) {
+            /* New table: share it the way the lock directory is shared */
+            struct stat dir_st;
+            if (stat(lock_dir, &dir_st) == 0) {
+                fchmod(fd, dir_st.st_mode & 0666);
+            }
+        } else if (errno == EEXIST) {
+            fd = open(path, O_RDWR);
+        }
+    } else {
+        fd = open(path, O_RDONLY);
+    }
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size < (off_t)SHM_TABLE_SIZE && writable) {
+        /* Sizing is idempotent, so racing creators all agree */
+        if (ftruncate(fd, SHM_TABLE_SIZE) != 0 || fstat(fd, &st) != 0) {
+            close(fd);
+            return NULL;
+        }
+    }
+    if (st.st_size != (off_t)SHM_TABLE_SIZE) {
+        close(fd);
+        errno = (st.st_size == 0) ? ENOENT : EINVAL;
+        return NULL;
+    }
+
+    hdr = mmap(NULL, SHM_TABLE_SIZE, writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+               MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (writable) {
+        __sync_bool_compare_and_swap(&hdr->magic, 0, SHM_TABLE_MAGIC);
+    }
+    if (hdr->magic != SHM_TABLE_MAGIC && (writable || hdr->magic != 0)) {
+        munmap(hdr, SHM_TABLE_SIZE);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return hdr;
+}
+
+/* Map the table for a descriptor, reporting failures */
+static struct shm_table_header *open_table(const char *descriptor) {
+    char *lock_dir;
+    char path[PATH_MAX];
+    struct shm_table_header *hdr;
+
+    lock_dir = find_lock_directory();
+    if (!lock_dir) {
+        error(E_NODIR, "Cannot find or create lock directory");
+        return NULL;
+    }
+
+    safe_snprintf(path, sizeof(path), "%s/%s%s", lock_dir, descriptor, SHM_TABLE_SUFFIX);
+    hdr = map_table(path, lock_dir, TRUE);
+    if (!hdr) {
+        if (errno == EINVAL) {
+            error(E_SYSTEM, "Slot table %s has an unsupported format", path);
+        } else {
+            error(E_SYSTEM, "Cannot open slot table %s: %s", path, strerror(errno));
+        }
+    }
+    return hdr;
+}
+
+/* Wake processes waiting on the table after a slot was freed */
+static void notify_release(struct shm_table_header *hdr) {
+    __sync_fetch_and_add(&hdr->release_seq, 1);
+    if (hdr->waiters > 0) {
+#ifdef SHM_USE_FUTEX
+        syscall(SYS_futex, &hdr->release_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+    }
+}
+
+/* Wait until a slot is released or wait_ms passes */
+static void wait_for_slot_release(struct shm_table_header *hdr, uint32_t seen_seq, int wait_ms) {
+#ifdef SHM_USE_FUTEX
+    struct timespec ts;
+
+    ts.tv_sec = wait_ms / 1000;
+    ts.tv_nsec = (long)(wait_ms % 1000) * 1000000L;
+    syscall(SYS_futex, &hdr->release_seq, FUTEX_WAIT, seen_seq, &ts, NULL, 0);
+#else
+    (void)hdr;
+    (void)seen_seq;
+    usleep(wait_ms * 1000);
+#endif
+}
+
+/* Claim a free slot below max_holders, unless the table already has
+ * max_holders owners. Only memory operations; returns the slot or -1. */
+static int claim_slot(struct shm_table_header *hdr, int max_holders, uint64_t me) {
+    struct shm_slot *slots = table_slots(hdr);
+    uint32_t high_water = hdr->high_water;
+    int occupied = 0;
+    int i;
+
+    for (i = 0; i < (int)high_water && i < SHM_TABLE_SLOTS; i++) {
+        if (slots[i].owner != 0) {
+            occupied++;
+        }
+    }
+    if (occupied >= max_holders) {
+        return -1;
+    }
+
+    for (i = 0; i < max_holders; i++) {
+        if (slots[i].owner == 0 && __sync_bool_compare_and_swap(&slots[i].owner, 0, me)) {
+            /* Raise the high water mark so counting scans cover this slot */
+            while ((high_water = hdr->high_water) < (uint32_t)i + 1 &&
+                   !__sync_bool_compare_and_swap(&hdr->high_water, high_water, (uint32_t)i + 1)) {
+                /* Retry */
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Free slots whose owner is gone. Returns the number reclaimed. */
+static int reap_stale_slots(struct shm_table_header *hdr) {
+    struct shm_slot *slots = table_slots(hdr);
+    uint32_t high_water = hdr->high_water;
+    int reaped = 0;
+    int i;
+
+    for (i = 0; i < (int)high_water && i < SHM_TABLE_SLOTS; i++) {
+        uint64_t owner = slots[i].owner;
+
+        if (owner != 0 && !owner_alive(owner) &&
+            __sync_bool_compare_and_swap(&slots[i].owner, owner, 0)) {
+            debug("Reclaimed slot %d from dead process %d", i, (int)owner_pid(owner));
+            reaped++;
+        }
+    }
+    if (reaped > 0) {
+        notify_release(hdr);
+    }
+    return reaped;
+}
+
+/* Acquire a slot from the descriptor's shared table */
+int shm_acquire_lock(const char *descriptor, int max_holders, double timeout) {
+    struct shm_table_header *hdr;
+    struct shm_slot *slot;
+    struct timeval start_time, now;
+    double elapsed;
+    int wait_ms = INITIAL_WAIT_MS;
+    bool contention_logged = FALSE;
+    bool waiting = FALSE;
+    uint64_t me;
+    int claimed;
+
+    if (max_holders > SHM_TABLE_SLOTS) {
+        error(E_USAGE, "The shm backend supports at most %d holders", SHM_TABLE_SLOTS);
+        return E_USAGE;
+    }
+
+    hdr = open_table(descriptor);
+    if (!hdr) {
+        return E_SYSTEM;
+    }
+
+    me = owner_word(getpid());
+    gettimeofday(&start_time, NULL);
+
+    while (1) {
+        uint32_t seen_seq = hdr->release_seq;
+
+        /* Check timeout at start of each iteration, as the file backend does */
+        if (timeout >= 0) {
+            gettimeofday(&now, NULL);
+            elapsed = (now.tv_sec - start_time.tv_sec) +
+                     (now.tv_usec - start_time.tv_usec) / 1000000.0;
+            if (elapsed >= timeout) {
+                if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                    openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                    syslog(LOG_WARNING, "timeout waiting for lock '%s' after %.1f seconds",
+                           descriptor, timeout);
+                    closelog();
+#endif
+                }
+                error(E_TIMEOUT, "Timeout waiting for lock '%s' after %.1f seconds", descriptor, timeout);
+                break;
+            }
+        }
+
+        claimed = claim_slot(hdr, max_holders, me);
+        if (claimed < 0 && reap_stale_slots(hdr) > 0) {
+            claimed = claim_slot(hdr, max_holders, me);
+        }
+
+        if (claimed >= 0) {
+            slot = &table_slots(hdr)[claimed];
+            slot->acquired_at = time(NULL);
+            slot->uid = getuid();
+            slot->ppid = getppid();
+            slot->max_holders = max_holders;
+
+            if (waiting) {
+                __sync_fetch_and_sub(&hdr->waiters, 1);
+            }
+            held_owner = me;
+            strncpy(held_descriptor, descriptor, sizeof(held_descriptor) - 1);
+            held_descriptor[sizeof(held_descriptor) - 1] = '\0';
+            held_slot = claimed;
+            held_table = hdr;
+
+            if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                syslog(LOG_INFO, "acquired lock '%s' (slot %d)", descriptor, claimed);
+                closelog();
+#endif
+            }
+            debug("Claimed slot %d of '%s' in shared table", claimed, descriptor);
+            return E_SUCCESS;
+        }
+
+        debug("All %d slots are currently in use", max_holders);
+        if (timeout <= 0) {
+            /* Fail fast if no timeout, as the file backend does */
+            if (waiting) {
+                __sync_fetch_and_sub(&hdr->waiters, 1);
+            }
+            munmap(hdr, SHM_TABLE_SIZE);
+            return E_BUSY;
+        }
+
+        if (g_state.should_exit) {
+            break;
+        }
+
+        if (!contention_logged) {
+            contention_logged = TRUE;
+            if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                syslog(LOG_INFO, "lock contention for '%s' (waiting)", descriptor);
+                closelog();
+#endif
+            }
+        }
+
+        /* Register as a waiter and rescan before sleeping, so a release
+         * that happened before registration is not missed */
+        if (!waiting) {
+            waiting = TRUE;
+            __sync_fetch_and_add(&hdr->waiters, 1);
+            continue;
+        }
+
+        /* Wait for a release, with exponential backoff as the upper bound
+         * so slots of holders that died are still reclaimed */
+        int sleep_ms = wait_ms;
+        if (timeout >= 0) {
+            gettimeofday(&now, NULL);
+            elapsed = (now.tv_sec - start_time.tv_sec) +
+                     (now.tv_usec - start_time.tv_usec) / 1000000.0;
+            int max_sleep_ms = (int)((timeout - elapsed) * 1000 * TIMEOUT_FACTOR);
+            if (max_sleep_ms < sleep_ms) {
+                sleep_ms = max_sleep_ms;
+            }
+            if (sleep_ms < 1) sleep_ms = 1;
+        }
+        wait_for_slot_release(hdr, seen_seq, sleep_ms);
+
+        wait_ms = wait_ms * 2;
+        if (wait_ms > MAX_WAIT_MS) wait_ms = MAX_WAIT_MS;
+        wait_ms += rand() % (wait_ms / 10 + 1);
+    }
+
+    if (waiting) {
+        __sync_fetch_and_sub(&hdr->waiters, 1);
+    }
+    munmap(hdr, SHM_TABLE_SIZE);
+    return g_state.should_exit ? E_SYSTEM : E_TIMEOUT;
+}
+
+/* Free the held slot - only atomic operations and a syscall, so it is
+ * safe to call from the signal handler */
+void shm_release_on_signal(void) {
+    struct shm_table_header *hdr = held_table;
+    int slot = held_slot;
+
+    if (!hdr || slot < 0) {
+        return;
+    }
+    held_table = NULL;
+    held_slot = -1;
+
+    /* Fails harmlessly in a forked child, which does not own the slot */
+    if (__sync_bool_compare_and_swap(&table_slots(hdr)[slot].owner, held_owner, 0)) {
+        notify_release(hdr);
+    }
+}
+
+/* Release the held slot */
+void shm_release_lock(void) {
+    struct shm_table_header *hdr = held_table;
+
+    if (!hdr) {
+        return;
+    }
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        struct shm_slot *slot = &table_slots(hdr)[held_slot];
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "released lock '%s' after %.0f seconds",
+               held_descriptor, difftime(time(NULL), (time_t)slot->acquired_at));
+        closelog();
+#endif
+    }
+
+    debug("Releasing slot %d of '%s'", held_slot, held_descriptor);
+    shm_release_on_signal();
+    munmap(hdr, SHM_TABLE_SIZE);
+}
+
+/* Slot held by this process, or -1 */
+int shm_held_slot(void) {
+    return held_table ? held_slot : -1;
+}
+
+/* Check if a slot could be acquired now */
+int shm_check_lock(const char *descriptor) {
+    struct shm_table_header *hdr;
+    struct shm_slot *slots;
+    int active = 0;
+    int max_holders = 1;  /* Default to mutex behavior */
+    int i;
+
+    hdr = open_table(descriptor);
+    if (!hdr) {
+        return E_SYSTEM;
+    }
+
+    reap_stale_slots(hdr);
+    slots = table_slots(hdr);
+    for (i = 0; i < (int)hdr->high_water && i < SHM_TABLE_SLOTS; i++) {
+        if (slots[i].owner != 0) {
+            active++;
+            /* Use max_holders from any holder */
+            if (slots[i].max_holders > 0) {
+                max_holders = slots[i].max_holders;
+            }
+        }
+    }
+    munmap(hdr, SHM_TABLE_SIZE);
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "check lock '%s': %s (%d/%d holders)",
+               descriptor, (active >= max_holders) ? "busy" : "available",
+               active, max_holders);
+        closelog();
+#endif
+    }
+
+    return (active >= max_holders) ? E_BUSY : E_SUCCESS;
+}
+
+/* Signal every holder of the descriptor to release its slot */
+int shm_done_lock(const char *descriptor) {
+    struct shm_table_header *hdr;
+    struct shm_slot *slots;
+    int found = 0;
+    int released = 0;
+    int i;
+
+    hdr = open_table(descriptor);
+    if (!hdr) {
+        return E_SYSTEM;
+    }
+
+    slots = table_slots(hdr);
+    for (i = 0; i < (int)hdr->high_water && i < SHM_TABLE_SLOTS; i++) {
+        uint64_t owner = slots[i].owner;
+        pid_t pid = owner_pid(owner);
+
+        if (owner == 0) {
+            continue;
+        }
+        found++;
+
+        if (owner_alive(owner) && kill(pid, SIGTERM) == 0) {
+            debug("Sent SIGTERM to process %d for lock %s", (int)pid, descriptor);
+            released++;
+            if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                syslog(LOG_INFO, "signaled process %d to release lock '%s'", (int)pid, descriptor);
+                closelog();
+#endif
+            }
+        } else if (!owner_alive(owner)) {
+            debug("Process %d no longer exists, freeing its slot", (int)pid);
+            if (__sync_bool_compare_and_swap(&slots[i].owner, owner, 0)) {
+                notify_release(hdr);
+            }
+            released++;
+        } else {
+            debug("Failed to send SIGTERM to process %d: %s", (int)pid, strerror(errno));
+        }
+    }
+    munmap(hdr, SHM_TABLE_SIZE);
+
+    if (found == 0) {
+        if (!g_state.quiet) {
+            error(E_NOTFOUND, "No locks found for descriptor '%s'", descriptor);
+        }
+        return E_NOTFOUND;
+    }
+
+    if (released == 0) {
+        if (!g_state.quiet) {
+            error(E_SYSTEM, "Failed to release any locks for descriptor '%s'", descriptor);
+        }
+        return E_SYSTEM;
+    }
+
+    debug("Released %d lock(s) for descriptor '%s'", released, descriptor);
+    return E_SUCCESS;
+}
+
+/* Print the holders recorded in one slot table */
+void shm_list_table(const char *path, output_format_t format, bool show_all, bool stale_only) {
+    struct shm_table_header *hdr;
+    struct shm_slot *slots;
+    struct lock_info info;
+    const char *name;
+    size_t name_len;
+    int i;
+
+    hdr = map_table(path, NULL, FALSE);
+    if (!hdr) {
+        debug("Skipping slot table %s: %s", path, strerror(errno));
+        return;
+    }
+
+    /* The descriptor is the file name without the table suffix */
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    name_len = strlen(name) - strlen(SHM_TABLE_SUFFIX);
+
+    slots = table_slots(hdr);
+    for (i = 0; i < (int)hdr->high_water && i < SHM_TABLE_SLOTS; i++) {
+        uint64_t owner = slots[i].owner;
+        char *cmdline;
+        bool is_stale;
+
+        if (owner == 0) {
+            continue;
+        }
+        is_stale = !owner_alive(owner);
+
+        memset(&info, 0, sizeof(info));
+        info.magic = LOCK_MAGIC;
+        info.pid = owner_pid(owner);
+        info.ppid = slots[i].ppid;
+        info.uid = slots[i].uid;
+        info.acquired_at = (time_t)slots[i].acquired_at;
+        info.max_holders = slots[i].max_holders;
+        info.lock_type = (info.max_holders > 1) ? 1 : 0;
+        info.slot = i;
+        safe_snprintf(info.descriptor, sizeof(info.descriptor), "%.*s", (int)name_len, name);
+        cmdline = is_stale ? NULL : get_process_cmdline(info.pid);
+        if (cmdline) {
+            strncpy(info.cmdline, cmdline, sizeof(info.cmdline) - 1);
+        }
+
+        print_lock_info(&info, is_stale, format, show_all, stale_only);
+    }
+    munmap(hdr, SHM_TABLE_SIZE);
+}
+
+#else /* !HAVE_SHM_BACKEND */
+
+int shm_acquire_lock(const char *descriptor, int max_holders, double timeout) {
+    error(E_USAGE, "The shm backend is not supported on this platform");
+    return E_USAGE;
+}
+
+void shm_release_lock(void) {
+}
+
+void shm_release_on_signal(void) {
+}
+
+int shm_held_slot(void) {
+    return -1;
+}
+
+int shm_check_lock(const char *descriptor) {
+    error(E_USAGE, "The shm backend is not supported on this platform");
+    return E_USAGE;
+}
+
+int shm_done_lock(const char *descriptor) {
+    error(E_USAGE, "The shm backend is not supported on this platform");
+    return E_USAGE;
+}
+
+bool shm_is_table_name(const char *name) {
+    return FALSE;
+}
+
+void shm_list_table(const char *path, output_format_t format, bool show_all, bool stale_only) {
+}
+
+#endif /* HAVE_SHM_BACKEND */
@@ -0,0 +1,49 @@
+#ifndef WAITLOCK_SHM_H
+#define WAITLOCK_SHM_H
+
+#include "../waitlock.h"
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_SYNC_BUILTINS)
+  #define HAVE_SHM_BACKEND 1
+  #include <sys/mman.h>
+#endif
+
+/* Slot table file, one per descriptor: <lockdir>/<descriptor>.shm */
+#define SHM_TABLE_SUFFIX  ".shm"
+#define SHM_TABLE_MAGIC   0x57415301  /* "WAS" + table format version 1 */
+#define SHM_TABLE_SLOTS   1024
+
+/* Table header. The magic is set once with CAS after the file is sized and
+ * the slot count is implied by the file size, so tables need no locking to
+ * initialise. */
+struct shm_table_header {
+    uint32_t magic;
+    uint32_t high_water;    /* One past the highest slot ever claimed */
+    uint32_t waiters;       /* Processes blocked waiting for a release */
+    uint32_t release_seq;   /* Bumped on every release; futex word on Linux */
+    uint32_t reserved[4];
+};
+
+/* Slot record. The owner word packs the holder's pid (high 32 bits) with the
+ * low 32 bits of its start time, so claiming, releasing and reclaiming a slot
+ * from a dead or recycled pid are each a single compare-and-swap. */
+struct shm_slot {
+    uint64_t owner;         /* 0 = free */
+    int64_t acquired_at;
+    uint32_t uid;
+    uint32_t ppid;
+    uint16_t max_holders;
+    uint16_t reserved[3];
+};
+
+/* Shared memory slot table backend */
+int shm_acquire_lock(const char *descriptor, int max_holders, double timeout);
+void shm_release_lock(void);
+void shm_release_on_signal(void);
+int shm_held_slot(void);
+int shm_check_lock(const char *descriptor);
+int shm_done_lock(const char *descriptor);
+bool shm_is_table_name(const char *name);
+void shm_list_table(const char *path, output_format_t format, bool show_all, bool stale_only);
+
+#endif /* WAITLOCK_SHM_H */
@@ -3,6 +3,7 @@
  */
 
 #include "signal.h"
+#include "../shm/shm.h"
 
 /* Use simple signal() for C89 compatibility */
 #include <signal.h>
@@ -30,6 +31,9 @@ void signal_handler(int sig) {
         g_state.lock_fd = -1;
     }
     
+    /* Free a shared table slot; atomic operations only */
+    shm_release_on_signal();
+    
     /* Mark for cleanup but don't do unsafe operations in signal handler */
     g_state.cleanup_needed = 1;
     
@@ -0,0 +1,445 @@
+/*
+ * System V semaphore backend - the kernel counts holders and restores the
+ * count of a holder that dies (SEM_UNDO); slot numbers and holder records
+ * are kept in a slot file
+ */
+
+#include "sysv.h"
+#include "../core/core.h"
+#include "../lock/lock.h"
+#include "../checksum/checksum.h"
+
+/* Check if a directory entry name is a sysv slot file */
+bool sysv_is_slot_file_name(const char *name) {
+    size_t len = strlen(name);
+    size_t suffix_len = strlen(SYSV_FILE_SUFFIX);
+
+    return len > suffix_len && strcmp(name + len - suffix_len, SYSV_FILE_SUFFIX) == 0;
+}
+
+#ifdef HAVE_SYSV_BACKEND
+
+#ifdef _SEM_SEMUN_UNDEFINED
+union semun {
+    int val;
+    struct semid_ds *buf;
+    unsigned short *array;
+};
+#endif
+
+/* Semaphores of a descriptor's set: the free units, and the number of
+ * units it was created with, which never changes */
+#define SEM_UNITS     0
+#define SEM_CAPACITY  1
+#define SEM_COUNT     2
+
+/* Unit held by this process; the slot file is also g_state.lock_fd */
+static int held_semid = -1;
+static int held_fd = -1;
+static int held_slot = -1;
+static time_t held_since;
+static char held_descriptor[MAX_DESC_LEN + 1];
+
+/* Semaphore key for a descriptor: a hash of its slot file path, so
+ * descriptors in different lock directories do not share a count */
+static key_t semaphore_key(const char *lock_dir, const char *descriptor) {
+    char path[PATH_MAX];
+    uint32_t hash;
+
+    safe_snprintf(path, sizeof(path), "%s/%s%s", lock_dir, descriptor, SYSV_FILE_SUFFIX);
+    hash = calculate_crc32(path, strlen(path)) & 0x7fffffff;
+    return (key_t)(hash ? hash : 1);  /* Never IPC_PRIVATE */
+}
+
+/* Get the descriptor's semaphore set. With create set, a missing set is
+ * created holding max_holders units. Returns the id, or -1; errno is
+ * ENOENT when the set does not exist and create is not set. */
+static int open_semaphore(const char *descriptor, int max_holders, bool create) {
+    char *lock_dir;
+    struct semid_ds ds;
+    union semun arg;
+    key_t key;
+    int semid;
+    int waited;
+
+    lock_dir = find_lock_directory();
+    if (!lock_dir) {
+        error(E_NODIR, "Cannot find or create lock directory");
+        return -1;
+    }
+    key = semaphore_key(lock_dir, descriptor);
+
+    if (create) {
+        struct stat dir_st;
+        int mode = 0666;
+
+        /* Share it the way the lock directory is shared */
+        if (stat(lock_dir, &dir_st) == 0) {
+            mode = dir_st.st_mode & 0666;
+        }
+        semid = semget(key, SEM_COUNT, IPC_CREAT | IPC_EXCL | mode);
+        if (semid >= 0) {
+            /* The first operation sets sem_otime, which tells other
+             * openers that the count is ready */
+            struct sembuf ops[SEM_COUNT];
+            ops[0].sem_num = SEM_UNITS;
+            ops[0].sem_op = (short)max_holders;
+            ops[0].sem_flg = 0;
+            ops[1].sem_num = SEM_CAPACITY;
+            ops[1].sem_op = (short)max_holders;
+            ops[1].sem_flg = 0;
+            if (semop(semid, ops, SEM_COUNT) != 0) {
+                error(E_SYSTEM, "Cannot initialise semaphore for '%s': %s", descriptor, strerror(errno));
+                semctl(semid, 0, IPC_RMID);
+                return -1;
+            }
+            debug("Created semaphore 0x%08x with %d units for '%s'", (unsigned)key, max_holders, descriptor);
+            return semid;
+        }
+        if (errno != EEXIST) {
+            error(E_SYSTEM, "Cannot create semaphore for '%s': %s", descriptor, strerror(errno));
+            return -1;
+        }
+    }
+
+    semid = semget(key, SEM_COUNT, 0);
+    if (semid < 0) {
+        if (errno != ENOENT || create) {
+            error(E_SYSTEM, "Cannot open semaphore for '%s': %s", descriptor, strerror(errno));
+        }
+        return -1;
+    }
+
+    /* Wait for a concurrent creator to set the initial count */
+    arg.buf = &ds;
+    for (waited = 0; ; waited++) {
+        if (semctl(semid, 0, IPC_STAT, arg) != 0) {
+            error(E_SYSTEM, "Cannot stat semaphore for '%s': %s", descriptor, strerror(errno));
+            return -1;
+        }
+        if (ds.sem_otime != 0) {
+            return semid;
+        }
+        if (waited >= SYSV_INIT_WAIT_MS) {
+            error(E_SYSTEM, "Semaphore for '%s' was never initialised", descriptor);
+            return -1;
+        }
+        usleep(1000);
+    }
+}
+
+/* Open the descriptor's semaphore set for taking one of max_holders units,
+ * creating it if needed. A set created with a different number of units
+ * is refused, as its count cannot be changed while it is in use. Returns
+ * E_SUCCESS and sets *semid, or an error code. */
+static int open_counted_semaphore(const char *descriptor, int max_holders, int *semid) {
+    int capacity;
+
+    *semid = open_semaphore(descriptor, max_holders, TRUE);
+    if (*semid < 0) {
+        return E_SYSTEM;
+    }
+    capacity = semctl(*semid, SEM_CAPACITY, GETVAL);
+    if (capacity < 0) {
+        error(E_SYSTEM, "Cannot read semaphore for '%s': %s", descriptor, strerror(errno));
+        return E_SYSTEM;
+    }
+    if (capacity != max_holders) {
+        error(E_USAGE, "Lock '%s' allows %d holder(s) under the sysv backend, not %d; "
+              "use the same -m everywhere, or wait until it is unused and run --check to reset it",
+              descriptor, capacity, max_holders);
+        return E_USAGE;
+    }
+    return E_SUCCESS;
+}
+
+/* Remove the set semid of capacity units if nobody holds a unit: all of
+ * them are taken first, so no holder can slip in before the removal.
+ * Waiters that arrive meanwhile see the set go and create a new one.
+ * Returns TRUE if the set was removed. */
+static bool remove_idle_semaphore(int semid, int capacity) {
+    struct sembuf op;
+
+    op.sem_num = SEM_UNITS;
+    op.sem_op = (short)-capacity;
+    op.sem_flg = IPC_NOWAIT;
+    if (capacity < 1 || semop(semid, &op, 1) != 0) {
+        return FALSE;
+    }
+    if (semctl(semid, 0, IPC_RMID) != 0) {
+        op.sem_op = (short)capacity;
+        op.sem_flg = 0;
+        if (semop(semid, &op, 1) != 0) {
+            debug("Cannot give back semaphore units: %s", strerror(errno));
+        }
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Give back one unit; the SEM_UNDO adjustment cancels out */
+static void post_semaphore(int semid) {
+    struct sembuf op;
+
+    op.sem_num = SEM_UNITS;
+    op.sem_op = 1;
+    op.sem_flg = SEM_UNDO;
+    if (semop(semid, &op, 1) != 0) {
+        debug("Cannot post semaphore: %s", strerror(errno));
+    }
+}
+
+/* Take a unit of the descriptor's semaphore, then a slot number */
+int sysv_acquire_lock(const char *descriptor, int max_holders, double timeout) {
+    struct sembuf op;
+    struct timespec ts;
+    struct timeval start_time, now;
+    double elapsed;
+    double remaining;
+    bool nowait = TRUE;
+    int semid;
+    int slot;
+    int fd;
+    int result;
+
+    if (max_holders > OFD_MAX_SLOTS) {
+        error(E_USAGE, "The sysv backend supports at most %d holders", OFD_MAX_SLOTS);
+        return E_USAGE;
+    }
+
+    result = open_counted_semaphore(descriptor, max_holders, &semid);
+    if (result != E_SUCCESS) {
+        return result;
+    }
+
+    gettimeofday(&start_time, NULL);
+
+    while (1) {
+        /* Check timeout at start of each iteration, as the file backend does */
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - start_time.tv_sec) +
+                 (now.tv_usec - start_time.tv_usec) / 1000000.0;
+        if (timeout >= 0 && elapsed >= timeout) {
+            if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                syslog(LOG_WARNING, "timeout waiting for lock '%s' after %.1f seconds",
+                       descriptor, timeout);
+                closelog();
+#endif
+            }
+            error(E_TIMEOUT, "Timeout waiting for lock '%s' after %.1f seconds", descriptor, timeout);
+            return E_TIMEOUT;
+        }
+
+        op.sem_num = SEM_UNITS;
+        op.sem_op = -1;
+        op.sem_flg = SEM_UNDO | (nowait ? IPC_NOWAIT : 0);
+        if (nowait) {
+            result = semop(semid, &op, 1);
+        } else {
+            /* Sleep in the kernel until a unit is posted or the deadline */
+            remaining = timeout - elapsed;
+            ts.tv_sec = (time_t)remaining;
+            ts.tv_nsec = (long)((remaining - (double)ts.tv_sec) * 1000000000.0);
+            result = semtimedop(semid, &op, 1, &ts);
+        }
+        if (result == 0) {
+            break;
+        }
+
+        if (errno == EAGAIN) {
+            if (timeout <= 0) {
+                /* Fail fast if no timeout, as the file backend does */
+                debug("All slots of '%s' are currently in use", descriptor);
+                return E_BUSY;
+            }
+            if (nowait) {
+                nowait = FALSE;
+                if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+                    openlog("waitlock", LOG_PID, g_state.syslog_facility);
+                    syslog(LOG_INFO, "lock contention for '%s' (waiting)", descriptor);
+                    closelog();
+#endif
+                }
+            }
+        } else if (errno == EINTR) {
+            if (g_state.should_exit) {
+                return E_SYSTEM;
+            }
+        } else if (errno == EIDRM || errno == EINVAL) {
+            /* Removed while waiting; start over with a new semaphore */
+            result = open_counted_semaphore(descriptor, max_holders, &semid);
+            if (result != E_SUCCESS) {
+                return result;
+            }
+        } else {
+            error(E_SYSTEM, "Cannot wait for semaphore of '%s': %s", descriptor, strerror(errno));
+            return E_SYSTEM;
+        }
+    }
+
+    /* The kernel now counts us as a holder; pick a free slot number */
+    fd = ofd_open_slot_file(descriptor, SYSV_FILE_SUFFIX);
+    if (fd < 0) {
+        post_semaphore(semid);
+        return E_SYSTEM;
+    }
+    slot = ofd_claim_slot(fd, max_holders);
+    if (slot < 0) {
+        error(E_SYSTEM, "No free slot number for '%s'", descriptor);
+        close(fd);
+        post_semaphore(semid);
+        return E_SYSTEM;
+    }
+    ofd_write_record(fd, slot, max_holders);
+
+    held_semid = semid;
+    held_fd = fd;
+    held_slot = slot;
+    held_since = time(NULL);
+    strncpy(held_descriptor, descriptor, sizeof(held_descriptor) - 1);
+    held_descriptor[sizeof(held_descriptor) - 1] = '\0';
+    g_state.lock_fd = fd;
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "acquired lock '%s' (slot %d)", descriptor, slot);
+        closelog();
+#endif
+    }
+    debug("Took semaphore unit of '%s' as slot %d", descriptor, slot);
+    return E_SUCCESS;
+}
+
+/* Release the held unit. The slot number is given up first, so whoever the
+ * unit wakes finds a free one. */
+void sysv_release_lock(void) {
+    if (held_semid < 0) {
+        return;
+    }
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "released lock '%s' after %.0f seconds",
+               held_descriptor, difftime(time(NULL), held_since));
+        closelog();
+#endif
+    }
+
+    debug("Releasing slot %d of '%s'", held_slot, held_descriptor);
+    ofd_clear_record(held_fd, held_slot);
+    close(held_fd);
+    if (g_state.lock_fd == held_fd) {
+        g_state.lock_fd = -1;
+    }
+    post_semaphore(held_semid);
+
+    held_semid = -1;
+    held_fd = -1;
+    held_slot = -1;
+}
+
+/* Slot held by this process, or -1 */
+int sysv_held_slot(void) {
+    return (held_semid >= 0) ? held_slot : -1;
+}
+
+/* Check if a unit could be taken now. Semaphores outlive their processes,
+ * so, as stale lock files are removed by the file backend's check, the set
+ * of a descriptor nobody holds or waits for is removed; the next holder
+ * creates it again with its own -m. */
+int sysv_check_lock(const char *descriptor) {
+    int semid;
+    int available;
+    int capacity;
+    int waiting;
+
+    semid = open_semaphore(descriptor, 0, FALSE);
+    if (semid < 0) {
+        /* Never used, so nothing holds it */
+        return (errno == ENOENT) ? E_SUCCESS : E_SYSTEM;
+    }
+
+    available = semctl(semid, SEM_UNITS, GETVAL);
+    capacity = semctl(semid, SEM_CAPACITY, GETVAL);
+    waiting = semctl(semid, SEM_UNITS, GETNCNT);
+    if (available < 0 || capacity < 0) {
+        error(E_SYSTEM, "Cannot read semaphore for '%s': %s", descriptor, strerror(errno));
+        return E_SYSTEM;
+    }
+    debug("Semaphore for '%s': %d of %d units free, %d waiting", descriptor, available, capacity, waiting);
+
+    if (available == capacity && waiting == 0 && remove_idle_semaphore(semid, capacity)) {
+        debug("Removed unused semaphore of '%s'", descriptor);
+    }
+
+    if (g_state.use_syslog) {
+#ifdef HAVE_SYSLOG_H
+        openlog("waitlock", LOG_PID, g_state.syslog_facility);
+        syslog(LOG_INFO, "check lock '%s': %s (%d free, %d waiting)",
+               descriptor, (available > 0) ? "available" : "busy", available, waiting);
+        closelog();
+#endif
+    }
+
+    return (available > 0) ? E_SUCCESS : E_BUSY;
+}
+
+/* Signal every holder of the descriptor to release its unit */
+int sysv_done_lock(const char *descriptor) {
+    int result;
+    int fd;
+
+    fd = ofd_open_slot_file(descriptor, SYSV_FILE_SUFFIX);
+    if (fd < 0) {
+        return E_SYSTEM;
+    }
+    result = ofd_signal_holders(fd, descriptor);
+    close(fd);
+    return result;
+}
+
+/* Remove the descriptor's semaphore. Semaphores outlive their processes,
+ * so this is for discarding a lock directory; holders and waiters fail. */
+int sysv_remove_semaphore(const char *descriptor) {
+    int semid = open_semaphore(descriptor, 0, FALSE);
+
+    if (semid < 0) {
+        return (errno == ENOENT) ? E_NOTFOUND : E_SYSTEM;
+    }
+    return (semctl(semid, 0, IPC_RMID) == 0) ? E_SUCCESS : E_SYSTEM;
+}
+
+#else /* !HAVE_SYSV_BACKEND */
+
+int sysv_acquire_lock(const char *descriptor, int max_holders, double timeout) {
+    error(E_USAGE, "The sysv backend is not supported on this platform");
+    return E_USAGE;
+}
+
+void sysv_release_lock(void) {
+}
+
+int sysv_held_slot(void) {
+    return -1;
+}
+
+int sysv_check_lock(const char *descriptor) {
+    error(E_USAGE, "The sysv backend is not supported on this platform");
+    return E_USAGE;
+}
+
+int sysv_done_lock(const char *descriptor) {
+    error(E_USAGE, "The sysv backend is not supported on this platform");
+    return E_USAGE;
+}
+
+int sysv_remove_semaphore(const char *descriptor) {
+    return E_NOTFOUND;
+}
+
+#endif /* HAVE_SYSV_BACKEND */
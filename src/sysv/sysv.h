@@ -0,0 +1,28 @@
+#ifndef WAITLOCK_SYSV_H
+#define WAITLOCK_SYSV_H
+
+#include "../waitlock.h"
+#include "../ofd/ofd.h"
+
+#if defined(HAVE_SYS_SEM_H) && defined(HAVE_SEMTIMEDOP) && defined(HAVE_OFD_BACKEND)
+  #define HAVE_SYSV_BACKEND 1
+  #include <sys/ipc.h>
+  #include <sys/sem.h>
+#endif
+
+/* Slot file holding slot numbers and holder records for --list:
+ * <lockdir>/<descriptor>.sem, laid out like an ofd slot file. The count
+ * itself lives in a System V semaphore keyed by a hash of the file path. */
+#define SYSV_FILE_SUFFIX   ".sem"
+#define SYSV_INIT_WAIT_MS  1000   /* How long to wait for another creator */
+
+/* System V semaphore backend */
+int sysv_acquire_lock(const char *descriptor, int max_holders, double timeout);
+void sysv_release_lock(void);
+int sysv_held_slot(void);
+int sysv_check_lock(const char *descriptor);
+int sysv_done_lock(const char *descriptor);
+bool sysv_is_slot_file_name(const char *name);
+int sysv_remove_semaphore(const char *descriptor);
+
+#endif /* WAITLOCK_SYSV_H */
@@ -0,0 +1,348 @@
+/*
+ * Unit tests for the waitlockd daemon and its client
+ * Tests queued handoff, release on holder death and fallback to the directory
+ */
+
+#include "test.h"
+#include "../daemon/daemon.h"
+#include "../lock/lock.h"
+#include "../core/core.h"
+
+/* Test framework */
+static int test_count = 0;
+static int pass_count = 0;
+static int fail_count = 0;
+
+#define TEST_START(name) \
+    do { \
+        test_count++; \
+        printf("\n[DAEMON_TEST %d] %s\n", test_count, name); \
+    } while(0)
+
+#define TEST_ASSERT(condition, message) \
+    do { \
+        if (condition) { \
+            pass_count++; \
+            printf("  ✓ PASS: %s\n", message); \
+        } else { \
+            fail_count++; \
+            printf("  ✗ FAIL: %s\n", message); \
+        } \
+    } while(0)
+
+#ifdef HAVE_DAEMON_SERVER
+
+/* Fork a daemon on socket_path and wait until it accepts connections.
+ * Returns its pid, or -1. */
+static pid_t start_daemon(const char *socket_path) {
+    struct sockaddr_un addr;
+    pid_t daemon_pid;
+    int i;
+
+    daemon_pid = fork();
+    if (daemon_pid == 0) {
+        _exit(run_daemon(socket_path));
+    }
+    if (daemon_pid < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    safe_snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    for (i = 0; i < 200; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        int connected = (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (connected) {
+            return daemon_pid;
+        }
+        usleep(10000);
+    }
+    kill(daemon_pid, SIGKILL);
+    waitpid(daemon_pid, NULL, 0);
+    return -1;
+}
+
+/* Fork a child that acquires the descriptor with the given timeout, writes
+ * its tag to fd once granted, holds for hold_us and exits; release selects
+ * whether it calls release_lock() first. Returns the child pid. */
+static pid_t spawn_waiter(const char *descriptor, int max_holders, double timeout,
+                          int fd, char tag, int hold_us, bool release) {
+    pid_t child_pid = fork();
+
+    if (child_pid == 0) {
+        int result = acquire_lock(descriptor, max_holders, timeout);
+        if (result == 0) {
+            ssize_t bytes_written = write(fd, &tag, 1);
+            (void)bytes_written;
+            usleep(hold_us);
+            if (release) {
+                release_lock();
+            }
+        }
+        _exit(result);
+    }
+    return child_pid;
+}
+
+/* Test basic lock and release through the daemon */
+int test_daemon_acquire_release(void) {
+    TEST_START("waitlockd acquire and release");
+
+    int result = acquire_lock("test_daemon_mutex", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should acquire mutex from the daemon");
+    TEST_ASSERT(held_lock_slot() == 0, "Mutex should hold slot 0");
+    TEST_ASSERT(g_state.lock_path[0] == '\0', "No lock file should be used");
+    TEST_ASSERT(check_lock("test_daemon_mutex") == E_BUSY, "Check should report held mutex as busy");
+
+    int status;
+    pid_t child_pid = spawn_waiter("test_daemon_mutex", 1, 0.3, -1, 0, 0, TRUE);
+    waitpid(child_pid, &status, 0);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == E_TIMEOUT,
+                "Second holder should time out");
+
+    release_lock();
+    TEST_ASSERT(held_lock_slot() == -1, "No slot should be held after release");
+    TEST_ASSERT(check_lock("test_daemon_mutex") == E_SUCCESS, "Check should report released mutex as available");
+
+    return 0;
+}
+
+/* Test that a zero timeout asks the daemon once instead of giving up */
+int test_daemon_try_once(void) {
+    TEST_START("waitlockd zero timeout");
+
+    int result = acquire_lock("test_daemon_try", 1, 0.0);
+    TEST_ASSERT(result == 0, "Zero timeout should acquire a free mutex");
+    TEST_ASSERT(held_lock_slot() == 0, "Mutex should hold slot 0");
+
+    int status;
+    pid_t child_pid = spawn_waiter("test_daemon_try", 1, 0.0, -1, 0, 0, TRUE);
+    waitpid(child_pid, &status, 0);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == E_TIMEOUT,
+                "Zero timeout on a held mutex should time out");
+
+    child_pid = spawn_waiter("test_daemon_try", 1, -1.0, -1, 0, 0, TRUE);
+    waitpid(child_pid, &status, 0);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == E_BUSY,
+                "No timeout on a held mutex should report it busy");
+
+    release_lock();
+    return 0;
+}
+
+/* Test that waiters are granted in arrival order */
+int test_daemon_fifo_handoff(void) {
+    TEST_START("waitlockd FIFO handoff");
+
+    int order_pipe[2];
+    char order[3] = "";
+    int status_a, status_b;
+
+    if (pipe(order_pipe) != 0) {
+        TEST_ASSERT(0, "Should create pipe");
+        return 1;
+    }
+
+    TEST_ASSERT(acquire_lock("test_daemon_fifo", 1, 1.0) == 0, "Should acquire mutex");
+
+    pid_t first = spawn_waiter("test_daemon_fifo", 1, 5.0, order_pipe[1], 'A', 50000, TRUE);
+    usleep(100000);
+    pid_t second = spawn_waiter("test_daemon_fifo", 1, 5.0, order_pipe[1], 'B', 50000, TRUE);
+    usleep(100000);
+    close(order_pipe[1]);
+
+    release_lock();
+    waitpid(first, &status_a, 0);
+    waitpid(second, &status_b, 0);
+    TEST_ASSERT(read(order_pipe[0], order, 2) == 2, "Both waiters should be granted");
+    close(order_pipe[0]);
+
+    TEST_ASSERT(strcmp(order, "AB") == 0, "Waiters should be granted in arrival order");
+    TEST_ASSERT(WIFEXITED(status_a) && WEXITSTATUS(status_a) == 0 &&
+                WIFEXITED(status_b) && WEXITSTATUS(status_b) == 0,
+                "Both waiters should exit cleanly");
+
+    return 0;
+}
+
+/* Test that a holder that exits without releasing frees its slot */
+int test_daemon_holder_death(void) {
+    TEST_START("waitlockd release on holder death");
+
+    int sync_pipe[2];
+    char tag;
+    int status;
+
+    if (pipe(sync_pipe) != 0) {
+        TEST_ASSERT(0, "Should create pipe");
+        return 1;
+    }
+
+    pid_t child_pid = spawn_waiter("test_daemon_dead", 2, 1.0, sync_pipe[1], 'H', 0, FALSE);
+    close(sync_pipe[1]);
+    TEST_ASSERT(read(sync_pipe[0], &tag, 1) == 1, "Child should acquire a slot");
+    close(sync_pipe[0]);
+    waitpid(child_pid, &status, 0);
+
+    TEST_ASSERT(check_lock("test_daemon_dead") == E_SUCCESS, "Slot of the dead holder should be free");
+    TEST_ASSERT(acquire_lock("test_daemon_dead", 2, 1.0) == 0 && held_lock_slot() == 0,
+                "Freed slot 0 should be reused");
+    release_lock();
+
+    /* --done signals the holder, whose exit releases the lock */
+    child_pid = spawn_waiter("test_daemon_done", 1, 1.0, -1, 0, 5000000, TRUE);
+    usleep(200000);
+    TEST_ASSERT(done_lock("test_daemon_done") == E_SUCCESS, "Done should signal the holder");
+    waitpid(child_pid, &status, 0);
+    TEST_ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM, "Holder should exit on SIGTERM");
+    TEST_ASSERT(check_lock("test_daemon_done") == E_SUCCESS, "Lock should be free after done");
+
+    return 0;
+}
+
+/* Test that a client that never reads its replies neither stalls the
+ * daemon nor makes it queue replies without bound */
+int test_daemon_slow_reader(void) {
+    TEST_START("waitlockd client that stops reading");
+
+    struct sockaddr_un addr;
+    struct timespec start, end;
+    int status;
+
+    TEST_ASSERT(acquire_lock("test_daemon_slow", 1, 1.0) == 0, "Should acquire mutex");
+
+    pid_t flood_pid = fork();
+    if (flood_pid == 0) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        int i;
+
+        alarm(20);
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        safe_snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", opts.socket_path);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            _exit(2);
+        }
+        /* Each LIST is answered with a HOLDER line and END, never read */
+        for (i = 0; i < 400000; i++) {
+            if (send(fd, "LIST\n", 5, MSG_NOSIGNAL) != 5) {
+                _exit(0);  /* Disconnected */
+            }
+        }
+        _exit(1);
+    }
+
+    usleep(100000);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TEST_ASSERT(check_lock("test_daemon_slow") == E_BUSY, "Other clients should still be served");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    TEST_ASSERT((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9 < 1.0,
+                "Replies should not wait on the client that stopped reading");
+
+    waitpid(flood_pid, &status, 0);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+                "Client whose replies pile up should be disconnected");
+    TEST_ASSERT(check_lock("test_daemon_slow") == E_BUSY, "Daemon should keep serving after the disconnect");
+    release_lock();
+
+    return 0;
+}
+
+/* Test that without a listening daemon the directory backend is used */
+int test_daemon_fallback(void) {
+    TEST_START("Fallback without waitlockd");
+
+    const char *saved_socket = opts.socket_path;
+    char missing[PATH_MAX];
+
+    safe_snprintf(missing, sizeof(missing), "%s/missing.sock", opts.lock_dir);
+    opts.socket_path = missing;
+
+    TEST_ASSERT(acquire_lock("test_daemon_fallback", 1, 1.0) == 0, "Should acquire from the directory");
+    TEST_ASSERT(daemon_held_slot() == -1, "Daemon should not hold the lock");
+    TEST_ASSERT(g_state.lock_path[0] != '\0', "Lock file should be used");
+    release_lock();
+
+    opts.socket_path = saved_socket;
+    return 0;
+}
+
+#endif /* HAVE_DAEMON_SERVER */
+
+/* Print test summary */
+void test_daemon_summary(void) {
+    printf("\n=== DAEMON TEST SUMMARY ===\n");
+    printf("Total tests: %d\n", test_count);
+    printf("Passed: %d\n", pass_count);
+    printf("Failed: %d\n", fail_count);
+    if (fail_count == 0) {
+        printf("All daemon tests passed!\n");
+    } else {
+        printf("Some daemon tests failed!\n");
+    }
+}
+
+/* Main test runner for daemon module */
+int run_daemon_tests(void) {
+    printf("=== DAEMON MODULE TEST SUITE ===\n");
+
+    /* Reset counters */
+    test_count = 0;
+    pass_count = 0;
+    fail_count = 0;
+
+#ifdef HAVE_DAEMON_SERVER
+    const char *saved_lock_dir = opts.lock_dir;
+    const char *saved_socket = opts.socket_path;
+    int saved_backend = opts.backend;
+    char test_dir[256];
+    char socket_path[PATH_MAX];
+    char cleanup_cmd[PATH_MAX];
+    pid_t daemon_pid;
+
+    /* Run against a private lock directory and daemon */
+    snprintf(test_dir, sizeof(test_dir), "/tmp/waitlock_test_daemon_%d", getpid());
+    if (mkdir(test_dir, 0755) != 0) {
+        printf("  ✗ FAIL: Cannot create %s\n", test_dir);
+        return 1;
+    }
+    safe_snprintf(socket_path, sizeof(socket_path), "%s/%s", test_dir, DAEMON_SOCKET_NAME);
+    opts.lock_dir = test_dir;
+    opts.backend = BACKEND_FILE;
+
+    daemon_pid = start_daemon(socket_path);
+    if (daemon_pid < 0) {
+        fail_count++;
+        printf("  ✗ FAIL: Cannot start waitlockd on %s\n", socket_path);
+    } else {
+        opts.socket_path = socket_path;
+
+        test_daemon_acquire_release();
+        test_daemon_try_once();
+        test_daemon_fifo_handoff();
+        test_daemon_holder_death();
+        test_daemon_slow_reader();
+        test_daemon_fallback();
+
+        kill(daemon_pid, SIGTERM);
+        waitpid(daemon_pid, NULL, 0);
+    }
+
+    opts.lock_dir = saved_lock_dir;
+    opts.socket_path = saved_socket;
+    opts.backend = saved_backend;
+    snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf %s", test_dir);
+    int sys_result = system(cleanup_cmd);
+    (void)sys_result;
+#else
+    printf("  → waitlockd not available on this platform, skipping\n");
+#endif
+
+    test_daemon_summary();
+
+    return (fail_count > 0) ? 1 : 0;
+}
@@ -2,8 +2,8 @@
  * Test framework utilities implementation
  */
 
-#include "test_framework.h"
 #include "../lock/lock.h"
+#include "test_framework.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -136,4 +136,49 @@ int test_teardown_context(test_context_t *ctx) {
     
     ctx->cleanup_needed = 0;
     return 0;
-}
\ No newline at end of file
+}
+
+/* Fork a child that acquires the descriptor and reports its slot over a pipe.
+ * The child then sleeps for hold_us and exits; release selects whether it
+ * calls release_lock() first. Returns the child pid, or -1. */
+pid_t spawn_holder(const char *descriptor, int max_holders, int hold_us,
+                   bool release, int *slot_out) {
+    int sync_pipe[2];
+    pid_t child_pid;
+    char slot = -1;
+
+    if (pipe(sync_pipe) != 0) {
+        return -1;
+    }
+
+    child_pid = fork();
+    if (child_pid == 0) {
+        close(sync_pipe[0]);
+        /* The lock belongs to the open file, so drop the parent's copy */
+        if (g_state.lock_fd >= 0) {
+            close(g_state.lock_fd);
+            g_state.lock_fd = -1;
+        }
+        int result = acquire_lock(descriptor, max_holders, 2.0);
+        slot = (result == 0) ? (char)held_lock_slot() : -1;
+        ssize_t bytes_written = write(sync_pipe[1], &slot, 1);
+        (void)bytes_written;
+        close(sync_pipe[1]);
+
+        if (result == 0) {
+            usleep(hold_us);
+            if (release) {
+                release_lock();
+            }
+        }
+        _exit(result);
+    }
+
+    close(sync_pipe[1]);
+    if (child_pid < 0 || read(sync_pipe[0], &slot, 1) != 1) {
+        slot = -1;
+    }
+    close(sync_pipe[0]);
+    *slot_out = slot;
+    return child_pid;
+}
@@ -27,6 +27,10 @@ int test_setup_context(test_context_t *ctx, const char *test_name);
 /* Cleanup test context and restore environment */
 int test_teardown_context(test_context_t *ctx);
 
+/* Fork a child that takes a lock and reports its slot, for the backend suites */
+pid_t spawn_holder(const char *descriptor, int max_holders, int hold_us,
+                   bool release, int *slot_out);
+
 /* Enhanced test macros with context and better error reporting */
 #define TEST_START_CTX(ctx, name) \
     do { \
@@ -0,0 +1,312 @@
+/*
+ * Unit tests for the libwaitlock C API
+ * Tests acquire/try/release, listing, interoperation with the CLI engine,
+ * async acquisition and concurrent acquisition from several threads
+ */
+
+#include "test.h"
+#include "../lib/libwaitlock.h"
+#include "../lock/lock.h"
+#include "../core/core.h"
+#include <poll.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* Test framework */
+static int test_count = 0;
+static int pass_count = 0;
+static int fail_count = 0;
+
+#define TEST_START(name) \
+    do { \
+        test_count++; \
+        printf("\n[LIB_TEST %d] %s\n", test_count, name); \
+    } while(0)
+
+#define TEST_ASSERT(condition, message) \
+    do { \
+        if (condition) { \
+            pass_count++; \
+            printf("  ✓ PASS: %s\n", message); \
+        } else { \
+            fail_count++; \
+            printf("  ✗ FAIL: %s\n", message); \
+        } \
+    } while(0)
+
+/* Test acquire, try and release of a mutex */
+int test_lib_acquire_release(wl_ctx *ctx) {
+    TEST_START("wl_acquire, wl_try and wl_release");
+
+    wl_handle first, second;
+
+    TEST_ASSERT(wl_acquire(ctx, "test_lib_mutex", 1, 1.0, &first) == WL_OK, "Should acquire mutex");
+    TEST_ASSERT(first.fd >= 0 && first.slot == 0, "Handle should hold slot 0");
+    TEST_ASSERT(access(first.path, F_OK) == 0, "Slot file should exist");
+    TEST_ASSERT(wl_check(ctx, "test_lib_mutex") == WL_BUSY, "Check should report held mutex as busy");
+    TEST_ASSERT(wl_try(ctx, "test_lib_mutex", 1, &second) == WL_BUSY, "Try should fail while held");
+    TEST_ASSERT(wl_acquire(ctx, "test_lib_mutex", 1, 0.2, &second) == WL_TIMEOUT,
+                "Acquire should time out while held");
+
+    TEST_ASSERT(wl_release(ctx, &first) == WL_OK, "Should release mutex");
+    TEST_ASSERT(first.fd == -1, "Released handle should be cleared");
+    TEST_ASSERT(wl_release(ctx, &first) == WL_EINVAL, "Double release should be rejected");
+    TEST_ASSERT(wl_check(ctx, "test_lib_mutex") == WL_OK, "Check should report released mutex as available");
+
+    TEST_ASSERT(wl_try(ctx, "bad/name", 1, &second) == WL_EINVAL, "Invalid descriptor should be rejected");
+    TEST_ASSERT(wl_try(ctx, "test_lib_mutex", 0, &second) == WL_EINVAL, "Zero holders should be rejected");
+
+    return 0;
+}
+
+/* Test listing the holders of a semaphore */
+int test_lib_list(wl_ctx *ctx) {
+    TEST_START("wl_list iteration");
+
+    wl_handle a, b;
+    wl_info info;
+    wl_iter *it;
+    int found = 0;
+    int slots = 0;
+
+    TEST_ASSERT(wl_acquire(ctx, "test_lib_sem", 3, 1.0, &a) == WL_OK &&
+                wl_acquire(ctx, "test_lib_sem", 3, 1.0, &b) == WL_OK, "Should take two of three slots");
+    TEST_ASSERT(a.slot != b.slot, "Holders should get different slots");
+
+    it = wl_list(ctx);
+    TEST_ASSERT(it != NULL, "Should open a listing");
+    while (it && wl_list_next(it, &info)) {
+        if (strcmp(info.descriptor, "test_lib_sem") == 0) {
+            found++;
+            slots |= 1 << info.slot;
+            TEST_ASSERT(info.pid == getpid() && info.max_holders == 3 && !info.stale,
+                        "Holder record should describe this process");
+        }
+    }
+    wl_list_end(it);
+    TEST_ASSERT(found == 2, "Listing should show both holders");
+    TEST_ASSERT(slots == ((1 << a.slot) | (1 << b.slot)), "Listing should show the held slots");
+
+    wl_release(ctx, &a);
+    wl_release(ctx, &b);
+    return 0;
+}
+
+/* Test that the library and the CLI engine see each other's locks */
+int test_lib_cli_interop(wl_ctx *ctx) {
+    TEST_START("Interoperation with the CLI engine");
+
+    wl_handle handle;
+
+    TEST_ASSERT(wl_acquire(ctx, "test_lib_interop", 1, 1.0, &handle) == WL_OK, "Library should acquire");
+    TEST_ASSERT(check_lock("test_lib_interop") == E_BUSY, "CLI check should see the library lock");
+    wl_release(ctx, &handle);
+
+    TEST_ASSERT(acquire_lock("test_lib_interop", 1, 1.0) == E_SUCCESS, "CLI engine should acquire");
+    TEST_ASSERT(wl_try(ctx, "test_lib_interop", 1, &handle) == WL_BUSY, "Library should see the CLI lock");
+    release_lock();
+    TEST_ASSERT(wl_try(ctx, "test_lib_interop", 1, &handle) == WL_OK, "Library should acquire after release");
+    wl_release(ctx, &handle);
+
+    return 0;
+}
+
+/* Poll a pending acquisition until it resolves, releasing *held after a
+ * few rounds when given. Returns the final result and counts the rounds. */
+static int lib_poll_pending(wl_pending *pending, wl_handle *handle, wl_ctx *ctx,
+                            wl_handle *held, int *rounds) {
+    struct pollfd pfd;
+    int rc = WL_AGAIN;
+
+    *rounds = 0;
+    while (rc == WL_AGAIN && *rounds < 500) {
+        pfd.fd = wl_pending_fd(pending);
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 2000) != 1) {
+            wl_acquire_cancel(pending);
+            return -1;
+        }
+        rc = wl_acquire_complete(pending, handle);
+        (*rounds)++;
+        if (held && held->fd >= 0 && *rounds == 3) {
+            wl_release(ctx, held);
+        }
+    }
+    return rc;
+}
+
+/* Test acquisition through a pollable descriptor */
+int test_lib_async(wl_ctx *ctx) {
+    TEST_START("wl_acquire_async and wl_acquire_complete");
+
+    wl_handle held, handle;
+    wl_pending *pending = NULL;
+    struct timeval start, end;
+    int rounds;
+    int rc;
+
+    rc = wl_acquire_async(ctx, "test_lib_async", 1, 1.0, &pending);
+    if (rc == WL_ESYSTEM && errno == ENOSYS) {
+        printf("  → async acquisition not available on this platform, skipping\n");
+        return 0;
+    }
+    TEST_ASSERT(rc == WL_OK && pending != NULL, "Should start acquiring a free mutex");
+    TEST_ASSERT(pending && lib_poll_pending(pending, &handle, ctx, NULL, &rounds) == WL_OK &&
+                rounds == 1, "Free mutex should be granted on the first wakeup");
+    wl_release(ctx, &handle);
+
+    /* Granted once the holder releases */
+    TEST_ASSERT(wl_acquire(ctx, "test_lib_async", 1, 1.0, &held) == WL_OK, "Should hold mutex");
+    rc = wl_acquire_async(ctx, "test_lib_async", 1, 5.0, &pending);
+    TEST_ASSERT(rc == WL_OK, "Should start waiting for the held mutex");
+    rc = (rc == WL_OK) ? lib_poll_pending(pending, &handle, ctx, &held, &rounds) : rc;
+    TEST_ASSERT(rc == WL_OK && rounds > 3, "Waiter should be granted after the release");
+    TEST_ASSERT(handle.fd >= 0 && wl_check(ctx, "test_lib_async") == WL_BUSY,
+                "Granted handle should hold the mutex");
+    wl_release(ctx, &handle);
+
+    /* Deadline */
+    TEST_ASSERT(wl_acquire(ctx, "test_lib_async", 1, 1.0, &held) == WL_OK, "Should hold mutex again");
+    TEST_ASSERT(wl_acquire_async(ctx, "test_lib_async", 1, 0, &pending) == WL_BUSY,
+                "Zero timeout should report busy at once");
+    gettimeofday(&start, NULL);
+    rc = wl_acquire_async(ctx, "test_lib_async", 1, 0.3, &pending);
+    rc = (rc == WL_OK) ? lib_poll_pending(pending, &handle, ctx, NULL, &rounds) : rc;
+    gettimeofday(&end, NULL);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    TEST_ASSERT(rc == WL_TIMEOUT, "Waiter should time out");
+    TEST_ASSERT(elapsed >= 0.29 && elapsed < 1.0, "Timeout should fire at the deadline");
+
+    /* Cancelling leaves the lock untouched */
+    TEST_ASSERT(wl_acquire_async(ctx, "test_lib_async", 1, 5.0, &pending) == WL_OK, "Should start waiting");
+    wl_acquire_cancel(pending);
+    wl_release(ctx, &held);
+    TEST_ASSERT(wl_check(ctx, "test_lib_async") == WL_OK, "Mutex should be free after cancel and release");
+
+    return 0;
+}
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_SYNC_BUILTINS)
+
+#define LIB_THREADS     4
+#define LIB_ITERATIONS  25
+
+struct lib_thread_arg {
+    wl_ctx *ctx;
+    volatile int *inside;
+    volatile int *overlaps;
+    int failures;
+};
+
+static void *lib_contender(void *p) {
+    struct lib_thread_arg *arg = (struct lib_thread_arg *)p;
+    wl_handle handle;
+    int i;
+
+    for (i = 0; i < LIB_ITERATIONS; i++) {
+        if (wl_acquire(arg->ctx, "test_lib_threads", 1, 10.0, &handle) != WL_OK) {
+            arg->failures++;
+            continue;
+        }
+        if (__sync_add_and_fetch(arg->inside, 1) > 1) {
+            __sync_add_and_fetch(arg->overlaps, 1);
+        }
+        usleep(200);
+        __sync_sub_and_fetch(arg->inside, 1);
+        wl_release(arg->ctx, &handle);
+    }
+    return NULL;
+}
+
+/* Test mutual exclusion between threads sharing one context */
+int test_lib_threads(wl_ctx *ctx) {
+    TEST_START("Threads contending through one context");
+
+    pthread_t threads[LIB_THREADS];
+    struct lib_thread_arg args[LIB_THREADS];
+    volatile int inside = 0;
+    volatile int overlaps = 0;
+    int failures = 0;
+    int i;
+
+    for (i = 0; i < LIB_THREADS; i++) {
+        args[i].ctx = ctx;
+        args[i].inside = &inside;
+        args[i].overlaps = &overlaps;
+        args[i].failures = 0;
+        pthread_create(&threads[i], NULL, lib_contender, &args[i]);
+    }
+    for (i = 0; i < LIB_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        failures += args[i].failures;
+    }
+
+    TEST_ASSERT(failures == 0, "Every thread should acquire every time");
+    TEST_ASSERT(overlaps == 0, "No two threads should hold the mutex at once");
+    TEST_ASSERT(wl_check(ctx, "test_lib_threads") == WL_OK, "Mutex should be free afterwards");
+
+    return 0;
+}
+
+#endif /* HAVE_PTHREAD_H && HAVE_SYNC_BUILTINS */
+
+/* Print test summary */
+void test_lib_summary(void) {
+    printf("\n=== LIB TEST SUMMARY ===\n");
+    printf("Total tests: %d\n", test_count);
+    printf("Passed: %d\n", pass_count);
+    printf("Failed: %d\n", fail_count);
+    if (fail_count == 0) {
+        printf("All lib tests passed!\n");
+    } else {
+        printf("Some lib tests failed!\n");
+    }
+}
+
+/* Main test runner for lib module */
+int run_lib_tests(void) {
+    printf("=== LIB MODULE TEST SUITE ===\n");
+
+    /* Reset counters */
+    test_count = 0;
+    pass_count = 0;
+    fail_count = 0;
+
+    const char *saved_lock_dir = opts.lock_dir;
+    int saved_backend = opts.backend;
+    char test_dir[256];
+    char cleanup_cmd[PATH_MAX];
+    wl_ctx *ctx;
+
+    /* Run against a private lock directory shared with the CLI engine */
+    snprintf(test_dir, sizeof(test_dir), "/tmp/waitlock_test_lib_%d", getpid());
+    ctx = wl_open(test_dir);
+    if (!ctx) {
+        printf("  ✗ FAIL: Cannot open %s\n", test_dir);
+        return 1;
+    }
+    opts.lock_dir = test_dir;
+    opts.backend = BACKEND_FILE;
+
+    TEST_ASSERT(strcmp(wl_dir(ctx), test_dir) == 0, "Context should use the requested directory");
+    test_lib_acquire_release(ctx);
+    test_lib_list(ctx);
+    test_lib_cli_interop(ctx);
+    test_lib_async(ctx);
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_SYNC_BUILTINS)
+    test_lib_threads(ctx);
+#endif
+
+    wl_close(ctx);
+    opts.lock_dir = saved_lock_dir;
+    opts.backend = saved_backend;
+    snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf %s", test_dir);
+    int sys_result = system(cleanup_cmd);
+    (void)sys_result;
+
+    test_lib_summary();
+
+    return (fail_count > 0) ? 1 : 0;
+}
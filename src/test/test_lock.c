@@ -506,6 +506,930 @@ int test_lock_timeout(void) {
     return 0;
 }
 
+/* Test that a waiter wakes promptly when the holder releases */
+int test_release_wakeup(void) {
+    TEST_START("Release wakeup latency");
+
+    const char *test_descriptor = "test_wakeup_lock";
+
+    int wakeup_pipe[2];
+    if (pipe(wakeup_pipe) != 0) {
+        printf("  ✗ FAIL: Cannot create coordination pipe\n");
+        fail_count++;
+        return 1;
+    }
+
+    pid_t child_pid = fork();
+    if (child_pid == 0) {
+        /* Child process - hold the lock past the backoff ramp, then release */
+        close(wakeup_pipe[0]);
+
+        int acquire_result = acquire_lock(test_descriptor, 1, 2.0);
+        char signal = (acquire_result == 0) ? 'S' : 'F';
+        ssize_t bytes_written = write(wakeup_pipe[1], &signal, 1);
+        (void)bytes_written;
+
+        if (acquire_result == 0) {
+            usleep(1500000); /* Waiter backoff is near MAX_WAIT_MS by now */
+            release_lock();
+        }
+
+        close(wakeup_pipe[1]);
+        exit(acquire_result);
+    } else if (child_pid > 0) {
+        close(wakeup_pipe[1]);
+
+        char child_signal;
+        if (read(wakeup_pipe[0], &child_signal, 1) == 1 && child_signal == 'S') {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            int result = acquire_lock(test_descriptor, 1, 5.0);
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double elapsed = (end.tv_sec - start.tv_sec) +
+                           (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+            printf("  → Acquired after %.3f seconds\n", elapsed);
+
+            TEST_ASSERT(result == 0, "Waiter should acquire lock after release");
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_INOTIFY_INIT1)
+            TEST_ASSERT(elapsed < 1.8, "Waiter should wake on release, not on backoff");
+#endif
+            if (result == 0) {
+                release_lock();
+            }
+        } else {
+            TEST_ASSERT(0, "Child failed to acquire lock");
+        }
+
+        close(wakeup_pipe[0]);
+        int status;
+        waitpid(child_pid, &status, 0);
+    } else {
+        close(wakeup_pipe[0]);
+        close(wakeup_pipe[1]);
+        printf("  ✗ FAIL: Fork failed\n");
+        fail_count++;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Write a binary lock file recording pid. If hold is set the file is
+ * flocked like a live holder's and the open descriptor is returned. */
+static int write_test_lock_file(const char *path, const char *descriptor, int slot,
+                                pid_t pid, bool hold) {
+    struct lock_info info;
+    int fd;
+
+    memset(&info, 0, sizeof(info));
+    info.magic = LOCK_MAGIC;
+    info.version = 1;
+    info.pid = pid;
+    info.uid = getuid();
+    info.acquired_at = time(NULL);
+    info.max_holders = 1;
+    info.slot = slot;
+    strncpy(info.descriptor, descriptor, sizeof(info.descriptor) - 1);
+    info.checksum = calculate_lock_checksum(&info);
+
+    fd = open(path, O_CREAT | O_WRONLY | O_EXCL, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (write(fd, &info, sizeof(info)) != sizeof(info)) {
+        close(fd);
+        return -1;
+    }
+    if (hold && portable_lock(fd, LOCK_EX) == 0) {
+        return fd;
+    }
+    close(fd);
+    return hold ? -1 : 0;
+}
+
+/* Move the acquisition time of a test lock file seconds into the past */
+static int age_test_lock_file(const char *path, int seconds) {
+    struct lock_info info;
+    int fd;
+    int rc = -1;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+    if (pread(fd, &info, sizeof(info), 0) == sizeof(info)) {
+        info.acquired_at -= seconds;
+        info.checksum = calculate_lock_checksum(&info);
+        rc = (pwrite(fd, &info, sizeof(info), 0) == sizeof(info)) ? 0 : -1;
+    }
+    close(fd);
+    return rc;
+}
+
+/* Test that liveness follows the holder's flock rather than its pid */
+int test_flock_liveness(void) {
+    TEST_START("Lock liveness from flock");
+
+    char *lock_dir = find_lock_directory();
+    char path[PATH_MAX];
+    struct stat st;
+    int status;
+
+    if (!lock_dir) {
+        printf("  ✗ FAIL: Cannot find lock directory\n");
+        fail_count++;
+        return 1;
+    }
+
+    /* Unlocked file whose pid is alive (pid reused): stale */
+    safe_snprintf(path, sizeof(path), "%s/test_flock_reused.slot0.lock", lock_dir);
+    unlink(path);
+    TEST_ASSERT(write_test_lock_file(path, "test_flock_reused", 0, getppid(), FALSE) == 0 &&
+                age_test_lock_file(path, 60) == 0,
+                "Should create unlocked lock file");
+    TEST_ASSERT(check_lock("test_flock_reused") == E_SUCCESS, "Unlocked lock file with a live pid should be stale");
+    int result = acquire_lock("test_flock_reused", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should reclaim unlocked lock file");
+    if (result == 0) {
+        release_lock();
+    }
+
+    /* A fresh unlocked format 1 file of a live pid is an older binary
+     * between writing its slot file and flocking it: live */
+    safe_snprintf(path, sizeof(path), "%s/test_flock_legacy.slot0.lock", lock_dir);
+    unlink(path);
+    TEST_ASSERT(write_test_lock_file(path, "test_flock_legacy", 0, getppid(), FALSE) == 0,
+                "Should create an unlocked format 1 lock file");
+    TEST_ASSERT(check_lock("test_flock_legacy") == E_BUSY,
+                "A fresh unlocked record of a live pid should count as a holder");
+    TEST_ASSERT(acquire_lock("test_flock_legacy", 1, 0.2) != 0, "Its slot should not be reclaimed");
+    TEST_ASSERT(stat(path, &st) == 0, "Its lock file should not be removed");
+    unlink(path);
+
+    /* Locked file whose pid is not visible (other PID namespace): live */
+    pid_t dead_pid = fork();
+    if (dead_pid == 0) {
+        _exit(0);
+    }
+    waitpid(dead_pid, &status, 0);
+    safe_snprintf(path, sizeof(path), "%s/test_flock_foreign.slot0.lock", lock_dir);
+    unlink(path);
+    int fd = write_test_lock_file(path, "test_flock_foreign", 0, dead_pid, TRUE);
+    TEST_ASSERT(fd >= 0, "Should create locked lock file");
+    TEST_ASSERT(check_lock("test_flock_foreign") == E_BUSY, "Locked lock file with a dead pid should be live");
+    TEST_ASSERT(acquire_lock("test_flock_foreign", 1, 0.2) != 0, "Locked lock file should block acquisition");
+    TEST_ASSERT(stat(path, &st) == 0, "Locked lock file should not be removed");
+
+    /* Once the lock is dropped the file is reclaimed at once */
+    if (fd >= 0) {
+        close(fd);
+    }
+    result = acquire_lock("test_flock_foreign", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should reclaim lock file once its flock is dropped");
+    if (result == 0) {
+        release_lock();
+    }
+
+    return 0;
+}
+
+/* Test that slot files appear complete and scans leave locked ones alone */
+int test_atomic_publish(void) {
+    TEST_START("Atomic lock file publication");
+
+    char *lock_dir = find_lock_directory();
+    char path[PATH_MAX];
+    struct lock_info info;
+    struct dirent *entry;
+    DIR *dir;
+    int claim_files = 0;
+    int result;
+    int fd;
+
+    if (!lock_dir) {
+        printf("  ✗ FAIL: Cannot find lock directory\n");
+        fail_count++;
+        return 1;
+    }
+
+    result = acquire_lock("test_publish", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should acquire lock");
+    if (result == 0) {
+        TEST_ASSERT(read_lock_file_any_format(g_state.lock_path, &info) == 0 &&
+                    validate_lock_checksum(&info) && info.pid == getpid(),
+                    "Published lock file should hold a complete record");
+        dir = opendir(lock_dir);
+        while (dir && (entry = readdir(dir)) != NULL) {
+            if (strncmp(entry->d_name, ".claim.", 7) == 0) {
+                claim_files++;
+            }
+        }
+        if (dir) {
+            closedir(dir);
+        }
+        TEST_ASSERT(claim_files == 0, "No claim file should be left behind");
+        release_lock();
+    }
+
+    /* A holder that has locked but not yet written its file */
+    safe_snprintf(path, sizeof(path), "%s/test_publish.slot0.lock", lock_dir);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    TEST_ASSERT(fd >= 0 && portable_lock(fd, LOCK_EX) == 0, "Should create a locked empty lock file");
+    done_lock("test_publish");
+    check_lock("test_publish");
+    TEST_ASSERT(access(path, F_OK) == 0, "A locked lock file should not be removed as corrupt");
+    if (fd >= 0) {
+        close(fd);
+    }
+    done_lock("test_publish");
+    TEST_ASSERT(access(path, F_OK) != 0, "An unlocked unreadable lock file should be removed");
+    unlink(path);
+
+    return 0;
+}
+
+/* Test that scans do not follow symlinks planted in the lock directory */
+int test_scan_symlink(void) {
+    TEST_START("Lock directory scans skip symlinks");
+
+    char *lock_dir = find_lock_directory();
+    char target[PATH_MAX];
+    char path[PATH_MAX];
+    int result;
+    int fd;
+
+    if (!lock_dir) {
+        printf("  ✗ FAIL: Cannot find lock directory\n");
+        fail_count++;
+        return 1;
+    }
+
+    /* A live, valid record reachable only through a symlink */
+    safe_snprintf(target, sizeof(target), "%s/.symlink_target.%d", lock_dir, (int)getpid());
+    safe_snprintf(path, sizeof(path), "%s/test_symlink.slot0.lock", lock_dir);
+    fd = write_test_lock_file(target, "test_symlink", 0, getpid(), TRUE);
+    TEST_ASSERT(fd >= 0, "Should create a held lock file");
+    TEST_ASSERT(symlink(target, path) == 0, "Should plant a symlink as a slot file");
+
+    TEST_ASSERT(check_lock("test_symlink") == E_SUCCESS, "Check should ignore the symlink");
+    result = acquire_lock("test_symlink", 2, 1.0);
+    TEST_ASSERT(result == 0, "Acquire should not count the symlink as a holder");
+    if (result == 0) {
+        release_lock();
+    }
+    TEST_ASSERT(access(target, F_OK) == 0, "The symlink target should be left alone");
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    unlink(path);
+    unlink(target);
+    return 0;
+}
+
+/* Test handing the lock to an inherited descriptor with --fd */
+int test_hold_fd(void) {
+    TEST_START("Lock held on an inherited descriptor");
+
+    char *lock_dir = find_lock_directory();
+    char path[PATH_MAX];
+    char record[sizeof(struct lock_info) + sizeof(struct lock_header)];
+    struct lock_info info;
+    ssize_t len;
+    int status;
+    int fd;
+
+    if (!lock_dir) {
+        printf("  ✗ FAIL: Cannot find lock directory\n");
+        fail_count++;
+        return 1;
+    }
+
+    /* We play the shell: open a file in the lock directory and let a
+     * child take the lock on it and exit */
+    safe_snprintf(path, sizeof(path), "%s/.fd.test.%d", lock_dir, (int)getpid());
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    TEST_ASSERT(fd >= 0, "Should open the descriptor to hand over");
+    if (fd < 0) {
+        return 1;
+    }
+
+    pid_t child_pid = fork();
+    if (child_pid == 0) {
+        opts.hold_fd = fd;
+        _exit(acquire_lock("test_hold_fd", 1, 1.0));
+    }
+    waitpid(child_pid, &status, 0);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Child should acquire and exit");
+    TEST_ASSERT(access(path, F_OK) != 0, "File should have been renamed into its slot");
+    TEST_ASSERT(check_lock("test_hold_fd") == E_BUSY, "Lock should outlive the child");
+    len = pread(fd, record, sizeof(record), 0);
+    TEST_ASSERT(parse_lock_record(record, len, fd, &info) == 0 &&
+                info.pid == getpid(),
+                "Record should name the process holding the descriptor");
+    TEST_ASSERT(acquire_lock("test_hold_fd", 1, 0.2) != 0, "Lock should block other holders");
+
+    close(fd);
+    TEST_ASSERT(check_lock("test_hold_fd") == E_SUCCESS, "Closing the descriptor should release the lock");
+
+    return 0;
+}
+
+/* Count the --fair queue files of descriptor in dir */
+static int count_queue_files(const char *dir_path, const char *descriptor) {
+    char prefix[MAX_DESC_LEN + 8];
+    struct dirent *entry;
+    DIR *dir = opendir(dir_path);
+    int count = 0;
+
+    if (!dir) {
+        return 0;
+    }
+    safe_snprintf(prefix, sizeof(prefix), "%s.queue", descriptor);
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0) {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+/* Start a --fair waiter that reports id on report_fd once it holds the
+ * lock, and wait until its ticket is in the queue */
+static pid_t start_fair_waiter(const char *lock_dir, char id, int priority, double timeout,
+                               int report_fd) {
+    int queued = count_queue_files(lock_dir, "test_fair");
+    pid_t pid = fork();
+    int i;
+
+    if (pid == 0) {
+        opts.fair = TRUE;
+        opts.priority = priority;
+        if (acquire_lock("test_fair", 1, timeout) == E_SUCCESS) {
+            ssize_t n = write(report_fd, &id, 1);
+            (void)n;
+            release_lock();
+        }
+        _exit(0);
+    }
+    for (i = 0; i < 100 && count_queue_files(lock_dir, "test_fair") <= queued; i++) {
+        usleep(10000);
+    }
+    return pid;
+}
+
+/* Test that --fair waiters are served in ticket order, skipping waiters
+ * that died or gave up */
+int test_fair_queue(void) {
+    TEST_START("Fair queueing in ticket order");
+
+    char *lock_dir = find_lock_directory();
+    int report[2];
+    char order[8];
+    ssize_t len;
+    pid_t first, dead, gave_up, last;
+
+    if (!lock_dir || pipe(report) != 0) {
+        TEST_ASSERT(0, "Should find the lock directory and create a pipe");
+        return 1;
+    }
+
+    TEST_ASSERT(acquire_lock("test_fair", 1, 1.0) == E_SUCCESS, "Should take the lock first");
+    first = start_fair_waiter(lock_dir, 'A', 0, 10.0, report[1]);
+    dead = start_fair_waiter(lock_dir, 'X', 0, 10.0, report[1]);
+    gave_up = start_fair_waiter(lock_dir, 'T', 0, 0.2, report[1]);
+    last = start_fair_waiter(lock_dir, 'B', 0, 10.0, report[1]);
+    TEST_ASSERT(count_queue_files(lock_dir, "test_fair") == 4, "Each waiter should hold a ticket");
+
+    kill(dead, SIGKILL);
+    waitpid(dead, NULL, 0);
+    waitpid(gave_up, NULL, 0);
+    release_lock();
+
+    waitpid(first, NULL, 0);
+    waitpid(last, NULL, 0);
+    close(report[1]);
+    len = read(report[0], order, sizeof(order) - 1);
+    close(report[0]);
+    order[len > 0 ? len : 0] = '\0';
+
+    TEST_ASSERT(strcmp(order, "AB") == 0, "Waiters should be served in ticket order");
+    TEST_ASSERT(count_queue_files(lock_dir, "test_fair") == 0, "Abandoned tickets should be cleaned up");
+
+    return 0;
+}
+
+/* Test that higher --priority waiters are served first, in ticket order
+ * within a priority */
+int test_priority_queue(void) {
+    TEST_START("Priority queueing");
+
+    char *lock_dir = find_lock_directory();
+    int report[2];
+    char order[8];
+    ssize_t len;
+    pid_t waiters[4];
+    int i;
+
+    if (!lock_dir || pipe(report) != 0) {
+        TEST_ASSERT(0, "Should find the lock directory and create a pipe");
+        return 1;
+    }
+
+    TEST_ASSERT(acquire_lock("test_fair", 1, 1.0) == E_SUCCESS, "Should take the lock first");
+    waiters[0] = start_fair_waiter(lock_dir, 'A', 0, 10.0, report[1]);
+    waiters[1] = start_fair_waiter(lock_dir, 'B', 3, 10.0, report[1]);
+    waiters[2] = start_fair_waiter(lock_dir, 'C', 1, 10.0, report[1]);
+    waiters[3] = start_fair_waiter(lock_dir, 'D', 3, 10.0, report[1]);
+    release_lock();
+
+    for (i = 0; i < 4; i++) {
+        waitpid(waiters[i], NULL, 0);
+    }
+    close(report[1]);
+    len = read(report[0], order, sizeof(order) - 1);
+    close(report[0]);
+    order[len > 0 ? len : 0] = '\0';
+
+    TEST_ASSERT(strcmp(order, "BDCA") == 0, "Waiters should be served by priority, then ticket");
+
+    return 0;
+}
+
+/* Count the slot files of descriptor in dir */
+static int count_slot_files(const char *dir_path, const char *descriptor) {
+    char prefix[MAX_DESC_LEN + 8];
+    struct dirent *entry;
+    DIR *dir = opendir(dir_path);
+    int count = 0;
+
+    if (!dir) {
+        return 0;
+    }
+    safe_snprintf(prefix, sizeof(prefix), "%s.slot", descriptor);
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0) {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+/* Take K units of a semaphore at once with --weight */
+static int try_weight_in_child(int weight, double timeout) {
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int rc;
+        opts.weight = weight;
+        rc = acquire_lock("test_weight", 4, timeout);
+        if (rc == E_SUCCESS) {
+            release_lock();
+        }
+        _exit(rc);
+    }
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int test_weighted_units(void) {
+    TEST_START("Weighted semaphore units");
+
+    char *lock_dir = find_lock_directory();
+    char slots[64];
+
+    if (!lock_dir) {
+        TEST_ASSERT(0, "Should find the lock directory");
+        return 1;
+    }
+
+    opts.weight = 3;
+    opts.timeout = 1.0;
+    TEST_ASSERT(acquire_lock("test_weight", 4, 1.0) == E_SUCCESS, "Should take 3 of 4 units");
+    TEST_ASSERT(held_lock_slots(slots, sizeof(slots)) == 3 && strcmp(slots, "0,1,2") == 0,
+                "All granted slots should be reported");
+    TEST_ASSERT(count_slot_files(lock_dir, "test_weight") == 3, "Each unit should be a slot file");
+
+    TEST_ASSERT(try_weight_in_child(2, 0.2) == E_TIMEOUT, "2 units should not fit in the 1 left");
+    TEST_ASSERT(count_slot_files(lock_dir, "test_weight") == 3, "A failed weighted claim should hold nothing");
+    TEST_ASSERT(try_weight_in_child(1, 0.2) == E_SUCCESS, "1 unit should fit");
+
+    release_lock();
+    opts.weight = 1;
+    TEST_ASSERT(count_slot_files(lock_dir, "test_weight") == 0, "Release should free every unit");
+    TEST_ASSERT(try_weight_in_child(4, 0.2) == E_SUCCESS, "All units should be free again");
+
+    return 0;
+}
+
+/* Take the reader-writer lock in a child, as --shared or --exclusive */
+static int try_rw_in_child(int rw_mode, bool prefer_readers, double timeout) {
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int rc;
+        opts.rw_mode = rw_mode;
+        opts.rw_prefer_readers = prefer_readers;
+        rc = acquire_lock("test_rw", 1, timeout);
+        if (rc == E_SUCCESS) {
+            release_lock();
+        }
+        _exit(rc);
+    }
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* Test that readers share the lock, a writer excludes them, and a queued
+ * writer holds off new readers unless readers are preferred */
+int test_reader_writer(void) {
+    TEST_START("Shared and exclusive locks");
+
+    char *lock_dir = find_lock_directory();
+    int report[2];
+    char got = 0;
+    pid_t writer;
+    int i;
+
+    if (!lock_dir || pipe(report) != 0) {
+        TEST_ASSERT(0, "Should find the lock directory and create a pipe");
+        return 1;
+    }
+
+    opts.rw_mode = LOCK_TYPE_SHARED;
+    opts.timeout = 1.0;
+    TEST_ASSERT(acquire_lock("test_rw", 1, 1.0) == E_SUCCESS, "Should take the lock shared");
+    TEST_ASSERT(try_rw_in_child(LOCK_TYPE_SHARED, FALSE, 0.2) == E_SUCCESS,
+                "Another reader should share the lock");
+    TEST_ASSERT(try_rw_in_child(LOCK_TYPE_EXCLUSIVE, FALSE, 0.2) == E_TIMEOUT,
+                "A writer should wait for the reader");
+    TEST_ASSERT(check_lock("test_rw") == E_SUCCESS, "The lock should be available to readers");
+    opts.rw_mode = LOCK_TYPE_EXCLUSIVE;
+    TEST_ASSERT(check_lock("test_rw") == E_BUSY, "The lock should be busy for writers");
+
+    writer = fork();
+    if (writer == 0) {
+        if (acquire_lock("test_rw", 1, 10.0) == E_SUCCESS) {
+            ssize_t n = write(report[1], "W", 1);
+            (void)n;
+            release_lock();
+        }
+        _exit(0);
+    }
+    for (i = 0; i < 100 && count_queue_files(lock_dir, "test_rw") == 0; i++) {
+        usleep(10000);
+    }
+    TEST_ASSERT(count_queue_files(lock_dir, "test_rw") == 1, "The waiting writer should queue");
+    TEST_ASSERT(try_rw_in_child(LOCK_TYPE_SHARED, FALSE, 0.2) == E_TIMEOUT,
+                "New readers should wait for the queued writer");
+    TEST_ASSERT(try_rw_in_child(LOCK_TYPE_SHARED, TRUE, 0.2) == E_SUCCESS,
+                "With readers preferred, new readers should not wait");
+    opts.rw_mode = LOCK_TYPE_SHARED;
+    TEST_ASSERT(check_lock("test_rw") == E_BUSY, "The lock should be busy for readers behind a writer");
+
+    release_lock();
+    waitpid(writer, NULL, 0);
+    close(report[1]);
+    TEST_ASSERT(read(report[0], &got, 1) == 1 && got == 'W', "The writer should get the lock");
+    close(report[0]);
+    TEST_ASSERT(count_queue_files(lock_dir, "test_rw") == 0, "The writer should leave the queue");
+
+    opts.rw_mode = 0;
+    return 0;
+}
+
+/* Test that --all takes every descriptor or none, without holding part of
+ * the set while one of them is busy */
+int test_all_locks(void) {
+    TEST_START("All-or-none multi-descriptor acquisition");
+
+    char *lock_dir = find_lock_directory();
+    char name_a[] = "test_all_a";
+    char name_b[] = "test_all_b";
+    char *set[2];
+    int status;
+    pid_t pid;
+
+    if (!lock_dir) {
+        TEST_ASSERT(0, "Should find the lock directory");
+        return 1;
+    }
+
+    opts.timeout = 1.0;
+    TEST_ASSERT(acquire_lock("test_all_b", 1, 1.0) == E_SUCCESS, "Should take the second lock first");
+    pid = fork();
+    if (pid == 0) {
+        set[0] = name_b;
+        set[1] = name_a;
+        _exit(acquire_all_locks(set, 2, 1, 0.5));
+    }
+    usleep(200000);
+    TEST_ASSERT(count_slot_files(lock_dir, "test_all_a") == 0,
+                "A blocked set should not hold its free lock");
+    waitpid(pid, &status, 0);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == E_TIMEOUT,
+                "The set should time out while one lock is busy");
+    release_lock();
+
+    set[0] = name_b;
+    set[1] = name_a;
+    TEST_ASSERT(acquire_all_locks(set, 2, 1, 1.0) == E_SUCCESS, "Should take the whole set");
+    TEST_ASSERT(strcmp(set[0], "test_all_a") == 0, "The set should be taken in sorted order");
+    TEST_ASSERT(count_slot_files(lock_dir, "test_all_a") == 1 &&
+                count_slot_files(lock_dir, "test_all_b") == 1, "Every lock should be held");
+    release_lock();
+    TEST_ASSERT(count_slot_files(lock_dir, "test_all_a") == 0 &&
+                count_slot_files(lock_dir, "test_all_b") == 0, "Release should free every lock");
+
+    /* With --list, -a still means "include stale locks" and takes nothing */
+    struct options saved_opts = opts;
+    char *list_args[] = {"waitlock", "--list", "--all"};
+    char *check_args[] = {"waitlock", "--check", "--all", "test_all_a"};
+    char *done_args[] = {"waitlock", "--done", "--all", "test_all_a"};
+    opts.test_mode = FALSE;
+    opts.descriptor = NULL;
+    opts.descriptor_count = 0;
+    TEST_ASSERT(parse_args(3, list_args) == 0 && opts.list_mode && opts.show_all &&
+                opts.descriptor_count == 0, "--list --all should parse as a listing");
+    opts = saved_opts;
+    opts.test_mode = FALSE;
+    opts.descriptor = NULL;
+    TEST_ASSERT(parse_args(4, check_args) == E_USAGE, "--check should refuse --all");
+    opts = saved_opts;
+    opts.test_mode = FALSE;
+    opts.descriptor = NULL;
+    TEST_ASSERT(parse_args(4, done_args) == E_USAGE, "--done should refuse --all");
+    opts = saved_opts;
+
+    char stale_path[PATH_MAX + 64];
+    char out_path[PATH_MAX + 64];
+    char output[65536];
+    ssize_t len = -1;
+    int saved_stdout;
+    int out_fd;
+
+    pid = fork();
+    if (pid == 0) {
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    snprintf(stale_path, sizeof(stale_path), "%s/test_all_stale.slot0.lock", lock_dir);
+    snprintf(out_path, sizeof(out_path), "%s/.test_all_list.%d", lock_dir, (int)getpid());
+    TEST_ASSERT(write_test_lock_file(stale_path, "test_all_stale", 0, pid, FALSE) == 0,
+                "Should create a stale lock file");
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (saved_stdout >= 0 && out_fd >= 0) {
+        dup2(out_fd, STDOUT_FILENO);
+        list_locks(FMT_CSV, TRUE, FALSE);
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        len = pread(out_fd, output, sizeof(output) - 1, 0);
+    }
+    output[len > 0 ? len : 0] = '\0';
+    TEST_ASSERT(strstr(output, "test_all_stale,") != NULL &&
+                strstr(output, ",stale,") != NULL, "--list --all should show the stale lock");
+    TEST_ASSERT(access(stale_path, F_OK) == 0, "Listing should leave the stale lock in place");
+    if (out_fd >= 0) close(out_fd);
+    if (saved_stdout >= 0) close(saved_stdout);
+    unlink(out_path);
+    unlink(stale_path);
+
+    return 0;
+}
+
+/* Test that --any takes a free descriptor, and otherwise the first one
+ * released while it waits on all of them */
+int test_any_lock(void) {
+    TEST_START("First-free acquisition of any descriptor");
+
+    char name_a[] = "test_any_a";
+    char name_b[] = "test_any_b";
+    char *set[2];
+    int winner = -1;
+    int status;
+    pid_t holder, waiter;
+
+    set[0] = name_a;
+    set[1] = name_b;
+    opts.timeout = 1.0;
+    TEST_ASSERT(acquire_lock("test_any_a", 1, 1.0) == E_SUCCESS, "Should take the first lock");
+
+    holder = fork();
+    if (holder == 0) {
+        if (acquire_lock("test_any_b", 1, 1.0) == E_SUCCESS) {
+            pause();
+        }
+        _exit(0);
+    }
+    usleep(100000);
+
+    waiter = fork();
+    if (waiter == 0) {
+        _exit(acquire_any_lock(set, 2, 1, 0.2, &winner));
+    }
+    waitpid(waiter, &status, 0);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == E_TIMEOUT,
+                "Should time out while every descriptor is busy");
+
+    waiter = fork();
+    if (waiter == 0) {
+        int rc = acquire_any_lock(set, 2, 1, 5.0, &winner);
+        _exit(rc == E_SUCCESS ? winner : 100 + rc);
+    }
+    usleep(200000);
+    kill(holder, SIGKILL);
+    waitpid(holder, NULL, 0);
+    waitpid(waiter, &status, 0);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 1,
+                "Should take the descriptor released while waiting");
+
+    release_lock();
+    TEST_ASSERT(acquire_any_lock(set, 2, 1, 1.0, &winner) == E_SUCCESS && winner == 0,
+                "Should prefer the first free descriptor");
+    release_lock();
+
+    return 0;
+}
+
+/* Test flat and per-descriptor layouts and migration between them */
+int test_lock_layout(void) {
+    TEST_START("Lock directory layout migration");
+
+    const char *saved_lock_dir = opts.lock_dir;
+    char test_dir[256];
+    char path[PATH_MAX + 50];
+    struct stat st;
+
+    snprintf(test_dir, sizeof(test_dir), "/tmp/waitlock_test_layout_%d", getpid());
+    if (mkdir(test_dir, 0755) != 0) {
+        printf("  ✗ FAIL: Cannot create %s\n", test_dir);
+        fail_count++;
+        return 1;
+    }
+    opts.lock_dir = test_dir;
+
+    TEST_ASSERT(get_lock_layout(test_dir) == LAYOUT_FLAT, "Unmarked directory should use flat layout");
+
+    /* A holder of "test_foobar" must not count as a holder of "test_foo" */
+    snprintf(path, sizeof(path), "%s/test_foobar.slot0.lock", test_dir);
+    int holder_fd = write_test_lock_file(path, "test_foobar", 0, getpid(), TRUE);
+    TEST_ASSERT(holder_fd >= 0, "Should create flat lock file");
+    TEST_ASSERT(check_lock("test_foobar") == E_BUSY, "Flat holder should be seen");
+    int result = acquire_lock("test_foo", 1, 1.0);
+    TEST_ASSERT(result == 0, "Prefix of a held descriptor should be available");
+    if (result == 0) {
+        /* Read it the way binaries older than format 2 do, which remove
+         * a lock file they cannot read as a stale one */
+        struct lock_info old_info;
+        int old_fd = open(g_state.lock_path, O_RDONLY);
+        TEST_ASSERT(old_fd >= 0 && read(old_fd, &old_info, sizeof(old_info)) == sizeof(old_info) &&
+                    old_info.magic == LOCK_MAGIC && validate_lock_checksum(&old_info) &&
+                    old_info.pid == getpid(),
+                    "An older binary should read a live flat holder as live");
+        if (old_fd >= 0) close(old_fd);
+        release_lock();
+    }
+
+    /* Migrate: the held lock moves into its descriptor directory */
+    TEST_ASSERT(migrate_lock_layout() == 0, "Migration should succeed");
+    TEST_ASSERT(get_lock_layout(test_dir) == LAYOUT_SUBDIR, "Directory should be marked as subdirectory layout");
+    snprintf(path, sizeof(path), "%s/test_foobar/slot0.lock", test_dir);
+    TEST_ASSERT(stat(path, &st) == 0, "Lock file should be moved into descriptor directory");
+    TEST_ASSERT(check_lock("test_foobar") == E_BUSY, "Migrated holder should still be seen");
+
+    /* Descriptors name directories now, so none may leave the lock directory */
+    struct options saved_opts = opts;
+    char *dotdot_args[] = {"waitlock", "--lock-dir", test_dir, ".."};
+    opts.descriptor = NULL;
+    opts.test_mode = FALSE;
+    TEST_ASSERT(parse_args(4, dotdot_args) == E_USAGE, "\"..\" should be refused as a descriptor");
+    opts = saved_opts;
+    TEST_ASSERT(!valid_descriptor(".") && !valid_descriptor(".layout"),
+                "Descriptors starting with a dot should be refused");
+    TEST_ASSERT(valid_descriptor("test.foo."), "Dots after the first character should be allowed");
+    snprintf(path, sizeof(path), "%s/../slot0.lock", test_dir);
+    TEST_ASSERT(access(path, F_OK) != 0, "No lock file should be created outside the lock directory");
+
+    /* New locks are created in the descriptor directory */
+    result = acquire_lock("test_foo", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should acquire lock in subdirectory layout");
+    if (result == 0) {
+        snprintf(path, sizeof(path), "%s/test_foo/slot0.lock", test_dir);
+        TEST_ASSERT(strcmp(g_state.lock_path, path) == 0, "Lock file should be in descriptor directory");
+        TEST_ASSERT(lock_path_slot(g_state.lock_path) == 0, "Slot should be parsed from lock path");
+        struct lock_info new_info;
+        TEST_ASSERT(read_lock_header(g_state.lock_path, &new_info) == 0 &&
+                    new_info.version == LOCK_FORMAT_V2,
+                    "Lock files of a marked directory should use format 2");
+        release_lock();
+    }
+
+    /* Holders left in the flat layout by older binaries are still honoured */
+    snprintf(path, sizeof(path), "%s/test_foo.slot0.lock", test_dir);
+    int legacy_fd = write_test_lock_file(path, "test_foo", 0, getpid(), TRUE);
+    TEST_ASSERT(legacy_fd >= 0, "Should create legacy lock file");
+    TEST_ASSERT(check_lock("test_foo") == E_BUSY, "Legacy holder should be seen after migration");
+    TEST_ASSERT(acquire_lock("test_foo", 1, 0.2) != 0, "Legacy holder should block acquisition");
+
+    if (holder_fd >= 0) close(holder_fd);
+    if (legacy_fd >= 0) close(legacy_fd);
+
+    snprintf(path, sizeof(path), "rm -rf %s", test_dir);
+    int sys_result = system(path);
+    (void)sys_result;
+    opts.lock_dir = saved_lock_dir;
+
+    return 0;
+}
+
+/* Test the sharded layout and migration to it */
+int test_sharded_layout(void) {
+    TEST_START("Sharded lock directory layout");
+
+    const char *saved_lock_dir = opts.lock_dir;
+    int saved_shards = opts.shards;
+    char test_dir[256];
+    char path[PATH_MAX + 50];
+    char first_path[PATH_MAX];
+    const char *base;
+    struct stat st;
+    int shards = 0;
+
+    snprintf(test_dir, sizeof(test_dir), "/tmp/waitlock_test_shards_%d", getpid());
+    if (mkdir(test_dir, 0755) != 0) {
+        printf("  ✗ FAIL: Cannot create %s\n", test_dir);
+        fail_count++;
+        return 1;
+    }
+    opts.lock_dir = test_dir;
+
+    /* A flat holder is moved into its shard without losing its lock */
+    snprintf(path, sizeof(path), "%s/test_shard_a.slot0.lock", test_dir);
+    int holder_fd = write_test_lock_file(path, "test_shard_a", 0, getpid(), TRUE);
+    TEST_ASSERT(holder_fd >= 0, "Should create flat lock file");
+
+    opts.shards = 4;
+    TEST_ASSERT(migrate_lock_layout() == 0, "Migration to 4 shards should succeed");
+    TEST_ASSERT(read_lock_layout(test_dir, &shards) == LAYOUT_SHARDED && shards == 4,
+                "Directory should be marked as sharded with its fan-out");
+    snprintf(path, sizeof(path), "%s/03", test_dir);
+    TEST_ASSERT(stat(path, &st) == 0 && S_ISDIR(st.st_mode), "Every shard should be created up front");
+    TEST_ASSERT(check_lock("test_shard_a") == E_BUSY, "Migrated holder should still be seen");
+    TEST_ASSERT(acquire_lock("test_shard_a", 1, 0.2) != 0, "Migrated holder should block acquisition");
+
+    /* New lock files keep their flat name, in a shard chosen by the descriptor */
+    int result = acquire_lock("test_shard_b", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should acquire lock in sharded layout");
+    first_path[0] = '\0';
+    if (result == 0) {
+        snprintf(first_path, sizeof(first_path), "%s", g_state.lock_path);
+        base = first_path + strlen(test_dir);
+        TEST_ASSERT(strncmp(first_path, test_dir, strlen(test_dir)) == 0 &&
+                    base[0] == '/' && isxdigit((unsigned char)base[1]) &&
+                    isxdigit((unsigned char)base[2]) && strcmp(base + 3, "/test_shard_b.slot0.lock") == 0,
+                    "Lock file should be <lockdir>/<hh>/<descriptor>.slotN.lock");
+        TEST_ASSERT(check_lock("test_shard_b") == E_BUSY, "Sharded holder should be seen");
+        release_lock();
+        TEST_ASSERT(stat(first_path, &st) != 0, "Release should remove the sharded lock file");
+    }
+    result = acquire_lock("test_shard_b", 1, 1.0);
+    if (result == 0) {
+        TEST_ASSERT(strcmp(g_state.lock_path, first_path) == 0, "Shard should be stable for a descriptor");
+        release_lock();
+    }
+
+    /* Holders left in the flat layout by older binaries are still honoured */
+    snprintf(path, sizeof(path), "%s/test_shard_c.slot0.lock", test_dir);
+    int legacy_fd = write_test_lock_file(path, "test_shard_c", 0, getpid(), TRUE);
+    TEST_ASSERT(legacy_fd >= 0 && check_lock("test_shard_c") == E_BUSY,
+                "Legacy holder should be seen after migration");
+
+    /* Files are never moved between shard counts or to subdirectories */
+    opts.shards = 8;
+    TEST_ASSERT(migrate_lock_layout() == E_USAGE, "Changing the fan-out should be refused");
+    opts.shards = 0;
+    TEST_ASSERT(migrate_lock_layout() == E_USAGE, "Switching to subdirectories should be refused");
+
+    if (holder_fd >= 0) close(holder_fd);
+    if (legacy_fd >= 0) close(legacy_fd);
+
+    snprintf(path, sizeof(path), "rm -rf %s", test_dir);
+    int sys_result = system(path);
+    (void)sys_result;
+    opts.lock_dir = saved_lock_dir;
+    opts.shards = saved_shards;
+
+    return 0;
+}
+
 /* Test text lock file I/O */
 int test_text_lock_file(void) {
     TEST_START("Text lock file I/O");
@@ -623,6 +1547,115 @@ int test_binary_lock_file(void) {
     return 0;
 }
 
+/* Test the compact format 2 record and its header-only reads */
+int test_v2_lock_file(void) {
+    TEST_START("Format 2 lock file I/O");
+    
+    char *lock_dir = find_lock_directory();
+    if (!lock_dir) {
+        printf("  ✗ FAIL: Cannot find lock directory\n");
+        fail_count++;
+        return 1;
+    }
+    
+    char test_file[PATH_MAX];
+    char record[sizeof(struct lock_info) + sizeof(struct lock_header)];
+    struct lock_info write_info;
+    struct lock_info read_info;
+    size_t len;
+    struct stat st;
+    int fd;
+    
+    snprintf(test_file, sizeof(test_file), "%s/test_v2_lock.tmp", lock_dir);
+    memset(&write_info, 0, sizeof(write_info));
+    write_info.magic = LOCK_MAGIC;
+    write_info.pid = getpid();
+    write_info.ppid = getppid();
+    write_info.uid = getuid();
+    write_info.acquired_at = time(NULL);
+    write_info.lock_type = LOCK_TYPE_SHARED;
+    write_info.max_holders = 4;
+    write_info.slot = 3;
+    strcpy(write_info.hostname, "testhost");
+    strcpy(write_info.descriptor, "test_v2_descriptor");
+    strcpy(write_info.cmdline, "test_v2_command --flag");
+    
+    len = encode_lock_record(&write_info, record, sizeof(record));
+    TEST_ASSERT(len == sizeof(struct lock_header) + strlen("testhost") +
+                strlen("test_v2_descriptor") + strlen("test_v2_command --flag"),
+                "Record should be the header plus its strings");
+    TEST_ASSERT(encode_lock_record(&write_info, record, sizeof(struct lock_header)) == 0,
+                "Encoding should fail when the buffer is too small");
+    
+    fd = open(test_file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    TEST_ASSERT(fd >= 0, "Should be able to create lock file");
+    if (fd < 0) {
+        return 1;
+    }
+    TEST_ASSERT(write_lock_record(fd, &write_info, TRUE) == 0, "Should write the record");
+    close(fd);
+    TEST_ASSERT(stat(test_file, &st) == 0 && (size_t)st.st_size == len,
+                "File should hold only the record");
+    
+    /* Full read */
+    TEST_ASSERT(read_lock_file_any_format(test_file, &read_info) == 0, "Should read the record");
+    TEST_ASSERT(read_info.version == LOCK_FORMAT_V2, "Version should be 2");
+    TEST_ASSERT(read_info.pid == write_info.pid && read_info.slot == 3 &&
+                read_info.lock_type == LOCK_TYPE_SHARED && read_info.max_holders == 4,
+                "Header fields should round-trip");
+    TEST_ASSERT(strcmp(read_info.descriptor, write_info.descriptor) == 0 &&
+                strcmp(read_info.hostname, write_info.hostname) == 0 &&
+                strcmp(read_info.cmdline, write_info.cmdline) == 0,
+                "Strings should round-trip");
+    TEST_ASSERT(validate_lock_checksum(&read_info), "Checksum should be valid");
+    
+    /* Parse of a batched read, as --list does it */
+    memset(&read_info, 0, sizeof(read_info));
+    TEST_ASSERT(parse_lock_record(record, (ssize_t)len, -1, &read_info) == 0 &&
+                strcmp(read_info.cmdline, write_info.cmdline) == 0,
+                "Should parse the record from a buffer");
+    
+    /* Header-only read, as the scans do it */
+    TEST_ASSERT(read_lock_header(test_file, &read_info) == 0, "Should read the header");
+    TEST_ASSERT(read_info.pid == write_info.pid && read_info.slot == 3 && read_info.descriptor[0] == '\0',
+                "Header read should skip the strings");
+    
+    /* A damaged string fails the full read but not the header read */
+    record[len - 1] ^= 0x20;
+    fd = open(test_file, O_WRONLY | O_TRUNC);
+    TEST_ASSERT(fd >= 0 && write(fd, record, len) == (ssize_t)len, "Should rewrite the record");
+    if (fd >= 0) {
+        close(fd);
+    }
+    TEST_ASSERT(read_lock_file_any_format(test_file, &read_info) == 0 &&
+                !validate_lock_checksum(&read_info),
+                "Damaged strings should fail the checksum");
+    TEST_ASSERT(parse_lock_record(record, (ssize_t)len, -1, &read_info) == LOCK_RECORD_CORRUPT,
+                "Damaged strings should fail the parse");
+    TEST_ASSERT(read_lock_header(test_file, &read_info) == 0, "Header should still be valid");
+    
+    /* A damaged header fails both */
+    record[offsetof(struct lock_header, pid)] ^= 0x01;
+    fd = open(test_file, O_WRONLY | O_TRUNC);
+    TEST_ASSERT(fd >= 0 && write(fd, record, len) == (ssize_t)len, "Should rewrite the record");
+    if (fd >= 0) {
+        close(fd);
+    }
+    TEST_ASSERT(read_lock_header(test_file, &read_info) == LOCK_RECORD_CORRUPT,
+                "Damaged header should be reported as corrupt");
+    
+    /* Format 1 records are still read by the header path */
+    unlink(test_file);
+    TEST_ASSERT(write_test_lock_file(test_file, "test_v1_descriptor", 0, getpid(), FALSE) == 0,
+                "Should write a format 1 record");
+    TEST_ASSERT(read_lock_header(test_file, &read_info) == 0 && read_info.pid == getpid() &&
+                read_info.version == 1,
+                "Format 1 record should be read");
+    
+    unlink(test_file);
+    return 0;
+}
+
 /* Test stale lock detection */
 int test_stale_lock_detection(void) {
     TEST_START("Stale lock detection");
@@ -857,9 +1890,23 @@ int run_lock_tests(void) {
     test_list_locks();
     test_done_lock();
     test_lock_timeout();
+    test_release_wakeup();
+    test_lock_layout();
+    test_sharded_layout();
     test_text_lock_file();
     test_binary_lock_file();
+    test_v2_lock_file();
     test_stale_lock_detection();
+    test_flock_liveness();
+    test_atomic_publish();
+    test_scan_symlink();
+    test_hold_fd();
+    test_fair_queue();
+    test_priority_queue();
+    test_weighted_units();
+    test_reader_writer();
+    test_all_locks();
+    test_any_lock();
     test_semaphore_slots();
     
     test_lock_summary();
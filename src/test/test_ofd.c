@@ -0,0 +1,237 @@
+/*
+ * Unit tests for ofd.c functions
+ * Tests byte-range slot locking, kernel-blocking waits and dead holders
+ */
+
+#include "test.h"
+#include "test_framework.h"
+#include "../ofd/ofd.h"
+#include "../lock/lock.h"
+#include "../core/core.h"
+#include <time.h>
+
+/* Test framework */
+static int test_count = 0;
+static int pass_count = 0;
+static int fail_count = 0;
+
+#define TEST_START(name) \
+    do { \
+        test_count++; \
+        printf("\n[OFD_TEST %d] %s\n", test_count, name); \
+    } while(0)
+
+#define TEST_ASSERT(condition, message) \
+    do { \
+        if (condition) { \
+            pass_count++; \
+            printf("  ✓ PASS: %s\n", message); \
+        } else { \
+            fail_count++; \
+            printf("  ✗ FAIL: %s\n", message); \
+        } \
+    } while(0)
+
+#ifdef HAVE_OFD_BACKEND
+
+/* Read the holder record of a slot straight from the slot file */
+static int read_slot_record(const char *descriptor, int slot, struct ofd_record *rec) {
+    char path[PATH_MAX];
+    int fd;
+    ssize_t n;
+
+    safe_snprintf(path, sizeof(path), "%s/%s%s", opts.lock_dir, descriptor, OFD_FILE_SUFFIX);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    n = pread(fd, rec, sizeof(*rec),
+              OFD_RECORD_BASE + (off_t)slot * (off_t)sizeof(*rec));
+    close(fd);
+    return (n == (ssize_t)sizeof(*rec)) ? 0 : -1;
+}
+
+/* Test basic lock and release */
+int test_ofd_acquire_release(void) {
+    TEST_START("Byte-range slot acquire and release");
+
+    struct ofd_record rec;
+    char path[PATH_MAX];
+    struct stat st;
+
+    int result = acquire_lock("test_ofd_mutex", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should acquire mutex slot");
+    TEST_ASSERT(held_lock_slot() == 0, "Mutex should hold slot 0");
+    TEST_ASSERT(check_lock("test_ofd_mutex") == E_BUSY, "Check should report held mutex as busy");
+    TEST_ASSERT(read_slot_record("test_ofd_mutex", 0, &rec) == 0 &&
+                rec.magic == OFD_RECORD_MAGIC && rec.pid == getpid(),
+                "Holder record should name this process");
+
+    release_lock();
+    TEST_ASSERT(held_lock_slot() == -1, "No slot should be held after release");
+    TEST_ASSERT(g_state.lock_fd == -1, "Slot file should be closed after release");
+    TEST_ASSERT(check_lock("test_ofd_mutex") == E_SUCCESS, "Check should report released mutex as available");
+    TEST_ASSERT(read_slot_record("test_ofd_mutex", 0, &rec) == 0 && rec.magic == 0,
+                "Holder record should be cleared on release");
+
+    /* The file is reused, not unlinked, across acquisitions */
+    safe_snprintf(path, sizeof(path), "%s/test_ofd_mutex%s", opts.lock_dir, OFD_FILE_SUFFIX);
+    TEST_ASSERT(stat(path, &st) == 0 && S_ISREG(st.st_mode), "Slot file should remain after release");
+    TEST_ASSERT(ofd_is_slot_file_name("test_ofd_mutex.ofd"), "Slot file name should be recognised");
+    TEST_ASSERT(!ofd_is_slot_file_name("test_ofd_mutex.shm"), "Table file name should not be a slot file");
+
+    return 0;
+}
+
+/* Test semaphore slots and contention with another process */
+int test_ofd_contention(void) {
+    TEST_START("Byte-range slot contention");
+
+    int slot = -1;
+    int status;
+
+    TEST_ASSERT(acquire_lock("test_ofd_sem", 2, 1.0) == 0, "Should acquire first semaphore slot");
+
+    pid_t child_pid = spawn_holder("test_ofd_sem", 2, 1000000, TRUE, &slot);
+    TEST_ASSERT(child_pid > 0 && slot == 1, "Second holder should get slot 1");
+    TEST_ASSERT(check_lock("test_ofd_sem") == E_BUSY, "Semaphore with 2 holders should be busy");
+
+    /* A freed slot can be locked again while the other is still held */
+    release_lock();
+    TEST_ASSERT(acquire_lock("test_ofd_sem", 2, 1.0) == 0, "Should reacquire freed slot");
+    TEST_ASSERT(held_lock_slot() == 0, "Freed slot 0 should be reused");
+    release_lock();
+    if (child_pid > 0) {
+        waitpid(child_pid, &status, 0);
+    }
+
+    /* A waiter blocked in the kernel is woken by the holder's release */
+    child_pid = spawn_holder("test_ofd_mutex2", 1, 1500000, TRUE, &slot);
+    if (child_pid > 0 && slot == 0) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = acquire_lock("test_ofd_mutex2", 1, 5.0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - start.tv_sec) +
+                       (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+        printf("  → Acquired after %.3f seconds\n", elapsed);
+
+        TEST_ASSERT(result == 0, "Waiter should acquire slot after release");
+        TEST_ASSERT(elapsed < 1.8, "Waiter should wake on release, not on backoff");
+        if (result == 0) {
+            release_lock();
+        }
+        waitpid(child_pid, &status, 0);
+    } else {
+        TEST_ASSERT(0, "Child failed to acquire mutex");
+    }
+
+    /* The deadline still bounds a blocked wait */
+    child_pid = spawn_holder("test_ofd_mutex3", 1, 2000000, TRUE, &slot);
+    if (child_pid > 0 && slot == 0) {
+        TEST_ASSERT(acquire_lock("test_ofd_mutex3", 1, 0.3) == E_TIMEOUT,
+                    "Blocked wait should time out while the slot is held");
+        waitpid(child_pid, &status, 0);
+    } else {
+        TEST_ASSERT(0, "Child failed to acquire mutex");
+    }
+
+    return 0;
+}
+
+/* Test that slots of dead holders are free without any cleanup */
+int test_ofd_dead_holder(void) {
+    TEST_START("Byte-range slot of dead holder");
+
+    struct ofd_record rec;
+    int slot = -1;
+    int status;
+
+    /* Holder exits without releasing, leaving its record behind */
+    pid_t child_pid = spawn_holder("test_ofd_stale", 1, 0, FALSE, &slot);
+    TEST_ASSERT(child_pid > 0 && slot == 0, "Child should acquire slot");
+    if (child_pid > 0) {
+        waitpid(child_pid, &status, 0);
+    }
+
+    TEST_ASSERT(read_slot_record("test_ofd_stale", 0, &rec) == 0 && rec.pid == child_pid,
+                "Record of exited holder should remain");
+    TEST_ASSERT(check_lock("test_ofd_stale") == E_SUCCESS, "Slot of exited holder should be free");
+    int result = acquire_lock("test_ofd_stale", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should acquire slot of exited holder");
+    if (result == 0) {
+        TEST_ASSERT(read_slot_record("test_ofd_stale", 0, &rec) == 0 && rec.pid == getpid(),
+                    "New holder should overwrite the stale record");
+        release_lock();
+    }
+
+    /* Holder terminated by signal drops its lock when the file closes */
+    child_pid = spawn_holder("test_ofd_signal", 1, 5000000, TRUE, &slot);
+    TEST_ASSERT(child_pid > 0 && slot == 0, "Child should acquire slot");
+    if (child_pid > 0) {
+        TEST_ASSERT(done_lock("test_ofd_signal") == E_SUCCESS, "Done should signal the holder");
+        waitpid(child_pid, &status, 0);
+        TEST_ASSERT(WIFSIGNALED(status), "Holder should terminate on signal");
+        TEST_ASSERT(check_lock("test_ofd_signal") == E_SUCCESS, "Slot should be free after holder exits");
+    }
+    TEST_ASSERT(done_lock("test_ofd_signal") == E_NOTFOUND, "Done should find no holder of a free slot");
+
+    return 0;
+}
+
+#endif /* HAVE_OFD_BACKEND */
+
+/* Print test summary */
+void test_ofd_summary(void) {
+    printf("\n=== OFD TEST SUMMARY ===\n");
+    printf("Total tests: %d\n", test_count);
+    printf("Passed: %d\n", pass_count);
+    printf("Failed: %d\n", fail_count);
+    if (fail_count == 0) {
+        printf("All ofd tests passed!\n");
+    } else {
+        printf("Some ofd tests failed!\n");
+    }
+}
+
+/* Main test runner for ofd module */
+int run_ofd_tests(void) {
+    printf("=== OFD MODULE TEST SUITE ===\n");
+
+    /* Reset counters */
+    test_count = 0;
+    pass_count = 0;
+    fail_count = 0;
+
+#ifdef HAVE_OFD_BACKEND
+    const char *saved_lock_dir = opts.lock_dir;
+    int saved_backend = opts.backend;
+    char test_dir[256];
+    char cleanup_cmd[PATH_MAX];
+
+    /* Run against a private lock directory */
+    snprintf(test_dir, sizeof(test_dir), "/tmp/waitlock_test_ofd_%d", getpid());
+    if (mkdir(test_dir, 0755) != 0) {
+        printf("  ✗ FAIL: Cannot create %s\n", test_dir);
+        return 1;
+    }
+    opts.lock_dir = test_dir;
+    opts.backend = BACKEND_OFD;
+
+    test_ofd_acquire_release();
+    test_ofd_contention();
+    test_ofd_dead_holder();
+
+    opts.lock_dir = saved_lock_dir;
+    opts.backend = saved_backend;
+    snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf %s", test_dir);
+    int sys_result = system(cleanup_cmd);
+    (void)sys_result;
+#else
+    printf("  → ofd backend not available on this platform, skipping\n");
+#endif
+
+    test_ofd_summary();
+
+    return (fail_count > 0) ? 1 : 0;
+}
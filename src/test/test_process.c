@@ -288,6 +288,115 @@ int test_exec_signal_forwarding(void) {
     return 0;
 }
 
+/* Test exec in place with --no-supervise */
+int test_exec_no_supervise(void) {
+    TEST_START("Exec without supervisor");
+    
+    const char *test_descriptor = "test_exec_nosup";
+    int sync_pipe[2];
+    char pid_str[32];
+    ssize_t len;
+    int status;
+    
+    if (pipe(sync_pipe) != 0) {
+        TEST_ASSERT(0, "Should create pipe");
+        return 1;
+    }
+    
+    /* The command reports its pid, then holds the lock until stdin closes */
+    pid_t child_pid = fork();
+    if (child_pid == 0) {
+        char *argv[] = {"sh", "-c", "echo $$ >&3; read line", NULL};
+        close(sync_pipe[0]);
+        dup2(sync_pipe[1], 3);
+        opts.no_supervise = TRUE;
+        opts.timeout = 5.0;
+        _exit(exec_with_lock(test_descriptor, argv));
+    }
+    close(sync_pipe[1]);
+    len = read(sync_pipe[0], pid_str, sizeof(pid_str) - 1);
+    close(sync_pipe[0]);
+    pid_str[len > 0 ? len : 0] = '\0';
+    
+    TEST_ASSERT(atoi(pid_str) == child_pid, "Command should run in the waitlock process");
+    TEST_ASSERT(check_lock(test_descriptor) == E_BUSY, "Command should hold the lock");
+    
+    kill(child_pid, SIGTERM);
+    waitpid(child_pid, &status, 0);
+    TEST_ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM,
+                "Signals should reach the command directly");
+    TEST_ASSERT(check_lock(test_descriptor) == E_SUCCESS, "Lock should be released when the command dies");
+    
+    return 0;
+}
+
+/* Test --ready-fd status bytes and the --background handoff */
+int test_background_ready(void) {
+    TEST_START("Background holder and ready fd");
+    
+    const char *test_descriptor = "test_background";
+    int ready_pipe[2];
+    int out_pipe[2];
+    char buf[32];
+    ssize_t len;
+    int status;
+    int i;
+    
+    if (pipe(ready_pipe) != 0 || pipe(out_pipe) != 0) {
+        TEST_ASSERT(0, "Should create pipes");
+        return 1;
+    }
+    
+    opts.ready_fd = ready_pipe[1];
+    notify_ready(E_TIMEOUT);
+    len = read(ready_pipe[0], buf, sizeof(buf));
+    close(ready_pipe[0]);
+    TEST_ASSERT(len == 1 && buf[0] == '2', "Ready fd should carry the exit code digit");
+    TEST_ASSERT(opts.ready_fd == -1, "Ready fd should be closed after notification");
+    
+    /* The caller prints the holder's pid on stdout and exits 0 */
+    fflush(stdout);
+    pid_t caller_pid = fork();
+    if (caller_pid == 0) {
+        close(out_pipe[0]);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        opts.background = TRUE;
+        opts.timeout = 5.0;
+        status = start_background();
+        if (status >= 0) {
+            fflush(stdout);
+            _exit(status);
+        }
+        status = acquire_lock(test_descriptor, 1, opts.timeout);
+        notify_ready(status);
+        while (!g_state.should_exit) {
+            pause();
+        }
+        _exit(0);
+    }
+    close(out_pipe[1]);
+    len = read(out_pipe[0], buf, sizeof(buf) - 1);
+    close(out_pipe[0]);
+    buf[len > 0 ? len : 0] = '\0';
+    waitpid(caller_pid, &status, 0);
+    
+    pid_t holder_pid = atoi(buf);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == E_SUCCESS,
+                "Caller should exit 0 once the lock is held");
+    TEST_ASSERT(holder_pid > 0 && holder_pid != caller_pid, "Caller should print the holder's pid");
+    TEST_ASSERT(check_lock(test_descriptor) == E_BUSY, "Holder should keep the lock after the caller exits");
+    
+    if (holder_pid > 0) {
+        kill(holder_pid, SIGTERM);
+    }
+    for (i = 0; i < 50 && check_lock(test_descriptor) != E_SUCCESS; i++) {
+        usleep(20000);
+    }
+    TEST_ASSERT(check_lock(test_descriptor) == E_SUCCESS, "Lock should be released when the holder is signalled");
+    
+    return 0;
+}
+
 /* Test process death detection */
 int test_process_death_detection(void) {
     TEST_START("Process death detection");
@@ -392,6 +501,8 @@ int run_process_tests(void) {
     test_exec_with_lock_contention();
     test_exec_with_timeout();
     test_exec_signal_forwarding();
+    test_exec_no_supervise();
+    test_background_ready();
     test_process_death_detection();
     test_zombie_process_handling();
     test_cross_platform_cmdline();
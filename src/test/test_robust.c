@@ -0,0 +1,241 @@
+/*
+ * Unit tests for robust.c functions
+ * Tests slot mutexes, kernel wakeups and recovery from holders that died
+ */
+
+#include "test.h"
+#include "test_framework.h"
+#include "../robust/robust.h"
+#include "../lock/lock.h"
+#include "../core/core.h"
+#include <time.h>
+
+/* Test framework */
+static int test_count = 0;
+static int pass_count = 0;
+static int fail_count = 0;
+
+#define TEST_START(name) \
+    do { \
+        test_count++; \
+        printf("\n[ROBUST_TEST %d] %s\n", test_count, name); \
+    } while(0)
+
+#define TEST_ASSERT(condition, message) \
+    do { \
+        if (condition) { \
+            pass_count++; \
+            printf("  ✓ PASS: %s\n", message); \
+        } else { \
+            fail_count++; \
+            printf("  ✗ FAIL: %s\n", message); \
+        } \
+    } while(0)
+
+#ifdef HAVE_ROBUST_BACKEND
+
+/* Fork a child that kills pid with SIGKILL after delay_us */
+static pid_t spawn_killer(pid_t pid, int delay_us) {
+    pid_t killer_pid = fork();
+
+    if (killer_pid == 0) {
+        usleep(delay_us);
+        kill(pid, SIGKILL);
+        _exit(0);
+    }
+    return killer_pid;
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+/* Test basic lock and release */
+int test_robust_acquire_release(void) {
+    TEST_START("Robust mutex acquire and release");
+
+    int result = acquire_lock("test_robust_mutex", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should acquire mutex slot");
+    TEST_ASSERT(held_lock_slot() == 0, "Mutex should hold slot 0");
+    TEST_ASSERT(check_lock("test_robust_mutex") == E_BUSY, "Check should report held mutex as busy");
+
+    release_lock();
+    TEST_ASSERT(held_lock_slot() == -1, "No slot should be held after release");
+    TEST_ASSERT(check_lock("test_robust_mutex") == E_SUCCESS, "Check should report released mutex as available");
+
+    char path[PATH_MAX];
+    struct stat st;
+    safe_snprintf(path, sizeof(path), "%s/test_robust_mutex%s", opts.lock_dir, ROBUST_FILE_SUFFIX);
+    TEST_ASSERT(stat(path, &st) == 0 && st.st_size == (off_t)sizeof(struct robust_block),
+                "Control block file should exist");
+    TEST_ASSERT(robust_is_block_name("test_robust_mutex.mtx"), "Control block name should be recognised");
+    TEST_ASSERT(!robust_is_block_name("test_robust_mutex.shm"), "Table file name should not be a control block");
+
+    return 0;
+}
+
+/* Test semaphore slots and waking of waiters */
+int test_robust_contention(void) {
+    TEST_START("Robust mutex contention");
+
+    struct timespec start;
+    int slot = -1;
+    int status;
+
+    TEST_ASSERT(acquire_lock("test_robust_sem", 2, 1.0) == 0, "Should acquire first semaphore slot");
+
+    pid_t child_pid = spawn_holder("test_robust_sem", 2, 1000000, TRUE, &slot);
+    TEST_ASSERT(child_pid > 0 && slot == 1, "Second holder should get slot 1");
+    TEST_ASSERT(check_lock("test_robust_sem") == E_BUSY, "Semaphore with 2 holders should be busy");
+
+    /* A semaphore waiter is signalled by the child's release */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t waiter_pid = fork();
+    if (waiter_pid == 0) {
+        int result = acquire_lock("test_robust_sem", 2, 5.0);
+        _exit((result == 0 && held_lock_slot() == 1) ? 0 : 1);
+    }
+    if (child_pid > 0) {
+        waitpid(child_pid, &status, 0);
+    }
+    waitpid(waiter_pid, &status, 0);
+    double elapsed = seconds_since(&start);
+    printf("  → Semaphore waiter done after %.3f seconds\n", elapsed);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Waiter should take the released slot");
+    TEST_ASSERT(elapsed < 1.4, "Waiter should wake on release, not on backoff");
+    release_lock();
+
+    /* A mutex waiter blocks on the slot itself */
+    child_pid = spawn_holder("test_robust_mutex2", 1, 1500000, TRUE, &slot);
+    if (child_pid > 0 && slot == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = acquire_lock("test_robust_mutex2", 1, 5.0);
+        elapsed = seconds_since(&start);
+        printf("  → Acquired after %.3f seconds\n", elapsed);
+
+        TEST_ASSERT(result == 0, "Waiter should acquire slot after release");
+        TEST_ASSERT(elapsed < 1.8, "Waiter should wake on release, not on backoff");
+        if (result == 0) {
+            release_lock();
+        }
+        waitpid(child_pid, &status, 0);
+    } else {
+        TEST_ASSERT(0, "Child failed to acquire mutex");
+    }
+
+    /* The deadline bounds a blocked wait */
+    child_pid = spawn_holder("test_robust_mutex3", 1, 2000000, TRUE, &slot);
+    if (child_pid > 0 && slot == 0) {
+        TEST_ASSERT(acquire_lock("test_robust_mutex3", 1, 0.3) == E_TIMEOUT,
+                    "Blocked wait should time out while the slot is held");
+        waitpid(child_pid, &status, 0);
+    } else {
+        TEST_ASSERT(0, "Child failed to acquire mutex");
+    }
+
+    return 0;
+}
+
+/* Test recovery of slots whose holder was killed */
+int test_robust_owner_died(void) {
+    TEST_START("Robust mutex owner died");
+
+    struct timespec start;
+    int slot = -1;
+    int status;
+
+    /* A waiter blocked on a mutex is handed it when the holder is killed */
+    pid_t child_pid = spawn_holder("test_robust_dead", 1, 5000000, TRUE, &slot);
+    TEST_ASSERT(child_pid > 0 && slot == 0, "Child should acquire slot");
+    if (child_pid > 0) {
+        pid_t killer_pid = spawn_killer(child_pid, 300000);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = acquire_lock("test_robust_dead", 1, 5.0);
+        double elapsed = seconds_since(&start);
+        printf("  → Recovered after %.3f seconds\n", elapsed);
+
+        TEST_ASSERT(result == 0, "Waiter should take over the dead holder's slot");
+        TEST_ASSERT(elapsed < 1.0, "Holder death should wake the waiter");
+        if (result == 0) {
+            release_lock();
+        }
+        waitpid(child_pid, &status, 0);
+        waitpid(killer_pid, &status, 0);
+    }
+    TEST_ASSERT(check_lock("test_robust_dead") == E_SUCCESS, "Recovered mutex should be available after release");
+
+    /* A semaphore slot of a killed holder is taken over */
+    TEST_ASSERT(acquire_lock("test_robust_sem2", 2, 1.0) == 0, "Should acquire first semaphore slot");
+    child_pid = spawn_holder("test_robust_sem2", 2, 5000000, TRUE, &slot);
+    TEST_ASSERT(child_pid > 0 && slot == 1, "Child should acquire slot 1");
+    if (child_pid > 0) {
+        kill(child_pid, SIGKILL);
+        waitpid(child_pid, &status, 0);
+        TEST_ASSERT(check_lock("test_robust_sem2") == E_SUCCESS, "Killed holder's slot should be free");
+        int result = acquire_lock("test_robust_sem2", 2, -1);
+        TEST_ASSERT(result == 0 && held_lock_slot() == 1, "Killed holder's slot should be taken over");
+    }
+    release_lock();
+
+    return 0;
+}
+
+#endif /* HAVE_ROBUST_BACKEND */
+
+/* Print test summary */
+void test_robust_summary(void) {
+    printf("\n=== ROBUST TEST SUMMARY ===\n");
+    printf("Total tests: %d\n", test_count);
+    printf("Passed: %d\n", pass_count);
+    printf("Failed: %d\n", fail_count);
+    if (fail_count == 0) {
+        printf("All robust tests passed!\n");
+    } else {
+        printf("Some robust tests failed!\n");
+    }
+}
+
+/* Main test runner for robust module */
+int run_robust_tests(void) {
+    printf("=== ROBUST MODULE TEST SUITE ===\n");
+
+    /* Reset counters */
+    test_count = 0;
+    pass_count = 0;
+    fail_count = 0;
+
+#ifdef HAVE_ROBUST_BACKEND
+    const char *saved_lock_dir = opts.lock_dir;
+    int saved_backend = opts.backend;
+    char test_dir[256];
+    char cleanup_cmd[PATH_MAX];
+
+    /* Run against a private lock directory */
+    snprintf(test_dir, sizeof(test_dir), "/tmp/waitlock_test_robust_%d", getpid());
+    if (mkdir(test_dir, 0755) != 0) {
+        printf("  ✗ FAIL: Cannot create %s\n", test_dir);
+        return 1;
+    }
+    opts.lock_dir = test_dir;
+    opts.backend = BACKEND_ROBUST;
+
+    test_robust_acquire_release();
+    test_robust_contention();
+    test_robust_owner_died();
+
+    opts.lock_dir = saved_lock_dir;
+    opts.backend = saved_backend;
+    snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf %s", test_dir);
+    int sys_result = system(cleanup_cmd);
+    (void)sys_result;
+#else
+    printf("  → robust backend not available on this platform, skipping\n");
+#endif
+
+    test_robust_summary();
+
+    return (fail_count > 0) ? 1 : 0;
+}
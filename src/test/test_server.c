@@ -0,0 +1,182 @@
+/*
+ * Unit tests for the --server coprocess mode
+ * Tests the command protocol, holding several locks at once and release
+ * of every lock at end of input
+ */
+
+#include "test.h"
+#include "../server/server.h"
+#include "../lock/lock.h"
+#include "../core/core.h"
+
+/* Test framework */
+static int test_count = 0;
+static int pass_count = 0;
+static int fail_count = 0;
+
+#define TEST_START(name) \
+    do { \
+        test_count++; \
+        printf("\n[SERVER_TEST %d] %s\n", test_count, name); \
+    } while(0)
+
+#define TEST_ASSERT(condition, message) \
+    do { \
+        if (condition) { \
+            pass_count++; \
+            printf("  ✓ PASS: %s\n", message); \
+        } else { \
+            fail_count++; \
+            printf("  ✗ FAIL: %s\n", message); \
+        } \
+    } while(0)
+
+/* Feed script to run_server() and collect its replies, joined with '|'.
+ * Returns the server's exit code. */
+static int run_script(const char *script, char *replies, size_t size) {
+    FILE *in = tmpfile();
+    FILE *out = tmpfile();
+    size_t len = 0;
+    int rc;
+
+    replies[0] = '\0';
+    if (!in || !out) {
+        if (in) fclose(in);
+        if (out) fclose(out);
+        return -1;
+    }
+    fputs(script, in);
+    rewind(in);
+
+    rc = run_server(in, out);
+
+    rewind(out);
+    while (len + 1 < size && fgets(replies + len, size - len, out)) {
+        len += strlen(replies + len);
+        if (len > 0 && replies[len - 1] == '\n') {
+            replies[len - 1] = '|';
+        }
+    }
+    fclose(in);
+    fclose(out);
+    return rc;
+}
+
+/* Test acquire, check and release commands */
+int test_server_commands(void) {
+    TEST_START("ACQUIRE, CHECK and RELEASE");
+
+    char replies[1024];
+    int rc;
+
+    rc = run_script("ACQUIRE test_srv_a\n"
+                    "CHECK test_srv_a\n"
+                    "ACQUIRE test_srv_a -t 0\n"
+                    "ACQUIRE test_srv_a\n"
+                    "RELEASE test_srv_a\n"
+                    "CHECK test_srv_a\n"
+                    "RELEASE test_srv_a\n",
+                    replies, sizeof(replies));
+    TEST_ASSERT(rc == E_SUCCESS, "Server should exit cleanly at end of input");
+    TEST_ASSERT(strcmp(replies, "OK 0|BUSY|BUSY|BUSY|OK|AVAILABLE|ERROR not held: test_srv_a|") == 0,
+                "Replies should follow the protocol, without waiting on a held lock");
+
+    rc = run_script("acquire test_srv_b -m 2\n"
+                    "ACQUIRE test_srv_b -m 2\n"
+                    "ACQUIRE test_srv_b -m 2 -t 0.1\n"
+                    "RELEASE test_srv_b\n"
+                    "ACQUIRE test_srv_b -m 2 -t 0\n",
+                    replies, sizeof(replies));
+    TEST_ASSERT(strcmp(replies, "OK 0|OK 1|TIMEOUT|OK|OK 1|") == 0,
+                "Semaphore slots should be held concurrently and reused");
+    TEST_ASSERT(check_lock("test_srv_b") == E_SUCCESS, "Locks should be released at end of input");
+
+    return 0;
+}
+
+/* Test LIST, QUIT and malformed input */
+int test_server_list_and_errors(void) {
+    TEST_START("LIST, QUIT and malformed commands");
+
+    char replies[1024];
+
+    run_script("ACQUIRE test_srv_c\n"
+               "ACQUIRE test_srv_d -m 3\n"
+               "LIST\n",
+               replies, sizeof(replies));
+    TEST_ASSERT(strstr(replies, "|HOLDER test_srv_c 0 1 ") != NULL &&
+                strstr(replies, "|HOLDER test_srv_d 0 3 ") != NULL &&
+                strstr(replies, "|END|") != NULL, "LIST should show both held locks");
+
+    run_script("frobnicate\n"
+               "ACQUIRE bad/name\n"
+               "ACQUIRE test_srv_e -m 0\n"
+               "ACQUIRE test_srv_e -x\n"
+               "\n"
+               "QUIT\n"
+               "ACQUIRE test_srv_e\n",
+               replies, sizeof(replies));
+    TEST_ASSERT(strncmp(replies, "ERROR unknown command: frobnicate|ERROR usage:", 46) == 0,
+                "Unknown commands and bad descriptors should be rejected");
+    TEST_ASSERT(strstr(replies, "|ERROR invalid holder count: 0|ERROR unknown option: -x|OK|") != NULL,
+                "Bad options should be rejected and QUIT acknowledged");
+    TEST_ASSERT(strstr(replies, "OK 0") == NULL, "Commands after QUIT should not run");
+
+    return 0;
+}
+
+/* Print test summary */
+void test_server_summary(void) {
+    printf("\n=== SERVER TEST SUMMARY ===\n");
+    printf("Total tests: %d\n", test_count);
+    printf("Passed: %d\n", pass_count);
+    printf("Failed: %d\n", fail_count);
+    if (fail_count == 0) {
+        printf("All server tests passed!\n");
+    } else {
+        printf("Some server tests failed!\n");
+    }
+}
+
+/* Main test runner for server module */
+int run_server_tests(void) {
+    printf("=== SERVER MODULE TEST SUITE ===\n");
+
+    /* Reset counters */
+    test_count = 0;
+    pass_count = 0;
+    fail_count = 0;
+
+    const char *saved_lock_dir = opts.lock_dir;
+    const char *saved_socket = opts.socket_path;
+    int saved_backend = opts.backend;
+    double saved_timeout = opts.timeout;
+    char test_dir[256];
+    char cleanup_cmd[PATH_MAX];
+
+    /* Run against a private lock directory */
+    snprintf(test_dir, sizeof(test_dir), "/tmp/waitlock_test_server_%d", getpid());
+    if (mkdir(test_dir, 0755) != 0) {
+        printf("  ✗ FAIL: Cannot create %s\n", test_dir);
+        return 1;
+    }
+    opts.lock_dir = test_dir;
+    opts.socket_path = NULL;
+    opts.backend = BACKEND_FILE;
+    opts.timeout = -1.0;
+
+    test_server_commands();
+    test_server_list_and_errors();
+
+    opts.lock_dir = saved_lock_dir;
+    opts.socket_path = saved_socket;
+    opts.backend = saved_backend;
+    opts.timeout = saved_timeout;
+    snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf %s", test_dir);
+    int sys_result = system(cleanup_cmd);
+    (void)sys_result;
+
+    test_server_summary();
+
+    return (fail_count > 0) ? 1 : 0;
+}
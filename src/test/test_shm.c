@@ -0,0 +1,197 @@
+/*
+ * Unit tests for shm.c functions
+ * Tests slot claiming, contention, stale slot reclaim and release on signal
+ */
+
+#include "test.h"
+#include "test_framework.h"
+#include "../shm/shm.h"
+#include "../lock/lock.h"
+#include "../core/core.h"
+#include <time.h>
+
+/* Test framework */
+static int test_count = 0;
+static int pass_count = 0;
+static int fail_count = 0;
+
+#define TEST_START(name) \
+    do { \
+        test_count++; \
+        printf("\n[SHM_TEST %d] %s\n", test_count, name); \
+    } while(0)
+
+#define TEST_ASSERT(condition, message) \
+    do { \
+        if (condition) { \
+            pass_count++; \
+            printf("  ✓ PASS: %s\n", message); \
+        } else { \
+            fail_count++; \
+            printf("  ✗ FAIL: %s\n", message); \
+        } \
+    } while(0)
+
+#ifdef HAVE_SHM_BACKEND
+
+/* Test basic claim and release */
+int test_shm_acquire_release(void) {
+    TEST_START("Shared table acquire and release");
+
+    int result = acquire_lock("test_shm_mutex", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should acquire mutex slot");
+    TEST_ASSERT(held_lock_slot() == 0, "Mutex should hold slot 0");
+    TEST_ASSERT(check_lock("test_shm_mutex") == E_BUSY, "Check should report held mutex as busy");
+
+    release_lock();
+    TEST_ASSERT(held_lock_slot() == -1, "No slot should be held after release");
+    TEST_ASSERT(check_lock("test_shm_mutex") == E_SUCCESS, "Check should report released mutex as available");
+
+    char path[PATH_MAX];
+    struct stat st;
+    safe_snprintf(path, sizeof(path), "%s/test_shm_mutex%s", opts.lock_dir, SHM_TABLE_SUFFIX);
+    TEST_ASSERT(stat(path, &st) == 0 && S_ISREG(st.st_mode), "Slot table file should exist");
+    TEST_ASSERT(shm_is_table_name("test_shm_mutex.shm"), "Table file name should be recognised");
+    TEST_ASSERT(!shm_is_table_name("test_shm_mutex.slot0.lock"), "Lock file name should not be a table");
+
+    return 0;
+}
+
+/* Test semaphore slots and contention with another process */
+int test_shm_contention(void) {
+    TEST_START("Shared table contention");
+
+    int slot = -1;
+    int status;
+
+    TEST_ASSERT(acquire_lock("test_shm_sem", 2, 1.0) == 0, "Should acquire first semaphore slot");
+
+    pid_t child_pid = spawn_holder("test_shm_sem", 2, 1000000, TRUE, &slot);
+    TEST_ASSERT(child_pid > 0 && slot == 1, "Second holder should get slot 1");
+    TEST_ASSERT(check_lock("test_shm_sem") == E_BUSY, "Semaphore with 2 holders should be busy");
+
+    /* A freed slot can be claimed again while the other is still held */
+    release_lock();
+    TEST_ASSERT(acquire_lock("test_shm_sem", 2, 1.0) == 0, "Should reacquire freed slot");
+    TEST_ASSERT(held_lock_slot() == 0, "Freed slot 0 should be reused");
+    release_lock();
+    if (child_pid > 0) {
+        waitpid(child_pid, &status, 0);
+    }
+
+    /* A waiter is woken by the holder's release */
+    child_pid = spawn_holder("test_shm_mutex2", 1, 1500000, TRUE, &slot);
+    if (child_pid > 0 && slot == 0) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = acquire_lock("test_shm_mutex2", 1, 5.0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - start.tv_sec) +
+                       (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+        printf("  → Acquired after %.3f seconds\n", elapsed);
+
+        TEST_ASSERT(result == 0, "Waiter should acquire slot after release");
+#ifdef HAVE_LINUX_FUTEX_H
+        TEST_ASSERT(elapsed < 1.8, "Waiter should wake on release, not on backoff");
+#endif
+        if (result == 0) {
+            release_lock();
+        }
+        waitpid(child_pid, &status, 0);
+    } else {
+        TEST_ASSERT(0, "Child failed to acquire mutex");
+    }
+
+    return 0;
+}
+
+/* Test that slots of dead holders are reclaimed */
+int test_shm_stale_reclaim(void) {
+    TEST_START("Shared table stale slot reclaim");
+
+    int slot = -1;
+    int status;
+
+    /* Holder exits without releasing */
+    pid_t child_pid = spawn_holder("test_shm_stale", 1, 0, FALSE, &slot);
+    TEST_ASSERT(child_pid > 0 && slot == 0, "Child should acquire slot");
+    if (child_pid > 0) {
+        waitpid(child_pid, &status, 0);
+    }
+
+    TEST_ASSERT(check_lock("test_shm_stale") == E_SUCCESS, "Slot of exited holder should be reclaimed by check");
+    int result = acquire_lock("test_shm_stale", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should acquire slot of exited holder");
+    if (result == 0) {
+        release_lock();
+    }
+
+    /* Holder terminated by signal frees its slot from the handler */
+    child_pid = spawn_holder("test_shm_signal", 1, 5000000, TRUE, &slot);
+    TEST_ASSERT(child_pid > 0 && slot == 0, "Child should acquire slot");
+    if (child_pid > 0) {
+        TEST_ASSERT(done_lock("test_shm_signal") == E_SUCCESS, "Done should signal the holder");
+        waitpid(child_pid, &status, 0);
+        TEST_ASSERT(WIFSIGNALED(status), "Holder should terminate on signal");
+        TEST_ASSERT(check_lock("test_shm_signal") == E_SUCCESS, "Signal handler should free the slot");
+    }
+
+    return 0;
+}
+
+#endif /* HAVE_SHM_BACKEND */
+
+/* Print test summary */
+void test_shm_summary(void) {
+    printf("\n=== SHM TEST SUMMARY ===\n");
+    printf("Total tests: %d\n", test_count);
+    printf("Passed: %d\n", pass_count);
+    printf("Failed: %d\n", fail_count);
+    if (fail_count == 0) {
+        printf("All shm tests passed!\n");
+    } else {
+        printf("Some shm tests failed!\n");
+    }
+}
+
+/* Main test runner for shm module */
+int run_shm_tests(void) {
+    printf("=== SHM MODULE TEST SUITE ===\n");
+
+    /* Reset counters */
+    test_count = 0;
+    pass_count = 0;
+    fail_count = 0;
+
+#ifdef HAVE_SHM_BACKEND
+    const char *saved_lock_dir = opts.lock_dir;
+    int saved_backend = opts.backend;
+    char test_dir[256];
+    char cleanup_cmd[PATH_MAX];
+
+    /* Run against a private lock directory */
+    snprintf(test_dir, sizeof(test_dir), "/tmp/waitlock_test_shm_%d", getpid());
+    if (mkdir(test_dir, 0755) != 0) {
+        printf("  ✗ FAIL: Cannot create %s\n", test_dir);
+        return 1;
+    }
+    opts.lock_dir = test_dir;
+    opts.backend = BACKEND_SHM;
+
+    test_shm_acquire_release();
+    test_shm_contention();
+    test_shm_stale_reclaim();
+
+    opts.lock_dir = saved_lock_dir;
+    opts.backend = saved_backend;
+    snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf %s", test_dir);
+    int sys_result = system(cleanup_cmd);
+    (void)sys_result;
+#else
+    printf("  → shm backend not available on this platform, skipping\n");
+#endif
+
+    test_shm_summary();
+
+    return (fail_count > 0) ? 1 : 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Unit tests for sysv.c functions
+ * Tests kernel-counted units, slot numbers, timeouts and crash recovery
+ */
+
+#include "test.h"
+#include "test_framework.h"
+#include "../sysv/sysv.h"
+#include "../lock/lock.h"
+#include "../core/core.h"
+#include <time.h>
+
+/* Test framework */
+static int test_count = 0;
+static int pass_count = 0;
+static int fail_count = 0;
+
+#define TEST_START(name) \
+    do { \
+        test_count++; \
+        printf("\n[SYSV_TEST %d] %s\n", test_count, name); \
+    } while(0)
+
+#define TEST_ASSERT(condition, message) \
+    do { \
+        if (condition) { \
+            pass_count++; \
+            printf("  ✓ PASS: %s\n", message); \
+        } else { \
+            fail_count++; \
+            printf("  ✗ FAIL: %s\n", message); \
+        } \
+    } while(0)
+
+#ifdef HAVE_SYSV_BACKEND
+
+/* Test basic acquire and release */
+int test_sysv_acquire_release(void) {
+    TEST_START("Semaphore acquire and release");
+
+    TEST_ASSERT(check_lock("test_sysv_mutex") == E_SUCCESS, "Unused descriptor should be available");
+
+    int result = acquire_lock("test_sysv_mutex", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should acquire mutex unit");
+    TEST_ASSERT(held_lock_slot() == 0, "Mutex should hold slot 0");
+    TEST_ASSERT(check_lock("test_sysv_mutex") == E_BUSY, "Check should report held mutex as busy");
+    TEST_ASSERT(acquire_lock("test_sysv_mutex", 1, -1) == E_BUSY, "Held mutex should fail fast without timeout");
+    TEST_ASSERT(acquire_lock("test_sysv_mutex", 2, -1) == E_USAGE,
+                "A different -m should be refused while the semaphore is in use");
+
+    release_lock();
+    TEST_ASSERT(held_lock_slot() == -1, "No slot should be held after release");
+    TEST_ASSERT(check_lock("test_sysv_mutex") == E_SUCCESS, "Check should report released mutex as available");
+    TEST_ASSERT(sysv_remove_semaphore("test_sysv_mutex") == E_NOTFOUND,
+                "Check should remove the semaphore nobody uses");
+    result = acquire_lock("test_sysv_mutex", 2, 1.0);
+    TEST_ASSERT(result == 0, "A new -m should be accepted once the semaphore is removed");
+    if (result == 0) {
+        release_lock();
+    }
+    TEST_ASSERT(sysv_is_slot_file_name("test_sysv_mutex.sem"), "Slot file name should be recognised");
+    TEST_ASSERT(!sysv_is_slot_file_name("test_sysv_mutex.ofd"), "Other slot file name should not match");
+
+    return 0;
+}
+
+/* Test unit counting, slot numbers and kernel wakeups */
+int test_sysv_contention(void) {
+    TEST_START("Semaphore contention");
+
+    int slot = -1;
+    int status;
+
+    TEST_ASSERT(acquire_lock("test_sysv_sem", 2, 1.0) == 0, "Should acquire first semaphore unit");
+
+    pid_t child_pid = spawn_holder("test_sysv_sem", 2, 1500000, TRUE, &slot);
+    TEST_ASSERT(child_pid > 0 && slot == 1, "Second holder should get slot 1");
+    TEST_ASSERT(check_lock("test_sysv_sem") == E_BUSY, "Semaphore with 2 holders should be busy");
+
+    /* A waiter sleeps in the kernel until the child posts its unit */
+    release_lock();
+    TEST_ASSERT(acquire_lock("test_sysv_sem", 2, 1.0) == 0, "Should reacquire released unit");
+    TEST_ASSERT(held_lock_slot() == 0, "Freed slot 0 should be reused");
+    if (child_pid > 0 && slot == 1) {
+        struct timespec start, end;
+        pid_t waiter_pid = fork();
+        if (waiter_pid == 0) {
+            if (g_state.lock_fd >= 0) {
+                close(g_state.lock_fd);
+                g_state.lock_fd = -1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            int result = acquire_lock("test_sysv_sem", 2, 5.0);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double elapsed = (end.tv_sec - start.tv_sec) +
+                           (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+            _exit((result == 0 && held_lock_slot() == 1 && elapsed < 2.5) ? 0 : 1);
+        }
+        TEST_ASSERT(acquire_lock("test_sysv_sem", 2, 0.3) == E_TIMEOUT,
+                    "Third holder should time out while both units are held");
+        waitpid(child_pid, &status, 0);
+        waitpid(waiter_pid, &status, 0);
+        TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+                    "Waiter should take the unit and slot the holder released");
+    }
+    release_lock();
+
+    return 0;
+}
+
+/* Test that the kernel returns the unit of a holder killed outright */
+int test_sysv_crash_recovery(void) {
+    TEST_START("Semaphore crash recovery");
+
+    int slot = -1;
+    int status;
+
+    pid_t child_pid = spawn_holder("test_sysv_crash", 1, 5000000, TRUE, &slot);
+    TEST_ASSERT(child_pid > 0 && slot == 0, "Child should acquire unit");
+    if (child_pid > 0) {
+        TEST_ASSERT(check_lock("test_sysv_crash") == E_BUSY, "Mutex should be busy while child holds it");
+        kill(child_pid, SIGKILL);
+        waitpid(child_pid, &status, 0);
+    }
+
+    TEST_ASSERT(check_lock("test_sysv_crash") == E_SUCCESS, "SEM_UNDO should return the unit of a killed holder");
+    int result = acquire_lock("test_sysv_crash", 1, 1.0);
+    TEST_ASSERT(result == 0, "Should acquire unit of killed holder");
+    TEST_ASSERT(held_lock_slot() == 0, "Slot of killed holder should be reused");
+    if (result == 0) {
+        release_lock();
+    }
+
+    /* Holder signalled by --done */
+    child_pid = spawn_holder("test_sysv_crash", 1, 5000000, TRUE, &slot);
+    TEST_ASSERT(child_pid > 0 && slot == 0, "Child should acquire unit");
+    if (child_pid > 0) {
+        TEST_ASSERT(done_lock("test_sysv_crash") == E_SUCCESS, "Done should signal the holder");
+        waitpid(child_pid, &status, 0);
+        TEST_ASSERT(WIFSIGNALED(status), "Holder should terminate on signal");
+        TEST_ASSERT(check_lock("test_sysv_crash") == E_SUCCESS, "Unit should be returned after holder exits");
+    }
+
+    return 0;
+}
+
+#endif /* HAVE_SYSV_BACKEND */
+
+/* Print test summary */
+void test_sysv_summary(void) {
+    printf("\n=== SYSV TEST SUMMARY ===\n");
+    printf("Total tests: %d\n", test_count);
+    printf("Passed: %d\n", pass_count);
+    printf("Failed: %d\n", fail_count);
+    if (fail_count == 0) {
+        printf("All sysv tests passed!\n");
+    } else {
+        printf("Some sysv tests failed!\n");
+    }
+}
+
+/* Main test runner for sysv module */
+int run_sysv_tests(void) {
+    printf("=== SYSV MODULE TEST SUITE ===\n");
+
+    /* Reset counters */
+    test_count = 0;
+    pass_count = 0;
+    fail_count = 0;
+
+#ifdef HAVE_SYSV_BACKEND
+    const char *saved_lock_dir = opts.lock_dir;
+    int saved_backend = opts.backend;
+    char test_dir[256];
+    char cleanup_cmd[PATH_MAX];
+
+    /* Run against a private lock directory */
+    snprintf(test_dir, sizeof(test_dir), "/tmp/waitlock_test_sysv_%d", getpid());
+    if (mkdir(test_dir, 0755) != 0) {
+        printf("  ✗ FAIL: Cannot create %s\n", test_dir);
+        return 1;
+    }
+    opts.lock_dir = test_dir;
+    opts.backend = BACKEND_SYSV;
+
+    test_sysv_acquire_release();
+    test_sysv_contention();
+    test_sysv_crash_recovery();
+
+    /* Semaphores outlive the directory */
+    sysv_remove_semaphore("test_sysv_mutex");
+    sysv_remove_semaphore("test_sysv_sem");
+    sysv_remove_semaphore("test_sysv_crash");
+
+    opts.lock_dir = saved_lock_dir;
+    opts.backend = saved_backend;
+    snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf %s", test_dir);
+    int sys_result = system(cleanup_cmd);
+    (void)sys_result;
+#else
+    printf("  → sysv backend not available on this platform, skipping\n");
+#endif
+
+    test_sysv_summary();
+
+    return (fail_count > 0) ? 1 : 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * Unit tests for uring.c functions
+ * Tests batched open/read/close of lock files relative to a directory
+ */
+
+#include "test.h"
+#include "../uring/uring.h"
+#include "../core/core.h"
+
+/* Test framework */
+static int test_count = 0;
+static int pass_count = 0;
+static int fail_count = 0;
+
+#define TEST_START(name) \
+    do { \
+        test_count++; \
+        printf("\n[URING_TEST %d] %s\n", test_count, name); \
+    } while(0)
+
+#define TEST_ASSERT(condition, message) \
+    do { \
+        if (condition) { \
+            pass_count++; \
+            printf("  ✓ PASS: %s\n", message); \
+        } else { \
+            fail_count++; \
+            printf("  ✗ FAIL: %s\n", message); \
+        } \
+    } while(0)
+
+#ifdef HAVE_URING
+
+static int write_file(const char *dir, const char *name, const char *content) {
+    char path[PATH_MAX];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "w");
+    if (!f) {
+        return -1;
+    }
+    fputs(content, f);
+    fclose(f);
+    return 0;
+}
+
+/* Open and read a batch of regular files, a symlink and a missing name */
+static void test_uring_open_read(struct uring *ring, const char *dir) {
+    struct uring_file files[4];
+    char bufs[4][64];
+    char path[PATH_MAX];
+    int dir_fd;
+    int i;
+
+    TEST_START("Batched open and read");
+
+    write_file(dir, "alpha.slot0.lock", "alpha");
+    write_file(dir, "beta.slot0.lock", "beta-contents");
+    snprintf(path, sizeof(path), "%s/link.slot0.lock", dir);
+    TEST_ASSERT(symlink("alpha.slot0.lock", path) == 0, "Symlink created");
+
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    TEST_ASSERT(dir_fd >= 0, "Directory opened");
+    if (dir_fd < 0) {
+        return;
+    }
+
+    files[0].name = "alpha.slot0.lock";
+    files[1].name = "beta.slot0.lock";
+    files[2].name = "link.slot0.lock";
+    files[3].name = "missing.slot0.lock";
+    for (i = 0; i < 4; i++) {
+        files[i].buf = bufs[i];
+        files[i].size = sizeof(bufs[i]);
+    }
+
+    TEST_ASSERT(uring_open_read(ring, dir_fd, O_RDONLY | O_NOFOLLOW | O_CLOEXEC, files, 4) == 0,
+                "Batch completes");
+    TEST_ASSERT(files[0].fd >= 0 && files[0].len == 5 && memcmp(bufs[0], "alpha", 5) == 0,
+                "First file read in full");
+    TEST_ASSERT(files[1].fd >= 0 && files[1].len == 13 && memcmp(bufs[1], "beta-contents", 13) == 0,
+                "Second file read in full");
+    TEST_ASSERT(files[2].fd < 0 && files[2].len < 0, "Symlink is not followed");
+    TEST_ASSERT(files[3].fd < 0 && files[3].len < 0, "Missing file reported");
+
+    uring_close_files(ring, files, 4);
+    TEST_ASSERT(files[0].fd == -1 && files[1].fd == -1, "Descriptors closed");
+
+    close(dir_fd);
+}
+
+/* A file larger than its buffer reads only the buffer's worth */
+static void test_uring_short_buffer(struct uring *ring, const char *dir) {
+    struct uring_file file;
+    char buf[4];
+    int dir_fd;
+
+    TEST_START("Read limited to buffer size");
+
+    write_file(dir, "long.slot0.lock", "0123456789");
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        TEST_ASSERT(0, "Directory opened");
+        return;
+    }
+
+    file.name = "long.slot0.lock";
+    file.buf = buf;
+    file.size = sizeof(buf);
+    TEST_ASSERT(uring_open_read(ring, dir_fd, O_RDONLY, &file, 1) == 0, "Batch completes");
+    TEST_ASSERT(file.len == 4 && memcmp(buf, "0123", 4) == 0, "Only the buffer is filled");
+    uring_close_files(ring, &file, 1);
+    close(dir_fd);
+}
+
+#endif /* HAVE_URING */
+
+void test_uring_summary(void) {
+    printf("\n=== URING TEST SUMMARY ===\n");
+    printf("Total tests: %d\n", test_count);
+    printf("Passed: %d\n", pass_count);
+    printf("Failed: %d\n", fail_count);
+    if (fail_count == 0) {
+        printf("All uring tests passed!\n");
+    } else {
+        printf("Some uring tests failed!\n");
+    }
+}
+
+/* Main test runner for uring module */
+int run_uring_tests(void) {
+    printf("=== URING MODULE TEST SUITE ===\n");
+
+    /* Reset counters */
+    test_count = 0;
+    pass_count = 0;
+    fail_count = 0;
+
+#ifdef HAVE_URING
+    struct uring *ring = uring_create();
+    char test_dir[256];
+    char cleanup_cmd[PATH_MAX];
+
+    if (!ring) {
+        printf("  → io_uring not permitted for this process, skipping\n");
+        test_uring_summary();
+        return 0;
+    }
+
+    snprintf(test_dir, sizeof(test_dir), "/tmp/waitlock_test_uring_%d", getpid());
+    if (mkdir(test_dir, 0755) != 0) {
+        printf("  ✗ FAIL: Cannot create %s\n", test_dir);
+        uring_destroy(ring);
+        return 1;
+    }
+
+    test_uring_open_read(ring, test_dir);
+    test_uring_short_buffer(ring, test_dir);
+
+    uring_destroy(ring);
+    snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf %s", test_dir);
+    int sys_result = system(cleanup_cmd);
+    (void)sys_result;
+#else
+    printf("  → io_uring not available on this platform, skipping\n");
+#endif
+
+    test_uring_summary();
+
+    return (fail_count > 0) ? 1 : 0;
+}
@@ -12,6 +12,14 @@ extern int run_checksum_tests(void);
 extern int run_core_tests(void);
 extern int run_process_coordinator_tests(void);
 extern int run_lock_tests(void);
+extern int run_shm_tests(void);
+extern int run_ofd_tests(void);
+extern int run_sysv_tests(void);
+extern int run_robust_tests(void);
+extern int run_uring_tests(void);
+extern int run_daemon_tests(void);
+extern int run_lib_tests(void);
+extern int run_server_tests(void);
 extern int run_process_tests(void);
 extern int run_signal_tests(void);
 extern int run_integration_tests(void);
@@ -69,6 +77,30 @@ int run_unit_tests(void) {
     run_test_suite("Lock", run_lock_tests);
     test_cleanup_between_suites();
     
+    run_test_suite("Shm", run_shm_tests);
+    test_cleanup_between_suites();
+    
+    run_test_suite("Ofd", run_ofd_tests);
+    test_cleanup_between_suites();
+    
+    run_test_suite("Sysv", run_sysv_tests);
+    test_cleanup_between_suites();
+    
+    run_test_suite("Robust", run_robust_tests);
+    test_cleanup_between_suites();
+    
+    run_test_suite("Uring", run_uring_tests);
+    test_cleanup_between_suites();
+    
+    run_test_suite("Daemon", run_daemon_tests);
+    test_cleanup_between_suites();
+    
+    run_test_suite("Lib", run_lib_tests);
+    test_cleanup_between_suites();
+    
+    run_test_suite("Server", run_server_tests);
+    test_cleanup_between_suites();
+    
     run_test_suite("Integration", run_integration_tests);
     
     /* Print final summary */
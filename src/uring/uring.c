@@ -0,0 +1,302 @@
+/*
+ * Batched lock file reads over io_uring - a scan of a large lock directory
+ * opens, reads and closes hundreds of files per system call instead of
+ * making three calls per file
+ */
+
+#include "uring.h"
+#include "../core/core.h"
+
+#ifdef HAVE_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+struct uring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int sq_tail;  /* Local copy; we are the only submitter */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned int *sq_tail_ptr;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    struct io_uring_cqe *cqes;
+    bool failed;  /* Entries may be left queued; submit nothing more */
+};
+
+/* Result of an entry that has not completed */
+#define URING_PENDING INT_MIN
+
+/* Set up a ring of URING_BATCH entries. Returns NULL if io_uring is not
+ * available to this process. */
+struct uring *uring_create(void) {
+    struct io_uring_params params;
+    struct uring *ring;
+    char *sq;
+    char *cq;
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_BATCH, &params);
+    if (ring->fd < 0) {
+        debug("io_uring unavailable (%s), reading lock files one at a time", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+    ring->sq_entries = params.sq_entries;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        goto fail_fd;
+    }
+    if (ring->cq_ring_size) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            goto fail_sq;
+        }
+    } else {
+        ring->cq_ring = ring->sq_ring;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail_cq;
+    }
+
+    sq = (char *)ring->sq_ring;
+    cq = (char *)ring->cq_ring;
+    ring->sq_tail_ptr = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->sq_tail = *ring->sq_tail_ptr;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return ring;
+
+fail_cq:
+    if (ring->cq_ring_size) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+fail_sq:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+fail_fd:
+    debug("Cannot map io_uring rings: %s", strerror(errno));
+    close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+void uring_destroy(struct uring *ring) {
+    if (!ring) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+/* Next free submission entry, cleared and tagged with user_data */
+static struct io_uring_sqe *next_sqe(struct uring *ring, int user_data) {
+    unsigned int index = ring->sq_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)user_data;
+    ring->sq_array[index] = index;
+    ring->sq_tail++;
+    return sqe;
+}
+
+/* Submit the count entries queued with next_sqe() and wait for all of them
+ * to complete, storing each result in results[user_data]; the results of
+ * entries that were queued must be URING_PENDING beforehand. Returns 0, or
+ * -1 if the ring failed, in which case entries still URING_PENDING may not
+ * have run and the ring is not used again. */
+static int submit_and_wait(struct uring *ring, int count, int *results) {
+    unsigned int head;
+    unsigned int tail;
+    int to_submit = count;
+    int done = 0;
+    int ret;
+
+    if (ring->failed) {
+        return -1;
+    }
+    __atomic_store_n(ring->sq_tail_ptr, ring->sq_tail, __ATOMIC_RELEASE);
+    while (done < count) {
+        ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            debug("io_uring_enter failed: %s", strerror(errno));
+            ring->failed = TRUE;
+            return -1;
+        }
+        to_submit -= ret;
+        if (to_submit < 0) {
+            to_submit = 0;
+        }
+
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            results[cqe->user_data] = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/* Open each of count files relative to dir_fd with flags and read the
+ * start of it, in two batches. Files that cannot be opened or read are
+ * left with fd or len -1. Returns 0, or -1 if the ring cannot do the job
+ * (e.g. a kernel without IORING_OP_OPENAT), in which case no file is left
+ * open and the caller should fall back to plain system calls. */
+int uring_open_read(struct uring *ring, int dir_fd, int flags, struct uring_file *files, int count) {
+    int results[URING_BATCH];
+    struct io_uring_sqe *sqe;
+    int reads = 0;
+    int rc;
+    int i;
+
+    if (count > (int)ring->sq_entries || count > URING_BATCH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        sqe = next_sqe(ring, i);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dir_fd;
+        sqe->addr = (uint64_t)(uintptr_t)files[i].name;
+        sqe->open_flags = (uint32_t)flags;
+        files[i].fd = -1;
+        files[i].len = -1;
+        results[i] = URING_PENDING;
+    }
+    rc = submit_and_wait(ring, count, results);
+    for (i = 0; i < count; i++) {
+        if (results[i] >= 0) {
+            files[i].fd = results[i];
+        }
+    }
+    if (rc != 0) {
+        uring_close_files(ring, files, count);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (results[i] == -EINVAL) {
+            /* Opcode not supported by this kernel */
+            uring_close_files(ring, files, count);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (files[i].fd < 0) {
+            continue;
+        }
+        sqe = next_sqe(ring, i);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = files[i].fd;
+        sqe->addr = (uint64_t)(uintptr_t)files[i].buf;
+        sqe->len = (uint32_t)files[i].size;
+        sqe->off = 0;
+        results[i] = URING_PENDING;
+        reads++;
+    }
+    if (reads > 0 && submit_and_wait(ring, reads, results) != 0) {
+        uring_close_files(ring, files, count);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (files[i].fd >= 0) {
+            files[i].len = (results[i] >= 0) ? results[i] : -1;
+        }
+    }
+    return 0;
+}
+
+/* Close the open descriptors of count files in one batch, or one at a time
+ * once the ring has failed. A close that did not complete in a failed
+ * batch is made with close(); one that did is not repeated, as the
+ * descriptor number may already be reused. */
+void uring_close_files(struct uring *ring, struct uring_file *files, int count) {
+    int results[URING_BATCH];
+    struct io_uring_sqe *sqe;
+    int closes = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        results[i] = URING_PENDING;
+        if (files[i].fd < 0 || ring->failed) {
+            continue;
+        }
+        sqe = next_sqe(ring, i);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = files[i].fd;
+        closes++;
+    }
+    if (closes > 0) {
+        submit_and_wait(ring, closes, results);
+    }
+    for (i = 0; i < count; i++) {
+        if (files[i].fd >= 0 && results[i] == URING_PENDING) {
+            close(files[i].fd);
+        }
+        files[i].fd = -1;
+    }
+}
+
+#else /* !HAVE_URING */
+
+struct uring *uring_create(void) {
+    return NULL;
+}
+
+void uring_destroy(struct uring *ring) {
+}
+
+int uring_open_read(struct uring *ring, int dir_fd, int flags, struct uring_file *files, int count) {
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_close_files(struct uring *ring, struct uring_file *files, int count) {
+}
+
+#endif /* HAVE_URING */
@@ -0,0 +1,34 @@
+#ifndef WAITLOCK_URING_H
+#define WAITLOCK_URING_H
+
+#include "../waitlock.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_SYSCALL_H) && \
+    HAVE_DECL___NR_IO_URING_SETUP && HAVE_DECL_IORING_OP_CLOSE
+  #define HAVE_URING 1
+#endif
+
+/* Files opened and read per batch */
+#define URING_BATCH 256
+
+/* One file of a batch: name is opened relative to the batch's directory
+ * and up to size bytes from its start are read into buf */
+struct uring_file {
+    const char *name;
+    char *buf;
+    size_t size;
+    int fd;       /* Open descriptor, or -1 */
+    ssize_t len;  /* Bytes read, or -1 */
+};
+
+struct uring;
+
+/* Batched openat/read/close over io_uring (Linux). uring_create() returns
+ * NULL where io_uring is unavailable, e.g. disabled by sysctl or seccomp,
+ * and callers then use plain system calls. */
+struct uring *uring_create(void);
+void uring_destroy(struct uring *ring);
+int uring_open_read(struct uring *ring, int dir_fd, int flags, struct uring_file *files, int count);
+void uring_close_files(struct uring *ring, struct uring_file *files, int count);
+
+#endif /* WAITLOCK_URING_H */
@@ -12,32 +12,8 @@
 #include "process/process.h"
 #include "signal/signal.h"
 #include "test/test.h"
-
-/* Global state for signal handlers */
-#ifdef HAVE_SYSLOG_H
-struct global_state g_state = { -1, "", 0, FALSE, FALSE, FALSE, LOG_DAEMON, 0, 0, 0 };
-#else
-struct global_state g_state = { -1, "", 0, FALSE, FALSE, FALSE, 0, 0, 0, 0 };
-#endif
-
-/* Command line options */
-struct options opts = {
-    NULL,      /* descriptor */
-    1,         /* max_holders */
-    FALSE,     /* one_per_cpu */
-    0,         /* exclude_cpus */
-    -1.0,      /* timeout (infinite) */
-    FALSE,     /* check_only */
-    FALSE,     /* list_mode */
-    FALSE,     /* done_mode */
-    FALSE,     /* show_all */
-    FALSE,     /* stale_only */
-    FMT_HUMAN, /* output_format */
-    NULL,      /* lock_dir */
-    NULL,      /* exec_argv */
-    FALSE,     /* test_mode */
-    -1         /* preferred_slot (auto) */
-};
+#include "daemon/daemon.h"
+#include "server/server.h"
 
 /* Main function */
 int main(int argc, char *argv[]) {
@@ -81,16 +57,46 @@ int main(int argc, char *argv[]) {
         return done_lock(opts.descriptor);
     }
     
+    if (opts.migrate_mode) {
+        return migrate_lock_layout();
+    }
+    
+    if (opts.daemon_mode) {
+        return run_daemon(daemon_socket_path());
+    }
+    
+    if (opts.server_mode) {
+        return run_server(stdin, stdout);
+    }
+    
+    /* The holder carries on below; the caller waits for its status byte */
+    if (opts.background) {
+        ret = start_background();
+        if (ret >= 0) {
+            return ret;
+        }
+    }
+    
     if (opts.exec_argv) {
         return exec_with_lock(opts.descriptor, opts.exec_argv);
     }
     
     /* Normal lock acquisition */
-    ret = acquire_lock(opts.descriptor, opts.max_holders, opts.timeout);
+    ret = acquire_requested_locks(opts.descriptor);
+    if (ret == E_SUCCESS && opts.any_mode) {
+        printf("%s\n", opts.descriptor);  /* The one --any got */
+        fflush(stdout);
+    }
+    notify_ready(ret);
     if (ret != 0) {
         return ret;
     }
     
+    /* With --fd the caller's descriptor holds the lock from here on */
+    if (opts.hold_fd >= 0) {
+        return E_SUCCESS;
+    }
+    
     /* Wait for signal */
     while (!g_state.should_exit) {
         pause();
@@ -22,6 +22,7 @@
 #include <limits.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 #ifdef HAVE_SYS_SELECT_H
   #include <sys/select.h>
@@ -49,6 +50,17 @@
   #define LOCK_NB 4
 #endif
 
+/* Open flags that only harden lock directory scans where available */
+#ifndef O_CLOEXEC
+  #define O_CLOEXEC 0
+#endif
+#ifndef O_NOFOLLOW
+  #define O_NOFOLLOW 0
+#endif
+#ifndef O_DIRECTORY
+  #define O_DIRECTORY 0
+#endif
+
 #ifdef HAVE_SYSLOG_H
   #include <syslog.h>
 #endif
@@ -71,6 +83,42 @@
 #define MAX_CMDLINE 4096
 #define LOCK_MAGIC 0x57414C4B  /* "WALK" */
 
+/* Lock directory layouts, recorded in LAYOUT_MARKER inside the directory */
+#define LAYOUT_FLAT    1        /* <lockdir>/<descriptor>.slotN.lock */
+#define LAYOUT_SUBDIR  2        /* <lockdir>/<descriptor>/slotN.lock */
+#define LAYOUT_SHARDED 3        /* <lockdir>/<hh>/<descriptor>.slotN.lock */
+#define LAYOUT_MARKER  ".layout"
+
+/* Sharded layout: hh is the CRC32 of the descriptor modulo the fan-out, in
+ * hex; the marker reads "3 <fan-out>" */
+#define LAYOUT_SHARDS_MAX 256
+
+/* --fair queue next to the slot files: <descriptor>.queueT.wait per waiter
+ * holding ticket T, and <descriptor>.ticket counting tickets handed out
+ * (queueT.wait and ticket in the subdirectory layout) */
+#define QUEUE_FILE_SUFFIX   ".wait"
+#define QUEUE_COUNTER_NAME  "ticket"
+
+/* --weight: at most WEIGHT_MAX slot files per holder, listed in
+ * WAITLOCK_SLOT in a buffer of WEIGHT_SLOTS_MAX bytes */
+#define WEIGHT_MAX          1024
+#define WEIGHT_SLOTS_MAX    (WEIGHT_MAX * 6 + 1)
+
+/* --shared and --exclusive holders: lock_type of their slot files, which
+ * are claimed under the descriptor's <descriptor>.rwgate file (rwgate in
+ * the subdirectory layout). Shared holders take slots below RW_HOLDERS_MAX. */
+#define LOCK_TYPE_SHARED    2
+#define LOCK_TYPE_EXCLUSIVE 3
+#define RW_GATE_NAME        "rwgate"
+#define RW_HOLDERS_MAX      65535
+
+/* Lock backends, selected with --backend or WAITLOCK_BACKEND */
+#define BACKEND_FILE   0        /* One lock file per held slot */
+#define BACKEND_SHM    1        /* Shared slot table per descriptor, see shm/ */
+#define BACKEND_OFD    2        /* Byte-range locked slot file per descriptor, see ofd/ */
+#define BACKEND_SYSV   3        /* System V semaphore per descriptor, see sysv/ */
+#define BACKEND_ROBUST 4        /* Robust process-shared mutexes per descriptor, see robust/ */
+
 #ifndef PATH_MAX
   #define PATH_MAX 4096
 #endif
@@ -111,7 +159,7 @@ struct lock_info {
     pid_t ppid;
     uid_t uid;
     time_t acquired_at;
-    uint16_t lock_type;  /* 0=mutex, 1=semaphore */
+    uint16_t lock_type;  /* 0=mutex, 1=semaphore, LOCK_TYPE_SHARED/EXCLUSIVE */
     uint16_t max_holders;
     uint16_t slot;       /* Semaphore slot number (0 to max_holders-1) */
     uint16_t reserved;   /* Reserved for future use */
@@ -121,6 +169,38 @@ struct lock_info {
     uint32_t checksum;
 };
 
+/* Lock file record, format 2: this header, then the hostname, descriptor
+ * and command line without terminators. Scans that only need liveness,
+ * slot and queue order read the header alone. It is written in directories
+ * with a layout marker; unmarked ones, which older binaries may share, get
+ * format 1, a raw struct lock_info. Both, and text files, are read. */
+#define LOCK_FORMAT_V2 2
+
+/* Version stamped on format 1 records by binaries that flock a slot file
+ * before it is published; older binaries stamp 1 and flock it afterwards */
+#define LOCK_FORMAT_V1_LOCKED 0x101
+#define LOCK_RECORD_CORRUPT -2  /* A record of ours that fails its checksum */
+
+struct lock_header {
+    uint32_t magic;          /* LOCK_MAGIC */
+    uint16_t version;        /* LOCK_FORMAT_V2 */
+    uint16_t header_size;    /* Offset of the strings */
+    int64_t acquired_at;
+    int32_t pid;
+    int32_t ppid;
+    uint32_t uid;
+    uint16_t lock_type;
+    uint16_t max_holders;
+    uint16_t slot;
+    uint16_t reserved;
+    uint16_t hostname_len;
+    uint16_t descriptor_len;
+    uint16_t cmdline_len;
+    uint16_t flags;          /* None defined yet */
+    uint32_t strings_crc;    /* CRC32 of the strings */
+    uint32_t header_crc;     /* CRC32 of the header up to this field */
+};
+
 /* Global state structure */
 struct global_state {
     int lock_fd;
@@ -152,6 +232,25 @@ struct options {
     char **exec_argv;
     bool test_mode;
     int preferred_slot;  /* Preferred slot number (-1 for auto) */
+    bool migrate_mode;   /* Switch the lock directory to LAYOUT_SUBDIR (or LAYOUT_SHARDED) */
+    int backend;         /* One of the BACKEND_* constants */
+    bool daemon_mode;    /* Run as waitlockd */
+    const char *socket_path;  /* waitlockd socket (NULL = directory backends only) */
+    bool server_mode;    /* Serve lock commands on stdin (--server) */
+    int hold_fd;         /* Inherited fd to hold the lock on (--fd, -1 = none) */
+    bool no_supervise;   /* --exec replaces waitlock instead of forking */
+    bool background;     /* Detach the holder once the lock is held (--background) */
+    int ready_fd;        /* Inherited fd for the acquisition status byte (--ready-fd, -1 = none) */
+    bool fair;           /* Grant slots in arrival order (--fair) */
+    int priority;        /* Queue priority, higher first (--priority, implies --fair) */
+    int aging;           /* Seconds of waiting per priority step (--aging, 0 = none) */
+    int weight;          /* Semaphore units taken at once (--weight) */
+    int rw_mode;         /* LOCK_TYPE_SHARED or LOCK_TYPE_EXCLUSIVE, 0 = neither */
+    bool rw_prefer_readers; /* --rw-policy reader: waiting writers do not hold off readers */
+    char **descriptors;  /* Every descriptor named, several with --all or --any */
+    int descriptor_count;
+    bool any_mode;       /* Take the first free of the descriptors (--any) */
+    int shards;          /* --migrate-layout to LAYOUT_SHARDED with this fan-out (--shards, 0 = no) */
 };
 
 /* Global variables */
@@ -169,11 +268,19 @@ int safe_snprintf(char *buf, size_t size, const char *fmt, ...);
 /* Function prototypes from lock module */
 char* find_lock_directory(void);
 int acquire_lock(const char *descriptor, int max_holders, double timeout);
+int acquire_all_locks(char *descriptors[], int count, int max_holders, double timeout);
+int acquire_any_lock(char *descriptors[], int count, int max_holders, double timeout,
+                     int *winner);
+int acquire_requested_locks(const char *descriptor);
 void release_lock(void);
 int check_lock(const char *descriptor);
 int list_locks(output_format_t format, bool show_all, bool stale_only);
 int done_lock(const char *descriptor);
 int portable_lock(int fd, int operation);
+int get_lock_layout(const char *lock_dir);
+int read_lock_layout(const char *lock_dir, int *shards);
+int migrate_lock_layout(void);
+int lock_path_slot(const char *path);
 
 /* Function prototypes from process module */
 bool process_exists(pid_t pid);
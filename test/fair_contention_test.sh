@@ -0,0 +1,73 @@
+#!/bin/bash
+
+# Contention benchmark for --fair
+# WORKERS processes each take the same mutex ROUNDS times, holding it for
+# HOLD seconds, first with the default backoff and then with --fair.
+# Reports the median and tail of the time each acquisition took and
+# passes if the --fair tail stays within TAIL_FACTOR times its median.
+
+WAITLOCK="${WAITLOCK:-./build/bin/waitlock}"
+TEST_DIR="/tmp/waitlock_fair_test_$$"
+WORKERS="${WORKERS:-8}"
+ROUNDS="${ROUNDS:-25}"
+HOLD="${HOLD:-0.01}"
+TAIL_FACTOR="${TAIL_FACTOR:-3}"
+
+# Colors for output
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+NC='\033[0m' # No Color
+
+cleanup() {
+    pkill -f "$WAITLOCK.*fair_bench" 2>/dev/null || true
+    rm -rf "$TEST_DIR" 2>/dev/null || true
+}
+trap cleanup EXIT
+
+if [ ! -x "$WAITLOCK" ]; then
+    echo -e "${RED}ERROR: waitlock binary not found or not executable${NC}"
+    exit 1
+fi
+
+# run_contention <mode> <lock dir>: prints "p50 p99 max" in milliseconds
+run_contention() {
+    local mode="$1"
+    local lock_dir="$2"
+    local w
+
+    mkdir -p "$lock_dir"
+    for w in $(seq 1 "$WORKERS"); do
+        (
+            for r in $(seq 1 "$ROUNDS"); do
+                start=$(date +%s%N)
+                $WAITLOCK --lock-dir "$lock_dir" $mode --timeout 120 fair_bench \
+                    --exec sleep "$HOLD" >/dev/null 2>&1
+                end=$(date +%s%N)
+                echo $(( (end - start) / 1000000 ))
+            done
+        ) > "$lock_dir/worker_$w.out" &
+    done
+    wait
+
+    cat "$lock_dir"/worker_*.out | sort -n | awk '
+        { ms[NR] = $1 }
+        END { printf "%d %d %d\n", ms[int(NR * 0.5)], ms[int(NR * 0.99)], ms[NR] }'
+}
+
+echo -e "${YELLOW}=== WAITLOCK FAIR QUEUEING BENCHMARK ===${NC}"
+echo "$WORKERS workers x $ROUNDS rounds, lock held for ${HOLD}s"
+
+read -r p50 p99 max <<< "$(run_contention "" "$TEST_DIR/backoff")"
+echo "  backoff: p50=${p50}ms p99=${p99}ms max=${max}ms"
+
+read -r fair_p50 fair_p99 fair_max <<< "$(run_contention "--fair" "$TEST_DIR/fair")"
+echo "  --fair:  p50=${fair_p50}ms p99=${fair_p99}ms max=${fair_max}ms"
+
+if [ "$fair_p99" -le $(( fair_p50 * TAIL_FACTOR )) ]; then
+    echo -e "${GREEN}✓ PASS: --fair p99 is within ${TAIL_FACTOR}x its median${NC}"
+    exit 0
+else
+    echo -e "${RED}✗ FAIL: --fair p99 exceeds ${TAIL_FACTOR}x its median${NC}"
+    exit 1
+fi
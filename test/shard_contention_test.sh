@@ -0,0 +1,92 @@
+#!/bin/bash
+
+# Create/unlink throughput benchmark for the sharded layout
+# WORKERS waitlock --server coprocesses each acquire and release ROUNDS
+# locks on descriptors of their own, so holders never wait for each other
+# and the only shared resource is the directory their lock files are
+# created in. Runs once on a flat lock directory and once per fan-out in
+# SHARDS, and reports lock operations per second for each. Passes if every
+# acquisition and release succeeded.
+
+WAITLOCK="${WAITLOCK:-./build/bin/waitlock}"
+TEST_DIR="/tmp/waitlock_shard_test_$$"
+WORKERS="${WORKERS:-$(nproc 2>/dev/null || echo 4)}"
+ROUNDS="${ROUNDS:-5000}"
+DESCRIPTORS="${DESCRIPTORS:-64}"
+SHARDS="${SHARDS:-1 16 256}"
+
+# Colors for output
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+NC='\033[0m' # No Color
+
+cleanup() {
+    pkill -f "$WAITLOCK --server --lock-dir $TEST_DIR" 2>/dev/null || true
+    rm -rf "$TEST_DIR" 2>/dev/null || true
+}
+trap cleanup EXIT
+
+if [ ! -x "$WAITLOCK" ]; then
+    echo -e "${RED}ERROR: waitlock binary not found or not executable${NC}"
+    exit 1
+fi
+
+mkdir -p "$TEST_DIR"
+
+# Command script of each worker: ROUNDS acquire/release pairs over
+# DESCRIPTORS descriptors of its own
+for w in $(seq 1 "$WORKERS"); do
+    awk -v w="$w" -v rounds="$ROUNDS" -v descs="$DESCRIPTORS" 'BEGIN {
+        for (i = 0; i < rounds; i++) {
+            printf "ACQUIRE shard_bench_%d_%d\nRELEASE shard_bench_%d_%d\n", w, i % descs, w, i % descs
+        }
+        print "QUIT"
+    }' > "$TEST_DIR/worker_$w.cmds"
+done
+
+failed=0
+
+# run_churn <lock dir>: prints "ops/s failures"
+run_churn() {
+    local lock_dir="$1"
+    local start end w
+
+    start=$(date +%s%N)
+    for w in $(seq 1 "$WORKERS"); do
+        $WAITLOCK --server --lock-dir "$lock_dir" < "$TEST_DIR/worker_$w.cmds" \
+            > "$lock_dir/worker_$w.out" 2>&1 &
+    done
+    wait
+    end=$(date +%s%N)
+
+    # Every command, QUIT included, answers OK on success
+    cat "$lock_dir"/worker_*.out | awk -v ops=$(( WORKERS * ROUNDS * 2 )) \
+        -v workers="$WORKERS" -v ns=$(( end - start )) '
+        /^OK/ { ok++ }
+        END { printf "%d %d\n", ops / (ns / 1e9), ops + workers - ok }'
+}
+
+echo -e "${YELLOW}=== WAITLOCK SHARDED LAYOUT BENCHMARK ===${NC}"
+echo "$WORKERS workers x $ROUNDS acquire/release pairs on $DESCRIPTORS descriptors each"
+
+mkdir -p "$TEST_DIR/flat"
+read -r rate errors <<< "$(run_churn "$TEST_DIR/flat")"
+printf "  flat:       %8d ops/s\n" "$rate"
+[ "$errors" -eq 0 ] || failed=1
+
+for n in $SHARDS; do
+    mkdir -p "$TEST_DIR/shards_$n"
+    $WAITLOCK --lock-dir "$TEST_DIR/shards_$n" --migrate-layout --shards "$n" -q || failed=1
+    read -r rate errors <<< "$(run_churn "$TEST_DIR/shards_$n")"
+    printf "  %3d shards: %8d ops/s\n" "$n" "$rate"
+    [ "$errors" -eq 0 ] || failed=1
+done
+
+if [ "$failed" -eq 0 ]; then
+    echo -e "${GREEN}✓ PASS: every acquisition and release succeeded${NC}"
+    exit 0
+else
+    echo -e "${RED}✗ FAIL: some lock operations failed${NC}"
+    exit 1
+fi